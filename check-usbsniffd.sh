@@ -0,0 +1,147 @@
+#!/bin/sh
+# Drives usbsniffd through usbsniffctl on a replayed dump and checks
+# the outputs and the replies. Run from the build directory, make check
+# does that. Needs usbsniff, usbsniffd, usbsniffctl and microbench.
+
+dir=$(mktemp -d /tmp/usbsniffd-check.XXXXXX) || exit 1
+sock=$dir/sock
+pid=
+failed=0
+
+cleanup() {
+  if [ -n "$pid" ]; then kill $pid 2>/dev/null; wait $pid 2>/dev/null; fi
+  rm -rf "$dir"
+}
+trap cleanup EXIT
+
+fail() {
+  echo "FAIL: $*"
+  failed=1
+}
+
+ctl() {
+  ./usbsniffctl -S "$sock" "$@"
+}
+
+# Value of a stats line
+stat() {
+  ctl stats | sed -n "s/^$1 //p"
+}
+
+start() {
+  ./usbsniffd -S "$sock" -i "$dir/in.dump" --pace "$@" 2>"$dir/err" &
+  pid=$!
+  i=0
+  while [ ! -S "$sock" ]; do
+    i=$((i + 1))
+    if [ $i -gt 100 ]; then
+      fail "usbsniffd did not start"
+      exit 1
+    fi
+    sleep 0.05
+  done
+}
+
+wait_end() {
+  i=0
+  while [ "$(stat capturing)" != 0 ]; do
+    i=$((i + 1))
+    if [ $i -gt 200 ]; then
+      fail "replay did not end"
+      return
+    fi
+    sleep 0.05
+  done
+}
+
+quit() {
+  ctl quit >/dev/null || fail "quit"
+  wait $pid || fail "usbsniffd exited with $?"
+  pid=
+  [ -e "$sock" ] && fail "socket left behind"
+}
+
+# Is $1 the end of $2, byte for byte
+is_tail() {
+  tail -c "$(wc -c < "$1")" "$2" | cmp -s - "$1"
+}
+
+# The sequence numbers start over in each part, the gaps make it 3.5 s
+# of bus time
+./microbench -k none -w "$dir/mb" >/dev/null 2>&1 || fail "microbench -w"
+for i in 1 2 3 4 5 6; do
+  cat "$dir/mb-bulk.dump" "$dir/mb-errors.dump" >> "$dir/in.dump"
+done
+./usbsniff -i "$dir/in.dump" -D "$dir/ref.txt" >/dev/null 2>&1 \
+  || fail "usbsniff -D"
+
+echo "Outputs"
+start
+[ "$(ctl attach log "$dir/log.txt")" = 1 ] || fail "attach log"
+[ "$(ctl attach log "$dir/nosof.txt")" = 2 ] || fail "attach second log"
+[ "$(ctl attach pcap "$dir/out.pcap")" = 3 ] || fail "attach pcap"
+[ "$(ctl attach vcd "$dir/out.vcd")" = 4 ] || fail "attach vcd"
+[ "$(ctl attach dump "$dir/out.dump")" = 5 ] || fail "attach dump"
+ctl attach text "$dir/x" 2>/dev/null && fail "attach of unknown type"
+ctl filter 2 nosof >/dev/null || fail "filter nosof"
+filtered=$(stat bus_time_ns)
+ctl filter 3 3.1 >/dev/null || fail "filter 3.1"
+ctl filter 9 all 2>/dev/null && fail "filter of unknown output"
+ctl frobnicate 2>/dev/null && fail "unknown command"
+[ "$(ctl list | wc -l)" = 5 ] || fail "list"
+sleep 0.5
+rotated=$(ctl rotate 1) || fail "rotate"
+[ -f "$rotated" ] || fail "rotated file $rotated"
+sleep 0.2
+ctl detach 4 >/dev/null || fail "detach"
+ctl detach 4 2>/dev/null && fail "detach twice"
+wait_end
+[ "$(stat blocks)" = $(($(wc -c < "$dir/in.dump") / 12)) ] \
+  || fail "stats blocks"
+[ "$(stat gaps)" = 11 ] || fail "stats gaps"
+[ "$(stat bad_packets)" -gt 0 ] || fail "stats bad_packets"
+[ "$(stat dump_blocks_dropped)" = 0 ] || fail "stats dump_blocks_dropped"
+pcap_count=$(ctl list | sed -n 's/^3 pcap 3\.1 .* //p')
+[ "${pcap_count:-0}" -gt 0 ] || fail "no packets for 3.1"
+quit
+
+cat "$rotated" "$dir/log.txt" > "$dir/got.txt"
+[ -s "$dir/log.txt" ] || fail "log empty after rotate"
+is_tail "$dir/got.txt" "$dir/ref.txt" || fail "log differs from usbsniff -D"
+awk -v t="$filtered" '/^# [0-9]+ ns$/ { ts = $2 } /^SOF/ && ts > t { n++ }
+  END { exit n > 0 }' "$dir/nosof.txt" || fail "SOF in filtered log"
+grep -q '^IN' "$dir/nosof.txt" || fail "filtered log has no IN"
+[ "$(od -An -tx4 -N4 "$dir/out.pcap" | tr -d ' ')" = a1b23c4d ] \
+  || fail "pcap header"
+grep -q '^\$enddefinitions' "$dir/out.vcd" || fail "vcd header"
+[ -s "$dir/out.dump" ] && is_tail "$dir/out.dump" "$dir/in.dump" \
+  || fail "dump differs from the input"
+
+echo "Shedding"
+rm -f "$dir"/log.txt* "$dir/out.vcd" "$dir/out.dump"
+start --shed=20,30,60,70
+ctl attach log "$dir/log.txt" >/dev/null || fail "attach log"
+ctl attach vcd "$dir/out.vcd" >/dev/null || fail "attach vcd"
+ctl attach dump "$dir/out.dump" >/dev/null || fail "attach dump"
+# A replay stopped for 0.5 s lags by 50%, which sheds VCD and text
+sleep 0.2
+kill -STOP $pid
+sleep 0.5
+kill -CONT $pid
+# and for 0.9 s everything
+sleep 0.5
+kill -STOP $pid
+sleep 0.9
+kill -CONT $pid
+wait_end
+for tier in vcd text decoded dump; do
+  [ "$(stat shed_$tier)" -gt 0 ] || fail "nothing shed for $tier"
+  ctl shed | grep -q "^$tier " || fail "no $tier range in shed"
+done
+[ "$(stat shedding)" = none ] || fail "still shedding at the end"
+quit
+grep -q '^! Shed: text skipped' "$dir/log.txt" || fail "no shed note in log"
+grep -q '^\$comment Shed' "$dir/out.vcd" || fail "no shed note in vcd"
+
+[ $failed = 0 ] && echo "All passed"
+exit $failed
@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <crc5.h>
+#include <usb_crc.h>
+
+/* Compares the CRC variants on random packets of typical sizes, and
+   the token CRC check against two crc5_update() calls. */
+
+#define N_PACKETS 256
+#define MIN_NS 200000000ULL
+
+static const unsigned int sizes[] = {3, 10, 66, 515, 1025};
+
+static unsigned long long
+now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+token_ok_crc5(uint16_t data)
+{
+  uint8_t crc = 0x1f;
+  crc = crc5_update(crc, data);
+  crc = crc5_update(crc, data >> 8);
+  return crc == 0x06;
+}
+
+int
+main(void)
+{
+  static uint8_t packets[N_PACKETS][1025];
+  volatile unsigned int sink = 0;
+  unsigned int s, i, impl;
+  unsigned long long t0, t, n;
+
+  srand(1);
+  for (i = 0; i < N_PACKETS; i++) {
+    for (s = 0; s < sizeof(packets[i]); s++) packets[i][s] = rand();
+  }
+
+  for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    unsigned int len = sizes[s];
+    for (i = 0; i < N_PACKETS; i++) {
+      uint16_t ref = usb_crc16_impl(USB_CRC16_BYTEWISE, 0xffff,
+				    packets[i], len);
+      for (impl = 0; impl < USB_CRC16_N_IMPL; impl++) {
+	if (!usb_crc16_impl_available(impl)) continue;
+	if (usb_crc16_impl(impl, 0xffff, packets[i], len) != ref) {
+	  fprintf(stderr, "%s differs for %u bytes\n",
+		  usb_crc16_impl_name(impl), len);
+	  return EXIT_FAILURE;
+	}
+      }
+    }
+  }
+  for (i = 0; i < 0x10000; i++) {
+    if (usb_crc5_token_ok(i) != token_ok_crc5(i)) {
+      fprintf(stderr, "Token check differs for %04x\n", i);
+      return EXIT_FAILURE;
+    }
+  }
+
+  printf("variant   bytes   ns/packet   ns/byte\n");
+  for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    unsigned int len = sizes[s];
+    for (impl = 0; impl < USB_CRC16_N_IMPL; impl++) {
+      if (!usb_crc16_impl_available(impl)) continue;
+      n = 0;
+      t0 = now_ns();
+      do {
+	for (i = 0; i < N_PACKETS; i++) {
+	  sink += usb_crc16_impl(impl, 0xffff, packets[i], len);
+	}
+	n += N_PACKETS;
+	t = now_ns() - t0;
+      } while(t < MIN_NS);
+      printf("%-9s %5u %11.1f %9.3f\n", usb_crc16_impl_name(impl), len,
+	     (double)t / n, (double)t / n / len);
+    }
+  }
+
+  n = 0;
+  t0 = now_ns();
+  do {
+    for (i = 0; i < 0x10000; i++) sink += token_ok_crc5(i);
+    n += 0x10000;
+    t = now_ns() - t0;
+  } while(t < MIN_NS);
+  printf("token crc5_update  %6.2f ns/token\n", (double)t / n);
+  n = 0;
+  t0 = now_ns();
+  do {
+    for (i = 0; i < 0x10000; i++) sink += usb_crc5_token_ok(i);
+    n += 0x10000;
+    t = now_ns() - t0;
+  } while(t < MIN_NS);
+  printf("token table        %6.2f ns/token\n", (double)t / n);
+  return EXIT_SUCCESS;
+}
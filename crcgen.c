@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <crc5.h>
+#include <crc16.h>
+
+/* Writes usb_crc_tables.h. The tables are computed from the
+   polynomials and checked against crc5_update() and crc16_update(), any
+   difference fails the build. */
+
+/* x^16 + x^15 + x^2 + 1 */
+#define CRC16_POLY 0x18005
+#define CRC16_POLY_REFLECTED 0xa001
+/* x^5 + x^2 + 1 */
+#define CRC5_POLY_REFLECTED 0x14
+
+static uint16_t slice[8][256];
+static uint8_t token_valid[65536 / 8];
+
+static uint16_t
+crc16_bitwise(uint16_t crc, uint8_t data)
+{
+  int i;
+  crc ^= data;
+  for (i = 0; i < 8; i++) {
+    crc = (crc & 1) ? (crc >> 1) ^ CRC16_POLY_REFLECTED : crc >> 1;
+  }
+  return crc;
+}
+
+static int
+check_token_bitwise(uint16_t token)
+{
+  uint8_t crc = 0x1f;
+  int i;
+  for (i = 0; i < 16; i++) {
+    unsigned int bit = (token >> i) & 1;
+    crc = ((crc ^ bit) & 1) ? (crc >> 1) ^ CRC5_POLY_REFLECTED : crc >> 1;
+  }
+  return crc == 0x06;
+}
+
+/* x^n mod P */
+static uint32_t
+xpow_mod(unsigned int n)
+{
+  uint32_t r = 1;
+  while(n-- > 0) {
+    r <<= 1;
+    if (r & 0x10000) r ^= CRC16_POLY;
+  }
+  return r;
+}
+
+/* Bit i of the result is the coefficient of x^(63-i), the order of
+   bits in a little endian load of the packet */
+static uint64_t
+reflect64(uint32_t p)
+{
+  uint64_t r = 0;
+  int i;
+  for (i = 0; i < 16; i++) {
+    if (p & (1 << i)) r |= (uint64_t)1 << (63 - i);
+  }
+  return r;
+}
+
+static int
+verify(void)
+{
+  unsigned int crc, b, t;
+  uint8_t buf[64];
+  int i, k;
+  for (crc = 0; crc < 0x10000; crc++) {
+    for (b = 0; b < 256; b++) {
+      uint16_t expect = crc16_update(crc, b);
+      if (((crc >> 8) ^ slice[0][(crc ^ b) & 0xff]) != expect) {
+	fprintf(stderr, "CRC16 table differs from crc16_update at %04x %02x\n",
+		crc, b);
+	return -1;
+      }
+    }
+  }
+  /* Each slice table advances the CRC by another zero byte */
+  srand(1);
+  for (i = 0; i < 1000; i++) {
+    uint16_t expect = 0xffff;
+    uint16_t c = 0xffff;
+    for (k = 0; k < 8; k++) {
+      buf[k] = rand();
+      expect = crc16_update(expect, buf[k]);
+    }
+    c ^= buf[0] | buf[1] << 8;
+    c = (slice[7][c & 0xff] ^ slice[6][c >> 8] ^ slice[5][buf[2]]
+	 ^ slice[4][buf[3]] ^ slice[3][buf[4]] ^ slice[2][buf[5]]
+	 ^ slice[1][buf[6]] ^ slice[0][buf[7]]);
+    if (c != expect) {
+      fprintf(stderr, "CRC16 slice tables wrong\n");
+      return -1;
+    }
+  }
+  for (t = 0; t < 0x10000; t++) {
+    uint8_t c = crc5_update(crc5_update(0x1f, t), t >> 8);
+    int valid = (token_valid[t >> 3] >> (t & 7)) & 1;
+    if (valid != (c == 0x06)) {
+      fprintf(stderr, "CRC5 table differs from crc5_update at %04x\n", t);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void
+print_fold(const char *name, unsigned int bits)
+{
+  /* A 128 bit block is moved bits further by multiplying its first
+     half by x^(bits + 64) and its second by x^bits. A carry-less
+     multiply of bit reversed values gives the product times x, so the
+     constants are one power lower. */
+  printf("#define USB_CRC16_%s_LO 0x%016llxULL\n", name,
+	 (unsigned long long)reflect64(xpow_mod(bits + 64 - 1)));
+  printf("#define USB_CRC16_%s_HI 0x%016llxULL\n", name,
+	 (unsigned long long)reflect64(xpow_mod(bits - 1)));
+}
+
+int
+main(void)
+{
+  unsigned int b, t;
+  int k;
+  for (b = 0; b < 256; b++) slice[0][b] = crc16_bitwise(0, b);
+  for (k = 1; k < 8; k++) {
+    for (b = 0; b < 256; b++) {
+      uint16_t c = slice[k - 1][b];
+      slice[k][b] = (c >> 8) ^ slice[0][c & 0xff];
+    }
+  }
+  for (t = 0; t < 0x10000; t++) {
+    if (check_token_bitwise(t)) token_valid[t >> 3] |= 1 << (t & 7);
+  }
+  if (verify() < 0) return EXIT_FAILURE;
+
+  printf("/* Generated by crcgen, do not edit */\n\n");
+  printf("/* crc16_slice[k][b] is the CRC of byte b followed by k zero bytes */\n");
+  printf("static const uint16_t\ncrc16_slice[8][256] = {\n");
+  for (k = 0; k < 8; k++) {
+    printf("{\n");
+    for (b = 0; b < 256; b++) {
+      printf("0x%04x,%s", slice[k][b], (b & 7) == 7 ? "\n" : " ");
+    }
+    printf("}%s\n", k < 7 ? "," : "");
+  }
+  printf("};\n\n");
+  printf("/* Bit t is set if token bits t (11 bit field and CRC5) are valid */\n");
+  printf("static const uint8_t\ncrc5_token_valid[8192] = {\n");
+  for (t = 0; t < 8192; t++) {
+    printf("0x%02x,%s", token_valid[t], (t & 15) == 15 ? "\n" : " ");
+  }
+  printf("};\n\n");
+  print_fold("FOLD128", 128);
+  print_fold("FOLD512", 512);
+  return EXIT_SUCCESS;
+}
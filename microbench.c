@@ -0,0 +1,913 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <crc5.h>
+#include <crc16.h>
+#include <usb_crc.h>
+#include <usb_logger.h>
+
+/* The decoder's static helpers are measured as they are compiled into
+   it, so this file includes the decoder instead of linking it. */
+#include "usb_packet_decoder.c"
+
+/* Benchmarks of the pieces the decoder is built from, on fixed corpora
+   generated at startup. Each result is one CSV line on stdout. */
+
+#define FRAME_BITS 12000
+#define CORPUS_FRAMES 100
+
+#define DEFAULT_SAMPLES 31
+#define WARMUP_NS 50000000ULL
+#define SAMPLE_NS 2000000ULL
+
+/* Line states */
+#define LINE_K 0
+#define LINE_J 1
+#define LINE_SE0 2
+
+struct Corpus
+{
+  const char *name;
+  struct USBSamples *blocks;
+  size_t n_blocks;
+  size_t size;
+  uint64_t bits;
+  struct USBSamples cur;
+  int prev_level;
+  int line; /* NRZI level */
+  int ones;
+};
+
+/* Packets decoded from a corpus */
+struct PacketList
+{
+  uint32_t (*bits)[USB_BUF_LEN];
+  uint32_t *n_bits;
+  size_t n;
+  size_t size;
+  uint64_t payload_bytes;
+};
+
+struct Options
+{
+  unsigned int samples;
+  const char *only;
+  double mhz;
+  const char *write_prefix;
+};
+
+static struct Options options = {DEFAULT_SAMPLES, NULL, 0.0, NULL};
+static int cycles_fd = -1;
+
+static void
+usage(void)
+{
+  fprintf(stderr,
+	  "usage: microbench [options]\n"
+	  "\t-n SAMPLES  Timed samples per benchmark (default %d)\n"
+	  "\t-k NAME     Only run benchmarks whose kernel contains NAME\n"
+	  "\t-M MHZ      CPU clock for cycle figures when there is no\n"
+	  "\t            cycle counter\n"
+	  "\t-w PREFIX   Also write the corpora to PREFIX-NAME.dump\n"
+	  "Writes one CSV line per kernel and corpus, times in ns.\n",
+	  DEFAULT_SAMPLES);
+}
+
+static void *
+alloc(size_t size)
+{
+  void *p = malloc(size);
+  if (!p) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+/* Corpus generation, a block is closed at the first level change after
+   32 samples, like the PRU does */
+
+static void
+corpus_emit(struct Corpus *c)
+{
+  if (c->n_blocks == c->size) {
+    c->size = c->size ? 2 * c->size : 4096;
+    c->blocks = realloc(c->blocks, c->size * sizeof(struct USBSamples));
+    if (!c->blocks) {
+      fprintf(stderr, "Failed to allocate memory\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  c->blocks[c->n_blocks++] = c->cur;
+  c->bits += c->cur.count;
+  memset(&c->cur, 0, sizeof(c->cur));
+  c->cur.sequence = c->n_blocks;
+}
+
+static void
+corpus_level(struct Corpus *c, int level)
+{
+  if (level != c->prev_level && c->cur.count >= 32) corpus_emit(c);
+  if (c->cur.count < 32) {
+    if (level == LINE_J) c->cur.dp_bits |= (uint32_t)1 << c->cur.count;
+    if (level == LINE_K) c->cur.dm_bits |= (uint32_t)1 << c->cur.count;
+  }
+  c->cur.count++;
+  c->prev_level = level;
+  if (c->cur.count == 0xffff) corpus_emit(c);
+}
+
+static void
+corpus_init(struct Corpus *c, const char *name)
+{
+  memset(c, 0, sizeof(*c));
+  c->name = name;
+  c->prev_level = LINE_J;
+}
+
+static void
+corpus_idle(struct Corpus *c, unsigned int bits)
+{
+  while(bits-- > 0) corpus_level(c, LINE_J);
+}
+
+static void
+corpus_nrzi(struct Corpus *c, int bit)
+{
+  if (!bit) c->line = !c->line;
+  corpus_level(c, c->line ? LINE_J : LINE_K);
+}
+
+static void
+corpus_bit(struct Corpus *c, int bit, int stuff)
+{
+  corpus_nrzi(c, bit);
+  if (bit) {
+    if (++c->ones == 6 && stuff) {
+      corpus_nrzi(c, 0);
+      c->ones = 0;
+    }
+  } else {
+    c->ones = 0;
+  }
+}
+
+/* Sync, bytes LSB first, EOP. Without stuffing for bit stuff errors. */
+static void
+corpus_packet(struct Corpus *c, const uint8_t *bytes, unsigned int len,
+	      int stuff)
+{
+  unsigned int i, b;
+  c->line = 1;
+  for (i = 0; i < 7; i++) corpus_nrzi(c, 0);
+  corpus_nrzi(c, 1);
+  c->ones = 1;
+  for (i = 0; i < len; i++) {
+    for (b = 0; b < 8; b++) corpus_bit(c, (bytes[i] >> b) & 1, stuff);
+  }
+  corpus_level(c, LINE_SE0);
+  corpus_level(c, LINE_SE0);
+  corpus_level(c, LINE_J);
+  corpus_idle(c, 4);
+}
+
+/* Four bits after the sync */
+static void
+corpus_short(struct Corpus *c)
+{
+  unsigned int i;
+  c->line = 1;
+  for (i = 0; i < 7; i++) corpus_nrzi(c, 0);
+  corpus_nrzi(c, 1);
+  c->ones = 1;
+  for (i = 0; i < 4; i++) corpus_bit(c, i & 1, 1);
+  corpus_level(c, LINE_SE0);
+  corpus_level(c, LINE_SE0);
+  corpus_level(c, LINE_J);
+  corpus_idle(c, 4);
+}
+
+static uint8_t
+pid_byte(uint8_t pid)
+{
+  return pid | ((~pid & 0xf) << 4);
+}
+
+static void
+corpus_token(struct Corpus *c, uint8_t pid, unsigned int field, int bad_crc)
+{
+  uint8_t bytes[3];
+  uint16_t token = 0;
+  unsigned int crc;
+  for (crc = 0; crc < 32; crc++) {
+    token = (field & 0x7ff) | crc << 11;
+    if (usb_crc5_token_ok(token)) break;
+  }
+  if (bad_crc) token ^= 0x800;
+  bytes[0] = pid_byte(pid);
+  bytes[1] = token;
+  bytes[2] = token >> 8;
+  corpus_packet(c, bytes, 3, 1);
+}
+
+static void
+corpus_data(struct Corpus *c, uint8_t pid, unsigned int len, int bad_crc)
+{
+  uint8_t bytes[USB_MAX_PAYLOAD + 3];
+  uint16_t crc;
+  unsigned int i;
+  bytes[0] = pid_byte(pid);
+  for (i = 0; i < len; i++) bytes[1 + i] = rand();
+  crc = ~usb_crc16(0xffff, bytes + 1, len);
+  if (bad_crc) crc ^= 0x10;
+  bytes[len + 1] = crc;
+  bytes[len + 2] = crc >> 8;
+  corpus_packet(c, bytes, len + 3, 1);
+}
+
+static void
+corpus_handshake(struct Corpus *c, uint8_t pid)
+{
+  uint8_t b = pid_byte(pid);
+  corpus_packet(c, &b, 1, 1);
+}
+
+static void
+corpus_frame_end(struct Corpus *c, unsigned int frame)
+{
+  uint64_t end = (uint64_t)(frame + 1) * FRAME_BITS;
+  uint64_t now = c->bits + c->cur.count;
+  if (now < end) corpus_idle(c, end - now);
+}
+
+static void
+corpus_finish(struct Corpus *c)
+{
+  if (c->cur.count > 0) corpus_emit(c);
+}
+
+static int
+corpus_write(const struct Corpus *c, const char *prefix)
+{
+  char name[256];
+  FILE *file;
+  snprintf(name, sizeof(name), "%s-%s.dump", prefix, c->name);
+  file = fopen(name, "wb");
+  if (!file) {
+    fprintf(stderr, "Failed to open file %s for writing: %s\n",
+	    name, strerror(errno));
+    return -1;
+  }
+  if (fwrite(c->blocks, sizeof(struct USBSamples), c->n_blocks, file)
+      != c->n_blocks) {
+    fprintf(stderr, "Failed to write %s: %s\n", name, strerror(errno));
+    fclose(file);
+    return -1;
+  }
+  fclose(file);
+  return 0;
+}
+
+/* No traffic at all */
+static void
+make_idle(struct Corpus *c)
+{
+  corpus_init(c, "idle");
+  corpus_idle(c, CORPUS_FRAMES * FRAME_BITS);
+  corpus_finish(c);
+}
+
+static void
+make_sof(struct Corpus *c)
+{
+  unsigned int f;
+  corpus_init(c, "sof");
+  for (f = 0; f < CORPUS_FRAMES; f++) {
+    corpus_token(c, 0x5, f, 0);
+    corpus_frame_end(c, f);
+  }
+  corpus_finish(c);
+}
+
+/* Frames full of 64 byte bulk transfers in both directions */
+static void
+make_bulk(struct Corpus *c)
+{
+  unsigned int f, t;
+  corpus_init(c, "bulk");
+  for (f = 0; f < CORPUS_FRAMES; f++) {
+    corpus_token(c, 0x5, f, 0);
+    for (t = 0; c->bits + c->cur.count + 1000 < (uint64_t)(f + 1) * FRAME_BITS;
+	 t++) {
+      uint8_t data_pid = (t & 2) ? 0xb : 0x3;
+      if (t & 1) {
+	corpus_token(c, 0x9, 3 | 1 << 7, 0);
+	corpus_data(c, data_pid, 64, 0);
+	corpus_handshake(c, 0x2);
+      } else {
+	corpus_token(c, 0x1, 3 | 2 << 7, 0);
+	corpus_data(c, data_pid, 64, 0);
+	corpus_handshake(c, 0x2);
+      }
+    }
+    corpus_frame_end(c, f);
+  }
+  corpus_finish(c);
+}
+
+/* CRC errors, unknown PIDs, bit stuff errors, short packets and NAKs */
+static void
+make_errors(struct Corpus *c)
+{
+  unsigned int f, t;
+  corpus_init(c, "errors");
+  for (f = 0; f < CORPUS_FRAMES; f++) {
+    corpus_token(c, 0x5, f, 0);
+    for (t = 0; c->bits + c->cur.count + 1000 < (uint64_t)(f + 1) * FRAME_BITS;
+	 t++) {
+      switch(t % 6) {
+      case 0:
+	corpus_token(c, 0x9, 3 | 1 << 7, 1);
+	corpus_handshake(c, 0xa);
+	break;
+      case 1:
+	corpus_token(c, 0x1, 3 | 2 << 7, 0);
+	corpus_data(c, 0x3, 64, 1);
+	break;
+      case 2: {
+	uint8_t bytes[4] = {0x00, 0x12, 0x34, 0x56};
+	corpus_packet(c, bytes, 4, 1);
+	break;
+      }
+      case 3: {
+	uint8_t bytes[4];
+	bytes[0] = pid_byte(0x3);
+	bytes[1] = 0xff;
+	bytes[2] = 0xff;
+	bytes[3] = 0x00;
+	corpus_packet(c, bytes, 4, 0);
+	break;
+      }
+      case 4:
+	corpus_short(c);
+	break;
+      default:
+	corpus_token(c, 0x9, 3 | 1 << 7, 0);
+	corpus_handshake(c, 0xa);
+	break;
+      }
+    }
+    corpus_frame_end(c, f);
+  }
+  corpus_finish(c);
+}
+
+/* Timing */
+
+static unsigned long long
+now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+cycles_open(void)
+{
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_CPU_CYCLES;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  cycles_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static unsigned long long
+cycles_now(void)
+{
+  unsigned long long v = 0;
+  if (cycles_fd < 0 || read(cycles_fd, &v, sizeof(v)) != sizeof(v)) return 0;
+  return v;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+  double da = *(const double*)a;
+  double db = *(const double*)b;
+  return da < db ? -1 : da > db;
+}
+
+static double
+percentile(const double *sorted, unsigned int n, unsigned int p)
+{
+  return sorted[(n - 1) * p / 100];
+}
+
+/* Runs op until warm, then takes samples of enough calls to last
+   SAMPLE_NS each. units is the number of bits, bytes or calls one op
+   handles. */
+static void
+bench(const char *kernel, const char *corpus, const char *unit,
+      double units, void (*op)(void *), void *arg)
+{
+  unsigned int n = options.samples;
+  double *per_op = alloc(n * sizeof(double));
+  double cycles_sum = 0;
+  unsigned long long reps = 1;
+  unsigned long long t0, t;
+  unsigned int s;
+  double median, cycles;
+
+  if (options.only && !strstr(kernel, options.only)) {
+    free(per_op);
+    return;
+  }
+  t0 = now_ns();
+  do {
+    unsigned long long i;
+    for (i = 0; i < reps; i++) op(arg);
+    t = now_ns() - t0;
+    if (t < SAMPLE_NS) reps *= 2;
+  } while(t < WARMUP_NS);
+  {
+    /* Calls per sample from the last warmup round */
+    unsigned long long one;
+    unsigned long long i;
+    t0 = now_ns();
+    for (i = 0; i < reps; i++) op(arg);
+    one = now_ns() - t0;
+    if (one == 0) one = 1;
+    reps = reps * SAMPLE_NS / one;
+    if (reps == 0) reps = 1;
+  }
+  for (s = 0; s < n; s++) {
+    unsigned long long i;
+    unsigned long long c0 = cycles_now();
+    t0 = now_ns();
+    for (i = 0; i < reps; i++) op(arg);
+    t = now_ns() - t0;
+    cycles_sum += cycles_now() - c0;
+    per_op[s] = (double)t / reps;
+  }
+  qsort(per_op, n, sizeof(double), cmp_double);
+  median = percentile(per_op, n, 50);
+  printf("%s,%s,%s,%.0f,%u,%.2f,%.2f,%.2f,%.2f,%.2f,%.4f,", kernel, corpus,
+	 unit, units, n, per_op[0], percentile(per_op, n, 10), median,
+	 percentile(per_op, n, 90), per_op[n - 1], median / units);
+  if (cycles_fd >= 0) {
+    cycles = cycles_sum / ((double)reps * n) / units;
+    printf("%.4f\n", cycles);
+  } else if (options.mhz > 0) {
+    printf("%.4f\n", median / units * options.mhz / 1000);
+  } else {
+    printf("\n");
+  }
+  fflush(stdout);
+  free(per_op);
+}
+
+/* Kernels */
+
+#define N_WORDS 4096
+
+struct WordsArg
+{
+  uint32_t words[N_WORDS];
+  uint8_t from[N_WORDS];
+};
+
+static volatile uint32_t sink;
+
+static void
+op_find_lowest_one(void *arg)
+{
+  struct WordsArg *w = arg;
+  unsigned int i;
+  uint32_t sum = 0;
+  for (i = 0; i < N_WORDS; i++) {
+    sum += find_lowest_one_from(w->words[i], w->from[i]);
+  }
+  sink = sum;
+}
+
+struct AddBitsArg
+{
+  USBDecoder decoder;
+  USBLogger quiet;
+  struct WordsArg *w;
+};
+
+/* Whole packets' worth of bits, restarting the buffer like an EOP */
+static void
+op_add_bits(void *arg)
+{
+  struct AddBitsArg *a = arg;
+  unsigned int i;
+  for (i = 0; i < N_WORDS; i++) {
+    unsigned int n = (a->w->from[i] & 0x1f) + 1;
+    if (a->decoder.n_buf_bits + n > 1024) a->decoder.n_buf_bits = 0;
+    add_bits(&a->decoder, a->w->words[i], n);
+  }
+  sink = a->decoder.buffer[0];
+}
+
+static void
+op_nrzi_masks(void *arg)
+{
+  const struct Corpus *c = arg;
+  uint32_t acc = 0;
+  uint8_t prev = 1;
+  size_t i;
+  for (i = 0; i < c->n_blocks; i++) {
+    uint32_t se0, decoded;
+    nrzi_masks(&c->blocks[i], prev, &se0, &decoded);
+    prev = c->blocks[i].dp_bits >> 31;
+    acc ^= se0 + decoded;
+  }
+  sink = acc;
+}
+
+static void
+op_crc5_update(void *arg)
+{
+  unsigned int t;
+  uint32_t ok = 0;
+  (void)arg;
+  for (t = 0; t < 0x10000; t++) {
+    uint8_t crc = crc5_update(crc5_update(0x1f, t), t >> 8);
+    ok += crc == 0x06;
+  }
+  sink = ok;
+}
+
+static void
+op_crc5_table(void *arg)
+{
+  unsigned int t;
+  uint32_t ok = 0;
+  (void)arg;
+  for (t = 0; t < 0x10000; t++) ok += usb_crc5_token_ok(t);
+  sink = ok;
+}
+
+struct CRC16Arg
+{
+  enum USBCRC16Impl impl;
+  const uint8_t *data;
+  unsigned int len;
+  unsigned int count;
+};
+
+static void
+op_crc16(void *arg)
+{
+  const struct CRC16Arg *a = arg;
+  unsigned int i;
+  uint32_t acc = 0;
+  for (i = 0; i < a->count; i++) {
+    acc += usb_crc16_impl(a->impl, 0xffff, a->data + i * a->len, a->len);
+  }
+  sink = acc;
+}
+
+static void
+collect_packet(uint32_t *bits, uint32_t n_bits, timestamp_t ts,
+	       void *user_data)
+{
+  struct PacketList *list = user_data;
+  (void)ts;
+  if (list->n == list->size) {
+    list->size = list->size ? 2 * list->size : 1024;
+    list->bits = realloc(list->bits, list->size * sizeof(*list->bits));
+    list->n_bits = realloc(list->n_bits, list->size * sizeof(uint32_t));
+    if (!list->bits || !list->n_bits) {
+      fprintf(stderr, "Failed to allocate memory\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  memcpy(list->bits[list->n], bits, (n_bits + 31) / 32 * 4);
+  list->n_bits[list->n] = n_bits;
+  if ((bits[0] & 0xff) == 0xc3 || (bits[0] & 0xff) == 0x4b) {
+    list->payload_bytes += n_bits / 8 > 3 ? n_bits / 8 - 3 : 0;
+  }
+  list->n++;
+}
+
+struct DecodeArg
+{
+  const struct Corpus *corpus;
+  USBDecoder decoder;
+  USBLogger logger;
+  int capture;
+};
+
+static void
+ignore_packet(uint32_t *bits, uint32_t n_bits, timestamp_t ts,
+	      void *user_data)
+{
+  (void)bits;
+  (void)n_bits;
+  (void)ts;
+  (void)user_data;
+}
+
+static void
+op_decode_block(void *arg)
+{
+  struct DecodeArg *a = arg;
+  const struct Corpus *c = a->corpus;
+  timestamp_t time = 0;
+  size_t i;
+  for (i = 0; i < c->n_blocks; i++) {
+    decode_block(&a->decoder, &c->blocks[i], time);
+    time += c->blocks[i].count * NS_PER_BIT;
+  }
+}
+
+struct PacketsArg
+{
+  const struct PacketList *list;
+  USBLogger logger;
+};
+
+/* decode_packet() through a logger without output is the PID dispatch
+   and CRC checks, with a capturing one it includes the formatting */
+static void
+op_decode_packet(void *arg)
+{
+  struct PacketsArg *a = arg;
+  size_t i;
+  for (i = 0; i < a->list->n; i++) {
+    decode_packet(a->list->bits[i], a->list->n_bits[i], i * 1000, &a->logger);
+    if (a->logger.buf && a->logger.used > LOG_BUFFER_SIZE / 2) {
+      size_t len;
+      log_take(&a->logger, &len);
+    }
+  }
+}
+
+struct LogArg
+{
+  USBLogger logger;
+  uint8_t data[64];
+};
+
+#define LOG_CALLS 256
+
+static void
+log_reset(USBLogger *logger)
+{
+  size_t len;
+  log_take(logger, &len);
+}
+
+static void
+op_log_time(void *arg)
+{
+  struct LogArg *a = arg;
+  unsigned int i;
+  for (i = 0; i < LOG_CALLS; i++) log_time(&a->logger, 123456789ULL + i * 85);
+  log_reset(&a->logger);
+}
+
+static void
+op_log_token(void *arg)
+{
+  struct LogArg *a = arg;
+  unsigned int i;
+  for (i = 0; i < LOG_CALLS; i++) {
+    log_token(&a->logger, USB_LOG_IN, i & 0x7f, i & 0xf);
+  }
+  log_reset(&a->logger);
+}
+
+static void
+op_log_sof(void *arg)
+{
+  struct LogArg *a = arg;
+  unsigned int i;
+  for (i = 0; i < LOG_CALLS; i++) log_sof(&a->logger, i & 0x7ff);
+  log_reset(&a->logger);
+}
+
+static void
+op_log_data(void *arg)
+{
+  struct LogArg *a = arg;
+  unsigned int i;
+  for (i = 0; i < LOG_CALLS; i++) {
+    log_data(&a->logger, USB_LOG_DATA0, a->data, sizeof(a->data));
+  }
+  log_reset(&a->logger);
+}
+
+static void
+op_log_error(void *arg)
+{
+  struct LogArg *a = arg;
+  unsigned int i;
+  for (i = 0; i < LOG_CALLS; i++) log_error(&a->logger, "CRC error\n");
+  log_reset(&a->logger);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct Corpus corpora[4];
+  struct PacketList packets[4];
+  struct WordsArg *words;
+  unsigned int n_corpora = sizeof(corpora) / sizeof(corpora[0]);
+  unsigned int i, impl;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:k:M:w:")) != -1) {
+    switch (opt) {
+    case 'n':
+      options.samples = atoi(optarg);
+      if (options.samples < 1) options.samples = 1;
+      break;
+    case 'k':
+      options.only = optarg;
+      break;
+    case 'M':
+      options.mhz = atof(optarg);
+      break;
+    case 'w':
+      options.write_prefix = optarg;
+      break;
+    default: /* '?' */
+      usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  srand(1);
+  make_idle(&corpora[0]);
+  make_sof(&corpora[1]);
+  make_bulk(&corpora[2]);
+  make_errors(&corpora[3]);
+  memset(packets, 0, sizeof(packets));
+  if (options.write_prefix) {
+    for (i = 0; i < n_corpora; i++) {
+      if (corpus_write(&corpora[i], options.write_prefix) < 0) {
+	exit(EXIT_FAILURE);
+      }
+    }
+  }
+  for (i = 0; i < n_corpora; i++) {
+    struct DecodeArg *a = alloc(sizeof(struct DecodeArg));
+    memset(a, 0, sizeof(*a));
+    a->corpus = &corpora[i];
+    log_init(&a->logger, NULL);
+    decode_init(&a->decoder, NULL);
+    a->decoder.logger = &a->logger;
+    a->decoder.packet_handler = collect_packet;
+    a->decoder.packet_handler_user_data = &packets[i];
+    op_decode_block(a);
+    free(a);
+  }
+
+  cycles_open();
+  if (cycles_fd < 0 && options.mhz <= 0) {
+    fprintf(stderr, "No cycle counter, use -M for cycle figures\n");
+  }
+  printf("kernel,corpus,unit,units_per_op,samples,min_ns,p10_ns,median_ns,"
+	 "p90_ns,max_ns,ns_per_unit,cycles_per_unit\n");
+
+  words = alloc(sizeof(struct WordsArg));
+  for (i = 0; i < N_WORDS; i++) {
+    words->words[i] = (uint32_t)rand() << 16 ^ rand();
+    /* Mostly sparse SE0 masks, as in real blocks */
+    if (i & 1) words->words[i] &= words->words[i] >> 3 & 0x80000011;
+    words->from[i] = rand() % 32;
+  }
+  bench("find_lowest_one_from", "random", "call", N_WORDS,
+	op_find_lowest_one, words);
+  {
+    struct AddBitsArg *a = alloc(sizeof(struct AddBitsArg));
+    uint64_t bits = 0;
+    memset(a, 0, sizeof(*a));
+    log_init(&a->quiet, NULL);
+    decode_init(&a->decoder, NULL);
+    a->decoder.logger = &a->quiet;
+    a->w = words;
+    for (i = 0; i < N_WORDS; i++) bits += (words->from[i] & 0x1f) + 1;
+    bench("add_bits", "random", "bit", bits, op_add_bits, a);
+    free(a);
+  }
+  for (i = 0; i < n_corpora; i++) {
+    bench("nrzi_masks", corpora[i].name, "bit", corpora[i].bits,
+	  op_nrzi_masks, &corpora[i]);
+  }
+
+  bench("crc5_update", "all_tokens", "token", 0x10000, op_crc5_update, NULL);
+  bench("crc5_table", "all_tokens", "token", 0x10000, op_crc5_table, NULL);
+  {
+    static const unsigned int lens[] = {11, 66, 1025};
+    uint8_t *data = alloc(64 * 1025);
+    unsigned int l;
+    for (i = 0; i < 64 * 1025; i++) data[i] = rand();
+    for (impl = 0; impl < USB_CRC16_N_IMPL; impl++) {
+      char kernel[32];
+      if (!usb_crc16_impl_available(impl)) continue;
+      snprintf(kernel, sizeof(kernel), "crc16_%s", usb_crc16_impl_name(impl));
+      for (l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+	struct CRC16Arg a;
+	char corpus[32];
+	a.impl = impl;
+	a.data = data;
+	a.len = lens[l];
+	a.count = 64;
+	snprintf(corpus, sizeof(corpus), "data%u", lens[l] - 3);
+	bench(kernel, corpus, "byte", a.len * a.count, op_crc16, &a);
+      }
+    }
+    free(data);
+  }
+
+  for (i = 0; i < n_corpora; i++) {
+    struct PacketsArg a;
+    if (packets[i].n == 0) continue;
+    a.list = &packets[i];
+    log_init(&a.logger, NULL);
+    bench("decode_packet", corpora[i].name, "packet", packets[i].n,
+	  op_decode_packet, &a);
+    log_init_capture(&a.logger);
+    bench("decode_packet_log", corpora[i].name, "packet", packets[i].n,
+	  op_decode_packet, &a);
+    free(a.logger.buf);
+  }
+  {
+    struct LogArg *a = alloc(sizeof(struct LogArg));
+    for (i = 0; i < sizeof(a->data); i++) a->data[i] = rand();
+    log_init_capture(&a->logger);
+    bench("log_time", "fixed", "call", LOG_CALLS, op_log_time, a);
+    bench("log_sof", "fixed", "call", LOG_CALLS, op_log_sof, a);
+    bench("log_token", "fixed", "call", LOG_CALLS, op_log_token, a);
+    bench("log_data", "data64", "call", LOG_CALLS, op_log_data, a);
+    bench("log_error", "fixed", "call", LOG_CALLS, op_log_error, a);
+    free(a->logger.buf);
+    free(a);
+  }
+
+  for (i = 0; i < n_corpora; i++) {
+    struct DecodeArg *a = alloc(sizeof(struct DecodeArg));
+    memset(a, 0, sizeof(*a));
+    a->corpus = &corpora[i];
+    log_init(&a->logger, NULL);
+    decode_init(&a->decoder, NULL);
+    a->decoder.logger = &a->logger;
+    a->decoder.packet_handler = ignore_packet;
+    bench("decode_block", corpora[i].name, "bit", corpora[i].bits,
+	  op_decode_block, a);
+    free(a);
+  }
+
+  /* Decoding with the PID dispatch and CRC checks of each packet, at
+     once and in batches */
+  for (i = 0; i < n_corpora; i++) {
+    struct DecodeArg *a = alloc(sizeof(struct DecodeArg));
+    struct USBPacketBatch *batch;
+    memset(a, 0, sizeof(*a));
+    a->corpus = &corpora[i];
+    log_init(&a->logger, NULL);
+    decode_init(&a->decoder, NULL);
+    a->decoder.logger = &a->logger;
+    a->decoder.packet_handler = decode_packet;
+    a->decoder.packet_handler_user_data = &a->logger;
+    bench("decode_check", corpora[i].name, "bit", corpora[i].bits,
+	  op_decode_block, a);
+    batch = usb_packet_batch_create(USB_PACKET_BATCH_DEFAULT_PACKETS);
+    if (!batch) {
+      fprintf(stderr, "Failed to allocate memory\n");
+      exit(EXIT_FAILURE);
+    }
+    decode_set_batch(&a->decoder, batch, USB_PACKET_BATCH_DEFAULT_BLOCKS,
+		     decode_packet_batch, &a->logger);
+    bench("decode_check_batch", corpora[i].name, "bit", corpora[i].bits,
+	  op_decode_block, a);
+    decode_close(&a->decoder);
+    usb_packet_batch_destroy(batch);
+    free(a);
+  }
+
+  for (i = 0; i < n_corpora; i++) {
+    free(corpora[i].blocks);
+    free(packets[i].bits);
+    free(packets[i].n_bits);
+  }
+  free(words);
+  if (cycles_fd >= 0) close(cycles_fd);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,66 @@
+#include "packet_handler.h"
+
+void
+packet_handler_chain_init(struct USBPacketHandlerChain *chain)
+{
+  chain->n_handlers = 0;
+}
+
+int
+packet_handler_chain_add(struct USBPacketHandlerChain *chain,
+			 USBPacketHandler handler, void *user_data)
+{
+  if (chain->n_handlers >= USB_PACKET_HANDLER_CHAIN_MAX) return -1;
+  chain->handlers[chain->n_handlers] = handler;
+  chain->batch_handlers[chain->n_handlers] = NULL;
+  chain->user_data[chain->n_handlers] = user_data;
+  chain->n_handlers++;
+  return 0;
+}
+
+void
+packet_handler_chain(uint32_t *bits, uint32_t n_bits, timestamp_t ts,
+		     void *user_data)
+{
+  struct USBPacketHandlerChain *chain = user_data;
+  unsigned int i;
+  for (i = 0; i < chain->n_handlers; i++) {
+    chain->handlers[i](bits, n_bits, ts, chain->user_data[i]);
+  }
+}
+
+int
+packet_handler_chain_add_batch(struct USBPacketHandlerChain *chain,
+			       USBPacketHandler handler,
+			       USBPacketBatchHandler batch_handler,
+			       void *user_data)
+{
+  if (packet_handler_chain_add(chain, handler, user_data) < 0) return -1;
+  chain->batch_handlers[chain->n_handlers - 1] = batch_handler;
+  return 0;
+}
+
+void
+packet_handler_batch(struct USBPacketBatch *batch, USBPacketHandler handler,
+		     void *user_data)
+{
+  unsigned int p;
+  for (p = 0; p < batch->n_packets; p++) {
+    handler(usb_packet_batch_bits(batch, p), batch->packets[p].n_bits,
+	    batch->packets[p].ts, user_data);
+  }
+}
+
+void
+packet_handler_chain_batch(struct USBPacketBatch *batch, void *user_data)
+{
+  struct USBPacketHandlerChain *chain = user_data;
+  unsigned int i;
+  for (i = 0; i < chain->n_handlers; i++) {
+    if (chain->batch_handlers[i]) {
+      chain->batch_handlers[i](batch, chain->user_data[i]);
+    } else {
+      packet_handler_batch(batch, chain->handlers[i], chain->user_data[i]);
+    }
+  }
+}
@@ -1,7 +1,54 @@
+#ifndef PACKET_HANDLER_H
+#define PACKET_HANDLER_H
 
 #include <stdint.h>
 #include <timestamp.h>
+#include <usb_packet_batch.h>
 
 typedef void (*USBPacketHandler)(uint32_t *bits, uint32_t n_bits, 
 				 timestamp_t ts, 
 				 void *user_data);
+
+#define USB_PACKET_HANDLER_CHAIN_MAX 8
+
+/* Passes each packet on to several handlers, in the order they were
+   added. Use packet_handler_chain as handler with the chain as user
+   data. */
+struct USBPacketHandlerChain
+{
+  unsigned int n_handlers;
+  USBPacketHandler handlers[USB_PACKET_HANDLER_CHAIN_MAX];
+  /* NULL for handlers that take one packet at a time */
+  USBPacketBatchHandler batch_handlers[USB_PACKET_HANDLER_CHAIN_MAX];
+  void *user_data[USB_PACKET_HANDLER_CHAIN_MAX];
+};
+
+void
+packet_handler_chain_init(struct USBPacketHandlerChain *chain);
+
+int
+packet_handler_chain_add(struct USBPacketHandlerChain *chain,
+			 USBPacketHandler handler, void *user_data);
+
+/* A handler that also has a batch version */
+int
+packet_handler_chain_add_batch(struct USBPacketHandlerChain *chain,
+			       USBPacketHandler handler,
+			       USBPacketBatchHandler batch_handler,
+			       void *user_data);
+
+/* Batch handler for the chain. Each handler gets the whole batch before
+   the next one. */
+void
+packet_handler_chain_batch(struct USBPacketBatch *batch, void *user_data);
+
+/* Passes the packets of a batch to a handler one at a time */
+void
+packet_handler_batch(struct USBPacketBatch *batch, USBPacketHandler handler,
+		     void *user_data);
+
+void
+packet_handler_chain(uint32_t *bits, uint32_t n_bits, timestamp_t ts,
+		     void *user_data);
+
+#endif
@@ -0,0 +1,580 @@
+#include "usb_class.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <usb_packet.h>
+
+#define DESC_DEVICE 1
+#define DESC_CONFIGURATION 2
+#define DESC_STRING 3
+#define DESC_INTERFACE 4
+#define DESC_ENDPOINT 5
+
+#define REQ_GET_DESCRIPTOR 6
+
+#define CBW_SIGNATURE 0x43425355
+#define CSW_SIGNATURE 0x53425355
+
+/* Longest text of a CDC data packet shown */
+#define MAX_TEXT 60
+
+static const char *standard_requests[] = {
+  "GET_STATUS", "CLEAR_FEATURE", NULL, "SET_FEATURE", NULL, "SET_ADDRESS",
+  "GET_DESCRIPTOR", "SET_DESCRIPTOR", "GET_CONFIGURATION",
+  "SET_CONFIGURATION", "GET_INTERFACE", "SET_INTERFACE", "SYNCH_FRAME"
+};
+
+static const char *descriptor_types[] = {
+  NULL, "DEVICE", "CONFIGURATION", "STRING", "INTERFACE", "ENDPOINT",
+  "DEVICE_QUALIFIER", "OTHER_SPEED_CONFIGURATION", "INTERFACE_POWER"
+};
+
+static const struct {
+  uint8_t opcode;
+  const char *name;
+} scsi_commands[] = {
+  {0x00, "TEST_UNIT_READY"}, {0x03, "REQUEST_SENSE"}, {0x12, "INQUIRY"},
+  {0x1a, "MODE_SENSE(6)"}, {0x1b, "START_STOP_UNIT"},
+  {0x1e, "PREVENT_ALLOW_MEDIUM_REMOVAL"},
+  {0x23, "READ_FORMAT_CAPACITIES"}, {0x25, "READ_CAPACITY(10)"},
+  {0x28, "READ(10)"}, {0x2a, "WRITE(10)"}, {0x2f, "VERIFY(10)"},
+  {0x35, "SYNCHRONIZE_CACHE(10)"}, {0x5a, "MODE_SENSE(10)"},
+  {0x88, "READ(16)"}, {0x8a, "WRITE(16)"}, {0x9e, "SERVICE_ACTION_IN(16)"},
+  {0xa0, "REPORT_LUNS"}
+};
+
+#define N_SCSI_COMMANDS (sizeof(scsi_commands) / sizeof(scsi_commands[0]))
+
+static uint16_t
+get_u16(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t
+get_u32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t
+get_be32(const uint8_t *p)
+{
+  return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* Appends to buf, pos stays at most size - 1 */
+static void
+put(char *buf, size_t size, size_t *pos, const char *format, ...)
+  __attribute__((format(printf, 4, 5)));
+
+static void
+put(char *buf, size_t size, size_t *pos, const char *format, ...)
+{
+  va_list ap;
+  int len;
+  if (*pos + 1 >= size) return;
+  va_start(ap, format);
+  len = vsnprintf(buf + *pos, size - *pos, format, ap);
+  va_end(ap);
+  if (len < 0) return;
+  *pos += len;
+  if (*pos >= size) *pos = size - 1;
+}
+
+void
+usb_class_map_init(struct USBClassMap *map)
+{
+  memset(map, 0, sizeof(*map));
+}
+
+int
+usb_class_map_set(struct USBClassMap *map, const char *arg)
+{
+  struct USBClassInterface interface = {USB_CLASS_NONE, 0, 0, 0};
+  unsigned int addr;
+  unsigned int endp;
+  char name[8];
+  unsigned int e;
+  if (sscanf(arg, "%u.%u=%7s", &addr, &endp, name) == 3) {
+    if (endp >= 16) addr = 128;
+  } else if (sscanf(arg, "%u=%7s", &addr, name) == 2) {
+    endp = 16;
+  } else {
+    addr = 128;
+  }
+  if (addr >= 128) {
+    fprintf(stderr, "Invalid class setting: %s\n", arg);
+    return -1;
+  }
+  if (strcmp(name, "hid") == 0) {
+    interface.cls = USB_CLASS_HID;
+  } else if (strcmp(name, "cdc") == 0) {
+    interface.cls = USB_CLASS_CDC_DATA;
+  } else if (strcmp(name, "msc") == 0) {
+    interface.cls = USB_CLASS_MSC;
+  } else {
+    fprintf(stderr, "Unknown class %s, use hid, cdc or msc\n", name);
+    return -1;
+  }
+  for (e = 1; e < 16; e++) {
+    if (endp < 16 && e != endp) continue;
+    map->endpoints[addr][e] = interface;
+    map->endpoints[addr][e | 16] = interface;
+  }
+  return 0;
+}
+
+static char *
+map_path(const char *dir)
+{
+  size_t len = strlen(dir) + 16;
+  char *path = malloc(len);
+  if (path) snprintf(path, len, "%s/classes", dir);
+  return path;
+}
+
+unsigned int
+usb_class_map_load(struct USBClassMap *map, const char *dir)
+{
+  char header[8];
+  uint32_t segments = 0;
+  char *path = map_path(dir);
+  FILE *in;
+  if (!path) return 0;
+  in = fopen(path, "r");
+  free(path);
+  if (!in) return 0;
+  if (fread(header, sizeof(header), 1, in) != 1
+      || memcmp(header, "USBCL1\0\0", 8) != 0
+      || fread(&segments, sizeof(segments), 1, in) != 1
+      || fread(map, sizeof(*map), 1, in) != 1) {
+    /* Learn again from the start */
+    usb_class_map_init(map);
+    segments = 0;
+  }
+  fclose(in);
+  return segments;
+}
+
+int
+usb_class_map_save(const struct USBClassMap *map, const char *dir,
+		   unsigned int segments)
+{
+  uint32_t n = segments;
+  char *path = map_path(dir);
+  char *tmp;
+  FILE *out;
+  int ok;
+  if (!path) return -1;
+  tmp = malloc(strlen(path) + 8);
+  if (!tmp) {
+    free(path);
+    return -1;
+  }
+  sprintf(tmp, "%s.new", path);
+  out = fopen(tmp, "w");
+  ok = out && fwrite("USBCL1\0\0", 8, 1, out) == 1
+    && fwrite(&n, sizeof(n), 1, out) == 1
+    && fwrite(map, sizeof(*map), 1, out) == 1;
+  if (out && fclose(out) != 0) ok = 0;
+  /* The store may be read only, the map is then learned every time */
+  if (ok) ok = rename(tmp, path) == 0;
+  if (!ok) remove(tmp);
+  free(tmp);
+  free(path);
+  return ok ? 0 : -1;
+}
+
+uint64_t
+usb_class_map_hash(const struct USBClassMap *map)
+{
+  /* FNV-1a */
+  const uint8_t *p = (const uint8_t *)map;
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  size_t i;
+  for (i = 0; i < sizeof(*map); i++) {
+    hash ^= p[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+void
+usb_class_learn_init(struct USBClassLearner *learner,
+		     struct USBClassMap *map)
+{
+  memset(learner, 0, sizeof(*learner));
+  learner->map = map;
+}
+
+static void
+parse_config(struct USBClassMap *map, uint8_t addr,
+	     const uint8_t *config, unsigned int len)
+{
+  struct USBClassInterface interface;
+  int have_interface = 0;
+  unsigned int i = 0;
+  while(i + 2 <= len) {
+    const uint8_t *d = config + i;
+    unsigned int d_len = d[0];
+    if (d_len < 2 || i + d_len > len) break;
+    if (d[1] == DESC_INTERFACE && d_len >= 9) {
+      interface.number = d[2];
+      interface.cls = d[5];
+      interface.subclass = d[6];
+      interface.protocol = d[7];
+      have_interface = 1;
+      map->interfaces[addr][d[2] % USB_CLASS_INTERFACES] = interface;
+    } else if (d[1] == DESC_ENDPOINT && d_len >= 7 && have_interface) {
+      map->endpoints[addr][(d[2] & 0x0f) | ((d[2] & 0x80) ? 16 : 0)]
+	= interface;
+    }
+    i += d_len;
+  }
+}
+
+static void
+finish_config(struct USBClassLearner *learner)
+{
+  if (!learner->collecting) return;
+  parse_config(learner->map, learner->collecting - 1, learner->config,
+	       learner->len);
+  learner->collecting = 0;
+}
+
+void
+usb_class_learn(struct USBClassLearner *learner, uint8_t pid, uint8_t addr,
+		uint8_t endp, unsigned int flags,
+		const uint8_t *data, unsigned int len)
+{
+  if (flags & (USB_PACKET_CRC_ERROR | USB_PACKET_INVALID)) return;
+  if (flags & USB_PACKET_TOKEN) {
+    if (pid == USB_PID_SOF) return;
+    /* A new request or the status stage ends the data stage */
+    if (learner->collecting == addr + 1 && endp == 0 && pid != USB_PID_IN) {
+      finish_config(learner);
+    }
+    learner->last_token = pid;
+    return;
+  }
+  if (!(flags & USB_PACKET_DATA)) return;
+  if (learner->last_token == USB_PID_SETUP && len == 8) {
+    finish_config(learner);
+    if (data[0] == 0x80 && data[1] == REQ_GET_DESCRIPTOR
+	&& data[3] == DESC_CONFIGURATION) {
+      learner->collecting = addr + 1;
+      learner->wanted = get_u16(data + 6);
+      if (learner->wanted > USB_CLASS_MAX_CONFIG) {
+	learner->wanted = USB_CLASS_MAX_CONFIG;
+      }
+      learner->len = 0;
+    }
+  } else if (learner->last_token == USB_PID_IN
+	     && learner->collecting == addr + 1 && endp == 0) {
+    unsigned int n = learner->wanted - learner->len;
+    if (len < n) n = len;
+    memcpy(learner->config + learner->len, data, n);
+    learner->len += n;
+    if (learner->len == learner->wanted) finish_config(learner);
+  }
+}
+
+static void
+describe_hid(const struct USBClassInterface *interface,
+	     const uint8_t *data, unsigned int len,
+	     char *buf, size_t size, size_t *pos)
+{
+  unsigned int i;
+  if (interface->subclass == 1 && interface->protocol == 1 && len == 8) {
+    int keys = 0;
+    put(buf, size, pos, "keyboard modifiers %02x keys", data[0]);
+    for (i = 2; i < 8; i++) {
+      if (data[i] == 0) continue;
+      put(buf, size, pos, " %02x", data[i]);
+      keys++;
+    }
+    if (!keys) put(buf, size, pos, " none");
+  } else if (interface->subclass == 1 && interface->protocol == 2
+	     && len >= 3) {
+    put(buf, size, pos, "mouse buttons %x x %d y %d", data[0] & 0x1f,
+	(int8_t)data[1], (int8_t)data[2]);
+    if (len >= 4) put(buf, size, pos, " wheel %d", (int8_t)data[3]);
+  } else {
+    put(buf, size, pos, "HID report");
+  }
+}
+
+static void
+describe_text(const uint8_t *data, unsigned int len,
+	      char *buf, size_t size, size_t *pos)
+{
+  unsigned int i;
+  put(buf, size, pos, "text \"");
+  for (i = 0; i < len && i < MAX_TEXT; i++) {
+    if (data[i] == '\n') {
+      put(buf, size, pos, "\\n");
+    } else if (data[i] == '\r') {
+      put(buf, size, pos, "\\r");
+    } else if (data[i] == '"' || data[i] == '\\') {
+      put(buf, size, pos, "\\%c", data[i]);
+    } else if (data[i] >= 0x20 && data[i] < 0x7f) {
+      put(buf, size, pos, "%c", data[i]);
+    } else {
+      put(buf, size, pos, "\\x%02x", data[i]);
+    }
+  }
+  put(buf, size, pos, "\"%s", len > MAX_TEXT ? "..." : "");
+}
+
+static void
+describe_notification(const uint8_t *data, unsigned int len,
+		      char *buf, size_t size, size_t *pos)
+{
+  static const char *state_bits[7] = {
+    "DCD", "DSR", "break", "ring", "framing-error", "parity-error",
+    "overrun"
+  };
+  unsigned int i;
+  if (data[1] == 0x20 && len >= 10) {
+    uint16_t state = get_u16(data + 8);
+    put(buf, size, pos, "serial state");
+    for (i = 0; i < 7; i++) {
+      if (state & (1 << i)) put(buf, size, pos, " %s", state_bits[i]);
+    }
+  } else if (data[1] == 0x00) {
+    put(buf, size, pos, "network %s",
+	get_u16(data + 2) ? "connected" : "disconnected");
+  } else {
+    put(buf, size, pos, "notification %02x", data[1]);
+  }
+}
+
+static const char *
+scsi_name(uint8_t opcode)
+{
+  unsigned int i;
+  for (i = 0; i < N_SCSI_COMMANDS; i++) {
+    if (scsi_commands[i].opcode == opcode) return scsi_commands[i].name;
+  }
+  return NULL;
+}
+
+static void
+describe_msc(const uint8_t *data, unsigned int len,
+	     char *buf, size_t size, size_t *pos)
+{
+  if (len == 31 && get_u32(data) == CBW_SIGNATURE) {
+    const uint8_t *cb = data + 15;
+    const char *name = scsi_name(cb[0]);
+    put(buf, size, pos, "CBW tag %08x %u bytes %s lun %u ", get_u32(data + 4),
+	get_u32(data + 8), (data[12] & 0x80) ? "in" : "out", data[13] & 0x0f);
+    if (name) {
+      put(buf, size, pos, "%s", name);
+    } else {
+      put(buf, size, pos, "SCSI %02x", cb[0]);
+    }
+    if (cb[0] == 0x28 || cb[0] == 0x2a || cb[0] == 0x2f) {
+      put(buf, size, pos, " lba %u blocks %u", get_be32(cb + 2),
+	  (cb[7] << 8) | cb[8]);
+    }
+  } else if (len == 13 && get_u32(data) == CSW_SIGNATURE) {
+    static const char *status[3] = {"passed", "failed", "phase-error"};
+    put(buf, size, pos, "CSW tag %08x residue %u %s", get_u32(data + 4),
+	get_u32(data + 8), data[12] < 3 ? status[data[12]] : "invalid");
+  } else if (len == 36 && data[4] == 31) {
+    /* Standard INQUIRY data */
+    put(buf, size, pos, "inquiry \"%.8s\" \"%.16s\" \"%.4s\"",
+	(const char*)data + 8, (const char*)data + 16, (const char*)data + 32);
+  }
+}
+
+size_t
+usb_class_describe(const struct USBClassInterface *interface,
+		   const uint8_t *data, unsigned int len,
+		   char *buf, size_t size)
+{
+  size_t pos = 0;
+  if (size == 0) return 0;
+  buf[0] = '\0';
+  switch(interface->cls) {
+  case USB_CLASS_HID:
+    describe_hid(interface, data, len, buf, size, &pos);
+    break;
+  case USB_CLASS_CDC_DATA:
+    if (len > 0) describe_text(data, len, buf, size, &pos);
+    break;
+  case USB_CLASS_CDC:
+    if (len >= 8 && data[0] == 0xa1) {
+      describe_notification(data, len, buf, size, &pos);
+    }
+    break;
+  case USB_CLASS_MSC:
+    describe_msc(data, len, buf, size, &pos);
+    break;
+  }
+  return pos;
+}
+
+static uint8_t
+interface_class(const struct USBClassMap *map, uint8_t addr,
+		const uint8_t *setup)
+{
+  /* Class requests to an interface or to one of its endpoints */
+  switch(setup[0] & 0x1f) {
+  case 1:
+    return map->interfaces[addr & 0x7f][setup[4] % USB_CLASS_INTERFACES].cls;
+  case 2:
+    return usb_class_lookup(map, addr, setup[4], setup[4] & 0x80)->cls;
+  }
+  return USB_CLASS_NONE;
+}
+
+static const char *
+class_request(uint8_t cls, uint8_t request)
+{
+  switch(cls) {
+  case USB_CLASS_HID:
+    switch(request) {
+    case 0x01: return "GET_REPORT";
+    case 0x02: return "GET_IDLE";
+    case 0x03: return "GET_PROTOCOL";
+    case 0x09: return "SET_REPORT";
+    case 0x0a: return "SET_IDLE";
+    case 0x0b: return "SET_PROTOCOL";
+    }
+    break;
+  case USB_CLASS_CDC:
+    switch(request) {
+    case 0x20: return "SET_LINE_CODING";
+    case 0x21: return "GET_LINE_CODING";
+    case 0x22: return "SET_CONTROL_LINE_STATE";
+    case 0x23: return "SEND_BREAK";
+    }
+    break;
+  case USB_CLASS_MSC:
+    switch(request) {
+    case 0xfe: return "GET_MAX_LUN";
+    case 0xff: return "BULK_ONLY_MASS_STORAGE_RESET";
+    }
+    break;
+  }
+  return NULL;
+}
+
+size_t
+usb_class_describe_setup(const struct USBClassMap *map, uint8_t addr,
+			 const uint8_t *setup, char *buf, size_t size)
+{
+  uint16_t value = get_u16(setup + 2);
+  uint16_t index = get_u16(setup + 4);
+  unsigned int type = (setup[0] >> 5) & 3;
+  size_t pos = 0;
+  if (size == 0) return 0;
+  buf[0] = '\0';
+  if (type == 0 && setup[1] < sizeof(standard_requests) / sizeof(char*)
+      && standard_requests[setup[1]]) {
+    put(buf, size, &pos, "%s", standard_requests[setup[1]]);
+    switch(setup[1]) {
+    case REQ_GET_DESCRIPTOR:
+    case 7:
+      if ((value >> 8) < sizeof(descriptor_types) / sizeof(char*)
+	  && descriptor_types[value >> 8]) {
+	put(buf, size, &pos, " %s", descriptor_types[value >> 8]);
+      } else {
+	put(buf, size, &pos, " type %02x", value >> 8);
+      }
+      put(buf, size, &pos, " %u", value & 0xff);
+      break;
+    case 1:
+    case 3:
+      if ((setup[0] & 0x1f) == 2 && value == 0) {
+	put(buf, size, &pos, " ENDPOINT_HALT %02x", index & 0xff);
+      } else {
+	put(buf, size, &pos, " %u", value);
+      }
+      break;
+    case 5:
+    case 9:
+      put(buf, size, &pos, " %u", value);
+      break;
+    case 11:
+      put(buf, size, &pos, " interface %u alternate %u", index, value);
+      break;
+    }
+  } else if (type == 1) {
+    uint8_t cls = interface_class(map, addr, setup);
+    const char *name = class_request(cls, setup[1]);
+    if (name) {
+      put(buf, size, &pos, "%s", name);
+    } else {
+      put(buf, size, &pos, "class request %02x", setup[1]);
+    }
+    if (cls == USB_CLASS_CDC && setup[1] == 0x22) {
+      put(buf, size, &pos, " DTR %u RTS %u", value & 1, (value >> 1) & 1);
+    } else if (cls == USB_CLASS_HID && setup[1] == 0x0a) {
+      put(buf, size, &pos, " %u ms", (value >> 8) * 4);
+    } else if (cls == USB_CLASS_HID && setup[1] == 0x0b) {
+      put(buf, size, &pos, " %s", value ? "report" : "boot");
+    }
+    if ((setup[0] & 0x1f) == 1) put(buf, size, &pos, " interface %u", index);
+  } else if (type == 2) {
+    put(buf, size, &pos, "vendor request %02x value %04x index %04x",
+	setup[1], value, index);
+  } else {
+    put(buf, size, &pos, "request %02x", setup[1]);
+  }
+  put(buf, size, &pos, " length %u", get_u16(setup + 6));
+  return pos;
+}
+
+size_t
+usb_class_describe_control(const struct USBClassMap *map, uint8_t addr,
+			   const uint8_t *setup,
+			   const uint8_t *data, unsigned int len,
+			   char *buf, size_t size)
+{
+  static const char parity[5] = {'N', 'O', 'E', 'M', 'S'};
+  static const char *stop_bits[3] = {"1", "1.5", "2"};
+  unsigned int type = (setup[0] >> 5) & 3;
+  size_t pos = 0;
+  if (size == 0) return 0;
+  buf[0] = '\0';
+  if (type == 1 && (setup[1] == 0x20 || setup[1] == 0x21) && len == 7
+      && interface_class(map, addr, setup) == USB_CLASS_CDC) {
+    put(buf, size, &pos, "line coding %u %u%c%s", get_u32(data), data[6],
+	data[5] < 5 ? parity[data[5]] : '?',
+	data[4] < 3 ? stop_bits[data[4]] : "?");
+  } else if (type == 0 && setup[1] == REQ_GET_DESCRIPTOR && len >= 2
+	     && data[1] == setup[3]) {
+    /* First packet of a descriptor */
+    switch(data[1]) {
+    case DESC_DEVICE:
+      if (len >= 12) {
+	put(buf, size, &pos, "device class %02x vendor %04x product %04x",
+	    data[4], get_u16(data + 8), get_u16(data + 10));
+      }
+      break;
+    case DESC_CONFIGURATION:
+      if (len >= 5) {
+	put(buf, size, &pos, "configuration %u interfaces %u bytes",
+	    data[4], get_u16(data + 2));
+      }
+      break;
+    case DESC_STRING:
+      if (setup[2] != 0) {
+	unsigned int i;
+	put(buf, size, &pos, "string \"");
+	for (i = 2; i + 1 < len && i + 1 < data[0]; i += 2) {
+	  uint8_t c = data[i];
+	  put(buf, size, &pos, "%c",
+	      data[i + 1] == 0 && c >= 0x20 && c < 0x7f ? c : '?');
+	}
+	put(buf, size, &pos, "\"");
+      }
+      break;
+    }
+  }
+  return pos;
+}
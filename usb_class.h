@@ -0,0 +1,116 @@
+#ifndef USB_CLASS_H
+#define USB_CLASS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Payloads described by device class: HID boot keyboards and mice,
+   CDC serial lines and mass storage Bulk-Only transport with SCSI
+   commands, plus the control requests of these and the standard
+   ones.
+
+   Nothing here runs while capturing. The column store keeps the
+   endpoint and payload of every packet. The class of each endpoint is
+   learned from the configuration descriptors in the stored control
+   transfers the first time a query needs it, and payloads are only
+   described when they are printed. */
+
+/* bInterfaceClass values */
+#define USB_CLASS_NONE 0x00
+#define USB_CLASS_CDC 0x02
+#define USB_CLASS_HID 0x03
+#define USB_CLASS_MSC 0x08
+#define USB_CLASS_CDC_DATA 0x0a
+
+#define USB_CLASS_INTERFACES 16
+/* Longest configuration descriptor collected */
+#define USB_CLASS_MAX_CONFIG 1024
+
+struct USBClassInterface
+{
+  uint8_t cls;
+  uint8_t subclass;
+  uint8_t protocol;
+  uint8_t number;
+};
+
+struct USBClassMap
+{
+  /* Endpoints of each address, IN endpoints at 16 and above */
+  struct USBClassInterface endpoints[128][32];
+  struct USBClassInterface interfaces[128][USB_CLASS_INTERFACES];
+};
+
+/* Follows control transfers and fills in the map from configuration
+   descriptors */
+struct USBClassLearner
+{
+  struct USBClassMap *map;
+  uint8_t last_token; /* PID of the last token */
+  int collecting; /* Address + 1 of a configuration being read */
+  unsigned int wanted;
+  unsigned int len;
+  uint8_t config[USB_CLASS_MAX_CONFIG];
+};
+
+void
+usb_class_map_init(struct USBClassMap *map);
+
+/* Set the class of all endpoints of an address or of one endpoint by
+   hand from "ADDR[.ENDP]=hid|cdc|msc", for captures that start after
+   enumeration */
+int
+usb_class_map_set(struct USBClassMap *map, const char *arg);
+
+static inline const struct USBClassInterface *
+usb_class_lookup(const struct USBClassMap *map, uint8_t addr, uint8_t endp,
+		 int in)
+{
+  return &map->endpoints[addr & 0x7f][(endp & 0x0f) | (in ? 16 : 0)];
+}
+
+/* The map learned from the first segments of a store is kept in
+   STORE/classes. Load returns the number of segments it covers, 0 if
+   there is none. */
+unsigned int
+usb_class_map_load(struct USBClassMap *map, const char *dir);
+
+int
+usb_class_map_save(const struct USBClassMap *map, const char *dir,
+		   unsigned int segments);
+
+/* Changes whenever the map does, for caches of descriptions */
+uint64_t
+usb_class_map_hash(const struct USBClassMap *map);
+
+void
+usb_class_learn_init(struct USBClassLearner *learner,
+		     struct USBClassMap *map);
+
+/* Feed every packet in order. addr and endp are those of the token,
+   flags are USB_PACKET_* flags. */
+void
+usb_class_learn(struct USBClassLearner *learner, uint8_t pid, uint8_t addr,
+		uint8_t endp, unsigned int flags,
+		const uint8_t *data, unsigned int len);
+
+/* Describe the payload of a data packet sent to or from an endpoint
+   of interface. Returns 0 if there is nothing to say. */
+size_t
+usb_class_describe(const struct USBClassInterface *interface,
+		   const uint8_t *data, unsigned int len,
+		   char *buf, size_t size);
+
+/* Describe the 8 bytes of a SETUP packet */
+size_t
+usb_class_describe_setup(const struct USBClassMap *map, uint8_t addr,
+			 const uint8_t *setup, char *buf, size_t size);
+
+/* Describe the data stage of the control request setup */
+size_t
+usb_class_describe_control(const struct USBClassMap *map, uint8_t addr,
+			   const uint8_t *setup,
+			   const uint8_t *data, unsigned int len,
+			   char *buf, size_t size);
+
+#endif
@@ -0,0 +1,392 @@
+#include "usb_colstore.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <usb_packet.h>
+
+/* Entries buffered per column before writing */
+#define COLUMN_BUF 65536
+#define PAYLOAD_BUF (1024 * 1024)
+
+enum {
+  COL_TS, COL_PID, COL_ADDR, COL_ENDP, COL_FLAGS, COL_PAYLOAD_OFF,
+  COL_PAYLOAD, N_COLUMNS = USB_COLSTORE_COLUMNS
+};
+
+static const char *column_names[N_COLUMNS] = {
+  "ts", "pid", "addr", "endp", "flags", "payload_off", "payload"
+};
+
+static const unsigned int column_width[N_COLUMNS] = {
+  sizeof(uint64_t), 1, 1, 1, 1, sizeof(uint32_t), 1
+};
+
+struct USBColStore
+{
+  char *dir;
+  uint64_t start_ns;
+  unsigned int segment;
+  int fds[N_COLUMNS]; /* -1 before the segment is created */
+  uint64_t seg_packets;
+  uint32_t seg_payload;
+  struct USBPacketTracker tracker;
+  uint8_t next_flags;
+  int failed; /* Could not create a segment, packets are dropped */
+  unsigned int n_buf; /* Packets buffered */
+  uint64_t *ts;
+  uint8_t *pid;
+  uint8_t *addr;
+  uint8_t *endp;
+  uint8_t *flags;
+  uint32_t *payload_off;
+  unsigned int payload_used;
+  uint8_t *payload;
+};
+
+char *
+usb_colstore_path(const char *dir, unsigned int number, const char *file)
+{
+  size_t len = strlen(dir) + 64;
+  char *path = malloc(len);
+  if (!path) return NULL;
+  if (file) {
+    snprintf(path, len, "%s/%08u/%s", dir, number, file);
+  } else {
+    snprintf(path, len, "%s/%08u", dir, number);
+  }
+  return path;
+}
+
+unsigned int
+usb_colstore_segments(const char *dir)
+{
+  unsigned int n = 0;
+  while(1) {
+    struct stat st;
+    char *path = usb_colstore_path(dir, n, NULL);
+    int found;
+    if (!path) break;
+    found = stat(path, &st) == 0;
+    free(path);
+    if (!found) break;
+    n++;
+  }
+  return n;
+}
+
+USBColStore *
+usb_colstore_open(const char *dir, uint64_t start_ns)
+{
+  unsigned int i;
+  USBColStore *store;
+  if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+    fprintf(stderr, "Failed to create directory %s: %s\n",
+	    dir, strerror(errno));
+    return NULL;
+  }
+  store = malloc(sizeof(USBColStore));
+  if (!store) return NULL;
+  memset(store, 0, sizeof(USBColStore));
+  for (i = 0; i < N_COLUMNS; i++) store->fds[i] = -1;
+  store->dir = strdup(dir);
+  store->ts = malloc(COLUMN_BUF * sizeof(uint64_t));
+  store->pid = malloc(COLUMN_BUF);
+  store->addr = malloc(COLUMN_BUF);
+  store->endp = malloc(COLUMN_BUF);
+  store->flags = malloc(COLUMN_BUF);
+  store->payload_off = malloc(COLUMN_BUF * sizeof(uint32_t));
+  store->payload = malloc(PAYLOAD_BUF);
+  if (!store->dir || !store->ts || !store->pid || !store->addr
+      || !store->endp || !store->flags || !store->payload_off
+      || !store->payload) {
+    usb_colstore_close(store);
+    return NULL;
+  }
+  store->start_ns = start_ns;
+  store->segment = usb_colstore_segments(dir);
+  usb_packet_tracker_init(&store->tracker);
+  return store;
+}
+
+static int
+write_start(USBColStore *store)
+{
+  char *path = usb_colstore_path(store->dir, store->segment, "start");
+  int fd;
+  if (!path) return -1;
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0
+      || write(fd, &store->start_ns, sizeof(store->start_ns))
+      != sizeof(store->start_ns)) {
+    fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+    if (fd >= 0) close(fd);
+    free(path);
+    return -1;
+  }
+  close(fd);
+  free(path);
+  return 0;
+}
+
+/* 0 if the segment has no start file */
+static uint64_t
+read_start(const char *dir, unsigned int number)
+{
+  char *path = usb_colstore_path(dir, number, "start");
+  uint64_t start_ns = 0;
+  int fd;
+  if (!path) return 0;
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  free(path);
+  if (fd < 0) return 0;
+  if (read(fd, &start_ns, sizeof(start_ns)) != sizeof(start_ns)) {
+    start_ns = 0;
+  }
+  close(fd);
+  return start_ns;
+}
+
+static int
+open_segment(USBColStore *store)
+{
+  unsigned int i;
+  char *path = usb_colstore_path(store->dir, store->segment, NULL);
+  if (!path) return -1;
+  if (mkdir(path, 0777) < 0) {
+    fprintf(stderr, "Failed to create directory %s: %s\n",
+	    path, strerror(errno));
+    free(path);
+    return -1;
+  }
+  free(path);
+  if (write_start(store) < 0) return -1;
+  for (i = 0; i < N_COLUMNS; i++) {
+    path = usb_colstore_path(store->dir, store->segment, column_names[i]);
+    if (!path) return -1;
+    store->fds[i] = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+			 0666);
+    if (store->fds[i] < 0) {
+      fprintf(stderr, "Failed to open file %s for writing: %s\n",
+	      path, strerror(errno));
+      free(path);
+      return -1;
+    }
+    free(path);
+  }
+  store->seg_packets = 0;
+  store->seg_payload = 0;
+  return 0;
+}
+
+static void
+close_segment(USBColStore *store)
+{
+  unsigned int i;
+  for (i = 0; i < N_COLUMNS; i++) {
+    if (store->fds[i] >= 0) close(store->fds[i]);
+    store->fds[i] = -1;
+  }
+  store->segment++;
+}
+
+static int
+write_column(int fd, const void *data, size_t len)
+{
+  const uint8_t *p = data;
+  while(len > 0) {
+    ssize_t w = write(fd, p, len);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "Failed to write packet store: %s\n", strerror(errno));
+      return -1;
+    }
+    p += w;
+    len -= w;
+  }
+  return 0;
+}
+
+int
+usb_colstore_flush(USBColStore *store)
+{
+  unsigned int n = store->n_buf;
+  int ret = 0;
+  if (n == 0 || store->fds[COL_TS] < 0) return 0;
+  /* Payload first so that readers never see offsets past its end */
+  if (write_column(store->fds[COL_PAYLOAD], store->payload,
+		   store->payload_used) < 0
+      || write_column(store->fds[COL_PAYLOAD_OFF], store->payload_off,
+		      n * sizeof(uint32_t)) < 0
+      || write_column(store->fds[COL_PID], store->pid, n) < 0
+      || write_column(store->fds[COL_ADDR], store->addr, n) < 0
+      || write_column(store->fds[COL_ENDP], store->endp, n) < 0
+      || write_column(store->fds[COL_FLAGS], store->flags, n) < 0
+      || write_column(store->fds[COL_TS], store->ts,
+		      n * sizeof(uint64_t)) < 0) {
+    ret = -1;
+  }
+  store->n_buf = 0;
+  store->payload_used = 0;
+  return ret;
+}
+
+static void
+add_packet(USBColStore *store, uint32_t *bits, uint32_t n_bits,
+	   const struct USBPacketInfo *info)
+{
+  unsigned int n;
+  unsigned int len;
+  if (store->failed) return;
+  len = info->data ? info->data_len : 0;
+  if (len > USB_MAX_PAYLOAD) len = USB_MAX_PAYLOAD;
+  if (store->fds[COL_TS] >= 0
+      && (store->seg_packets == USB_COLSTORE_SEGMENT_PACKETS
+	  || store->seg_payload + len > USB_COLSTORE_SEGMENT_PAYLOAD)) {
+    usb_colstore_flush(store);
+    close_segment(store);
+  }
+  if (store->fds[COL_TS] < 0) {
+    if (open_segment(store) < 0) {
+      close_segment(store);
+      store->failed = 1;
+      return;
+    }
+  }
+  if (store->n_buf == COLUMN_BUF || store->payload_used + len > PAYLOAD_BUF) {
+    usb_colstore_flush(store);
+  }
+  n = store->n_buf++;
+  store->ts[n] = info->ts;
+  store->pid[n] = info->pid;
+  store->addr[n] = info->has_token ? info->addr : USB_COLSTORE_NONE;
+  store->endp[n] = info->has_token ? info->endp : USB_COLSTORE_NONE;
+  store->flags[n] = info->flags | store->next_flags;
+  store->next_flags = 0;
+  store->payload_off[n] = store->seg_payload;
+  if (len > 0) {
+    memcpy(store->payload + store->payload_used, info->data, len);
+    store->payload_used += len;
+    store->seg_payload += len;
+  }
+  store->seg_packets++;
+}
+
+void
+usb_colstore_packet(uint32_t *bits, uint32_t n_bits, timestamp_t ts,
+		    void *user_data)
+{
+  USBColStore *store = user_data;
+  struct USBPacketInfo info;
+  usb_packet_parse(&store->tracker, bits, n_bits, ts, &info);
+  add_packet(store, bits, n_bits, &info);
+}
+
+void
+usb_colstore_batch(struct USBPacketBatch *batch, void *user_data)
+{
+  USBColStore *store = user_data;
+  unsigned int p;
+  for (p = 0; p < batch->n_packets; p++) {
+    add_packet(store, usb_packet_batch_bits(batch, p),
+	       batch->packets[p].n_bits, &batch->info[p]);
+  }
+}
+
+void
+usb_colstore_gap(USBColStore *store)
+{
+  usb_packet_tracker_init(&store->tracker);
+  store->next_flags = USB_COLSTORE_AFTER_GAP;
+}
+
+void
+usb_colstore_close(USBColStore *store)
+{
+  usb_colstore_flush(store);
+  if (store->fds[COL_TS] >= 0) close_segment(store);
+  free(store->ts);
+  free(store->pid);
+  free(store->addr);
+  free(store->endp);
+  free(store->flags);
+  free(store->payload_off);
+  free(store->payload);
+  free(store->dir);
+  free(store);
+}
+
+int
+usb_colstore_map(const char *dir, unsigned int number,
+		 struct USBColSegment *seg)
+{
+  unsigned int i;
+  uint64_t n = ~(uint64_t)0;
+  uint64_t n_off;
+  memset(seg, 0, sizeof(*seg));
+  for (i = 0; i < N_COLUMNS; i++) {
+    struct stat st;
+    char *path = usb_colstore_path(dir, number, column_names[i]);
+    int fd;
+    if (!path) goto error;
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+      fprintf(stderr, "Failed to open file %s for reading: %s\n",
+	      path, strerror(errno));
+      if (fd >= 0) close(fd);
+      free(path);
+      goto error;
+    }
+    free(path);
+    seg->map_len[i] = st.st_size;
+    if (st.st_size > 0) {
+      seg->maps[i] = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (seg->maps[i] == MAP_FAILED) {
+	fprintf(stderr, "Failed to map segment: %s\n", strerror(errno));
+	seg->maps[i] = NULL;
+	close(fd);
+	goto error;
+      }
+      /* Scans go through the columns from start to end */
+      madvise(seg->maps[i], st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    if (i != COL_PAYLOAD && st.st_size / column_width[i] < n) {
+      n = st.st_size / column_width[i];
+    }
+  }
+  seg->n_packets = n;
+  seg->number = number;
+  seg->start_ns = read_start(dir, number);
+  seg->ts = seg->maps[COL_TS];
+  seg->pid = seg->maps[COL_PID];
+  seg->addr = seg->maps[COL_ADDR];
+  seg->endp = seg->maps[COL_ENDP];
+  seg->flags = seg->maps[COL_FLAGS];
+  seg->payload_off = seg->maps[COL_PAYLOAD_OFF];
+  seg->payload = seg->maps[COL_PAYLOAD];
+  seg->payload_len = seg->map_len[COL_PAYLOAD];
+  /* Payload of packets beyond n_packets may already be there */
+  n_off = seg->map_len[COL_PAYLOAD_OFF] / sizeof(uint32_t);
+  if (n_off > n && seg->payload_off[n] < seg->payload_len) {
+    seg->payload_len = seg->payload_off[n];
+  }
+  return 0;
+ error:
+  usb_colstore_unmap(seg);
+  return -1;
+}
+
+void
+usb_colstore_unmap(struct USBColSegment *seg)
+{
+  unsigned int i;
+  for (i = 0; i < N_COLUMNS; i++) {
+    if (seg->maps[i]) munmap(seg->maps[i], seg->map_len[i]);
+    seg->maps[i] = NULL;
+  }
+}
@@ -0,0 +1,119 @@
+#ifndef USB_COLSTORE_H
+#define USB_COLSTORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <packet_handler.h>
+
+/* Decoded packets stored column by column so that usbquery can scan
+   them without decoding again.
+
+   The store is a directory of segments, STORE/00000000, STORE/00000001
+   and so on, each with one file per column in host byte order:
+   ts           uint64 timestamp in ns
+   pid          uint8 PID byte
+   addr, endp   uint8 address and endpoint of the transaction token,
+		USB_COLSTORE_NONE for packets without one
+   flags        uint8 USB_PACKET_* flags and USB_COLSTORE_AFTER_GAP
+   payload_off  uint32 offset of the payload in the payload file, it
+		ends where the next packet's starts
+   payload      payload bytes of all data packets
+   start        uint64 CLOCK_REALTIME in ns at ts 0, written when the
+		segment is created
+
+   Timestamps count from the start of the usbsniff run that stored
+   them, and each run starts a new segment, so segments of different
+   runs overlap in ts. Adding start gives wall clock times that can be
+   compared across segments. Segments of stores made before start was
+   kept have none, their start is 0.
+
+   usbquery -d also keeps the payload descriptions of a segment there,
+   in a descriptions file, once the segment is complete.
+
+   Files are only appended to and a segment is never touched again once
+   the next one exists. A segment being written may have columns of
+   different lengths, readers use the shortest. */
+
+#define USB_COLSTORE_NONE 0xff
+#define USB_COLSTORE_AFTER_GAP 0x80 /* First packet after lost blocks */
+
+#define USB_COLSTORE_COLUMNS 7
+
+/* Limits that start a new segment */
+#define USB_COLSTORE_SEGMENT_PACKETS (16 * 1024 * 1024)
+#define USB_COLSTORE_SEGMENT_PAYLOAD (1024 * 1024 * 1024)
+
+typedef struct USBColStore USBColStore;
+
+/* Creates the directory if needed, new packets go into a new segment
+   after the existing ones. start_ns is the CLOCK_REALTIME at ts 0. */
+USBColStore *
+usb_colstore_open(const char *dir, uint64_t start_ns);
+
+/* Packet handler, user_data is the USBColStore */
+void
+usb_colstore_packet(uint32_t *bits, uint32_t n_bits, timestamp_t ts,
+		    void *user_data);
+
+/* The same for batches, from the parsed packets */
+void
+usb_colstore_batch(struct USBPacketBatch *batch, void *user_data);
+
+void
+usb_colstore_gap(USBColStore *store);
+
+/* Write everything buffered so far */
+int
+usb_colstore_flush(USBColStore *store);
+
+void
+usb_colstore_close(USBColStore *store);
+
+/* A memory mapped segment */
+struct USBColSegment
+{
+  uint64_t n_packets;
+  unsigned int number;
+  uint64_t start_ns; /* Wall clock time of ts 0 */
+  const uint64_t *ts;
+  const uint8_t *pid;
+  const uint8_t *addr;
+  const uint8_t *endp;
+  const uint8_t *flags;
+  const uint32_t *payload_off;
+  const uint8_t *payload;
+  uint64_t payload_len;
+  void *maps[USB_COLSTORE_COLUMNS];
+  size_t map_len[USB_COLSTORE_COLUMNS];
+};
+
+/* DIR/NUMBER/FILE, or the segment directory if file is NULL.
+   Allocated. */
+char *
+usb_colstore_path(const char *dir, unsigned int number, const char *file);
+
+/* Number of segments in the store */
+unsigned int
+usb_colstore_segments(const char *dir);
+
+int
+usb_colstore_map(const char *dir, unsigned int number,
+		 struct USBColSegment *seg);
+
+void
+usb_colstore_unmap(struct USBColSegment *seg);
+
+/* Payload of packet i */
+static inline const uint8_t *
+usb_colstore_payload(const struct USBColSegment *seg, uint64_t i,
+		     unsigned int *len)
+{
+  uint64_t start = seg->payload_off[i];
+  uint64_t end = (i + 1 < seg->n_packets
+		  ? seg->payload_off[i + 1] : seg->payload_len);
+  if (end > seg->payload_len) end = seg->payload_len;
+  *len = end > start ? end - start : 0;
+  return seg->payload + start;
+}
+
+#endif
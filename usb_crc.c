@@ -0,0 +1,259 @@
+#include "usb_crc.h"
+#include <crc16.h>
+#include <usb_crc_tables.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_CLMUL_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define HAVE_CLMUL_ARM
+#endif
+
+/* Shorter data is not worth the setup of the folding */
+#define CLMUL_MIN_LEN 64
+
+static uint16_t
+crc16_bytewise(uint16_t crc, const uint8_t *data, size_t len)
+{
+  while(len-- > 0) {
+    crc = crc16_update(crc, *data++);
+  }
+  return crc;
+}
+
+static uint16_t
+crc16_slice8(uint16_t crc, const uint8_t *data, size_t len)
+{
+  while(len >= 8) {
+    uint32_t lo = ((data[0] | data[1] << 8) ^ crc);
+    crc = (crc16_slice[7][lo & 0xff] ^ crc16_slice[6][lo >> 8]
+	   ^ crc16_slice[5][data[2]] ^ crc16_slice[4][data[3]]
+	   ^ crc16_slice[3][data[4]] ^ crc16_slice[2][data[5]]
+	   ^ crc16_slice[1][data[6]] ^ crc16_slice[0][data[7]]);
+    data += 8;
+    len -= 8;
+  }
+  while(len-- > 0) {
+    crc = (crc >> 8) ^ crc16_slice[0][(crc ^ *data++) & 0xff];
+  }
+  return crc;
+}
+
+/* Folding: a block of the packet is congruent, modulo the polynomial,
+   to its halves multiplied by the power of x for their distance to the
+   block it is folded into. The products are 80 bits at most, so one
+   128 bit accumulator (four for long packets) carries everything before
+   the current block. What is left is finished with the tables. */
+
+#ifdef HAVE_CLMUL_X86
+
+__attribute__((target("pclmul,sse2")))
+static inline __m128i
+fold_x86(__m128i x, __m128i k)
+{
+  return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),
+		       _mm_clmulepi64_si128(x, k, 0x11));
+}
+
+__attribute__((target("pclmul,sse2")))
+static uint16_t
+crc16_clmul(uint16_t crc, const uint8_t *data, size_t len)
+{
+  const __m128i k128 = _mm_set_epi64x((long long)USB_CRC16_FOLD128_HI,
+				      (long long)USB_CRC16_FOLD128_LO);
+  const __m128i k512 = _mm_set_epi64x((long long)USB_CRC16_FOLD512_HI,
+				      (long long)USB_CRC16_FOLD512_LO);
+  __m128i x;
+  uint8_t rest[16];
+  if (len < CLMUL_MIN_LEN) return crc16_slice8(crc, data, len);
+  {
+    __m128i x0 = _mm_loadu_si128((const __m128i*)data);
+    __m128i x1 = _mm_loadu_si128((const __m128i*)(data + 16));
+    __m128i x2 = _mm_loadu_si128((const __m128i*)(data + 32));
+    __m128i x3 = _mm_loadu_si128((const __m128i*)(data + 48));
+    x0 = _mm_xor_si128(x0, _mm_cvtsi32_si128(crc));
+    data += 64;
+    len -= 64;
+    while(len >= 64) {
+      x0 = _mm_xor_si128(fold_x86(x0, k512),
+			 _mm_loadu_si128((const __m128i*)data));
+      x1 = _mm_xor_si128(fold_x86(x1, k512),
+			 _mm_loadu_si128((const __m128i*)(data + 16)));
+      x2 = _mm_xor_si128(fold_x86(x2, k512),
+			 _mm_loadu_si128((const __m128i*)(data + 32)));
+      x3 = _mm_xor_si128(fold_x86(x3, k512),
+			 _mm_loadu_si128((const __m128i*)(data + 48)));
+      data += 64;
+      len -= 64;
+    }
+    x = _mm_xor_si128(fold_x86(x0, k128), x1);
+    x = _mm_xor_si128(fold_x86(x, k128), x2);
+    x = _mm_xor_si128(fold_x86(x, k128), x3);
+  }
+  while(len >= 16) {
+    x = _mm_xor_si128(fold_x86(x, k128),
+		      _mm_loadu_si128((const __m128i*)data));
+    data += 16;
+    len -= 16;
+  }
+  _mm_storeu_si128((__m128i*)rest, x);
+  crc = crc16_slice8(0, rest, 16);
+  return crc16_slice8(crc, data, len);
+}
+
+static int
+clmul_available(void)
+{
+  __builtin_cpu_init();
+  return !!__builtin_cpu_supports("pclmul");
+}
+
+#elif defined(HAVE_CLMUL_ARM)
+
+__attribute__((target("+crypto")))
+static inline uint64x2_t
+fold_arm(uint64x2_t x, poly64_t k_lo, poly64_t k_hi)
+{
+  poly128_t l = vmull_p64((poly64_t)vgetq_lane_u64(x, 0), k_lo);
+  poly128_t h = vmull_p64((poly64_t)vgetq_lane_u64(x, 1), k_hi);
+  return veorq_u64(vreinterpretq_u64_p128(l), vreinterpretq_u64_p128(h));
+}
+
+static inline uint64x2_t
+load_arm(const uint8_t *data)
+{
+  return vreinterpretq_u64_u8(vld1q_u8(data));
+}
+
+__attribute__((target("+crypto")))
+static uint16_t
+crc16_clmul(uint16_t crc, const uint8_t *data, size_t len)
+{
+  const poly64_t k128_lo = USB_CRC16_FOLD128_LO;
+  const poly64_t k128_hi = USB_CRC16_FOLD128_HI;
+  const poly64_t k512_lo = USB_CRC16_FOLD512_LO;
+  const poly64_t k512_hi = USB_CRC16_FOLD512_HI;
+  uint64x2_t x;
+  uint8_t rest[16];
+  if (len < CLMUL_MIN_LEN) return crc16_slice8(crc, data, len);
+  {
+    uint64x2_t x0 = load_arm(data);
+    uint64x2_t x1 = load_arm(data + 16);
+    uint64x2_t x2 = load_arm(data + 32);
+    uint64x2_t x3 = load_arm(data + 48);
+    x0 = veorq_u64(x0, vsetq_lane_u64(crc, vdupq_n_u64(0), 0));
+    data += 64;
+    len -= 64;
+    while(len >= 64) {
+      x0 = veorq_u64(fold_arm(x0, k512_lo, k512_hi), load_arm(data));
+      x1 = veorq_u64(fold_arm(x1, k512_lo, k512_hi), load_arm(data + 16));
+      x2 = veorq_u64(fold_arm(x2, k512_lo, k512_hi), load_arm(data + 32));
+      x3 = veorq_u64(fold_arm(x3, k512_lo, k512_hi), load_arm(data + 48));
+      data += 64;
+      len -= 64;
+    }
+    x = veorq_u64(fold_arm(x0, k128_lo, k128_hi), x1);
+    x = veorq_u64(fold_arm(x, k128_lo, k128_hi), x2);
+    x = veorq_u64(fold_arm(x, k128_lo, k128_hi), x3);
+  }
+  while(len >= 16) {
+    x = veorq_u64(fold_arm(x, k128_lo, k128_hi), load_arm(data));
+    data += 16;
+    len -= 16;
+  }
+  vst1q_u8(rest, vreinterpretq_u8_u64(x));
+  crc = crc16_slice8(0, rest, 16);
+  return crc16_slice8(crc, data, len);
+}
+
+static int
+clmul_available(void)
+{
+  return (getauxval(AT_HWCAP) & HWCAP_PMULL) != 0;
+}
+
+#else
+
+/* 32 bit ARM has no 64 bit carry-less multiply */
+static uint16_t
+crc16_clmul(uint16_t crc, const uint8_t *data, size_t len)
+{
+  return crc16_slice8(crc, data, len);
+}
+
+static int
+clmul_available(void)
+{
+  return 0;
+}
+
+#endif
+
+static uint16_t
+crc16_select(uint16_t crc, const uint8_t *data, size_t len);
+
+static uint16_t (*crc16_best)(uint16_t crc, const uint8_t *data, size_t len)
+  = crc16_select;
+
+/* Only runs once, or a few times if threads race, with the same result */
+static uint16_t
+crc16_select(uint16_t crc, const uint8_t *data, size_t len)
+{
+  uint16_t (*best)(uint16_t crc, const uint8_t *data, size_t len);
+  best = clmul_available() ? crc16_clmul : crc16_slice8;
+  __atomic_store_n(&crc16_best, best, __ATOMIC_RELAXED);
+  return best(crc, data, len);
+}
+
+uint16_t
+usb_crc16(uint16_t crc, const uint8_t *data, size_t len)
+{
+  return __atomic_load_n(&crc16_best, __ATOMIC_RELAXED)(crc, data, len);
+}
+
+int
+usb_crc5_token_ok(uint16_t token)
+{
+  return (crc5_token_valid[token >> 3] >> (token & 7)) & 1;
+}
+
+int
+usb_crc16_impl_available(enum USBCRC16Impl impl)
+{
+  switch(impl) {
+  case USB_CRC16_BYTEWISE:
+  case USB_CRC16_SLICE8:
+    return 1;
+  case USB_CRC16_CLMUL:
+    return clmul_available();
+  default:
+    return 0;
+  }
+}
+
+const char *
+usb_crc16_impl_name(enum USBCRC16Impl impl)
+{
+  static const char *names[USB_CRC16_N_IMPL] = {
+    "bytewise", "slice8", "clmul"
+  };
+  if (impl >= USB_CRC16_N_IMPL) return "unknown";
+  return names[impl];
+}
+
+uint16_t
+usb_crc16_impl(enum USBCRC16Impl impl, uint16_t crc,
+	       const uint8_t *data, size_t len)
+{
+  switch(impl) {
+  case USB_CRC16_SLICE8:
+    return crc16_slice8(crc, data, len);
+  case USB_CRC16_CLMUL:
+    return crc16_clmul(crc, data, len);
+  default:
+    return crc16_bytewise(crc, data, len);
+  }
+}
@@ -0,0 +1,40 @@
+#ifndef USB_CRC_H
+#define USB_CRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRCs of USB packets. The CRC16 is updated slicing-by-8 or, on CPUs
+   with a carry-less multiply (PCLMULQDQ on x86, PMULL on ARMv8), by
+   folding 128 bit blocks. The best variant is chosen on first use. The
+   tables are generated by crcgen and checked against crc5.c and
+   crc16.c at build time. */
+
+enum USBCRC16Impl {
+  USB_CRC16_BYTEWISE, /* crc16_update() */
+  USB_CRC16_SLICE8,
+  USB_CRC16_CLMUL,
+  USB_CRC16_N_IMPL
+};
+
+/* Same result as calling crc16_update() for each byte */
+uint16_t
+usb_crc16(uint16_t crc, const uint8_t *data, size_t len);
+
+/* Token or SOF bits after the PID: 11 bit field and CRC5 */
+int
+usb_crc5_token_ok(uint16_t token);
+
+/* For testing and benchmarking the variants */
+
+int
+usb_crc16_impl_available(enum USBCRC16Impl impl);
+
+const char *
+usb_crc16_impl_name(enum USBCRC16Impl impl);
+
+uint16_t
+usb_crc16_impl(enum USBCRC16Impl impl, uint16_t crc,
+	       const uint8_t *data, size_t len);
+
+#endif
@@ -0,0 +1,527 @@
+#include "usb_decode_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <usb_ringbuffer.h>
+#include <usb_packet_decoder.h>
+#include <usb_logger.h>
+
+#define CACHE_MAGIC "USBDCAC1"
+#define CACHE_FORMAT 1
+
+#define WRITE_BUFFER (1024 * 1024)
+
+#define HASH_SEED 0x6a09e667f3bcc908ULL
+
+struct Header
+{
+  char magic[8];
+  uint32_t format;
+  uint32_t decoder_version; /* USB_DECODER_VERSION */
+  uint64_t dump_len; /* Bytes of the dump covered, whole blocks */
+  uint64_t dump_hash;
+  uint64_t records_end; /* Records start after the header */
+};
+
+/* Stored after the records, where decoding continues when the dump has
+   grown */
+struct Checkpoint
+{
+  uint64_t time;
+  struct USBSequence sequence;
+  uint32_t flags;
+  uint32_t dp_prev;
+  uint32_t one_count;
+  int32_t bit_count;
+  uint32_t se0_count;
+  uint32_t n_buf_bits;
+  uint32_t sof_frame;
+  uint32_t pad;
+  uint64_t sync_ts;
+  uint64_t sof_ts;
+  uint64_t gap_ns;
+  uint32_t bits[USB_BUF_LEN];
+};
+
+struct USBDecodeCache
+{
+  int fd; /* Holds a shared lock while the cache is mapped */
+  uint8_t *map;
+  size_t map_len;
+  size_t pos;
+};
+
+struct Builder
+{
+  int fd;
+  uint64_t offset; /* Where buf goes in the file */
+  uint8_t *buf;
+  size_t used;
+  int failed;
+  USBLogger capture; /* Errors from the decoder */
+};
+
+/* Not cryptographic, only to notice a dump that was replaced */
+static uint64_t
+hash_words(uint64_t h, const uint32_t *w, size_t n)
+{
+  while(n-- > 0) {
+    h = (h ^ *w++) * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 32;
+  }
+  return h;
+}
+
+static void
+write_buffer(struct Builder *b)
+{
+  size_t done = 0;
+  while(done < b->used && !b->failed) {
+    ssize_t w = pwrite(b->fd, b->buf + done, b->used - done,
+		       b->offset + done);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "Failed to write decode cache: %s\n", strerror(errno));
+      b->failed = 1;
+    } else {
+      done += w;
+    }
+  }
+  b->offset += b->used;
+  b->used = 0;
+}
+
+static void
+put(struct Builder *b, const void *data, size_t len)
+{
+  if (WRITE_BUFFER - b->used < len) write_buffer(b);
+  memcpy(b->buf + b->used, data, len);
+  b->used += len;
+}
+
+/* Record header, type in the low byte and length above it */
+static void
+put_header(struct Builder *b, unsigned int type, uint32_t len)
+{
+  uint32_t h = type | (len << 8);
+  put(b, &h, sizeof(h));
+}
+
+static void
+put_text(struct Builder *b)
+{
+  static const uint8_t pad[4];
+  size_t len;
+  const char *text = log_take(&b->capture, &len);
+  if (len == 0) return;
+  put_header(b, USB_DECODE_CACHE_TEXT, len);
+  put(b, text, len);
+  put(b, pad, -len & 3);
+}
+
+static void
+cache_packet(uint32_t *bits, uint32_t n_bits, timestamp_t ts, void *user_data)
+{
+  struct Builder *b = user_data;
+  uint64_t t = ts;
+  /* Keep the order of errors logged before the packet */
+  put_text(b);
+  put_header(b, USB_DECODE_CACHE_PACKET, n_bits);
+  put(b, &t, sizeof(t));
+  put(b, bits, (n_bits + 31) / 32 * sizeof(uint32_t));
+}
+
+static void
+save_state(struct Checkpoint *cp, const USBDecoder *decode,
+	   const struct USBSequence *seq, timestamp_t time)
+{
+  memset(cp, 0, sizeof(*cp));
+  cp->time = time;
+  cp->sequence = *seq;
+  cp->flags = decode->flags;
+  cp->dp_prev = decode->dp_prev;
+  cp->one_count = decode->one_count;
+  cp->bit_count = decode->bit_count;
+  cp->se0_count = decode->se0_count;
+  cp->n_buf_bits = decode->n_buf_bits;
+  cp->sof_frame = decode->sof_frame;
+  cp->sync_ts = decode->sync_ts;
+  cp->sof_ts = decode->sof_ts;
+  cp->gap_ns = decode->gap_ns;
+  memcpy(cp->bits, decode->buffer, sizeof(cp->bits));
+}
+
+static void
+restore_state(const struct Checkpoint *cp, USBDecoder *decode,
+	      struct USBSequence *seq, timestamp_t *time)
+{
+  *time = cp->time;
+  *seq = cp->sequence;
+  decode->flags = cp->flags;
+  decode->dp_prev = cp->dp_prev;
+  decode->one_count = cp->one_count;
+  decode->bit_count = cp->bit_count;
+  decode->se0_count = cp->se0_count;
+  decode->n_buf_bits = cp->n_buf_bits;
+  decode->sof_frame = cp->sof_frame;
+  decode->sync_ts = cp->sync_ts;
+  decode->sof_ts = cp->sof_ts;
+  decode->gap_ns = cp->gap_ns;
+  memcpy(decode->buffer, cp->bits, sizeof(cp->bits));
+}
+
+/* Decode blocks [first, n_blocks) and append the records */
+static void
+decode_blocks(struct Builder *b, const struct USBSamples *blocks,
+	      size_t first, size_t n_blocks, struct Checkpoint *cp,
+	      int resume)
+{
+  USBDecoder decoder;
+  struct USBSequence sequence;
+  timestamp_t time = 0;
+  size_t i;
+  usb_sequence_init(&sequence);
+  decode_init(&decoder, NULL);
+  decoder.logger = &b->capture;
+  decoder.packet_handler = cache_packet;
+  decoder.packet_handler_user_data = b;
+  if (resume) restore_state(cp, &decoder, &sequence, &time);
+  for (i = first; i < n_blocks; i++) {
+    timestamp_t lost_ns;
+    unsigned int lost = usb_sequence_check(&sequence, &blocks[i], &lost_ns);
+    if (lost > 0) {
+      size_t len;
+      uint32_t l = lost;
+      uint64_t t = time;
+      uint64_t ns = lost_ns;
+      put_text(b);
+      put_header(b, USB_DECODE_CACHE_GAP, 0);
+      put(b, &l, sizeof(l));
+      put(b, &t, sizeof(t));
+      put(b, &ns, sizeof(ns));
+      decode_gap(&decoder, lost, lost_ns, time);
+      /* The gap record stands for the line decode_gap() logged */
+      log_take(&b->capture, &len);
+      time += lost_ns;
+    }
+    decode_block(&decoder, &blocks[i], time);
+    put_text(b);
+    time += blocks[i].count * NS_PER_BIT;
+  }
+  save_state(cp, &decoder, &sequence, time);
+  decode_close(&decoder);
+}
+
+static int
+read_all(int fd, void *data, size_t len, off_t offset)
+{
+  ssize_t r = pread(fd, data, len, offset);
+  return r == (ssize_t)len ? 0 : -1;
+}
+
+static int
+write_all(int fd, const void *data, size_t len, off_t offset)
+{
+  ssize_t w = pwrite(fd, data, len, offset);
+  if (w != (ssize_t)len) {
+    fprintf(stderr, "Failed to write decode cache: %s\n",
+	    w < 0 ? strerror(errno) : "short write");
+    return -1;
+  }
+  return 0;
+}
+
+/* Reads the header into old. Returns 1 if the cache covers the whole
+   dump, 0 if it covers the start of it and -1 if it has to be built
+   again. */
+static int
+check_header(int fd, const uint8_t *dump, size_t dump_size,
+	     struct Header *old)
+{
+  uint64_t dump_len = (dump_size / sizeof(struct USBSamples)
+		       * sizeof(struct USBSamples));
+  struct stat st;
+  if (fstat(fd, &st) < 0
+      || read_all(fd, old, sizeof(*old), 0) < 0
+      || memcmp(old->magic, CACHE_MAGIC, sizeof(old->magic)) != 0
+      || old->format != CACHE_FORMAT
+      || old->decoder_version != USB_DECODER_VERSION
+      || old->dump_len > dump_len
+      || old->records_end < sizeof(*old)
+      /* The checkpoint is the end of a complete update */
+      || st.st_size != old->records_end + sizeof(struct Checkpoint)
+      || (hash_words(HASH_SEED, (const uint32_t*)dump, old->dump_len / 4)
+	  != old->dump_hash)) {
+    return -1;
+  }
+  return old->dump_len == dump_len;
+}
+
+/* Decodes what is missing from the cache, all of it with rebuild.
+   Returns the end of the records or 0 on failure. */
+static uint64_t
+update(int fd, const uint8_t *dump, size_t dump_size, int rebuild)
+{
+  struct Header header;
+  struct Header old;
+  struct Builder b;
+  struct Checkpoint *cp;
+  size_t n_blocks = dump_size / sizeof(struct USBSamples);
+  uint64_t dump_len = n_blocks * sizeof(struct USBSamples);
+  size_t first = 0;
+  int resume = 0;
+  int state = rebuild ? -1 : check_header(fd, dump, dump_size, &old);
+
+  if (state == 1) return old.records_end;
+  cp = malloc(sizeof(struct Checkpoint));
+  if (!cp) return 0;
+  if (state == 0 && read_all(fd, cp, sizeof(*cp), old.records_end) == 0) {
+    first = old.dump_len / sizeof(struct USBSamples);
+    resume = 1;
+    header = old;
+  } else {
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.format = CACHE_FORMAT;
+    header.decoder_version = USB_DECODER_VERSION;
+    header.dump_hash = HASH_SEED;
+    header.records_end = sizeof(header);
+  }
+
+  memset(&b, 0, sizeof(b));
+  b.fd = fd;
+  b.offset = header.records_end;
+  b.buf = malloc(WRITE_BUFFER);
+  log_init_capture(&b.capture);
+  if (!b.buf || !b.capture.buf) {
+    free(b.buf);
+    log_close(&b.capture);
+    free(cp);
+    return 0;
+  }
+  /* Invalid until the update is complete, the records overwrite the old
+     checkpoint */
+  memset(&old, 0, sizeof(old));
+  if (write_all(fd, &old, sizeof(old), 0) < 0) b.failed = 1;
+
+  if (!b.failed) {
+    decode_blocks(&b, (const struct USBSamples*)dump, first, n_blocks, cp,
+		  resume);
+    write_buffer(&b);
+  }
+  header.dump_hash = hash_words(header.dump_hash,
+				(const uint32_t*)(dump + header.dump_len),
+				(dump_len - header.dump_len) / 4);
+  header.dump_len = dump_len;
+  header.records_end = b.offset;
+  if (b.failed
+      || write_all(fd, cp, sizeof(*cp), header.records_end) < 0
+      || ftruncate(fd, header.records_end + sizeof(*cp)) < 0
+      || write_all(fd, &header, sizeof(header), 0) < 0) {
+    header.records_end = 0;
+  }
+  free(b.buf);
+  log_close(&b.capture);
+  free(cp);
+  return header.records_end;
+}
+
+/* Size of a record after its header, 0 for an unknown type */
+static size_t
+record_size(uint32_t h)
+{
+  uint32_t len = h >> 8;
+  switch(h & 0xff) {
+  case USB_DECODE_CACHE_PACKET:
+    return sizeof(uint64_t) + (size_t)(len + 31) / 32 * sizeof(uint32_t);
+  case USB_DECODE_CACHE_TEXT:
+    return ((size_t)len + 3) & ~(size_t)3;
+  case USB_DECODE_CACHE_GAP:
+    return 20;
+  default:
+    return 0;
+  }
+}
+
+/* The records end exactly at map_len */
+static int
+check_records(const uint8_t *map, size_t map_len)
+{
+  size_t pos = sizeof(struct Header);
+  while(pos < map_len) {
+    uint32_t h;
+    size_t size;
+    if (map_len - pos < sizeof(h)) return -1;
+    memcpy(&h, map + pos, sizeof(h));
+    size = record_size(h);
+    if (size == 0 || map_len - pos - sizeof(h) < size) return -1;
+    pos += sizeof(h) + size;
+  }
+  return 0;
+}
+
+/* Takes a flock(), saying so if it has to wait */
+static int
+lock(int fd, int op, const char *path)
+{
+  int r = flock(fd, op | LOCK_NB);
+  if (r < 0 && errno == EWOULDBLOCK) {
+    fprintf(stderr, "Waiting for another process using %s\n", path);
+    do {
+      r = flock(fd, op);
+    } while(r < 0 && errno == EINTR);
+  }
+  if (r < 0) {
+    fprintf(stderr, "Failed to lock %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/* Brings the cache up to date and maps it. Writers hold an exclusive
+   lock, so the records do not change while they are read. */
+static uint8_t *
+map_cache(int fd, const uint8_t *dump, size_t dump_size, const char *path,
+	  size_t *map_len)
+{
+  struct Header header;
+  uint64_t records_end = 0;
+  uint8_t *map;
+  int rebuild = 0;
+  while(1) {
+    if (lock(fd, LOCK_SH, path) < 0) return NULL;
+    if (!rebuild && check_header(fd, dump, dump_size, &header) == 1) {
+      records_end = header.records_end;
+    } else {
+      if (lock(fd, LOCK_EX, path) < 0) return NULL;
+      records_end = update(fd, dump, dump_size, rebuild);
+      if (records_end == 0 || lock(fd, LOCK_SH, path) < 0) return NULL;
+    }
+    /* Private and writable, packet handlers get non-const bits */
+    map = mmap(NULL, records_end, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      fprintf(stderr, "Failed to map decode cache: %s\n", strerror(errno));
+      return NULL;
+    }
+    if (check_records(map, records_end) == 0) break;
+    munmap(map, records_end);
+    if (rebuild) {
+      fprintf(stderr, "Failed to rebuild decode cache %s\n", path);
+      return NULL;
+    }
+    fprintf(stderr, "Decode cache %s is corrupt, rebuilding it\n", path);
+    rebuild = 1;
+  }
+  *map_len = records_end;
+  return map;
+}
+
+USBDecodeCache *
+usb_decode_cache_open(const char *dump_filename)
+{
+  USBDecodeCache *cache;
+  struct stat st;
+  uint8_t *dump = NULL;
+  char *path;
+  int dump_fd;
+  int fd;
+
+  dump_fd = open(dump_filename, O_RDONLY | O_CLOEXEC);
+  if (dump_fd < 0 || fstat(dump_fd, &st) < 0) {
+    fprintf(stderr, "Failed to open file %s for reading: %s\n",
+	    dump_filename, strerror(errno));
+    if (dump_fd >= 0) close(dump_fd);
+    return NULL;
+  }
+  if (st.st_size > 0) {
+    dump = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, dump_fd, 0);
+    if (dump == MAP_FAILED) {
+      fprintf(stderr, "Failed to map %s: %s\n", dump_filename,
+	      strerror(errno));
+      close(dump_fd);
+      return NULL;
+    }
+    madvise(dump, st.st_size, MADV_SEQUENTIAL);
+  }
+  close(dump_fd);
+
+  path = malloc(strlen(dump_filename) + sizeof(USB_DECODE_CACHE_SUFFIX));
+  if (!path) return NULL;
+  strcpy(path, dump_filename);
+  strcat(path, USB_DECODE_CACHE_SUFFIX);
+  fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open decode cache %s: %s\n",
+	    path, strerror(errno));
+    free(path);
+    if (dump) munmap(dump, st.st_size);
+    return NULL;
+  }
+  cache = malloc(sizeof(USBDecodeCache));
+  if (cache) {
+    cache->fd = fd;
+    cache->pos = sizeof(struct Header);
+    cache->map = map_cache(fd, dump, st.st_size, path, &cache->map_len);
+  }
+  free(path);
+  if (dump) munmap(dump, st.st_size);
+  if (!cache || !cache->map) {
+    free(cache);
+    close(fd);
+    return NULL;
+  }
+  madvise(cache->map, cache->map_len, MADV_SEQUENTIAL);
+  return cache;
+}
+
+int
+usb_decode_cache_next(USBDecodeCache *cache, struct USBDecodeRecord *rec)
+{
+  const uint8_t *p = cache->map + cache->pos;
+  uint32_t h;
+  uint32_t len;
+  size_t size;
+  if (cache->map_len - cache->pos < sizeof(h)) return 0;
+  memcpy(&h, p, sizeof(h));
+  p += sizeof(h);
+  len = h >> 8;
+  size = record_size(h);
+  /* Checked when the cache was opened */
+  if (size == 0 || cache->map_len - cache->pos - sizeof(h) < size) {
+    fprintf(stderr, "Corrupt decode cache\n");
+    return 0;
+  }
+  rec->type = h & 0xff;
+  switch(rec->type) {
+  case USB_DECODE_CACHE_PACKET:
+    memcpy(&rec->ts, p, sizeof(uint64_t));
+    rec->bits = (const uint32_t*)(p + sizeof(uint64_t));
+    rec->n_bits = len;
+    break;
+  case USB_DECODE_CACHE_TEXT:
+    rec->text = (const char*)p;
+    rec->len = len;
+    break;
+  case USB_DECODE_CACHE_GAP:
+    memcpy(&rec->lost_blocks, p, sizeof(uint32_t));
+    memcpy(&rec->ts, p + 4, sizeof(uint64_t));
+    memcpy(&rec->lost_ns, p + 12, sizeof(uint64_t));
+    break;
+  }
+  cache->pos += sizeof(h) + size;
+  return 1;
+}
+
+void
+usb_decode_cache_close(USBDecodeCache *cache)
+{
+  munmap(cache->map, cache->map_len);
+  close(cache->fd);
+  free(cache);
+}
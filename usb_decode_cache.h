@@ -0,0 +1,59 @@
+#ifndef USB_DECODE_CACHE_H
+#define USB_DECODE_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <timestamp.h>
+
+/* Decoded packets of a dump file kept in DUMP.dcache, so that later runs
+   render their output without decoding again.
+
+   The cache holds everything the decoder produced for the dump, in
+   order: packets with their timestamps, the decoder's own error lines
+   and sequence gaps. The header records a hash of the dump contents
+   covered and the decoder version. If the dump has grown since, only
+   the new blocks are decoded, continuing from the decoder state saved
+   at the end of the cache. Any other change rebuilds it, and so does a
+   cache whose records do not fit in the file, such as one left behind
+   by an interrupted update.
+
+   Updates hold an exclusive flock() on the cache and readers a shared
+   one while it is open, so runs on the same dump wait for each other
+   instead of writing the cache at the same time.
+
+   All values are in host byte order. */
+
+#define USB_DECODE_CACHE_SUFFIX ".dcache"
+
+enum {
+  USB_DECODE_CACHE_PACKET = 1,
+  USB_DECODE_CACHE_TEXT, /* Error lines logged by the decoder */
+  USB_DECODE_CACHE_GAP
+};
+
+struct USBDecodeRecord
+{
+  int type;
+  timestamp_t ts; /* Packet time or time of the gap */
+  const uint32_t *bits; /* Packet, 32 bit aligned */
+  uint32_t n_bits;
+  const char *text;
+  size_t len;
+  unsigned int lost_blocks; /* Gap */
+  timestamp_t lost_ns;
+};
+
+typedef struct USBDecodeCache USBDecodeCache;
+
+/* Brings the cache of a dump file up to date and maps it for reading */
+USBDecodeCache *
+usb_decode_cache_open(const char *dump_filename);
+
+/* Returns 0 after the last record */
+int
+usb_decode_cache_next(USBDecodeCache *cache, struct USBDecodeRecord *rec);
+
+void
+usb_decode_cache_close(USBDecodeCache *cache);
+
+#endif
@@ -0,0 +1,109 @@
+#include "usb_dumpfile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+USBDumpFile *
+usb_dumpfile_open(const char *filename)
+{
+  USBDumpFile *dump;
+  struct stat st;
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    fprintf(stderr, "Failed to open file %s for reading: %s\n",
+	    filename, strerror(errno));
+    if (fd >= 0) close(fd);
+    return NULL;
+  }
+  dump = malloc(sizeof(USBDumpFile));
+  if (!dump) {
+    close(fd);
+    return NULL;
+  }
+  dump->blocks = NULL;
+  dump->n_blocks = st.st_size / sizeof(struct USBSamples);
+  dump->map_len = dump->n_blocks * sizeof(struct USBSamples);
+  if (dump->map_len > 0) {
+    void *map = mmap(NULL, dump->map_len, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+      fprintf(stderr, "Failed to map %s: %s\n", filename, strerror(errno));
+      close(fd);
+      free(dump);
+      return NULL;
+    }
+    dump->blocks = map;
+  }
+  close(fd);
+  return dump;
+}
+
+void
+usb_dumpfile_close(USBDumpFile *dump)
+{
+  if (dump->map_len > 0) munmap((void*)dump->blocks, dump->map_len);
+  free(dump);
+}
+
+static int
+pos_cmp(const void *a, const void *b)
+{
+  const struct USBDumpPos *pa = *(struct USBDumpPos * const *)a;
+  const struct USBDumpPos *pb = *(struct USBDumpPos * const *)b;
+  if (pa->block != pb->block) return pa->block < pb->block ? -1 : 1;
+  return 0;
+}
+
+void
+usb_dumpfile_locate(const USBDumpFile *dump, struct USBDumpPos *pos,
+		    size_t n_pos)
+{
+  struct USBDumpPos **sorted;
+  struct USBSequence sequence;
+  timestamp_t time = 0;
+  size_t block = 0;
+  size_t i;
+  sorted = malloc(n_pos * sizeof(struct USBDumpPos*));
+  if (!sorted) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < n_pos; i++) sorted[i] = &pos[i];
+  qsort(sorted, n_pos, sizeof(struct USBDumpPos*), pos_cmp);
+  usb_sequence_init(&sequence);
+  madvise((void*)dump->blocks, dump->map_len, MADV_SEQUENTIAL);
+  for (i = 0; i < n_pos; i++) {
+    size_t target = sorted[i]->block;
+    if (target > dump->n_blocks) target = dump->n_blocks;
+    /* The time of a block only depends on the lengths of the blocks
+       before it and the sequence numbers */
+    for (; block < target; block++) {
+      timestamp_t lost_ns;
+      const struct USBSamples *samples = &dump->blocks[block];
+      if (usb_sequence_check(&sequence, samples, &lost_ns) > 0) {
+	time += lost_ns;
+      }
+      time += samples->count * NS_PER_BIT;
+    }
+    sorted[i]->time = time;
+    sorted[i]->sequence = sequence;
+  }
+  madvise((void*)dump->blocks, dump->map_len, MADV_NORMAL);
+  free(sorted);
+}
+
+size_t
+usb_dumpfile_back(const USBDumpFile *dump, size_t block, uint64_t bits)
+{
+  uint64_t sum = 0;
+  if (block > dump->n_blocks) block = dump->n_blocks;
+  while(block > 0 && sum < bits) {
+    block--;
+    sum += dump->blocks[block].count;
+  }
+  return block;
+}
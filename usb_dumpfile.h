@@ -0,0 +1,46 @@
+#ifndef USB_DUMPFILE_H
+#define USB_DUMPFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <usb_ringbuffer.h>
+
+/* A dump file mapped into memory, for tools that process parts of it in
+   parallel. Reading can start at any block given the time and sequence
+   state the sequential reader would have had there. */
+
+struct USBDumpFile
+{
+  const struct USBSamples *blocks;
+  size_t n_blocks;
+  size_t map_len;
+};
+
+typedef struct USBDumpFile USBDumpFile;
+
+/* State before reading a block */
+struct USBDumpPos
+{
+  size_t block;
+  timestamp_t time;
+  struct USBSequence sequence;
+};
+
+USBDumpFile *
+usb_dumpfile_open(const char *filename);
+
+void
+usb_dumpfile_close(USBDumpFile *dump);
+
+/* Fills in time and sequence of the positions, in any order, with one
+   pass over the blocks up to the last of them. */
+void
+usb_dumpfile_locate(const USBDumpFile *dump, struct USBDumpPos *pos,
+		    size_t n_pos);
+
+/* The latest block at or before block that is at least bits of bus
+   time earlier, or 0 */
+size_t
+usb_dumpfile_back(const USBDumpFile *dump, size_t block, uint64_t bits);
+
+#endif
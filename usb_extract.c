@@ -0,0 +1,344 @@
+#include "usb_extract.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <usb_packet.h>
+
+/* Payloads are copied here and written with writev when it is full */
+#define ARENA_SIZE (1024 * 1024)
+
+#define STREAM_IOV 64
+#define STREAM_INDEX 256
+
+#define N_DIRS 3
+#define N_STREAMS (128 * 16 * N_DIRS)
+#define STREAM_NUMBER(addr, endp, dir) ((((addr) << 4) | (endp)) * N_DIRS \
+					+ (dir))
+
+struct IndexEntry
+{
+  uint64_t offset;
+  uint64_t ts;
+};
+
+struct Stream
+{
+  int data_fd; /* -1 if the files could not be opened */
+  int index_fd;
+  uint64_t offset; /* Offset of next payload byte in data file */
+  uint8_t last_toggle; /* PID of last written packet, 0 if unknown */
+  unsigned int n_iov;
+  struct iovec iov[STREAM_IOV];
+  unsigned int n_index;
+  struct IndexEntry index[STREAM_INDEX];
+  int dirty;
+  struct Stream *next_dirty;
+};
+
+struct USBExtractor
+{
+  char *prefix;
+  USBPacketPool *pool;
+  struct USBPacketTracker tracker;
+  struct Stream *streams[N_STREAMS];
+  struct Stream *dirty; /* Streams with buffered data */
+  uint8_t *arena;
+  size_t arena_used;
+  /* Data packet waiting for its handshake */
+  int pending;
+  uint8_t pending_pid;
+  unsigned int pending_stream;
+  timestamp_t pending_ts;
+  unsigned int pending_len;
+  const uint8_t *pending_bytes; /* In pending_packet or pending_data */
+  struct USBPacketBuffer *pending_packet;
+  uint8_t pending_data[USB_MAX_PAYLOAD];
+};
+
+static const char *dir_names[N_DIRS] = {"out", "in", "setup"};
+
+USBExtractor *
+usb_extract_init(const char *prefix, USBPacketPool *pool)
+{
+  USBExtractor *extract = malloc(sizeof(USBExtractor));
+  if (!extract) return NULL;
+  memset(extract, 0, sizeof(USBExtractor));
+  extract->prefix = strdup(prefix);
+  extract->arena = malloc(ARENA_SIZE);
+  if (!extract->prefix || !extract->arena) {
+    free(extract->prefix);
+    free(extract->arena);
+    free(extract);
+    return NULL;
+  }
+  extract->pool = pool;
+  usb_packet_tracker_init(&extract->tracker);
+  return extract;
+}
+
+static int
+write_all(int fd, struct iovec *iov, unsigned int n_iov)
+{
+  while(n_iov > 0) {
+    ssize_t w = writev(fd, iov, n_iov);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    while(n_iov > 0 && w >= iov->iov_len) {
+      w -= iov->iov_len;
+      iov++;
+      n_iov--;
+    }
+    if (n_iov > 0) {
+      iov->iov_base = (uint8_t*)iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+  return 0;
+}
+
+static int
+flush_stream(struct Stream *stream)
+{
+  struct iovec index_iov;
+  int ret = 0;
+  if (stream->n_iov > 0 && write_all(stream->data_fd, stream->iov,
+				     stream->n_iov) < 0) {
+    fprintf(stderr, "Failed to write payload: %s\n", strerror(errno));
+    ret = -1;
+  }
+  index_iov.iov_base = stream->index;
+  index_iov.iov_len = stream->n_index * sizeof(struct IndexEntry);
+  if (stream->n_index > 0 && write_all(stream->index_fd, &index_iov, 1) < 0) {
+    fprintf(stderr, "Failed to write payload index: %s\n", strerror(errno));
+    ret = -1;
+  }
+  stream->n_iov = 0;
+  stream->n_index = 0;
+  return ret;
+}
+
+int
+usb_extract_flush(USBExtractor *extract)
+{
+  int ret = 0;
+  struct Stream *stream = extract->dirty;
+  while(stream) {
+    struct Stream *next = stream->next_dirty;
+    if (flush_stream(stream) < 0) ret = -1;
+    stream->dirty = 0;
+    stream->next_dirty = NULL;
+    stream = next;
+  }
+  extract->dirty = NULL;
+  extract->arena_used = 0;
+  return ret;
+}
+
+static struct Stream *
+get_stream(USBExtractor *extract, unsigned int number)
+{
+  struct Stream *stream = extract->streams[number];
+  char *name;
+  size_t name_len;
+  if (stream) return stream;
+  stream = malloc(sizeof(struct Stream));
+  if (!stream) return NULL;
+  memset(stream, 0, sizeof(struct Stream));
+  name_len = strlen(extract->prefix) + 32;
+  name = malloc(name_len);
+  if (!name) {
+    free(stream);
+    return NULL;
+  }
+  snprintf(name, name_len, "%s-%03d.%d-%s.bin", extract->prefix,
+	   number / N_DIRS >> 4, number / N_DIRS & 0xf,
+	   dir_names[number % N_DIRS]);
+  stream->data_fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			 0666);
+  if (stream->data_fd < 0) {
+    fprintf(stderr, "Failed to open file %s for writing: %s\n",
+	    name, strerror(errno));
+  }
+  strcpy(name + strlen(name) - 3, "idx");
+  stream->index_fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			  0666);
+  if (stream->index_fd < 0) {
+    fprintf(stderr, "Failed to open file %s for writing: %s\n",
+	    name, strerror(errno));
+    if (stream->data_fd >= 0) close(stream->data_fd);
+    stream->data_fd = -1;
+  }
+  free(name);
+  extract->streams[number] = stream;
+  return stream;
+}
+
+static void
+drop_pending(USBExtractor *extract)
+{
+  extract->pending = 0;
+  if (extract->pending_packet) {
+    usb_packet_release(extract->pending_packet);
+    extract->pending_packet = NULL;
+  }
+}
+
+static void
+commit_pending(USBExtractor *extract)
+{
+  struct Stream *stream;
+  struct iovec *last;
+  unsigned int len = extract->pending_len;
+  stream = get_stream(extract, extract->pending_stream);
+  if (!stream) {
+    drop_pending(extract);
+    return;
+  }
+  stream->last_toggle = extract->pending_pid;
+  if (stream->data_fd < 0 || len == 0) {
+    drop_pending(extract);
+    return;
+  }
+
+  if (extract->arena_used + len > ARENA_SIZE) usb_extract_flush(extract);
+  if (stream->n_iov == STREAM_IOV || stream->n_index == STREAM_INDEX) {
+    flush_stream(stream);
+  }
+  memcpy(extract->arena + extract->arena_used, extract->pending_bytes, len);
+  last = stream->n_iov > 0 ? &stream->iov[stream->n_iov - 1] : NULL;
+  if (last && ((uint8_t*)last->iov_base + last->iov_len
+	       == extract->arena + extract->arena_used)) {
+    /* Consecutive packets for the same stream become one write */
+    last->iov_len += len;
+  } else {
+    stream->iov[stream->n_iov].iov_base = extract->arena + extract->arena_used;
+    stream->iov[stream->n_iov].iov_len = len;
+    stream->n_iov++;
+  }
+  extract->arena_used += len;
+  stream->index[stream->n_index].offset = stream->offset;
+  stream->index[stream->n_index].ts = extract->pending_ts;
+  stream->n_index++;
+  stream->offset += len;
+  if (!stream->dirty) {
+    stream->dirty = 1;
+    stream->next_dirty = extract->dirty;
+    extract->dirty = stream;
+  }
+  drop_pending(extract);
+}
+
+static void
+reset_control_toggles(USBExtractor *extract, unsigned int addr)
+{
+  /* After SETUP both directions of the control endpoint start with
+     DATA1 */
+  struct Stream *stream;
+  stream = extract->streams[STREAM_NUMBER(addr, 0, USB_DIR_IN)];
+  if (stream) stream->last_toggle = USB_PID_DATA0;
+  stream = extract->streams[STREAM_NUMBER(addr, 0, USB_DIR_OUT)];
+  if (stream) stream->last_toggle = USB_PID_DATA0;
+}
+
+static void
+add_packet(USBExtractor *extract, uint32_t *bits, uint32_t n_bits,
+	   const struct USBPacketInfo *info)
+{
+  if (info->flags & USB_PACKET_HANDSHAKE) {
+    if (extract->pending) {
+      if (info->pid == USB_PID_ACK) {
+	unsigned int number = extract->pending_stream;
+	struct Stream *stream = extract->streams[number];
+	if (number % N_DIRS == USB_DIR_SETUP) {
+	  commit_pending(extract);
+	  reset_control_toggles(extract, number / N_DIRS >> 4);
+	} else if (stream && stream->last_toggle == extract->pending_pid) {
+	  /* Retransmission of a packet we already have */
+	  drop_pending(extract);
+	} else {
+	  commit_pending(extract);
+	}
+      }
+      drop_pending(extract);
+    }
+    return;
+  }
+  /* A data packet without handshake is isochronous */
+  if (extract->pending) commit_pending(extract);
+  if ((info->flags & USB_PACKET_DATA) && info->data && info->has_token) {
+    unsigned int len = info->data_len;
+    if (len > USB_MAX_PAYLOAD) len = USB_MAX_PAYLOAD;
+    extract->pending = 1;
+    extract->pending_pid = info->pid;
+    extract->pending_stream = STREAM_NUMBER(info->addr, info->endp, info->dir);
+    extract->pending_ts = info->ts;
+    extract->pending_len = len;
+    if (extract->pool) {
+      extract->pending_packet = usb_packet_retain_bits(extract->pool, bits);
+    }
+    if (extract->pending_packet) {
+      extract->pending_bytes = info->data;
+    } else {
+      memcpy(extract->pending_data, info->data, len);
+      extract->pending_bytes = extract->pending_data;
+    }
+  }
+}
+
+void
+usb_extract_packet(uint32_t *bits, uint32_t n_bits, timestamp_t ts,
+		   void *user_data)
+{
+  USBExtractor *extract = user_data;
+  struct USBPacketInfo info;
+  usb_packet_parse(&extract->tracker, bits, n_bits, ts, &info);
+  add_packet(extract, bits, n_bits, &info);
+}
+
+void
+usb_extract_batch(struct USBPacketBatch *batch, void *user_data)
+{
+  USBExtractor *extract = user_data;
+  unsigned int p;
+  for (p = 0; p < batch->n_packets; p++) {
+    add_packet(extract, usb_packet_batch_bits(batch, p),
+	       batch->packets[p].n_bits, &batch->info[p]);
+  }
+}
+
+void
+usb_extract_gap(USBExtractor *extract)
+{
+  unsigned int i;
+  drop_pending(extract);
+  usb_packet_tracker_init(&extract->tracker);
+  for (i = 0; i < N_STREAMS; i++) {
+    if (extract->streams[i]) extract->streams[i]->last_toggle = 0;
+  }
+}
+
+void
+usb_extract_close(USBExtractor *extract)
+{
+  unsigned int i;
+  drop_pending(extract);
+  usb_extract_flush(extract);
+  for (i = 0; i < N_STREAMS; i++) {
+    struct Stream *stream = extract->streams[i];
+    if (!stream) continue;
+    if (stream->data_fd >= 0) {
+      close(stream->data_fd);
+      close(stream->index_fd);
+    }
+    free(stream);
+  }
+  free(extract->arena);
+  free(extract->prefix);
+  free(extract);
+}
@@ -0,0 +1,44 @@
+#ifndef USB_EXTRACT_H
+#define USB_EXTRACT_H
+
+#include <packet_handler.h>
+#include <usb_packet_pool.h>
+
+/* Writes the payload of DATA packets to one file per address, endpoint
+   and direction, named PREFIX-AAA.E-DIR.bin where DIR is in, out or
+   setup. Only packets with a correct CRC that were acknowledged, or that
+   got no handshake at all as for isochronous endpoints, are written.
+   Retransmissions are recognized by the data toggle.
+
+   PREFIX-AAA.E-DIR.idx maps the payload back to the bus. It has one
+   entry per packet with two 64 bit numbers, the offset of the packet in
+   the .bin file and its timestamp. */
+
+typedef struct USBExtractor USBExtractor;
+
+/* If pool is the decoder's pool, a data packet waiting for its
+   handshake is kept in its buffer instead of being copied */
+USBExtractor *
+usb_extract_init(const char *prefix, USBPacketPool *pool);
+
+/* Packet handler, user_data is the USBExtractor */
+void
+usb_extract_packet(uint32_t *bits, uint32_t n_bits, timestamp_t ts,
+		   void *user_data);
+
+/* The same for batches, from the parsed packets */
+void
+usb_extract_batch(struct USBPacketBatch *batch, void *user_data);
+
+/* Blocks were lost, forget the current transaction */
+void
+usb_extract_gap(USBExtractor *extract);
+
+/* Write everything buffered so far */
+int
+usb_extract_flush(USBExtractor *extract);
+
+void
+usb_extract_close(USBExtractor *extract);
+
+#endif
@@ -0,0 +1,618 @@
+#include "usb_import.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/* Input is read in chunks of this size, tokens may not be longer */
+#define IMPORT_BUF_SIZE (1024 * 1024)
+
+#define FS_BIT_RATE 12000000ULL
+
+#define MAX_BLOCK_COUNT 0xffff
+
+/* Bits added after the last edge of the capture */
+#define FINAL_BITS 8
+
+#define VCD_ID_MAX 32
+
+/* Line states have DP in bit 0 and DM in bit 1 */
+#define LINE_NONE -1
+
+struct Resampler
+{
+  uint64_t bit_num; /* Bits per input time unit is bit_num / bit_den */
+  uint64_t bit_den;
+  int line; /* Current line state */
+  uint64_t line_start; /* Time of last edge */
+  uint64_t pending; /* Bits of pending_line not yet added to blocks */
+  int pending_line;
+  struct USBSamples block; /* Block being filled */
+  int block_line; /* Line state of the last bit in block */
+  uint16_t sequence;
+  int finished;
+  struct USBSamples *out;
+  size_t n_out;
+  size_t max_out;
+};
+
+static uint64_t
+gcd(uint64_t a, uint64_t b)
+{
+  while(b != 0) {
+    uint64_t t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+static void
+resampler_init(struct Resampler *r, uint64_t bit_num, uint64_t bit_den)
+{
+  uint64_t d = gcd(bit_num, bit_den);
+  memset(r, 0, sizeof(*r));
+  r->bit_num = bit_num / d;
+  r->bit_den = bit_den / d;
+  r->line = LINE_NONE;
+}
+
+static void
+emit_block(struct Resampler *r)
+{
+  r->out[r->n_out++] = r->block;
+  r->sequence++;
+  memset(&r->block, 0, sizeof(r->block));
+  r->block.sequence = r->sequence;
+}
+
+/* Add pending bits to blocks. Returns 0 if the output got full first. */
+static int
+resampler_drain(struct Resampler *r)
+{
+  struct USBSamples *b = &r->block;
+  while(r->pending > 0) {
+    if (b->count >= 32) {
+      /* Like the PRU, end the block at the next transition */
+      if (r->pending_line != r->block_line || b->count == MAX_BLOCK_COUNT) {
+	if (r->n_out == r->max_out) return 0;
+	emit_block(r);
+      } else {
+	uint64_t n = MAX_BLOCK_COUNT - b->count;
+	if (n > r->pending) n = r->pending;
+	b->count += n;
+	r->pending -= n;
+      }
+    } else {
+      unsigned int n = 32 - b->count;
+      uint32_t mask;
+      if (n > r->pending) n = r->pending;
+      mask = (n < 32 ? ((uint32_t)1 << n) - 1 : ~(uint32_t)0) << b->count;
+      if (r->pending_line & 1) b->dp_bits |= mask;
+      if (r->pending_line & 2) b->dm_bits |= mask;
+      b->count += n;
+      r->pending -= n;
+      r->block_line = r->pending_line;
+    }
+  }
+  return 1;
+}
+
+/* The line changes to state line at time t. Must only be called when
+   nothing is pending. */
+static void
+resampler_edge(struct Resampler *r, uint64_t t, int line)
+{
+  if (line == r->line) return;
+  if (r->line != LINE_NONE && t > r->line_start) {
+    /* Edges resynchronise the bit clock, so round each interval */
+    r->pending = (((t - r->line_start) * r->bit_num + r->bit_den / 2)
+		  / r->bit_den);
+    r->pending_line = r->line;
+  }
+  r->line = line;
+  r->line_start = t;
+}
+
+/* Extend the last state to time t, at least FINAL_BITS, and emit the
+   last block padded to 32 bits. Returns 0 if the output got full. */
+static int
+resampler_finish(struct Resampler *r, uint64_t t)
+{
+  if (r->line != LINE_NONE) {
+    int line = r->line;
+    resampler_edge(r, t, LINE_NONE);
+    if (r->pending < FINAL_BITS) r->pending = FINAL_BITS;
+    r->pending_line = line;
+  }
+  if (!resampler_drain(r)) return 0;
+  if (r->block.count > 0) {
+    if (r->n_out == r->max_out) return 0;
+    if (r->block.count < 32) {
+      r->pending = 32 - r->block.count;
+      r->pending_line = r->block_line;
+      resampler_drain(r);
+    }
+    emit_block(r);
+  }
+  r->finished = 1;
+  return 1;
+}
+
+static void
+resampler_output(struct Resampler *r, struct USBSamples *samples, size_t max)
+{
+  r->out = samples;
+  r->n_out = 0;
+  r->max_out = max;
+}
+
+/* Chunked input shared by both formats */
+struct ImportInput
+{
+  int fd;
+  char *buf;
+  size_t pos;
+  size_t len;
+  int eof;
+};
+
+static int
+input_open(struct ImportInput *in, const char *filename)
+{
+  if (filename[0] == '-' && filename[1] == '\0') {
+    in->fd = 0;
+  } else {
+    in->fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (in->fd < 0) {
+      fprintf(stderr, "Failed to open file %s for reading: %s\n",
+	      filename, strerror(errno));
+      return -1;
+    }
+  }
+  in->buf = malloc(IMPORT_BUF_SIZE);
+  if (!in->buf) {
+    if (in->fd != 0) close(in->fd);
+    return -1;
+  }
+  in->pos = 0;
+  in->len = 0;
+  in->eof = 0;
+  return 0;
+}
+
+static void
+input_close(struct ImportInput *in)
+{
+  if (in->fd != 0) close(in->fd);
+  free(in->buf);
+}
+
+/* Keep the unread data and read more after it. Returns 0 at end of
+   file or on errors. */
+static int
+input_fill(struct ImportInput *in)
+{
+  ssize_t r;
+  if (in->eof) return 0;
+  memmove(in->buf, in->buf + in->pos, in->len - in->pos);
+  in->len -= in->pos;
+  in->pos = 0;
+  if (in->len == IMPORT_BUF_SIZE) {
+    fprintf(stderr, "Token too long in input file\n");
+    in->eof = 1;
+    return 0;
+  }
+  do {
+    r = read(in->fd, in->buf + in->len, IMPORT_BUF_SIZE - in->len);
+  } while(r < 0 && errno == EINTR);
+  if (r <= 0) {
+    if (r < 0) {
+      fprintf(stderr, "Failed to read input file: %s\n", strerror(errno));
+    }
+    in->eof = 1;
+    return 0;
+  }
+  in->len += r;
+  return 1;
+}
+
+static void
+import_wait(USBSource *source)
+{
+}
+
+static void
+import_clear(USBSource *source)
+{
+}
+
+struct VCDSource
+{
+  USBSource source;
+  struct ImportInput in;
+  char dp_id[VCD_ID_MAX + 1];
+  char dm_id[VCD_ID_MAX + 1];
+  uint64_t time;
+  int dp;
+  int dm;
+  struct Resampler resampler;
+};
+
+static inline int
+is_space(char c)
+{
+  return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+/* Returns the length of the next token, 0 at end of file. The token is
+   valid until the next call. */
+static size_t
+next_token(struct ImportInput *in, const char **token)
+{
+  size_t end;
+  while(1) {
+    while(in->pos < in->len && is_space(in->buf[in->pos])) in->pos++;
+    if (in->pos == in->len) {
+      if (!input_fill(in)) return 0;
+      continue;
+    }
+    end = in->pos;
+    while(end < in->len && !is_space(in->buf[end])) end++;
+    if (end == in->len && !in->eof) {
+      /* May continue in the next chunk */
+      if (input_fill(in)) continue;
+      end = in->len;
+    }
+    *token = in->buf + in->pos;
+    in->pos = end;
+    return end - (*token - in->buf);
+  }
+}
+
+static int
+token_is(const char *token, size_t len, const char *str)
+{
+  return strlen(str) == len && memcmp(token, str, len) == 0;
+}
+
+static void
+skip_to_end(struct ImportInput *in)
+{
+  const char *token;
+  size_t len;
+  while((len = next_token(in, &token)) > 0) {
+    if (token_is(token, len, "$end")) return;
+  }
+}
+
+static uint64_t
+parse_u64(const char *str, size_t len, size_t *used)
+{
+  uint64_t v = 0;
+  size_t i;
+  for (i = 0; i < len && str[i] >= '0' && str[i] <= '9'; i++) {
+    v = v * 10 + (str[i] - '0');
+  }
+  if (used) *used = i;
+  return v;
+}
+
+static int
+name_matches(const char *token, size_t len, const char *name,
+	     const char *const *defaults)
+{
+  if (name) return strlen(name) == len && strncasecmp(token, name, len) == 0;
+  while(*defaults) {
+    if (strlen(*defaults) == len && strncasecmp(token, *defaults, len) == 0) {
+      return 1;
+    }
+    defaults++;
+  }
+  return 0;
+}
+
+static const char *const dp_defaults[] = {"DP", "D+", "DPLUS", "USB_DP", NULL};
+static const char *const dm_defaults[] = {"DM", "D-", "DMINUS", "USB_DM", NULL};
+
+/* Femtoseconds per unit */
+static uint64_t
+time_unit(const char *unit, size_t len)
+{
+  static const struct {
+    const char *name;
+    uint64_t fs;
+  } units[] = {
+    {"s", 1000000000000000ULL}, {"ms", 1000000000000ULL},
+    {"us", 1000000000ULL}, {"ns", 1000000ULL}, {"ps", 1000}, {"fs", 1}
+  };
+  unsigned int i;
+  for (i = 0; i < sizeof(units) / sizeof(units[0]); i++) {
+    if (token_is(unit, len, units[i].name)) return units[i].fs;
+  }
+  return 0;
+}
+
+static int
+parse_timescale(struct ImportInput *in, uint64_t *fs_per_tick)
+{
+  const char *token;
+  size_t len;
+  size_t used;
+  uint64_t magnitude = 0;
+  uint64_t unit = 0;
+  while((len = next_token(in, &token)) > 0) {
+    if (token_is(token, len, "$end")) break;
+    if (magnitude == 0) {
+      magnitude = parse_u64(token, len, &used);
+      token += used;
+      len -= used;
+    }
+    if (len > 0) unit = time_unit(token, len);
+  }
+  if (magnitude == 0 || unit == 0) {
+    fprintf(stderr, "Invalid VCD timescale\n");
+    return -1;
+  }
+  *fs_per_tick = magnitude * unit;
+  return 0;
+}
+
+/* $var type size id name [range] $end */
+static void
+parse_var(struct VCDSource *vcd, const char *dp_name, const char *dm_name)
+{
+  const char *token;
+  size_t len;
+  char id[VCD_ID_MAX + 1];
+  unsigned int n = 0;
+  id[0] = '\0';
+  while((len = next_token(&vcd->in, &token)) > 0) {
+    if (token_is(token, len, "$end")) break;
+    if (n == 2 && len <= VCD_ID_MAX) {
+      memcpy(id, token, len);
+      id[len] = '\0';
+    } else if (n == 3 && id[0] != '\0') {
+      if (vcd->dp_id[0] == '\0' && name_matches(token, len, dp_name,
+						 dp_defaults)) {
+	strcpy(vcd->dp_id, id);
+      } else if (vcd->dm_id[0] == '\0' && name_matches(token, len, dm_name,
+							dm_defaults)) {
+	strcpy(vcd->dm_id, id);
+      }
+    }
+    n++;
+  }
+}
+
+static int
+parse_header(struct VCDSource *vcd, const char *dp_name, const char *dm_name)
+{
+  const char *token;
+  size_t len;
+  uint64_t fs_per_tick = 1000000; /* 1 ns if there is no $timescale */
+  while((len = next_token(&vcd->in, &token)) > 0) {
+    if (token_is(token, len, "$var")) {
+      parse_var(vcd, dp_name, dm_name);
+    } else if (token_is(token, len, "$timescale")) {
+      if (parse_timescale(&vcd->in, &fs_per_tick) < 0) return -1;
+    } else if (token_is(token, len, "$enddefinitions")) {
+      skip_to_end(&vcd->in);
+      break;
+    } else if (token[0] == '$' && !token_is(token, len, "$end")) {
+      skip_to_end(&vcd->in);
+    }
+  }
+  if (vcd->dp_id[0] == '\0' || vcd->dm_id[0] == '\0') {
+    fprintf(stderr, "No signals for DP and DM found in VCD file\n");
+    return -1;
+  }
+  /* Bits per tick is fs_per_tick * 12 MHz / 10^15 fs */
+  resampler_init(&vcd->resampler, fs_per_tick * (FS_BIT_RATE / 1000000),
+		 1000000000ULL);
+  return 0;
+}
+
+static void
+vcd_change(struct VCDSource *vcd, char value, const char *id, size_t len)
+{
+  int level = (value == '1');
+  if (len > VCD_ID_MAX) return;
+  if (strlen(vcd->dp_id) == len && memcmp(vcd->dp_id, id, len) == 0) {
+    vcd->dp = level;
+  } else if (strlen(vcd->dm_id) == len && memcmp(vcd->dm_id, id, len) == 0) {
+    vcd->dm = level;
+  } else {
+    return;
+  }
+  resampler_edge(&vcd->resampler, vcd->time, vcd->dp | (vcd->dm << 1));
+}
+
+static int
+vcd_read(USBSource *source, struct USBSamples *samples, size_t max)
+{
+  struct VCDSource *vcd = (struct VCDSource*)source;
+  struct Resampler *r = &vcd->resampler;
+  const char *token;
+  size_t len;
+  if (r->finished) return -1;
+  resampler_output(r, samples, max);
+  while(resampler_drain(r)) {
+    len = next_token(&vcd->in, &token);
+    if (len == 0) {
+      resampler_finish(r, vcd->time);
+      break;
+    }
+    switch(token[0]) {
+    case '#':
+      vcd->time = parse_u64(token + 1, len - 1, NULL);
+      break;
+    case '0':
+    case '1':
+    case 'x':
+    case 'X':
+    case 'z':
+    case 'Z':
+      vcd_change(vcd, token[0], token + 1, len - 1);
+      break;
+    case 'b':
+    case 'B':
+      {
+	/* A one bit vector, the id is the next token */
+	char value = token[len - 1];
+	len = next_token(&vcd->in, &token);
+	if (len > 0) vcd_change(vcd, value, token, len);
+      }
+      break;
+    case 'r':
+    case 'R':
+      next_token(&vcd->in, &token);
+      break;
+    case '$':
+      if (token_is(token, len, "$comment")) skip_to_end(&vcd->in);
+      /* $dumpvars and friends only enclose value changes */
+      break;
+    }
+  }
+  if (r->n_out == 0 && r->finished) return -1;
+  return r->n_out;
+}
+
+static void
+vcd_close(USBSource *source)
+{
+  struct VCDSource *vcd = (struct VCDSource*)source;
+  input_close(&vcd->in);
+  free(vcd);
+}
+
+USBSource *
+usb_source_open_vcd(const char *filename,
+		    const char *dp_name, const char *dm_name)
+{
+  struct VCDSource *vcd = malloc(sizeof(struct VCDSource));
+  if (!vcd) return NULL;
+  memset(vcd, 0, sizeof(struct VCDSource));
+  if (input_open(&vcd->in, filename) < 0) {
+    free(vcd);
+    return NULL;
+  }
+  if (parse_header(vcd, dp_name, dm_name) < 0) {
+    vcd_close(&vcd->source);
+    return NULL;
+  }
+  vcd->source.read = vcd_read;
+  vcd->source.wait = import_wait;
+  vcd->source.clear = import_clear;
+  vcd->source.close = vcd_close;
+  vcd->source.backlog = NULL;
+  return &vcd->source;
+}
+
+struct LogicSource
+{
+  USBSource source;
+  struct ImportInput in;
+  unsigned int unit_size;
+  unsigned int dp_byte;
+  uint8_t dp_mask;
+  unsigned int dm_byte;
+  uint8_t dm_mask;
+  uint64_t index; /* Number of the sample at in.pos */
+  struct Resampler resampler;
+};
+
+static inline int
+logic_line(const struct LogicSource *logic, const uint8_t *sample)
+{
+  return (((sample[logic->dp_byte] & logic->dp_mask) ? 1 : 0)
+	  | ((sample[logic->dm_byte] & logic->dm_mask) ? 2 : 0));
+}
+
+static int
+logic_read(USBSource *source, struct USBSamples *samples, size_t max)
+{
+  struct LogicSource *logic = (struct LogicSource*)source;
+  struct Resampler *r = &logic->resampler;
+  struct ImportInput *in = &logic->in;
+  unsigned int unit = logic->unit_size;
+  if (r->finished) return -1;
+  resampler_output(r, samples, max);
+  while(resampler_drain(r)) {
+    const uint8_t *p;
+    const uint8_t *end;
+    if (in->len - in->pos < unit && !input_fill(in)) {
+      resampler_finish(r, logic->index);
+      break;
+    }
+    p = (const uint8_t*)in->buf + in->pos;
+    end = p + (in->len - in->pos) / unit * unit;
+    if (unit == 1 && logic->dp_byte == 0 && logic->dm_byte == 0) {
+      /* Common case, skip samples without change quickly */
+      uint8_t mask = logic->dp_mask | logic->dm_mask;
+      uint8_t cur = ((r->line & 1) ? logic->dp_mask : 0) |
+	((r->line & 2) ? logic->dm_mask : 0);
+      const uint8_t *start = p;
+      if (r->line != LINE_NONE) {
+	while(p < end && (*p & mask) == cur) p++;
+      }
+      logic->index += p - start;
+    } else {
+      while(p < end && logic_line(logic, p) == r->line) {
+	p += unit;
+	logic->index++;
+      }
+    }
+    if (p < end) {
+      resampler_edge(r, logic->index, logic_line(logic, p));
+      p += unit;
+      logic->index++;
+    }
+    in->pos = p - (const uint8_t*)in->buf;
+  }
+  if (r->n_out == 0 && r->finished) return -1;
+  return r->n_out;
+}
+
+static void
+logic_close(USBSource *source)
+{
+  struct LogicSource *logic = (struct LogicSource*)source;
+  input_close(&logic->in);
+  free(logic);
+}
+
+USBSource *
+usb_source_open_logic(const char *filename, unsigned long rate,
+		      unsigned int dp_channel, unsigned int dm_channel,
+		      unsigned int unit_size)
+{
+  struct LogicSource *logic;
+  if (rate == 0 || unit_size == 0
+      || dp_channel >= unit_size * 8 || dm_channel >= unit_size * 8) {
+    fprintf(stderr, "Invalid logic sample format\n");
+    return NULL;
+  }
+  logic = malloc(sizeof(struct LogicSource));
+  if (!logic) return NULL;
+  memset(logic, 0, sizeof(struct LogicSource));
+  if (input_open(&logic->in, filename) < 0) {
+    free(logic);
+    return NULL;
+  }
+  logic->unit_size = unit_size;
+  logic->dp_byte = dp_channel / 8;
+  logic->dp_mask = 1 << (dp_channel % 8);
+  logic->dm_byte = dm_channel / 8;
+  logic->dm_mask = 1 << (dm_channel % 8);
+  resampler_init(&logic->resampler, FS_BIT_RATE, rate);
+  logic->source.read = logic_read;
+  logic->source.wait = import_wait;
+  logic->source.clear = import_clear;
+  logic->source.close = logic_close;
+  logic->source.backlog = NULL;
+  return &logic->source;
+}
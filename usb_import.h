@@ -0,0 +1,25 @@
+#ifndef USB_IMPORT_H
+#define USB_IMPORT_H
+
+#include <usb_source.h>
+
+/* Sources reading logic analyzer captures. The DP and DM edges are
+   turned into the blocks the PRU would have produced: the line is
+   sampled at the full speed bit rate, resynchronised at every edge,
+   each block has 32 bits and idle periods extend the last block.
+   Low speed captures are not supported. */
+
+/* VCD file, "-" for stdin. dp_name and dm_name are the names of the
+   signals, NULL to look for the usual ones (DP, D+, DM, D- ...). */
+USBSource *
+usb_source_open_vcd(const char *filename,
+		    const char *dp_name, const char *dm_name);
+
+/* Raw logic samples as written by sigrok-cli -O binary, unit_size bytes
+   per sample with one bit per channel, sampled at rate Hz. */
+USBSource *
+usb_source_open_logic(const char *filename, unsigned long rate,
+		      unsigned int dp_channel, unsigned int dm_channel,
+		      unsigned int unit_size);
+
+#endif
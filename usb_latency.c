@@ -0,0 +1,352 @@
+#include "usb_latency.h"
+#include <stdlib.h>
+#include <string.h>
+#include <usb_packet.h>
+#include <usb_ringbuffer.h>
+
+#define SYNC_BITS 8
+#define EOP_BITS 3
+
+#define SUB_BITS 3
+#define SUB (1 << SUB_BITS)
+/* Values are clamped to 32 bits, about 6 minutes */
+#define N_BUCKETS ((32 - SUB_BITS + 1) * SUB)
+
+enum Metric {
+  METRIC_TOKEN_DATA,
+  METRIC_DATA_HANDSHAKE,
+  METRIC_NAK_RETRIES,
+  METRIC_COMPLETION,
+  METRIC_CONTROL,
+  N_METRICS
+};
+
+static const char *metric_names[N_METRICS] = {
+  "token_data", "data_handshake", "nak_retries", "completion", "control"
+};
+
+struct Histogram
+{
+  uint64_t count;
+  uint32_t max;
+  uint64_t buckets[N_BUCKETS];
+};
+
+struct Endpoint
+{
+  uint8_t addr;
+  uint8_t endp; /* 0x80 set for IN */
+  int pending; /* NAKed, waiting for the ACK */
+  unsigned int retries;
+  timestamp_t first_start; /* Start of the first token */
+  int control; /* Status stage of a control transfer expected */
+  uint8_t status_endp; /* Endpoint of the status stage, with 0x80 */
+  timestamp_t control_start;
+  struct Histogram histograms[N_METRICS];
+};
+
+/* Where the current transaction is */
+enum State {
+  STATE_IDLE,
+  STATE_TOKEN,
+  STATE_DATA
+};
+
+struct USBLatency
+{
+  FILE *out;
+  timestamp_t interval;
+  timestamp_t next_snapshot;
+  struct USBPacketTracker tracker;
+  enum State state;
+  struct Endpoint *current; /* Endpoint of the last token */
+  unsigned int data_len; /* Payload of the data packet */
+  int setup;
+  timestamp_t last_end; /* End of the last packet */
+  unsigned int n_endpoints;
+  struct Endpoint endpoints[LATENCY_ENDPOINTS];
+  unsigned long long untracked;
+};
+
+static unsigned int
+bucket(uint32_t v)
+{
+  unsigned int e;
+  if (v < SUB) return v;
+  e = 31 - __builtin_clz(v);
+  return (e - SUB_BITS + 1) * SUB + ((v >> (e - SUB_BITS)) & (SUB - 1));
+}
+
+static uint32_t
+bucket_low(unsigned int i)
+{
+  unsigned int e;
+  if (i < SUB) return i;
+  e = i / SUB + SUB_BITS - 1;
+  return (uint32_t)(SUB + i % SUB) << (e - SUB_BITS);
+}
+
+static void
+record(struct Histogram *h, unsigned long long v)
+{
+  uint32_t v32 = v > UINT32_MAX ? UINT32_MAX : v;
+  h->buckets[bucket(v32)]++;
+  h->count++;
+  if (v32 > h->max) h->max = v32;
+}
+
+/* Bit times between two bus times, 0 if they are out of order */
+static unsigned long long
+bit_times(timestamp_t from, timestamp_t to)
+{
+  if (to <= from) return 0;
+  return (to - from + NS_PER_BIT / 2) / NS_PER_BIT;
+}
+
+static uint32_t
+percentile(const struct Histogram *h, unsigned int percent)
+{
+  uint64_t rank = (h->count * percent + 99) / 100;
+  uint64_t sum = 0;
+  unsigned int i;
+  for (i = 0; i < N_BUCKETS; i++) {
+    sum += h->buckets[i];
+    if (sum >= rank) return bucket_low(i);
+  }
+  return h->max;
+}
+
+USBLatency *
+usb_latency_init(FILE *out, timestamp_t interval_ns)
+{
+  USBLatency *latency = malloc(sizeof(USBLatency));
+  if (!latency) return NULL;
+  memset(latency, 0, sizeof(USBLatency));
+  latency->out = out;
+  latency->interval = interval_ns;
+  latency->next_snapshot = interval_ns;
+  usb_packet_tracker_init(&latency->tracker);
+  fprintf(out, "# Transaction latencies in bit times of %d ns\n",
+	  NS_PER_BIT);
+  return latency;
+}
+
+static void
+write_snapshot(USBLatency *latency, timestamp_t time)
+{
+  FILE *out = latency->out;
+  int header = 0;
+  unsigned int e;
+  unsigned int m;
+  unsigned int i;
+  for (e = 0; e < latency->n_endpoints; e++) {
+    struct Endpoint *ep = &latency->endpoints[e];
+    for (m = 0; m < N_METRICS; m++) {
+      struct Histogram *h = &ep->histograms[m];
+      if (h->count == 0) continue;
+      if (!header) {
+	fprintf(out, "# %llu ns\n", time);
+	header = 1;
+      }
+      fprintf(out, "%d.%d %s %s %llu %u %u %u %u", ep->addr, ep->endp & 0x0f,
+	      (ep->endp & 0x80) ? "in" : "out", metric_names[m],
+	      (unsigned long long)h->count, percentile(h, 50),
+	      percentile(h, 90), percentile(h, 99), h->max);
+      for (i = 0; i < N_BUCKETS; i++) {
+	if (h->buckets[i]) {
+	  fprintf(out, " %u:%llu", bucket_low(i),
+		  (unsigned long long)h->buckets[i]);
+	}
+      }
+      fputc('\n', out);
+      memset(h, 0, sizeof(*h));
+    }
+  }
+  if (latency->untracked > 0) {
+    if (!header) fprintf(out, "# %llu ns\n", time);
+    fprintf(out, "# %llu transactions of further endpoints\n", latency->untracked);
+    latency->untracked = 0;
+  }
+}
+
+static struct Endpoint *
+find_endpoint(USBLatency *latency, uint8_t addr, uint8_t endp, int add)
+{
+  struct Endpoint *ep;
+  unsigned int e;
+  for (e = 0; e < latency->n_endpoints; e++) {
+    ep = &latency->endpoints[e];
+    if (ep->addr == addr && ep->endp == endp) return ep;
+  }
+  if (!add || latency->n_endpoints == LATENCY_ENDPOINTS) return NULL;
+  ep = &latency->endpoints[latency->n_endpoints++];
+  ep->addr = addr;
+  ep->endp = endp;
+  return ep;
+}
+
+static void
+token(USBLatency *latency, const struct USBPacketInfo *info,
+      timestamp_t start)
+{
+  struct Endpoint *ep;
+  /* Data without a handshake, isochronous, does not complete NAKed
+     transactions */
+  if (latency->state == STATE_DATA && latency->current) {
+    latency->current->pending = 0;
+    latency->current->retries = 0;
+  }
+  ep = find_endpoint(latency, info->addr,
+		     info->endp | (info->dir == USB_DIR_IN ? 0x80 : 0), 1);
+  latency->current = ep;
+  latency->state = STATE_TOKEN;
+  latency->setup = info->pid == USB_PID_SETUP;
+  if (!ep) {
+    latency->untracked++;
+    return;
+  }
+  if (latency->setup) {
+    /* A SETUP is never NAKed, it starts a new control transfer */
+    ep->pending = 0;
+    ep->retries = 0;
+    ep->control = 0;
+    ep->control_start = start;
+  }
+  if (!ep->pending) {
+    ep->pending = 1;
+    ep->first_start = start;
+  }
+}
+
+static void
+data(USBLatency *latency, const struct USBPacketInfo *info,
+     timestamp_t start)
+{
+  struct Endpoint *ep = latency->current;
+  if (latency->state != STATE_TOKEN || !ep) {
+    latency->state = STATE_IDLE;
+    return;
+  }
+  record(&ep->histograms[METRIC_TOKEN_DATA],
+	 bit_times(latency->last_end, start));
+  latency->state = STATE_DATA;
+  latency->data_len = info->data_len;
+  if (latency->setup && info->data_len == 8) {
+    /* The status stage goes the other way than the data stage, IN if
+       there is none */
+    uint16_t length = info->data[6] | (info->data[7] << 8);
+    ep->control = 1;
+    ep->status_endp = ep->endp & 0x0f;
+    if (!(info->data[0] & 0x80) || length == 0) ep->status_endp |= 0x80;
+  }
+}
+
+static void
+handshake(USBLatency *latency, const struct USBPacketInfo *info,
+	  timestamp_t start, timestamp_t end)
+{
+  struct Endpoint *ep = latency->current;
+  enum State state = latency->state;
+  latency->state = STATE_IDLE;
+  if (state == STATE_IDLE || !ep) return;
+  if (state == STATE_DATA) {
+    record(&ep->histograms[METRIC_DATA_HANDSHAKE],
+	   bit_times(latency->last_end, start));
+  }
+  if (info->pid == USB_PID_NAK) {
+    ep->retries++;
+    return;
+  }
+  if (info->pid == USB_PID_ACK && ep->pending) {
+    record(&ep->histograms[METRIC_NAK_RETRIES], ep->retries);
+    record(&ep->histograms[METRIC_COMPLETION],
+	   bit_times(ep->first_start, end));
+  }
+  ep->pending = 0;
+  ep->retries = 0;
+  if (info->pid == USB_PID_ACK && state == STATE_DATA
+      && latency->data_len == 0 && !latency->setup) {
+    struct Endpoint *control = find_endpoint(latency, ep->addr,
+					     ep->endp & 0x0f, 0);
+    if (control && control->control && control->status_endp == ep->endp) {
+      record(&control->histograms[METRIC_CONTROL],
+	     bit_times(control->control_start, end));
+      control->control = 0;
+    }
+  } else if (info->pid == USB_PID_STALL) {
+    struct Endpoint *control = find_endpoint(latency, ep->addr,
+					     ep->endp & 0x0f, 0);
+    if (control) control->control = 0;
+  }
+}
+
+static void
+add_packet(USBLatency *latency, uint32_t *bits, uint32_t n_bits,
+	   const struct USBPacketInfo *info)
+{
+  timestamp_t start = info->ts > SYNC_BITS * NS_PER_BIT
+    ? info->ts - SYNC_BITS * NS_PER_BIT : 0;
+  timestamp_t end = start + ((timestamp_t)SYNC_BITS
+			     + usb_packet_bus_bits(bits, n_bits)
+			     + EOP_BITS) * NS_PER_BIT;
+  if (info->ts >= latency->next_snapshot) {
+    write_snapshot(latency, latency->next_snapshot);
+    latency->next_snapshot += ((info->ts - latency->next_snapshot)
+			       / latency->interval + 1) * latency->interval;
+  }
+  if (info->flags & (USB_PACKET_CRC_ERROR | USB_PACKET_INVALID)) {
+    latency->state = STATE_IDLE;
+  } else if (info->pid == USB_PID_SOF) {
+    latency->state = STATE_IDLE;
+  } else if (info->flags & USB_PACKET_TOKEN) {
+    token(latency, info, start);
+  } else if (info->flags & USB_PACKET_DATA) {
+    data(latency, info, start);
+  } else if (info->flags & USB_PACKET_HANDSHAKE) {
+    handshake(latency, info, start, end);
+  }
+  latency->last_end = end;
+}
+
+void
+usb_latency_packet(uint32_t *bits, uint32_t n_bits, timestamp_t ts,
+		   void *user_data)
+{
+  USBLatency *latency = user_data;
+  struct USBPacketInfo info;
+  usb_packet_parse(&latency->tracker, bits, n_bits, ts, &info);
+  add_packet(latency, bits, n_bits, &info);
+}
+
+void
+usb_latency_batch(struct USBPacketBatch *batch, void *user_data)
+{
+  USBLatency *latency = user_data;
+  unsigned int p;
+  for (p = 0; p < batch->n_packets; p++) {
+    add_packet(latency, usb_packet_batch_bits(batch, p),
+	       batch->packets[p].n_bits, &batch->info[p]);
+  }
+}
+
+void
+usb_latency_gap(USBLatency *latency)
+{
+  unsigned int e;
+  for (e = 0; e < latency->n_endpoints; e++) {
+    latency->endpoints[e].pending = 0;
+    latency->endpoints[e].retries = 0;
+    latency->endpoints[e].control = 0;
+  }
+  latency->state = STATE_IDLE;
+  latency->current = NULL;
+  usb_packet_tracker_init(&latency->tracker);
+}
+
+void
+usb_latency_close(USBLatency *latency)
+{
+  write_snapshot(latency, latency->last_end);
+  fflush(latency->out);
+  free(latency);
+}
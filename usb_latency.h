@@ -0,0 +1,59 @@
+#ifndef USB_LATENCY_H
+#define USB_LATENCY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <packet_handler.h>
+
+/* Transaction latencies per endpoint, in bit times:
+
+   token_data      End of a token to the start of the data packet
+   data_handshake  End of a data packet to the start of the handshake
+   nak_retries     NAKs before a transaction was ACKed
+   completion      Start of the first token of a transaction, NAKed
+		   ones included, to the end of the ACK
+   control         Start of a SETUP token to the end of the ACK of the
+		   status stage
+
+   Endpoints are told apart by address, number and direction, SETUP
+   counts as OUT. Control transfers are listed under the OUT endpoint.
+
+   The values go into log-linear histograms: exact below 8, above that
+   8 buckets for each power of two, so a value is rounded down by less
+   than 1/8. The memory is allocated once for LATENCY_ENDPOINTS
+   endpoints, transactions of further endpoints are only counted.
+
+   Every interval of bus time the histograms are written as text and
+   cleared, so each snapshot covers one interval and snapshots can be
+   added up for longer periods:
+   # TIME ns
+   ADDR.ENDP DIR METRIC COUNT P50 P90 P99 MAX VALUE:COUNT...
+   where VALUE is the lowest value of each bucket that is not empty. */
+
+#define LATENCY_ENDPOINTS 32
+#define LATENCY_DEFAULT_INTERVAL_NS 60000000000ULL
+
+typedef struct USBLatency USBLatency;
+
+/* Does not take over the file */
+USBLatency *
+usb_latency_init(FILE *out, timestamp_t interval_ns);
+
+/* Packet handler, user_data is the USBLatency */
+void
+usb_latency_packet(uint32_t *bits, uint32_t n_bits, timestamp_t ts,
+		   void *user_data);
+
+/* The same for batches, from the parsed packets */
+void
+usb_latency_batch(struct USBPacketBatch *batch, void *user_data);
+
+/* Transactions in progress are dropped */
+void
+usb_latency_gap(USBLatency *latency);
+
+/* Writes the last snapshot and frees latency */
+void
+usb_latency_close(USBLatency *latency);
+
+#endif
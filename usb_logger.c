@@ -1,25 +1,257 @@
 #include "usb_logger.h"
+#include <stdlib.h>
+#include <string.h>
 #include <stdarg.h>
+#include <usb_profile.h>
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define LOG_HEX_NEON
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#define LOG_HEX_SSSE3
+#endif
+
+/* Enough for any line except data packets, which reserve as they go */
+#define LINE_MAX_LEN 256
+
+static const struct {
+  const char *str;
+  unsigned int len;
+} pid_names[] = {
+  {"SOF", 3}, {"IN", 2}, {"OUT", 3}, {"SETUP", 5}, {"ACK", 3},
+  {"NACK", 4}, {"STALL", 5}, {"DATA0", 5}, {"DATA1", 5}
+};
+
+static const char hex_digits[16] = "0123456789abcdef";
+
+static const char digit_pairs[201] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+static void
+write_out(USBLogger *logger)
+{
+  if (logger->used > 0) {
+    fwrite(logger->buf, 1, logger->used, logger->log);
+    logger->used = 0;
+  }
+}
+
+/* Writes out the buffer or, when capturing, makes it larger. len is
+   at most LOG_BUFFER_SIZE. */
+static void
+make_room(USBLogger *logger, size_t len)
+{
+  size_t size = logger->size;
+  char *buf;
+  if (logger->log) {
+    write_out(logger);
+    return;
+  }
+  while(size - logger->used < len) size *= 2;
+  buf = realloc(logger->buf, size);
+  if (!buf) {
+    fprintf(stderr, "Failed to grow log buffer, %lu bytes of text dropped\n",
+	    (unsigned long)logger->used);
+    logger->used = 0;
+    return;
+  }
+  logger->buf = buf;
+  logger->size = size;
+}
+
+/* Returns where to put at least len bytes */
+static inline char *
+reserve(USBLogger *logger, size_t len)
+{
+  if (logger->size - logger->used < len) make_room(logger, len);
+  return logger->buf + logger->used;
+}
+
+static inline void
+commit(USBLogger *logger, char *end)
+{
+  logger->used = end - logger->buf;
+}
+
+static inline char *
+put_str(char *p, const char *str, unsigned int len)
+{
+  memcpy(p, str, len);
+  return p + len;
+}
+
+static char *
+put_u64(char *p, unsigned long long v)
+{
+  char tmp[20];
+  char *t = tmp + sizeof(tmp);
+  while(v >= 100) {
+    unsigned int r = v % 100;
+    v /= 100;
+    t -= 2;
+    memcpy(t, digit_pairs + 2 * r, 2);
+  }
+  if (v >= 10) {
+    t -= 2;
+    memcpy(t, digit_pairs + 2 * v, 2);
+  } else {
+    *--t = '0' + v;
+  }
+  return put_str(p, t, tmp + sizeof(tmp) - t);
+}
+
+/* Like "%3d" for numbers below 10000 */
+static inline char *
+put_u3(char *p, unsigned int v)
+{
+  if (v < 10) {
+    p[0] = ' ';
+    p[1] = ' ';
+    p[2] = '0' + v;
+    return p + 3;
+  }
+  if (v < 100) {
+    p[0] = ' ';
+    memcpy(p + 1, digit_pairs + 2 * v, 2);
+    return p + 3;
+  }
+  return put_u64(p, v);
+}
+
+/* " %02x" for each of 16 bytes, 48 characters */
+static inline void
+hex16(char *p, const uint8_t *data)
+{
+#if defined(LOG_HEX_NEON)
+  uint8x16_t in = vld1q_u8(data);
+  uint8x16_t hi = vshrq_n_u8(in, 4);
+  uint8x16_t lo = vandq_u8(in, vdupq_n_u8(0x0f));
+  uint8x16x3_t out;
+  /* '0' + n, plus the distance from '9' + 1 to 'a' for n > 9 */
+  hi = vaddq_u8(vaddq_u8(hi, vdupq_n_u8('0')),
+		vandq_u8(vcgtq_u8(hi, vdupq_n_u8(9)), vdupq_n_u8('a' - '9' - 1)));
+  lo = vaddq_u8(vaddq_u8(lo, vdupq_n_u8('0')),
+		vandq_u8(vcgtq_u8(lo, vdupq_n_u8(9)), vdupq_n_u8('a' - '9' - 1)));
+  out.val[0] = vdupq_n_u8(' ');
+  out.val[1] = hi;
+  out.val[2] = lo;
+  vst3q_u8((uint8_t*)p, out);
+#elif defined(LOG_HEX_SSSE3)
+  const __m128i lut = _mm_loadu_si128((const __m128i*)hex_digits);
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  __m128i in = _mm_loadu_si128((const __m128i*)data);
+  __m128i hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(in, 4), mask));
+  __m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(in, mask));
+  /* Digit pairs of bytes 0-7 and 8-15 */
+  __m128i a = _mm_unpacklo_epi8(hi, lo);
+  __m128i b = _mm_unpackhi_epi8(hi, lo);
+  /* Spread the pairs three characters apart, -1 leaves a zero that
+     the spaces are ORed into */
+  __m128i o0 = _mm_shuffle_epi8(a, _mm_setr_epi8(-1, 0, 1, -1, 2, 3, -1, 4,
+						 5, -1, 6, 7, -1, 8, 9, -1));
+  __m128i o1 = _mm_or_si128(_mm_shuffle_epi8(a, _mm_setr_epi8(10, 11, -1, 12,
+							      13, -1, 14, 15,
+							      -1, -1, -1, -1,
+							      -1, -1, -1, -1)),
+			    _mm_shuffle_epi8(b, _mm_setr_epi8(-1, -1, -1, -1,
+							      -1, -1, -1, -1,
+							      -1, 0, 1, -1,
+							      2, 3, -1, 4)));
+  __m128i o2 = _mm_shuffle_epi8(b, _mm_setr_epi8(5, -1, 6, 7, -1, 8, 9, -1,
+						 10, 11, -1, 12, 13, -1, 14,
+						 15));
+  o0 = _mm_or_si128(o0, _mm_setr_epi8(' ', 0, 0, ' ', 0, 0, ' ', 0,
+				      0, ' ', 0, 0, ' ', 0, 0, ' '));
+  o1 = _mm_or_si128(o1, _mm_setr_epi8(0, 0, ' ', 0, 0, ' ', 0, 0,
+				      ' ', 0, 0, ' ', 0, 0, ' ', 0));
+  o2 = _mm_or_si128(o2, _mm_setr_epi8(0, ' ', 0, 0, ' ', 0, 0, ' ',
+				      0, 0, ' ', 0, 0, ' ', 0, 0));
+  _mm_storeu_si128((__m128i*)p, o0);
+  _mm_storeu_si128((__m128i*)(p + 16), o1);
+  _mm_storeu_si128((__m128i*)(p + 32), o2);
+#else
+  unsigned int i;
+  for (i = 0; i < 16; i++) {
+    p[3 * i] = ' ';
+    p[3 * i + 1] = hex_digits[data[i] >> 4];
+    p[3 * i + 2] = hex_digits[data[i] & 0x0f];
+  }
+#endif
+}
+
+static void
+log_vprintf(USBLogger *logger, const char *format, va_list ap)
+{
+  char *p = reserve(logger, LINE_MAX_LEN);
+  va_list again;
+  int len;
+  va_copy(again, ap);
+  len = vsnprintf(p, LINE_MAX_LEN, format, ap);
+  if (len >= LINE_MAX_LEN && logger->log) {
+    /* Too long for the reserved space, rare enough to go through stdio */
+    write_out(logger);
+    vfprintf(logger->log, format, again);
+  } else if (len >= LINE_MAX_LEN) {
+    p = reserve(logger, len + 1);
+    vsnprintf(p, len + 1, format, again);
+    logger->used += len;
+  } else if (len > 0) {
+    logger->used += len;
+  }
+  va_end(again);
+}
+
+static void
+log_printf(USBLogger *logger, const char *format, ...)
+{
+  va_list ap;
+  va_start(ap, format);
+  log_vprintf(logger, format, ap);
+  va_end(ap);
+}
 
 void
 log_error(USBLogger *logger, const char *format,  ...)
 {
   va_list ap;
+  char *p;
+  USB_PROBE1(decode_error, format);
+  if (!logger->buf) return;
+  USB_PROFILE_START(t0);
   va_start(ap, format);
-  fputs("! ",logger->log);
-  vfprintf(logger->log, format, ap);
-  fputc('\n', logger->log);
+  p = reserve(logger, 2);
+  commit(logger, put_str(p, "! ", 2));
+  log_vprintf(logger, format, ap);
+  p = reserve(logger, 1);
+  *p++ = '\n';
+  commit(logger, p);
   va_end(ap);
+  USB_PROFILE_END(USB_PROFILE_LOG, t0);
 }
 
 void
 log_packet(USBLogger *logger, const char *format,  ...)
 {
   va_list ap;
+  char *p;
+  if (!logger->buf) return;
+  USB_PROFILE_START(t0);
   va_start(ap, format);
-  vfprintf(logger->log, format, ap);
-  fputc('\n', logger->log);
+  log_vprintf(logger, format, ap);
+  p = reserve(logger, 1);
+  *p++ = '\n';
+  commit(logger, p);
   va_end(ap);
+  USB_PROFILE_END(USB_PROFILE_LOG, t0);
 }
 
 void
@@ -31,30 +263,228 @@ void
 log_packet_text(USBLogger *logger, const char *format,  ...)
 {
   va_list ap;
+  if (!logger->buf) return;
+  USB_PROFILE_START(t0);
   va_start(ap, format);
-  vfprintf(logger->log, format, ap);
+  log_vprintf(logger, format, ap);
   va_end(ap);
+  USB_PROFILE_END(USB_PROFILE_LOG, t0);
 }
 
 void
 log_packet_end(USBLogger *logger)
 {
-  fputc('\n', logger->log);
+  char *p;
+  if (!logger->buf) return;
+  USB_PROFILE_START(t0);
+  p = reserve(logger, 1);
+  *p++ = '\n';
+  commit(logger, p);
+  USB_PROFILE_END(USB_PROFILE_LOG, t0);
+}
+
+void
+log_sof(USBLogger *logger, unsigned int frame)
+{
+  char *p;
+  if (!logger->buf) return;
+  USB_PROFILE_START(t0);
+  p = reserve(logger, LINE_MAX_LEN);
+  p = put_str(p, "SOF ", 4);
+  p = put_u3(p, frame);
+  *p++ = '\n';
+  commit(logger, p);
+  USB_PROFILE_END(USB_PROFILE_LOG, t0);
+}
+
+void
+log_token(USBLogger *logger, enum USBLogPID pid, unsigned int addr,
+	  unsigned int endp)
+{
+  char *p;
+  if (!logger->buf) return;
+  USB_PROFILE_START(t0);
+  p = reserve(logger, LINE_MAX_LEN);
+  p = put_str(p, pid_names[pid].str, pid_names[pid].len);
+  *p++ = ' ';
+  p = put_u3(p, addr);
+  *p++ = '.';
+  p = put_u64(p, endp);
+  *p++ = '\n';
+  commit(logger, p);
+  USB_PROFILE_END(USB_PROFILE_LOG, t0);
+}
+
+void
+log_pid(USBLogger *logger, enum USBLogPID pid)
+{
+  char *p;
+  if (!logger->buf) return;
+  USB_PROFILE_START(t0);
+  p = reserve(logger, LINE_MAX_LEN);
+  p = put_str(p, pid_names[pid].str, pid_names[pid].len);
+  *p++ = '\n';
+  commit(logger, p);
+  USB_PROFILE_END(USB_PROFILE_LOG, t0);
+}
+
+void
+log_data(USBLogger *logger, enum USBLogPID pid,
+	 const uint8_t *data, unsigned int len)
+{
+  char *p;
+  if (!logger->buf) return;
+  USB_PROFILE_START(t0);
+  p = reserve(logger, LINE_MAX_LEN);
+  p = put_str(p, pid_names[pid].str, pid_names[pid].len);
+  while(len >= 16) {
+    commit(logger, p);
+    p = reserve(logger, 48);
+    hex16(p, data);
+    p += 48;
+    data += 16;
+    len -= 16;
+  }
+  commit(logger, p);
+  p = reserve(logger, 3 * 16 + 1);
+  while(len > 0) {
+    p[0] = ' ';
+    p[1] = hex_digits[*data >> 4];
+    p[2] = hex_digits[*data & 0x0f];
+    p += 3;
+    data++;
+    len--;
+  }
+  *p++ = '\n';
+  commit(logger, p);
+  USB_PROFILE_END(USB_PROFILE_LOG, t0);
+}
+
+/* "# %lld ns\n" */
+static inline char *
+put_time(USBLogger *logger, char *p, timestamp_t time)
+{
+  long long t = time;
+  p = put_str(p, "# ", 2);
+  if (t < 0) {
+    *p++ = '-';
+    p = put_u64(p, -(unsigned long long)t);
+  } else {
+    p = put_u64(p, t);
+  }
+  p = put_str(p, " ns", 3);
+  if (logger->label) {
+    *p++ = ' ';
+    p = put_str(p, logger->label, logger->label_len);
+  }
+  *p++ = '\n';
+  return p;
 }
 
 void
 log_time(USBLogger *logger, timestamp_t time)
 {
-  fprintf(logger->log, "# %lld ns\n", time);
+  char *p;
+  if (!logger->buf) return;
+  USB_PROFILE_START(t0);
+  p = reserve(logger, LINE_MAX_LEN + logger->label_len);
+  commit(logger, put_time(logger, p, time));
+  USB_PROFILE_END(USB_PROFILE_LOG, t0);
+}
+
+void
+log_gap(USBLogger *logger, timestamp_t time, unsigned int lost_blocks,
+	timestamp_t lost_ns)
+{
+  char *p;
+  if (!logger->buf) return;
+  p = reserve(logger, LINE_MAX_LEN + logger->label_len);
+  commit(logger, put_time(logger, p, time));
+  log_printf(logger, "! Gap: %u blocks lost, about %lld ns\n",
+	     lost_blocks, lost_ns);
+}
+
+void
+log_gap_check(USBLogger *logger, long long lost_ns)
+{
+  if (!logger->buf) return;
+  log_printf(logger, "! Gap: SOF frame numbers indicate %lld ns lost\n",
+	     lost_ns);
 }
 
 void
 log_init(USBLogger *logger, FILE *file)
 {
   logger->log = file;
+  logger->used = 0;
+  logger->label = NULL;
+  logger->label_len = 0;
+  logger->buf = NULL;
+  logger->size = 0;
+  if (file) {
+    logger->buf = malloc(LOG_BUFFER_SIZE);
+    if (!logger->buf) {
+      fprintf(stderr, "Failed to allocate log buffer\n");
+      logger->log = NULL;
+    } else {
+      logger->size = LOG_BUFFER_SIZE;
+    }
+  }
+}
+
+void
+log_text(USBLogger *logger, const char *text, size_t len)
+{
+  if (!logger->buf) return;
+  while(len > 0) {
+    size_t n = len < LOG_BUFFER_SIZE ? len : LOG_BUFFER_SIZE;
+    char *p = reserve(logger, n);
+    memcpy(p, text, n);
+    commit(logger, p + n);
+    text += n;
+    len -= n;
+  }
+}
+
+void
+log_init_capture(USBLogger *logger)
+{
+  log_init(logger, NULL);
+  logger->buf = malloc(LOG_BUFFER_SIZE);
+  if (!logger->buf) {
+    fprintf(stderr, "Failed to allocate log buffer\n");
+  } else {
+    logger->size = LOG_BUFFER_SIZE;
+  }
+}
+
+const char *
+log_take(USBLogger *logger, size_t *len)
+{
+  *len = logger->used;
+  logger->used = 0;
+  return logger->buf;
+}
+
+void
+log_label(USBLogger *logger, const char *label)
+{
+  logger->label = label;
+  logger->label_len = label ? strlen(label) : 0;
+}
+
+void
+log_flush(USBLogger *logger)
+{
+  if (!logger->buf || !logger->log) return;
+  write_out(logger);
+  fflush(logger->log);
 }
 
 void
 log_close(USBLogger *logger)
 {
+  if (logger->log) write_out(logger);
+  free(logger->buf);
+  logger->buf = NULL;
 }
@@ -1,11 +1,38 @@
+#ifndef USB_LOGGER_H
+#define USB_LOGGER_H
+
 #include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <timestamp.h>
 
+/* Text is collected in buf and written to log in large blocks */
+#define LOG_BUFFER_SIZE (256 * 1024)
+
 typedef struct _USBLogger
 {
    FILE *log;
+   char *buf;
+   size_t size; /* Of buf, capturing loggers grow it */
+   size_t used;
+   const char *label; /* Appended to time lines if not NULL */
+   unsigned int label_len;
 } USBLogger;
 
+/* Packet names for the formatted lines */
+enum USBLogPID
+{
+  USB_LOG_SOF,
+  USB_LOG_IN,
+  USB_LOG_OUT,
+  USB_LOG_SETUP,
+  USB_LOG_ACK,
+  USB_LOG_NACK,
+  USB_LOG_STALL,
+  USB_LOG_DATA0,
+  USB_LOG_DATA1
+};
+
 void
 log_error(USBLogger *logger, const char *format,  ...);
 
@@ -21,11 +48,62 @@ log_packet_text(USBLogger *logger, const char *format,  ...);
 void
 log_packet_end(USBLogger *logger);
 
+/* Same output as log_packet with "SOF %3d" */
+void
+log_sof(USBLogger *logger, unsigned int frame);
+
+/* Same output as log_packet with "IN %3d.%01d" and so on */
+void
+log_token(USBLogger *logger, enum USBLogPID pid, unsigned int addr,
+	  unsigned int endp);
+
+/* Just the name, for handshakes and data packets with CRC errors */
+void
+log_pid(USBLogger *logger, enum USBLogPID pid);
+
+/* The name followed by " %02x" for each byte */
+void
+log_data(USBLogger *logger, enum USBLogPID pid,
+	 const uint8_t *data, unsigned int len);
+
 void
 log_time(USBLogger *logger, timestamp_t time);
 
+void
+log_gap(USBLogger *logger, timestamp_t time, unsigned int lost_blocks,
+	timestamp_t lost_ns);
+
+void
+log_gap_check(USBLogger *logger, long long lost_ns);
+
 void
 log_init(USBLogger *logger, FILE *file);
 
+/* Append text as it is */
+void
+log_text(USBLogger *logger, const char *text, size_t len);
+
+/* A logger without a file, the text is collected until log_take().
+   The buffer grows as needed, if that fails the text so far is
+   dropped with a message on stderr. */
+void
+log_init_capture(USBLogger *logger);
+
+/* Returns the text collected so far and empties the buffer. It is valid
+   until the next call to a log function. */
+const char *
+log_take(USBLogger *logger, size_t *len);
+
+/* Time lines become "# <time> ns <label>", for merged captures */
+void
+log_label(USBLogger *logger, const char *label);
+
+/* Write the buffered text and flush the file, nothing for capturing
+   loggers */
+void
+log_flush(USBLogger *logger);
+
 void
 log_close(USBLogger *logger);
+
+#endif
@@ -0,0 +1,170 @@
+#include "usb_packet.h"
+#include <stddef.h>
+#include <pthread.h>
+#include <usb_crc.h>
+#include <usb_profile.h>
+
+int
+usb_packet_token_crc_ok(uint16_t data)
+{
+  int ok;
+  USB_PROFILE_START(t0);
+  ok = usb_crc5_token_ok(data);
+  USB_PROFILE_END(USB_PROFILE_CRC, t0);
+  return ok;
+}
+
+int
+usb_packet_data_crc_ok(const uint8_t *data, unsigned int len)
+{
+  uint16_t crc;
+  USB_PROFILE_START(t0);
+  crc = usb_crc16(0xffff, data, len);
+  USB_PROFILE_END(USB_PROFILE_CRC, t0);
+  return crc == 0xb001;
+}
+
+void
+usb_packet_tracker_init(struct USBPacketTracker *tracker)
+{
+  tracker->has_token = 0;
+  tracker->addr = 0;
+  tracker->endp = 0;
+  tracker->dir = 0;
+}
+
+void
+usb_packet_parse(struct USBPacketTracker *tracker,
+		 const uint32_t *bits, uint32_t n_bits, timestamp_t ts,
+		 struct USBPacketInfo *info)
+{
+  uint32_t packet = bits[0];
+  info->ts = ts;
+  info->pid = packet & 0xff;
+  info->flags = 0;
+  info->frame = 0;
+  info->data = NULL;
+  info->data_len = 0;
+  switch(info->pid) {
+  case USB_PID_SOF:
+    info->flags = USB_PACKET_TOKEN;
+    if (n_bits < 24) {
+      info->flags |= USB_PACKET_INVALID;
+    } else if (!usb_packet_token_crc_ok(packet >> 8)) {
+      info->flags |= USB_PACKET_CRC_ERROR;
+    }
+    info->frame = (packet >> 8) & 0x7ff;
+    tracker->has_token = 0;
+    break;
+  case USB_PID_IN:
+  case USB_PID_OUT:
+  case USB_PID_SETUP:
+    info->flags = USB_PACKET_TOKEN;
+    if (n_bits < 24) {
+      info->flags |= USB_PACKET_INVALID;
+      tracker->has_token = 0;
+      break;
+    }
+    if (!usb_packet_token_crc_ok(packet >> 8)) {
+      info->flags |= USB_PACKET_CRC_ERROR;
+      tracker->has_token = 0;
+    } else {
+      tracker->has_token = 1;
+      tracker->addr = (packet >> 8) & 0x7f;
+      tracker->endp = (packet >> 15) & 0x0f;
+      tracker->dir = (info->pid == USB_PID_IN ? USB_DIR_IN
+		      : (info->pid == USB_PID_OUT ? USB_DIR_OUT
+			 : USB_DIR_SETUP));
+    }
+    info->addr = (packet >> 8) & 0x7f;
+    info->endp = (packet >> 15) & 0x0f;
+    info->dir = tracker->dir;
+    info->has_token = tracker->has_token;
+    return;
+  case USB_PID_DATA0:
+  case USB_PID_DATA1:
+    info->flags = USB_PACKET_DATA;
+    if (n_bits < 24) {
+      info->flags |= USB_PACKET_INVALID;
+    } else if (!usb_packet_data_crc_ok(((uint8_t*)bits) + 1, n_bits / 8 - 1)) {
+      info->flags |= USB_PACKET_CRC_ERROR;
+    } else {
+      info->data = ((const uint8_t*)bits) + 1;
+      info->data_len = n_bits / 8 - 3;
+    }
+    break;
+  case USB_PID_ACK:
+  case USB_PID_NAK:
+  case USB_PID_STALL:
+    info->flags = USB_PACKET_HANDSHAKE;
+    break;
+  default:
+    info->flags = USB_PACKET_INVALID;
+    tracker->has_token = 0;
+    break;
+  }
+  info->has_token = tracker->has_token;
+  info->addr = tracker->addr;
+  info->endp = tracker->endp;
+  info->dir = tracker->dir;
+  /* A handshake ends the transaction */
+  if (info->flags & USB_PACKET_HANDSHAKE) tracker->has_token = 0;
+}
+
+/* Bit stuffing: for each run of ones so far (0 to 5) and byte, the run
+   after the byte in the low nibble and the number of stuffed bits in
+   the high nibble. */
+static uint8_t stuff_table[6][256];
+static pthread_once_t stuff_table_once = PTHREAD_ONCE_INIT;
+
+static void
+init_stuff_table(void)
+{
+  unsigned int run;
+  unsigned int byte;
+  for (run = 0; run < 6; run++) {
+    for (byte = 0; byte < 256; byte++) {
+      unsigned int r = run;
+      unsigned int stuffed = 0;
+      unsigned int b;
+      for (b = 0; b < 8; b++) {
+	if (byte & (1 << b)) {
+	  if (++r == 6) {
+	    stuffed++;
+	    r = 0;
+	  }
+	} else {
+	  r = 0;
+	}
+      }
+      stuff_table[run][byte] = (stuffed << 4) | r;
+    }
+  }
+}
+
+uint32_t
+usb_packet_bus_bits(const uint32_t *bits, uint32_t n_bits)
+{
+  const uint8_t *bytes = (const uint8_t*)bits;
+  unsigned int run = 1; /* The last bit of sync counts */
+  unsigned int stuffed = 0;
+  unsigned int i;
+  unsigned int b;
+  pthread_once(&stuff_table_once, init_stuff_table);
+  for (i = 0; i < n_bits / 8; i++) {
+    uint8_t s = stuff_table[run][bytes[i]];
+    stuffed += s >> 4;
+    run = s & 0x0f;
+  }
+  for (b = 0; b < (n_bits & 7); b++) {
+    if (bytes[i] & (1 << b)) {
+      if (++run == 6) {
+	stuffed++;
+	run = 0;
+      }
+    } else {
+      run = 0;
+    }
+  }
+  return n_bits + stuffed;
+}
@@ -0,0 +1,77 @@
+#ifndef USB_PACKET_H
+#define USB_PACKET_H
+
+#include <stdint.h>
+#include <timestamp.h>
+
+/* PID byte including the check bits */
+#define USB_PID_OUT 0xe1
+#define USB_PID_IN 0x69
+#define USB_PID_SOF 0xa5
+#define USB_PID_SETUP 0x2d
+#define USB_PID_DATA0 0xc3
+#define USB_PID_DATA1 0x4b
+#define USB_PID_ACK 0xd2
+#define USB_PID_NAK 0x5a
+#define USB_PID_STALL 0x1e
+
+#define USB_PACKET_TOKEN 0x01
+#define USB_PACKET_DATA 0x02
+#define USB_PACKET_HANDSHAKE 0x04
+#define USB_PACKET_CRC_ERROR 0x08
+#define USB_PACKET_INVALID 0x10 /* Unknown PID or too short */
+
+/* Largest full speed payload */
+#define USB_MAX_PAYLOAD 1023
+
+/* Direction of a transaction */
+#define USB_DIR_OUT 0
+#define USB_DIR_IN 1
+#define USB_DIR_SETUP 2
+
+struct USBPacketInfo
+{
+  timestamp_t ts;
+  uint8_t pid;
+  unsigned int flags;
+  /* For tokens the address and endpoint of the token itself, for data
+     and handshake packets those of the preceding token. */
+  uint8_t addr;
+  uint8_t endp;
+  uint8_t dir;
+  uint8_t has_token; /* addr, endp and dir are valid */
+  uint16_t frame; /* Only for SOF */
+  const uint8_t *data; /* Payload of data packets, without PID and CRC */
+  unsigned int data_len;
+};
+
+/* Remembers the last token so that data and handshake packets can be
+   attributed to an endpoint. */
+struct USBPacketTracker
+{
+  uint8_t has_token;
+  uint8_t addr;
+  uint8_t endp;
+  uint8_t dir;
+};
+
+int
+usb_packet_token_crc_ok(uint16_t data);
+
+int
+usb_packet_data_crc_ok(const uint8_t *data, unsigned int len);
+
+void
+usb_packet_tracker_init(struct USBPacketTracker *tracker);
+
+void
+usb_packet_parse(struct USBPacketTracker *tracker,
+		 const uint32_t *bits, uint32_t n_bits, timestamp_t ts,
+		 struct USBPacketInfo *info);
+
+/* Bit times of the packet from the PID to the end of the CRC, including
+   stuffed bits. SYNC and EOP are not counted. */
+uint32_t
+usb_packet_bus_bits(const uint32_t *bits, uint32_t n_bits);
+
+#endif
@@ -0,0 +1,47 @@
+#include "usb_packet_batch.h"
+#include <stdlib.h>
+#include <usb_packet_pool.h>
+
+/* Most packets are tokens and handshakes of one word */
+#define WORDS_PER_PACKET 4
+
+struct USBPacketBatch *
+usb_packet_batch_create(unsigned int max_packets)
+{
+  struct USBPacketBatch *batch = malloc(sizeof(struct USBPacketBatch));
+  if (!batch) return NULL;
+  if (max_packets == 0) max_packets = 1;
+  batch->n_packets = 0;
+  batch->max_packets = max_packets;
+  batch->n_words = 0;
+  batch->max_words = max_packets * WORDS_PER_PACKET + USB_BUF_LEN;
+  batch->packets = malloc(max_packets * sizeof(struct USBPacketBatchEntry));
+  batch->bits = malloc(batch->max_words * sizeof(uint32_t));
+  batch->info = malloc(max_packets * sizeof(struct USBPacketInfo));
+  usb_packet_tracker_init(&batch->tracker);
+  if (!batch->packets || !batch->bits || !batch->info) {
+    usb_packet_batch_destroy(batch);
+    return NULL;
+  }
+  return batch;
+}
+
+void
+usb_packet_batch_destroy(struct USBPacketBatch *batch)
+{
+  free(batch->packets);
+  free(batch->bits);
+  free(batch->info);
+  free(batch);
+}
+
+void
+usb_packet_batch_parse(struct USBPacketBatch *batch)
+{
+  unsigned int p;
+  for (p = 0; p < batch->n_packets; p++) {
+    usb_packet_parse(&batch->tracker, usb_packet_batch_bits(batch, p),
+		     batch->packets[p].n_bits, batch->packets[p].ts,
+		     &batch->info[p]);
+  }
+}
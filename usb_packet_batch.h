@@ -0,0 +1,61 @@
+#ifndef USB_PACKET_BATCH_H
+#define USB_PACKET_BATCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <timestamp.h>
+#include <usb_packet.h>
+
+/* Packets collected by the decoder and handed on together, so that
+   the decoding loop and each consumer run in loops of their own. The
+   bits of each packet start at a word boundary in one buffer. The
+   decoder decodes into the buffer directly, so a batch is flushed when
+   it has no room for the longest packet.
+
+   Before a batch is handed on, each packet is parsed once into info,
+   with its CRC checked, so the handlers of a batch share that work
+   instead of each parsing every packet again. */
+
+#define USB_PACKET_BATCH_DEFAULT_PACKETS 256
+#define USB_PACKET_BATCH_DEFAULT_BLOCKS 256
+
+struct USBPacketBatchEntry
+{
+  uint32_t offset; /* Words from the start of bits */
+  uint32_t n_bits;
+  timestamp_t ts;
+  timestamp_t eop_ts; /* End of EOP */
+};
+
+struct USBPacketBatch
+{
+  unsigned int n_packets;
+  unsigned int max_packets;
+  struct USBPacketBatchEntry *packets;
+  size_t n_words; /* Words used by the packets */
+  size_t max_words;
+  uint32_t *bits;
+  struct USBPacketInfo *info; /* Filled by usb_packet_batch_parse() */
+  struct USBPacketTracker tracker; /* Carries over between batches */
+};
+
+typedef void (*USBPacketBatchHandler)(struct USBPacketBatch *batch,
+				      void *user_data);
+
+struct USBPacketBatch *
+usb_packet_batch_create(unsigned int max_packets);
+
+void
+usb_packet_batch_destroy(struct USBPacketBatch *batch);
+
+/* Fill in info for the packets of the batch */
+void
+usb_packet_batch_parse(struct USBPacketBatch *batch);
+
+static inline uint32_t *
+usb_packet_batch_bits(struct USBPacketBatch *batch, unsigned int i)
+{
+  return batch->bits + batch->packets[i].offset;
+}
+
+#endif
@@ -1,17 +1,17 @@
 #include "usb_packet_decoder.h"
-#include <crc5.h>
-#include <crc16.h>
+#include <usb_packet.h>
+#include <usb_profile.h>
+#include <string.h>
 
 
 #define BIT31 0x80000000
 
+#define USB_FRAME_BITS 12000
+
 static int
 check_short_crc(USBLogger *logger, uint16_t data)
 {
-  uint8_t crc = 0x1f;
-  crc = crc5_update(crc, data);
-  crc = crc5_update(crc, data >> 8);
-  if (crc != 0x06) {
+  if (!usb_packet_token_crc_ok(data)) {
     log_error(logger, "CRC error\n");
     return 0;
   }
@@ -21,11 +21,7 @@ check_short_crc(USBLogger *logger, uint16_t data)
 static int
 check_crc16(USBLogger *logger, uint8_t *data, unsigned int len)
 {
-  uint16_t crc = 0xffff;
-  while(len -- > 0) {
-    crc = crc16_update(crc, *data++);
-  }
-  if (crc != 0xb001) {
+  if (!usb_packet_data_crc_ok(data, len)) {
     log_error(logger, "CRC error\n");
     return 0;
   }
@@ -35,18 +31,14 @@ check_crc16(USBLogger *logger, uint8_t *data, unsigned int len)
 static int
 decode_data_packet(USBLogger *logger, 
 		   const uint32_t *bits, uint32_t n_bits,
-		   const char *name)
+		   enum USBLogPID pid)
 {
   if (check_crc16(logger, ((uint8_t*)bits) + 1, n_bits / 8 - 1)) {
-    int i;
-    log_packet_start(logger);
-    log_packet_text(logger, "%s", name);
-    for (i = 1; i < n_bits/8 - 2; i++) {
-      log_packet_text(logger, " %02x", ((uint8_t*)bits)[i]);
-    }
-    log_packet_end(logger);
+    /* Leave out the PID and CRC */
+    log_data(logger, pid, ((uint8_t*)bits) + 1,
+	     n_bits / 8 > 3 ? n_bits / 8 - 3 : 0);
   } else {
-    log_packet(logger, "%s", name);
+    log_pid(logger, pid);
   }
   return 0;
 }
@@ -74,39 +66,39 @@ decode_packet(uint32_t *bits, uint32_t n_bits, timestamp_t ts, void *user_data)
   switch(pid) {
   case 0xa5:
     check_short_crc(logger, packet >> 8);
-    log_packet(logger, "SOF %3d", (packet >> 8) & 0x7ff);
+    log_sof(logger, (packet >> 8) & 0x7ff);
     break;
   case 0x69:
     check_short_crc(logger, packet >> 8);
-    log_packet(logger, "IN %3d.%01d", (packet >> 8) & 0x7f,
-	       (packet >> 15) & 0x0f);
+    log_token(logger, USB_LOG_IN, (packet >> 8) & 0x7f,
+	      (packet >> 15) & 0x0f);
     break;
   case 0xe1:
     check_short_crc(logger, packet >> 8);
-    log_packet(logger, "OUT %3d.%01d", (packet >> 8) & 0x7f,
-	       (packet >> 15) & 0x0f);
+    log_token(logger, USB_LOG_OUT, (packet >> 8) & 0x7f,
+	      (packet >> 15) & 0x0f);
     break;
   case 0x2d:
     check_short_crc(logger, packet >> 8);
-    log_packet(logger, "SETUP %3d.%01d", (packet >> 8) & 0x7f,
-	    (packet >> 15) & 0x0f);
+    log_token(logger, USB_LOG_SETUP, (packet >> 8) & 0x7f,
+	      (packet >> 15) & 0x0f);
     break;
   case 0xd2:
-    log_packet(logger, "ACK");
+    log_pid(logger, USB_LOG_ACK);
 	  break;
   case 0x5a:
-    log_packet(logger, "NACK");
+    log_pid(logger, USB_LOG_NACK);
     break;
   case 0x1e:
-    log_packet(logger, "STALL");
+    log_pid(logger, USB_LOG_STALL);
     break;
 
   case 0xc3:
-    decode_data_packet(logger, bits, n_bits, "DATA0");
+    decode_data_packet(logger, bits, n_bits, USB_LOG_DATA0);
     break;
     
   case 0x4b:
-    decode_data_packet(logger, bits, n_bits, "DATA1");
+    decode_data_packet(logger, bits, n_bits, USB_LOG_DATA1);
     break;
     
   default:
@@ -115,7 +107,79 @@ decode_packet(uint32_t *bits, uint32_t n_bits, timestamp_t ts, void *user_data)
   }
 }
 
-inline void
+/* The same text as decode_packet(), from info so that the CRCs are not
+   checked again */
+void
+decode_packet_info(uint32_t *bits, uint32_t n_bits,
+		   const struct USBPacketInfo *info, USBLogger *logger)
+{
+  if (info->flags & USB_PACKET_INVALID) {
+    /* Too short or unknown PID, rare enough to take the long way */
+    decode_packet(bits, n_bits, info->ts, logger);
+    return;
+  }
+  log_time(logger, info->ts);
+  if (info->flags & USB_PACKET_CRC_ERROR) {
+    log_error(logger, "CRC error\n");
+  }
+  switch(info->pid) {
+  case USB_PID_SOF:
+    log_sof(logger, info->frame);
+    break;
+  case USB_PID_IN:
+    log_token(logger, USB_LOG_IN, info->addr, info->endp);
+    break;
+  case USB_PID_OUT:
+    log_token(logger, USB_LOG_OUT, info->addr, info->endp);
+    break;
+  case USB_PID_SETUP:
+    log_token(logger, USB_LOG_SETUP, info->addr, info->endp);
+    break;
+  case USB_PID_ACK:
+    log_pid(logger, USB_LOG_ACK);
+    break;
+  case USB_PID_NAK:
+    log_pid(logger, USB_LOG_NACK);
+    break;
+  case USB_PID_STALL:
+    log_pid(logger, USB_LOG_STALL);
+    break;
+  case USB_PID_DATA0:
+  case USB_PID_DATA1:
+    {
+      enum USBLogPID pid = (info->pid == USB_PID_DATA0
+			    ? USB_LOG_DATA0 : USB_LOG_DATA1);
+      if (info->flags & USB_PACKET_CRC_ERROR) {
+	log_pid(logger, pid);
+      } else {
+	log_data(logger, pid, info->data, info->data_len);
+      }
+    }
+    break;
+  }
+}
+
+void
+decode_packet_batch(struct USBPacketBatch *batch, void *user_data)
+{
+  USBLogger *logger = user_data;
+  unsigned int p;
+  for (p = 0; p < batch->n_packets; p++) {
+    decode_packet_info(usb_packet_batch_bits(batch, p),
+		       batch->packets[p].n_bits, &batch->info[p], logger);
+  }
+}
+
+/* Errors found by the state machine, counted for error triggered outputs */
+static inline void
+decode_error(struct USBDecoder *decode, const char *msg)
+{
+  decode->errors++;
+  if (decode->batch) decode_flush(decode);
+  log_error(decode->logger, msg);
+}
+
+static inline void
 add_bits(struct USBDecoder *decode, uint32_t bits, unsigned long n_bits)
 {
   unsigned long offset = decode->n_buf_bits >> 5;
@@ -124,13 +188,13 @@ add_bits(struct USBDecoder *decode, uint32_t bits, unsigned long n_bits)
   if ((decode->n_buf_bits + n_bits) > USB_BUF_LEN * 32) {
     n_bits = USB_BUF_LEN * 32 - decode->n_buf_bits;
     if (!(decode->flags & USB_DECODER_BUFFER_OVERFLOW)) {
-      log_error(decode->logger,"Bits lost due to buffer overflow");
+      decode_error(decode, "Bits lost due to buffer overflow");
     }
     decode->flags |= USB_DECODER_BUFFER_OVERFLOW;
   } else {
     decode->flags &= ~USB_DECODER_BUFFER_OVERFLOW;
   }
-  mask = (1<<n_bits) - 1;
+  mask = n_bits < 32 ? ((uint32_t)1 << n_bits) - 1 : ~(uint32_t)0;
   if (offset < USB_BUF_LEN) {
     decode->buffer[offset] = ((decode->buffer[offset] & ~(mask<<shift)) 
 			      | ((bits & mask) << shift));
@@ -145,6 +209,122 @@ add_bits(struct USBDecoder *decode, uint32_t bits, unsigned long n_bits)
 }
 
 
+static void
+next_buffer(USBDecoder *decode)
+{
+  if (decode->batch) {
+    decode->packet = NULL;
+    decode->buffer = decode->batch->bits + decode->batch->n_words;
+    return;
+  }
+  decode->packet = decode->pool ? usb_packet_pool_get(decode->pool) : NULL;
+  decode->buffer = decode->packet ? decode->packet->bits : decode->fallback;
+}
+
+void
+decode_init(USBDecoder *decode, USBPacketPool *pool)
+{
+  decode->flags = 0;
+  decode->dp_prev = 1;
+  decode->one_count = 0;
+  decode->bit_count = -8;
+  decode->se0_count = 0;
+  decode->n_buf_bits = 0;
+  decode->eop_ts = 0;
+  decode->errors = 0;
+  decode->pool = pool;
+  decode->batch = NULL;
+  next_buffer(decode);
+}
+
+void
+decode_set_batch(USBDecoder *decode, struct USBPacketBatch *batch,
+		 unsigned int max_blocks, USBPacketBatchHandler handler,
+		 void *user_data)
+{
+  if (decode->batch) decode_flush(decode);
+  if (decode->packet) usb_packet_release(decode->packet);
+  decode->batch = batch;
+  decode->batch_max_blocks = max_blocks > 0 ? max_blocks : 1;
+  decode->batch_blocks = 0;
+  decode->batch_handler = handler;
+  decode->batch_handler_user_data = user_data;
+  if (batch) {
+    batch->n_packets = 0;
+    batch->n_words = 0;
+    usb_packet_tracker_init(&batch->tracker);
+  }
+  next_buffer(decode);
+}
+
+void
+decode_flush(USBDecoder *decode)
+{
+  struct USBPacketBatch *batch = decode->batch;
+  if (!batch) return;
+  decode->batch_blocks = 0;
+  if (batch->n_packets > 0) {
+    USB_PROFILE_START(t0);
+    usb_packet_batch_parse(batch);
+    decode->batch_handler(batch, decode->batch_handler_user_data);
+    USB_PROFILE_END(USB_PROFILE_PACKET, t0);
+    batch->n_packets = 0;
+  }
+  if (batch->n_words > 0) {
+    /* A packet in progress continues at the start */
+    memmove(batch->bits, decode->buffer,
+	    ((decode->n_buf_bits + 31) / 32) * sizeof(uint32_t));
+    batch->n_words = 0;
+    decode->buffer = batch->bits;
+  }
+}
+
+/* Takes the packet in the buffer into the batch */
+static inline void
+batch_add(USBDecoder *decode)
+{
+  struct USBPacketBatch *batch = decode->batch;
+  struct USBPacketBatchEntry *entry = &batch->packets[batch->n_packets++];
+  entry->offset = batch->n_words;
+  entry->n_bits = decode->n_buf_bits;
+  entry->ts = decode->sync_ts;
+  entry->eop_ts = decode->eop_ts;
+  batch->n_words += (decode->n_buf_bits + 31) / 32;
+  decode->buffer = batch->bits + batch->n_words;
+  decode->n_buf_bits = 0;
+  if (batch->n_packets == batch->max_packets
+      || batch->max_words - batch->n_words < USB_BUF_LEN) {
+    decode_flush(decode);
+  }
+}
+
+void
+decode_close(USBDecoder *decode)
+{
+  if (decode->batch) {
+    decode_flush(decode);
+    decode->batch = NULL;
+  }
+  if (decode->packet) usb_packet_release(decode->packet);
+  decode->packet = NULL;
+  decode->buffer = decode->fallback;
+}
+
+/* Called after the packet handlers */
+static inline void
+packet_done(USBDecoder *decode)
+{
+  if (decode->packet) {
+    if (__atomic_load_n(&decode->packet->refs, __ATOMIC_ACQUIRE) > 1) {
+      /* Kept by a handler */
+      usb_packet_release(decode->packet);
+      next_buffer(decode);
+    }
+  } else if (decode->pool) {
+    next_buffer(decode);
+  }
+}
+
 static int
 find_lowest_one_from(uint32_t w, int from)
 {
@@ -172,16 +352,72 @@ find_lowest_one_from(uint32_t w, int from)
 
 
 
+/* SE0 is both lines low. A decoded bit is 1 when D+ did not change
+   from the previous sample. */
+static inline void
+nrzi_masks(const struct USBSamples *samples, uint8_t dp_prev,
+	   uint32_t *se0, uint32_t *decoded)
+{
+  uint32_t dp = samples->dp_bits;
+  *se0 = ~(dp | samples->dm_bits);
+  *decoded = ~dp ^ ((dp << 1) | dp_prev);
+}
+
+static void
+track_sof(USBDecoder *decode, uint32_t packet, uint32_t n_bits)
+{
+  unsigned int frame;
+  if (n_bits < 24 || !usb_packet_token_crc_ok(packet >> 8)) return;
+  frame = (packet >> 8) & 0x7ff;
+  if ((decode->flags & (USB_DECODER_SOF_SEEN | USB_DECODER_GAP))
+      == (USB_DECODER_SOF_SEEN | USB_DECODER_GAP)) {
+    /* Frames are 1 ms, which is 12000 bits. Only the time not covered
+       by received blocks was lost. */
+    unsigned int frames = (frame - decode->sof_frame) & 0x7ff;
+    long long received = (decode->sync_ts - decode->sof_ts
+			  - decode->gap_ns);
+    if (decode->batch) decode_flush(decode);
+    log_gap_check(decode->logger,
+		  frames * (long long)USB_FRAME_BITS * NS_PER_BIT - received);
+  }
+  decode->flags &= ~USB_DECODER_GAP;
+  decode->flags |= USB_DECODER_SOF_SEEN;
+  decode->sof_frame = frame;
+  decode->sof_ts = decode->sync_ts;
+  decode->gap_ns = 0;
+}
+
+void
+decode_gap(USBDecoder *decode, unsigned int lost_blocks, timestamp_t lost_ns,
+	   timestamp_t time)
+{
+  decode->bit_count = -8;
+  decode->n_buf_bits = 0;
+  decode->one_count = 0;
+  decode->se0_count = 0;
+  decode->dp_prev = 1;
+  decode->flags &= ~USB_DECODER_BUFFER_OVERFLOW;
+  decode->flags |= USB_DECODER_GAP;
+  decode->gap_ns += lost_ns;
+  if (decode->batch) {
+    decode_flush(decode);
+    /* The handlers start over after a gap too */
+    usb_packet_tracker_init(&decode->batch->tracker);
+  }
+  log_gap(decode->logger, time, lost_blocks, lost_ns);
+}
+
 int
 decode_block(USBDecoder *decode, const struct USBSamples *samples, 
 	     timestamp_t time)
 {
-  uint32_t se0 = ~(samples->dp_bits | samples->dm_bits);
+  uint32_t se0;
   uint32_t dp = samples->dp_bits;
-  uint32_t decoded = (~dp ^ ((dp << 1) | decode->dp_prev));
+  uint32_t decoded;
   uint32_t bits_end = 32;
   uint32_t data_bits_end; /* Next SE0 position */
   uint32_t bits_pos = 0; /* Current bit position */
+  nrzi_masks(samples, decode->dp_prev, &se0, &decoded);
   decode->dp_prev = dp >> 31;
   
   /* fprintf(stderr, "%08x %08x %08x\n", dp, se0, decoded); */
@@ -194,6 +430,7 @@ decode_block(USBDecoder *decode, const struct USBSamples *samples,
       continue;
     } else {
       if (decode->se0_count >=30) {
+	if (decode->batch) decode_flush(decode);
 	log_packet(decode->logger, "RESET");
 	decode->bit_count = -8;
 	decode->n_buf_bits = 0;
@@ -201,11 +438,28 @@ decode_block(USBDecoder *decode, const struct USBSamples *samples,
 	/* fprintf(stderr, "Got %d bits\n", decode->n_buf_bits); */
 	/* fprintf(stderr, "EOP\n"); */
 	if (decode->n_buf_bits >= 8) {
-	  decode->packet_handler(decode->buffer, decode->n_buf_bits,
-				 decode->sync_ts,
-				 decode->packet_handler_user_data);
+	  uint32_t first = decode->buffer[0];
+	  uint32_t n_bits = decode->n_buf_bits;
+	  USB_PROBE3(packet_emitted, first & 0xff, n_bits, decode->sync_ts);
+	  decode->eop_ts = time + bits_pos * NS_PER_BIT;
+	  if (decode->batch) {
+	    batch_add(decode);
+	  } else {
+	    USB_PROFILE_START(t0);
+	    if (decode->packet) {
+	      decode->packet->n_bits = n_bits;
+	      decode->packet->ts = decode->sync_ts;
+	    }
+	    decode->packet_handler(decode->buffer, n_bits, decode->sync_ts,
+				   decode->packet_handler_user_data);
+	    USB_PROFILE_END(USB_PROFILE_PACKET, t0);
+	  }
+	  if ((first & 0xff) == 0xa5) {
+	    track_sof(decode, first, n_bits);
+	  }
+	  if (!decode->batch) packet_done(decode);
 	} else if (decode->n_buf_bits != 0) {
-	  log_error(decode->logger,"Short packet");
+	  decode_error(decode, "Short packet");
 	}
 	decode->bit_count = -8;
 	decode->n_buf_bits = 0;
@@ -227,7 +481,7 @@ decode_block(USBDecoder *decode, const struct USBSamples *samples,
 	  decode->one_count++;
 	} else {
 	  if (decode->one_count > 6) {
-	    log_error(decode->logger,"Bit stuff error");
+	    decode_error(decode, "Bit stuff error");
 	    bits_pos = b;
 	    decode->bit_count = -8;
 	    decode->one_count = 0;
@@ -263,16 +517,16 @@ decode_block(USBDecoder *decode, const struct USBSamples *samples,
 	b = data_bits_end;
 	decode->bit_count += data_bits_end - bits_pos;
 	if (decode->bit_count >= 0) {
-	  log_error(decode->logger, "Long sync");
+	  decode_error(decode, "Long sync");
 	  decode->bit_count = -8;
 	}
       } else {
 	decode->bit_count += (b - bits_pos) + 1;
 	if (decode->bit_count > 0) {
-	  log_error(decode->logger, "Long sync");
+	  decode_error(decode, "Long sync");
 	  decode->bit_count = -8;
 	} else if (decode->bit_count < 0) {
-	  log_error(decode->logger, "Short sync\n");
+	  decode_error(decode, "Short sync\n");
 	  decode->bit_count = -8;
 	} else {
 	  decode->one_count = 1;
@@ -298,7 +552,7 @@ decode_block(USBDecoder *decode, const struct USBSamples *samples,
 	extra--;
 	decode->bit_count++;
       } else if (decode->bit_count < -1 && decode->bit_count > -8) {
-	log_error(decode->logger, "Short sync\n");
+	decode_error(decode, "Short sync\n");
 	decode->bit_count = -8;
       }
       if (extra > 0 && decode->bit_count >= 0) {
@@ -314,6 +568,9 @@ decode_block(USBDecoder *decode, const struct USBSamples *samples,
       decode->se0_count += extra;
     }
   }
-
+  if (decode->batch && ++decode->batch_blocks >= decode->batch_max_blocks) {
+    decode_flush(decode);
+  }
+  USB_PROBE2(block_decoded, samples->sequence, samples->count);
   return 0;
 }
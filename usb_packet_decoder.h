@@ -1,12 +1,20 @@
+#ifndef USB_PACKET_DECODER_H
+#define USB_PACKET_DECODER_H
+
 #include <packet_handler.h>
 #include <usb_logger.h>
 #include <usb_ringbuffer.h>
+#include <usb_packet_pool.h>
+#include <usb_packet_batch.h>
 
 
-#define USB_BUF_BYTES 1024
-#define USB_BUF_LEN (USB_BUF_BYTES / sizeof(uint32_t))
+/* Change when the decoder produces different packets or errors, it
+   invalidates decode caches */
+#define USB_DECODER_VERSION 1
 
 #define USB_DECODER_BUFFER_OVERFLOW 0x1
+#define USB_DECODER_SOF_SEEN 0x2
+#define USB_DECODER_GAP 0x4 /* Blocks lost since last SOF */
 
 struct USBDecoder
 {
@@ -16,19 +24,76 @@ struct USBDecoder
   int bit_count; /* Bits of packet so far. -8 means no packet detected.
 		    Negative when decoding sync sequence. */
   unsigned int se0_count; /* SE0 count */
-  uint32_t buffer[USB_BUF_LEN]; /* Decoded bits of packet */
+  uint32_t *buffer; /* Decoded bits of packet, in packet or fallback */
+  struct USBPacketBuffer *packet; /* NULL when using fallback */
+  USBPacketPool *pool;
+  uint32_t fallback[USB_BUF_LEN]; /* Used without pool or when it is empty */
   unsigned int n_buf_bits; /* Number of bits in buffer */
   timestamp_t sync_ts; /* Timestamp of end of last sync sequence */
+  timestamp_t eop_ts; /* End of the EOP of the last packet */
+  unsigned long errors; /* Errors logged by the decoder itself */
+  unsigned int sof_frame; /* Frame number of last SOF */
+  timestamp_t sof_ts; /* Timestamp of last SOF */
+  timestamp_t gap_ns; /* Estimated time lost in gaps since last SOF */
   USBLogger *logger;
   USBPacketHandler packet_handler;
   void *packet_handler_user_data;
+  struct USBPacketBatch *batch; /* NULL to call packet_handler at once */
+  unsigned int batch_max_blocks;
+  unsigned int batch_blocks; /* Blocks since the last flush */
+  USBPacketBatchHandler batch_handler;
+  void *batch_handler_user_data;
 };
 
 typedef struct USBDecoder USBDecoder;
 
+/* Packets are decoded into buffers from pool if it isn't NULL. A packet
+   handler may keep the buffer with usb_packet_retain_bits(), the
+   decoder then continues with a new one. */
+void
+decode_init(USBDecoder *decode, USBPacketPool *pool);
+
+/* Releases the current buffer */
+void
+decode_close(USBDecoder *decode);
+
+/* Collect packets in batch and pass them to handler when it is full,
+   after max_blocks blocks, before the decoder logs anything itself and
+   at decode_flush() and decode_close(). The packets are decoded into
+   the batch, not into buffers from the pool. NULL goes back to calling
+   packet_handler for each packet. Call between packets, before the
+   first block. */
+void
+decode_set_batch(USBDecoder *decode, struct USBPacketBatch *batch,
+		 unsigned int max_blocks, USBPacketBatchHandler handler,
+		 void *user_data);
+
+/* Hand on the packets collected so far */
+void
+decode_flush(USBDecoder *decode);
+
 int
 decode_block(USBDecoder *decode, const struct USBSamples *samples, 
 	     timestamp_t time);
 
+/* Restart decoding after lost blocks. Any partially decoded packet is
+   dropped. The lost time is checked against the frame number of the
+   next SOF. */
+void
+decode_gap(USBDecoder *decode, unsigned int lost_blocks, timestamp_t lost_ns,
+	   timestamp_t time);
+
 void
 decode_packet(uint32_t *bits, uint32_t n_bits,  timestamp_t ts,void *user_data);
+
+/* Logs the same as decode_packet() for a packet already parsed into
+   info */
+void
+decode_packet_info(uint32_t *bits, uint32_t n_bits,
+		   const struct USBPacketInfo *info, USBLogger *logger);
+
+/* Batch version of decode_packet(), user_data is the USBLogger */
+void
+decode_packet_batch(struct USBPacketBatch *batch, void *user_data);
+
+#endif
@@ -0,0 +1,94 @@
+#include "usb_packet_pool.h"
+#include <stdlib.h>
+#include <stddef.h>
+#include <pthread.h>
+
+struct USBPacketPool
+{
+  pthread_mutex_t lock;
+  struct USBPacketBuffer *free;
+  unsigned int n_buffers;
+  struct USBPacketBuffer *buffers;
+};
+
+USBPacketPool *
+usb_packet_pool_create(unsigned int n_buffers)
+{
+  unsigned int i;
+  USBPacketPool *pool = malloc(sizeof(USBPacketPool));
+  if (!pool) return NULL;
+  pool->buffers = malloc(n_buffers * sizeof(struct USBPacketBuffer));
+  if (!pool->buffers) {
+    free(pool);
+    return NULL;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pool->n_buffers = n_buffers;
+  pool->free = NULL;
+  for (i = n_buffers; i-- > 0;) {
+    struct USBPacketBuffer *packet = &pool->buffers[i];
+    packet->n_bits = 0;
+    packet->ts = 0;
+    packet->refs = 0;
+    packet->pool = pool;
+    packet->next_free = pool->free;
+    pool->free = packet;
+  }
+  return pool;
+}
+
+void
+usb_packet_pool_destroy(USBPacketPool *pool)
+{
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->buffers);
+  free(pool);
+}
+
+struct USBPacketBuffer *
+usb_packet_pool_get(USBPacketPool *pool)
+{
+  struct USBPacketBuffer *packet;
+  pthread_mutex_lock(&pool->lock);
+  packet = pool->free;
+  if (packet) pool->free = packet->next_free;
+  pthread_mutex_unlock(&pool->lock);
+  if (packet) {
+    packet->next_free = NULL;
+    packet->refs = 1;
+  }
+  return packet;
+}
+
+struct USBPacketBuffer *
+usb_packet_retain_bits(USBPacketPool *pool, const uint32_t *bits)
+{
+  const uint8_t *start = (const uint8_t*)pool->buffers;
+  const uint8_t *p = (const uint8_t*)bits;
+  struct USBPacketBuffer *packet;
+  if (p < start
+      || p >= start + pool->n_buffers * sizeof(struct USBPacketBuffer)) {
+    return NULL;
+  }
+  packet = &pool->buffers[(p - start) / sizeof(struct USBPacketBuffer)];
+  if (packet->bits != bits) return NULL;
+  usb_packet_retain(packet);
+  return packet;
+}
+
+void
+usb_packet_retain(struct USBPacketBuffer *packet)
+{
+  __atomic_add_fetch(&packet->refs, 1, __ATOMIC_RELAXED);
+}
+
+void
+usb_packet_release(struct USBPacketBuffer *packet)
+{
+  USBPacketPool *pool = packet->pool;
+  if (__atomic_sub_fetch(&packet->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+  pthread_mutex_lock(&pool->lock);
+  packet->next_free = pool->free;
+  pool->free = packet;
+  pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,52 @@
+#ifndef USB_PACKET_POOL_H
+#define USB_PACKET_POOL_H
+
+#include <stdint.h>
+#include <timestamp.h>
+#include <usb_packet.h>
+
+/* Room for PID, the largest full speed payload, CRC16 and a few bits
+   before EOP, rounded up to whole words */
+#define USB_BUF_BYTES ((1 + USB_MAX_PAYLOAD + 2 + 2 + 3) & ~3)
+#define USB_BUF_LEN (USB_BUF_BYTES / sizeof(uint32_t))
+
+typedef struct USBPacketPool USBPacketPool;
+
+/* A decoded packet. Owned by whoever holds a reference, returned to the
+   pool when the last one is released. */
+struct USBPacketBuffer
+{
+  uint32_t bits[USB_BUF_LEN];
+  uint32_t n_bits;
+  timestamp_t ts;
+  unsigned int refs;
+  USBPacketPool *pool;
+  struct USBPacketBuffer *next_free;
+};
+
+/* All buffers are allocated here, none later */
+USBPacketPool *
+usb_packet_pool_create(unsigned int n_buffers);
+
+/* Buffers still referenced are freed too */
+void
+usb_packet_pool_destroy(USBPacketPool *pool);
+
+/* Returns a buffer with one reference, or NULL if all are in use */
+struct USBPacketBuffer *
+usb_packet_pool_get(USBPacketPool *pool);
+
+/* Takes a reference to the pool buffer holding the bits passed to a
+   packet handler. Returns NULL if they are not from this pool (the
+   decoder ran out of buffers), then the handler has to copy them. */
+struct USBPacketBuffer *
+usb_packet_retain_bits(USBPacketPool *pool, const uint32_t *bits);
+
+void
+usb_packet_retain(struct USBPacketBuffer *packet);
+
+/* May be called from any thread */
+void
+usb_packet_release(struct USBPacketBuffer *packet);
+
+#endif
@@ -0,0 +1,84 @@
+#include "usb_pcap.h"
+#include <stdlib.h>
+#include <stdint.h>
+
+/* Magic for nanosecond timestamps */
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define PCAP_SNAPLEN 65535
+
+struct USBPcap
+{
+  FILE *out;
+  uint64_t base_ns;
+  unsigned long long count;
+};
+
+struct PcapHeader
+{
+  uint32_t magic;
+  uint16_t version_major;
+  uint16_t version_minor;
+  int32_t thiszone;
+  uint32_t sigfigs;
+  uint32_t snaplen;
+  uint32_t linktype;
+};
+
+struct PcapRecord
+{
+  uint32_t ts_sec;
+  uint32_t ts_nsec;
+  uint32_t incl_len;
+  uint32_t orig_len;
+};
+
+USBPcap *
+usb_pcap_init(FILE *out, uint64_t base_ns)
+{
+  struct PcapHeader header;
+  USBPcap *pcap = malloc(sizeof(USBPcap));
+  if (!pcap) return NULL;
+  pcap->out = out;
+  pcap->base_ns = base_ns;
+  pcap->count = 0;
+  /* Host byte order, readers check the magic */
+  header.magic = PCAP_MAGIC_NS;
+  header.version_major = 2;
+  header.version_minor = 4;
+  header.thiszone = 0;
+  header.sigfigs = 0;
+  header.snaplen = PCAP_SNAPLEN;
+  header.linktype = USB_PCAP_LINKTYPE_USB_2_0;
+  fwrite(&header, sizeof(header), 1, out);
+  return pcap;
+}
+
+void
+usb_pcap_packet(uint32_t *bits, uint32_t n_bits, timestamp_t ts,
+		void *user_data)
+{
+  USBPcap *pcap = user_data;
+  struct PcapRecord record;
+  uint32_t len = n_bits / 8;
+  uint64_t t = pcap->base_ns + ts;
+  record.ts_sec = t / 1000000000;
+  record.ts_nsec = t % 1000000000;
+  record.incl_len = len;
+  record.orig_len = len;
+  fwrite(&record, sizeof(record), 1, pcap->out);
+  fwrite(bits, 1, len, pcap->out);
+  pcap->count++;
+}
+
+unsigned long long
+usb_pcap_count(const USBPcap *pcap)
+{
+  return pcap->count;
+}
+
+void
+usb_pcap_close(USBPcap *pcap)
+{
+  fflush(pcap->out);
+  free(pcap);
+}
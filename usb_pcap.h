@@ -0,0 +1,34 @@
+#ifndef USB_PCAP_H
+#define USB_PCAP_H
+
+#include <stdio.h>
+#include <packet_handler.h>
+
+/* Packets in pcap format with nanosecond timestamps and link type
+   LINKTYPE_USB_2_0: each record is the packet from the PID to the CRC,
+   as Wireshark's USB link layer dissector expects. Timestamps are the
+   time of the packet on the bus added to a wall clock base, so that
+   Wireshark shows the date and time of the capture. */
+
+#define USB_PCAP_LINKTYPE_USB_2_0 288
+
+typedef struct USBPcap USBPcap;
+
+/* Writes the file header. Does not take over the file. base_ns is the
+   CLOCK_REALTIME in ns at bus time 0. */
+USBPcap *
+usb_pcap_init(FILE *out, uint64_t base_ns);
+
+/* Packet handler, user_data is the USBPcap */
+void
+usb_pcap_packet(uint32_t *bits, uint32_t n_bits, timestamp_t ts,
+		void *user_data);
+
+unsigned long long
+usb_pcap_count(const USBPcap *pcap);
+
+/* Does not close the file */
+void
+usb_pcap_close(USBPcap *pcap);
+
+#endif
@@ -0,0 +1,70 @@
+#include "usb_profile.h"
+
+#ifdef USB_PROFILE
+
+struct USBProfileStage usb_profile_stages[USB_PROFILE_STAGES];
+
+static const char *stage_names[USB_PROFILE_STAGES] = {
+  "read", "decode", " packet", "  crc", "  log", "vcd"
+};
+
+#if defined(__x86_64__) || defined(__i386__) || defined(USB_PROFILE_PMCCNTR)
+#define UNIT "cycles"
+#else
+#define UNIT "ns"
+#endif
+
+/* Upper bound of the bucket where the given fraction of calls is reached */
+static unsigned long long
+percentile(const struct USBProfileStage *s, unsigned int percent)
+{
+  uint64_t limit = (s->calls * percent + 99) / 100;
+  uint64_t sum = 0;
+  unsigned int b;
+  for (b = 0; b < USB_PROFILE_BUCKETS - 1; b++) {
+    sum += s->hist[b];
+    if (sum >= limit) break;
+  }
+  return 2ULL << b;
+}
+
+void
+usb_profile_report(FILE *out)
+{
+  unsigned int i;
+  unsigned int b;
+  fprintf(out, "Profile (" UNIT ", indented stages are included above)\n");
+  fprintf(out, "%-8s %12s %16s %10s %10s %10s %12s\n",
+	  "stage", "calls", "total", "mean", "p50<", "p99<", "max");
+  for (i = 0; i < USB_PROFILE_STAGES; i++) {
+    const struct USBProfileStage *s = &usb_profile_stages[i];
+    if (s->calls == 0) continue;
+    fprintf(out, "%-8s %12llu %16llu %10llu %10llu %10llu %12llu\n",
+	    stage_names[i], (unsigned long long)s->calls,
+	    (unsigned long long)s->total,
+	    (unsigned long long)(s->total / s->calls),
+	    percentile(s, 50), percentile(s, 99),
+	    (unsigned long long)s->max);
+  }
+  fprintf(out, "Histograms (upper bound:calls)\n");
+  for (i = 0; i < USB_PROFILE_STAGES; i++) {
+    const struct USBProfileStage *s = &usb_profile_stages[i];
+    if (s->calls == 0) continue;
+    fprintf(out, "%-8s", stage_names[i]);
+    for (b = 0; b < USB_PROFILE_BUCKETS; b++) {
+      if (s->hist[b] == 0) continue;
+      fprintf(out, " %llu:%llu", 2ULL << b, (unsigned long long)s->hist[b]);
+    }
+    fputc('\n', out);
+  }
+}
+
+#else
+
+void
+usb_profile_report(FILE *out)
+{
+  fprintf(out, "Profiling not compiled in, rebuild with make PROFILE=1\n");
+}
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef USB_PROFILE_H
+#define USB_PROFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Optional instrumentation of the decoding path, enabled by building
+   with -DUSB_PROFILE (make PROFILE=1). Without it all macros expand to
+   nothing.
+
+   Each stage gets a call count, a total and a log2 histogram of the
+   time per call. Time is measured in TSC cycles on x86, in PMU cycles
+   on ARM if USB_PROFILE_PMCCNTR is defined (user access to the cycle
+   counter must then be enabled by the kernel) and in ns from
+   CLOCK_MONOTONIC otherwise.
+
+   With <sys/sdt.h> available (HAVE_SYS_SDT_H) the USB_PROBE macros
+   become USDT probes in the "usbsniff" provider. */
+
+enum {
+  USB_PROFILE_READ, /* Reading blocks from the source */
+  USB_PROFILE_DECODE, /* decode_block, includes packet handling */
+  USB_PROFILE_PACKET, /* Packet handlers, includes CRC and logging */
+  USB_PROFILE_CRC,
+  USB_PROFILE_LOG, /* Formatting decoded packets */
+  USB_PROFILE_VCD, /* Formatting VCD */
+  USB_PROFILE_STAGES
+};
+
+#define USB_PROFILE_BUCKETS 32
+
+#ifdef USB_PROFILE
+
+#if !(defined(__x86_64__) || defined(__i386__)) && !defined(USB_PROFILE_PMCCNTR)
+#include <time.h>
+#endif
+
+struct USBProfileStage
+{
+  uint64_t calls;
+  uint64_t total;
+  uint64_t max;
+  uint64_t hist[USB_PROFILE_BUCKETS]; /* Bucket n counts times < 2^(n+1) */
+};
+
+extern struct USBProfileStage usb_profile_stages[USB_PROFILE_STAGES];
+
+static inline uint64_t
+usb_profile_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  uint32_t lo, hi;
+  __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+  return ((uint64_t)hi << 32) | lo;
+#elif defined(USB_PROFILE_PMCCNTR)
+  uint32_t c;
+  __asm__ __volatile__ ("mrc p15, 0, %0, c9, c13, 0" : "=r" (c));
+  return c;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static inline void
+usb_profile_add(unsigned int stage, uint64_t t)
+{
+  struct USBProfileStage *s = &usb_profile_stages[stage];
+  unsigned int bucket = 63 - __builtin_clzll(t | 1);
+  if (bucket >= USB_PROFILE_BUCKETS) bucket = USB_PROFILE_BUCKETS - 1;
+  s->calls++;
+  s->total += t;
+  if (t > s->max) s->max = t;
+  s->hist[bucket]++;
+}
+
+#define USB_PROFILE_START(var) uint64_t var = usb_profile_cycles()
+#define USB_PROFILE_END(stage, var) \
+  usb_profile_add(stage, usb_profile_cycles() - (var))
+
+#else
+
+#define USB_PROFILE_START(var)
+#define USB_PROFILE_END(stage, var)
+
+#endif
+
+#if defined(USB_PROFILE) && defined(HAVE_SYS_SDT_H)
+#include <sys/sdt.h>
+#define USB_PROBE1(name, a) DTRACE_PROBE1(usbsniff, name, a)
+#define USB_PROBE2(name, a, b) DTRACE_PROBE2(usbsniff, name, a, b)
+#define USB_PROBE3(name, a, b, c) DTRACE_PROBE3(usbsniff, name, a, b, c)
+#else
+#define USB_PROBE1(name, a)
+#define USB_PROBE2(name, a, b)
+#define USB_PROBE3(name, a, b, c)
+#endif
+
+/* Print the statistics, or a note that profiling is not compiled in */
+void
+usb_profile_report(FILE *out);
+
+#endif
@@ -0,0 +1,328 @@
+#include "usb_pyramid.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <usb_packet.h>
+
+#define SYNC_BITS 8
+#define EOP_BITS 3
+
+/* Complete buckets kept per level before writing */
+#define BUCKET_BUF 64
+
+struct Level
+{
+  int fd;
+  uint64_t bucket_ns;
+  uint64_t current; /* Index of the bucket being added to */
+  struct USBPyramidBucket bucket;
+  uint64_t buf_start; /* Index of the first bucket in buf */
+  unsigned int n_buf;
+  struct USBPyramidBucket buf[BUCKET_BUF];
+};
+
+struct USBPyramid
+{
+  unsigned int n_levels;
+  struct USBPyramidHeader header; /* Of level 0 */
+  struct USBPacketTracker tracker;
+  struct Level levels[USB_PYRAMID_MAX_LEVELS];
+};
+
+static char *
+level_path(const char *dir, unsigned int level)
+{
+  size_t len = strlen(dir) + 16;
+  char *path = malloc(len);
+  if (!path) return NULL;
+  snprintf(path, len, "%s/level%02u", dir, level);
+  return path;
+}
+
+static void
+write_header(USBPyramid *pyramid, unsigned int level)
+{
+  struct USBPyramidHeader header = pyramid->header;
+  header.level = level;
+  header.bucket_ns = pyramid->levels[level].bucket_ns;
+  if (pwrite(pyramid->levels[level].fd, &header, sizeof(header), 0)
+      != sizeof(header)) {
+    fprintf(stderr, "Failed to write pyramid header: %s\n", strerror(errno));
+  }
+}
+
+USBPyramid *
+usb_pyramid_open(const char *dir, uint64_t base_ns, uint64_t start_ns)
+{
+  USBPyramid *pyramid;
+  uint64_t bucket_ns;
+  unsigned int i;
+  if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+    fprintf(stderr, "Failed to create directory %s: %s\n",
+	    dir, strerror(errno));
+    return NULL;
+  }
+  pyramid = malloc(sizeof(USBPyramid));
+  if (!pyramid) return NULL;
+  memset(pyramid, 0, sizeof(USBPyramid));
+  memcpy(pyramid->header.magic, USB_PYRAMID_MAGIC,
+	 sizeof(pyramid->header.magic));
+  pyramid->header.bucket_size = sizeof(struct USBPyramidBucket);
+  pyramid->header.start_ns = start_ns;
+  usb_packet_tracker_init(&pyramid->tracker);
+  for (i = 0; i < USB_PYRAMID_MAX_LEVELS; i++) pyramid->levels[i].fd = -1;
+  for (bucket_ns = base_ns;
+       pyramid->n_levels < USB_PYRAMID_MAX_LEVELS
+	 && (pyramid->n_levels == 0
+	     || bucket_ns <= USB_PYRAMID_MAX_BUCKET_NS);
+       bucket_ns *= USB_PYRAMID_FACTOR) {
+    pyramid->levels[pyramid->n_levels++].bucket_ns = bucket_ns;
+  }
+  for (i = 0; i < USB_PYRAMID_MAX_LEVELS; i++) {
+    struct Level *level = &pyramid->levels[i];
+    char *path = level_path(dir, i);
+    if (!path) {
+      usb_pyramid_close(pyramid);
+      return NULL;
+    }
+    if (i >= pyramid->n_levels) {
+      /* Levels left from a pyramid with a shorter base */
+      unlink(path);
+      free(path);
+      continue;
+    }
+    level->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (level->fd < 0) {
+      fprintf(stderr, "Failed to open file %s for writing: %s\n",
+	      path, strerror(errno));
+      free(path);
+      usb_pyramid_close(pyramid);
+      return NULL;
+    }
+    free(path);
+    write_header(pyramid, i);
+  }
+  return pyramid;
+}
+
+static void
+write_buffered(struct Level *level)
+{
+  size_t len = level->n_buf * sizeof(struct USBPyramidBucket);
+  off_t pos = (sizeof(struct USBPyramidHeader)
+	       + level->buf_start * sizeof(struct USBPyramidBucket));
+  if (level->n_buf == 0) return;
+  if (pwrite(level->fd, level->buf, len, pos) != len) {
+    fprintf(stderr, "Failed to write pyramid level: %s\n", strerror(errno));
+  }
+  level->n_buf = 0;
+}
+
+/* The current bucket of level is complete */
+static void
+end_bucket(struct Level *level)
+{
+  if (level->n_buf > 0
+      && (level->n_buf == BUCKET_BUF
+	  || level->buf_start + level->n_buf != level->current)) {
+    write_buffered(level);
+  }
+  if (level->n_buf == 0) level->buf_start = level->current;
+  level->buf[level->n_buf++] = level->bucket;
+  memset(&level->bucket, 0, sizeof(level->bucket));
+}
+
+/* Move every level to the bucket of time */
+static void
+advance(USBPyramid *pyramid, timestamp_t time)
+{
+  unsigned int i;
+  for (i = 0; i < pyramid->n_levels; i++) {
+    struct Level *level = &pyramid->levels[i];
+    uint64_t index = time / level->bucket_ns;
+    if (index <= level->current) break; /* So are the levels above */
+    end_bucket(level);
+    level->current = index;
+  }
+}
+
+static int
+endpoint_slot(USBPyramid *pyramid, uint8_t addr, uint8_t endp)
+{
+  struct USBPyramidHeader *header = &pyramid->header;
+  unsigned int i;
+  for (i = 0; i < header->n_endpoints; i++) {
+    if (header->endpoints[i].addr == addr
+	&& header->endpoints[i].endp == endp) {
+      return i;
+    }
+  }
+  if (header->n_endpoints == USB_PYRAMID_ENDPOINTS) return -1;
+  header->endpoints[i].addr = addr;
+  header->endpoints[i].endp = endp;
+  header->n_endpoints++;
+  for (i = 0; i < pyramid->n_levels; i++) write_header(pyramid, i);
+  return header->n_endpoints - 1;
+}
+
+static void
+add_packet(USBPyramid *pyramid, uint32_t *bits, uint32_t n_bits,
+	   const struct USBPacketInfo *info)
+{
+  uint32_t bus_bits;
+  int slot = -1;
+  unsigned int i;
+  bus_bits = SYNC_BITS + usb_packet_bus_bits(bits, n_bits) + EOP_BITS;
+  if ((info->flags & USB_PACKET_DATA) && info->has_token
+      && info->data_len > 0) {
+    slot = endpoint_slot(pyramid, info->addr,
+			 info->endp | (info->dir == USB_DIR_IN ? 0x80 : 0));
+  }
+  advance(pyramid, info->ts);
+  for (i = 0; i < pyramid->n_levels; i++) {
+    struct USBPyramidBucket *b = &pyramid->levels[i].bucket;
+    b->busy_bits += bus_bits;
+    b->packets[info->pid & 0x0f]++;
+    if (info->flags & USB_PACKET_CRC_ERROR) b->crc_errors++;
+    if (info->flags & USB_PACKET_INVALID) b->invalid++;
+    if (slot >= 0) {
+      b->bytes[slot] += info->data_len;
+    } else if (info->flags & USB_PACKET_DATA) {
+      b->other_bytes += info->data_len;
+    }
+  }
+}
+
+void
+usb_pyramid_packet(uint32_t *bits, uint32_t n_bits, timestamp_t ts,
+		   void *user_data)
+{
+  USBPyramid *pyramid = user_data;
+  struct USBPacketInfo info;
+  usb_packet_parse(&pyramid->tracker, bits, n_bits, ts, &info);
+  add_packet(pyramid, bits, n_bits, &info);
+}
+
+void
+usb_pyramid_batch(struct USBPacketBatch *batch, void *user_data)
+{
+  USBPyramid *pyramid = user_data;
+  unsigned int p;
+  for (p = 0; p < batch->n_packets; p++) {
+    add_packet(pyramid, usb_packet_batch_bits(batch, p),
+	       batch->packets[p].n_bits, &batch->info[p]);
+  }
+}
+
+void
+usb_pyramid_gap(USBPyramid *pyramid, unsigned int lost_blocks,
+		timestamp_t time)
+{
+  unsigned int i;
+  advance(pyramid, time);
+  for (i = 0; i < pyramid->n_levels; i++) {
+    pyramid->levels[i].bucket.lost_blocks += lost_blocks;
+  }
+  usb_packet_tracker_init(&pyramid->tracker);
+}
+
+void
+usb_pyramid_flush(USBPyramid *pyramid)
+{
+  unsigned int i;
+  for (i = 0; i < pyramid->n_levels; i++) {
+    write_buffered(&pyramid->levels[i]);
+  }
+}
+
+void
+usb_pyramid_close(USBPyramid *pyramid)
+{
+  unsigned int i;
+  for (i = 0; i < USB_PYRAMID_MAX_LEVELS; i++) {
+    struct Level *level = &pyramid->levels[i];
+    if (level->fd < 0) continue;
+    end_bucket(level);
+    write_buffered(level);
+    close(level->fd);
+  }
+  free(pyramid);
+}
+
+unsigned int
+usb_pyramid_levels(const char *dir)
+{
+  unsigned int n = 0;
+  while(n < USB_PYRAMID_MAX_LEVELS) {
+    struct stat st;
+    char *path = level_path(dir, n);
+    int found;
+    if (!path) break;
+    found = stat(path, &st) == 0;
+    free(path);
+    if (!found) break;
+    n++;
+  }
+  return n;
+}
+
+int
+usb_pyramid_map(const char *dir, unsigned int level,
+		struct USBPyramidLevel *map)
+{
+  char *path = level_path(dir, level);
+  struct stat st;
+  int fd;
+  memset(map, 0, sizeof(*map));
+  if (!path) return -1;
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    fprintf(stderr, "Failed to open file %s for reading: %s\n",
+	    path, strerror(errno));
+    if (fd >= 0) close(fd);
+    free(path);
+    return -1;
+  }
+  if (st.st_size < sizeof(struct USBPyramidHeader)) {
+    fprintf(stderr, "Not a pyramid level: %s\n", path);
+    close(fd);
+    free(path);
+    return -1;
+  }
+  map->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map->map == MAP_FAILED) {
+    fprintf(stderr, "Failed to map %s: %s\n", path, strerror(errno));
+    map->map = NULL;
+    free(path);
+    return -1;
+  }
+  map->map_len = st.st_size;
+  map->header = map->map;
+  if (memcmp(map->header->magic, USB_PYRAMID_MAGIC,
+	     sizeof(map->header->magic)) != 0
+      || map->header->bucket_size != sizeof(struct USBPyramidBucket)
+      || map->header->bucket_ns == 0) {
+    fprintf(stderr, "Not a pyramid level: %s\n", path);
+    free(path);
+    usb_pyramid_unmap(map);
+    return -1;
+  }
+  free(path);
+  map->buckets = (const struct USBPyramidBucket *)(map->header + 1);
+  map->n_buckets = ((st.st_size - sizeof(struct USBPyramidHeader))
+		    / sizeof(struct USBPyramidBucket));
+  return 0;
+}
+
+void
+usb_pyramid_unmap(struct USBPyramidLevel *map)
+{
+  if (map->map) munmap(map->map, map->map_len);
+  map->map = NULL;
+}
@@ -0,0 +1,116 @@
+#ifndef USB_PYRAMID_H
+#define USB_PYRAMID_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <packet_handler.h>
+
+/* Bus activity summed up over time buckets at several resolutions,
+   built while decoding so that a long capture can be looked at as a
+   whole and then zoomed into without decoding it again.
+
+   Level 0 has buckets of the base time, 1 ms unless given, and each
+   level above has buckets 4 times as long, up to about 17 minutes.
+   That keeps the 32 bit counters of a full speed bus from overflowing.
+   Packets are counted in the bucket their SYNC starts in.
+
+   The pyramid is a directory with one file per level, DIR/level00,
+   DIR/level01 and so on, in host byte order. Each file has a header
+   and then one bucket for each bucket time from the start of the
+   capture, so bucket i of a level is at a fixed offset and a level can
+   be memory mapped and read from any time on. A bucket is written when
+   its time is over; while capturing, the last bucket of each level is
+   missing. Buckets without any packets may be holes in the file.
+
+   The header has the CLOCK_REALTIME of the start of bucket 0, so that
+   bucket times can be given as wall clock times. */
+
+#define USB_PYRAMID_MAGIC "USBPYR02"
+#define USB_PYRAMID_MAX_LEVELS 16
+#define USB_PYRAMID_FACTOR 4
+#define USB_PYRAMID_DEFAULT_BASE_NS 1000000ULL
+/* No level has buckets longer than this */
+#define USB_PYRAMID_MAX_BUCKET_NS 1100000000000ULL
+/* Endpoints with their own byte count, the first ones seen */
+#define USB_PYRAMID_ENDPOINTS 16
+
+struct USBPyramidEndpoint
+{
+  uint8_t addr;
+  uint8_t endp; /* 0x80 set for IN, SETUP counts as OUT */
+};
+
+struct USBPyramidHeader
+{
+  char magic[8];
+  uint32_t level;
+  uint32_t bucket_size; /* sizeof(struct USBPyramidBucket) */
+  uint64_t bucket_ns;
+  uint64_t start_ns; /* Wall clock time of bus time 0 */
+  uint32_t n_endpoints;
+  uint32_t pad;
+  struct USBPyramidEndpoint endpoints[USB_PYRAMID_ENDPOINTS];
+};
+
+struct USBPyramidBucket
+{
+  uint64_t busy_bits; /* Bit times from SYNC to EOP of all packets */
+  uint32_t packets[16]; /* By the low 4 bits of the PID */
+  uint32_t crc_errors;
+  uint32_t invalid; /* Unknown PID or too short */
+  uint32_t lost_blocks;
+  uint32_t other_bytes; /* Payload of endpoints without their own count */
+  uint32_t bytes[USB_PYRAMID_ENDPOINTS]; /* Payload of data packets */
+};
+
+typedef struct USBPyramid USBPyramid;
+
+/* Creates the directory if needed and replaces a pyramid in it.
+   start_ns is the CLOCK_REALTIME at bus time 0. */
+USBPyramid *
+usb_pyramid_open(const char *dir, uint64_t base_ns, uint64_t start_ns);
+
+/* Packet handler, user_data is the USBPyramid */
+void
+usb_pyramid_packet(uint32_t *bits, uint32_t n_bits, timestamp_t ts,
+		   void *user_data);
+
+/* The same for batches, from the parsed packets */
+void
+usb_pyramid_batch(struct USBPacketBatch *batch, void *user_data);
+
+/* Blocks lost at time */
+void
+usb_pyramid_gap(USBPyramid *pyramid, unsigned int lost_blocks,
+		timestamp_t time);
+
+/* Write the buckets that are complete */
+void
+usb_pyramid_flush(USBPyramid *pyramid);
+
+/* Writes the last buckets and frees pyramid */
+void
+usb_pyramid_close(USBPyramid *pyramid);
+
+/* A memory mapped level */
+struct USBPyramidLevel
+{
+  const struct USBPyramidHeader *header;
+  const struct USBPyramidBucket *buckets;
+  uint64_t n_buckets;
+  void *map;
+  size_t map_len;
+};
+
+/* Number of levels in the pyramid */
+unsigned int
+usb_pyramid_levels(const char *dir);
+
+int
+usb_pyramid_map(const char *dir, unsigned int level,
+		struct USBPyramidLevel *map);
+
+void
+usb_pyramid_unmap(struct USBPyramidLevel *map);
+
+#endif
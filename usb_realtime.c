@@ -0,0 +1,146 @@
+#define _GNU_SOURCE
+#include "usb_realtime.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <usb_ringbuffer.h>
+
+/* Sleep when there is nothing to read */
+#define WAIT_NS 1000000
+
+/* Stack touched before locking */
+#define PREFAULT_STACK (256 * 1024)
+
+static uint64_t
+now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int
+usb_realtime_parse(struct USBRealtime *rt, const char *arg)
+{
+  memset(rt, 0, sizeof(*rt));
+  rt->priority = USB_REALTIME_DEFAULT_PRIORITY;
+  if (!arg) return 0;
+  if (sscanf(arg, "%d,%d", &rt->cpu, &rt->priority) < 1
+      || rt->cpu < 0 || rt->priority < 1 || rt->priority > 99) {
+    fprintf(stderr, "Invalid real-time setting %s\n", arg);
+    return -1;
+  }
+  return 0;
+}
+
+int
+usb_realtime_buffer(FILE *file, size_t size)
+{
+  char *buf = malloc(size);
+  if (!buf) return -1;
+  /* Touch it now, locking alone does not prevent copy-on-write faults
+     of the zero page */
+  memset(buf, 0, size);
+  return setvbuf(file, buf, _IOFBF, size);
+}
+
+static void
+prefault_stack(void)
+{
+  volatile uint8_t stack[PREFAULT_STACK];
+  size_t i;
+  for (i = 0; i < sizeof(stack); i += 4096) stack[i] = 0;
+}
+
+int
+usb_realtime_start(struct USBRealtime *rt)
+{
+  cpu_set_t cpus;
+  struct sched_param param;
+  CPU_ZERO(&cpus);
+  CPU_SET(rt->cpu, &cpus);
+  if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+    fprintf(stderr, "Failed to pin to CPU %d: %s\n", rt->cpu,
+	    strerror(errno));
+    return -1;
+  }
+  /* Freed memory stays mapped and locked */
+  mallopt(M_TRIM_THRESHOLD, -1);
+  mallopt(M_MMAP_MAX, 0);
+  prefault_stack();
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+    fprintf(stderr, "Failed to lock memory: %s\n", strerror(errno));
+    return -1;
+  }
+  memset(&param, 0, sizeof(param));
+  param.sched_priority = rt->priority;
+  if (sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+    fprintf(stderr, "Failed to set SCHED_FIFO priority %d: %s\n",
+	    rt->priority, strerror(errno));
+    return -1;
+  }
+  getrusage(RUSAGE_SELF, &rt->start_usage);
+  return 0;
+}
+
+void
+usb_realtime_read(struct USBRealtime *rt)
+{
+  uint64_t now = now_ns();
+  if (rt->last_read != 0 && now - rt->last_read > rt->max_read_gap) {
+    rt->max_read_gap = now - rt->last_read;
+  }
+  rt->last_read = now;
+}
+
+void
+usb_realtime_wait(struct USBRealtime *rt)
+{
+  struct timespec deadline;
+  uint64_t target = now_ns() + WAIT_NS;
+  uint64_t latency;
+  unsigned int bucket;
+  deadline.tv_sec = target / 1000000000;
+  deadline.tv_nsec = target % 1000000000;
+  while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL)
+	== EINTR);
+  latency = now_ns() - target;
+  if (latency > rt->max_latency) rt->max_latency = latency;
+  bucket = 63 - __builtin_clzll((latency / 1000) | 1);
+  if (bucket >= USB_REALTIME_BUCKETS) bucket = USB_REALTIME_BUCKETS - 1;
+  rt->latency_hist[bucket]++;
+  rt->wakeups++;
+}
+
+void
+usb_realtime_report(struct USBRealtime *rt, FILE *out)
+{
+  struct rusage usage;
+  unsigned int b;
+  /* Shortest time to fill the ring: every block 32 bits */
+  unsigned long long fill_ms =
+    ((unsigned long long)USB_REALTIME_RING_BYTES / sizeof(struct USBSamples)
+     * 32 * NS_PER_BIT / 1000000);
+  getrusage(RUSAGE_SELF, &usage);
+  fprintf(out, "Real-time: CPU %d, SCHED_FIFO priority %d\n",
+	  rt->cpu, rt->priority);
+  fprintf(out, "Wake-up latency: %llu wake-ups, max %llu us\n",
+	  rt->wakeups, (unsigned long long)rt->max_latency / 1000);
+  for (b = 0; b < USB_REALTIME_BUCKETS; b++) {
+    if (rt->latency_hist[b] == 0) continue;
+    fprintf(out, "  < %llu us: %llu\n", 2ULL << b, rt->latency_hist[b]);
+  }
+  fprintf(out, "Longest time between reads: %llu us "
+	  "(the ring lasts at least %llu ms)\n",
+	  (unsigned long long)rt->max_read_gap / 1000, fill_ms);
+  fprintf(out, "Page faults: %ld minor, %ld major\n",
+	  usage.ru_minflt - rt->start_usage.ru_minflt,
+	  usage.ru_majflt - rt->start_usage.ru_majflt);
+  fprintf(out, "Context switches: %ld voluntary, %ld involuntary\n",
+	  usage.ru_nvcsw - rt->start_usage.ru_nvcsw,
+	  usage.ru_nivcsw - rt->start_usage.ru_nivcsw);
+}
@@ -0,0 +1,55 @@
+#ifndef USB_REALTIME_H
+#define USB_REALTIME_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/resource.h>
+
+/* Real-time drain loop: pinned to one CPU, SCHED_FIFO, all memory
+   locked and prefaulted. Idle waits are done with absolute sleeps so
+   that the wake-up latency can be measured. */
+
+/* Size of the PRU carveout, for the report */
+#define USB_REALTIME_RING_BYTES (1024 * 1024)
+
+#define USB_REALTIME_BUCKETS 24
+
+#define USB_REALTIME_DEFAULT_PRIORITY 50
+
+struct USBRealtime
+{
+  int cpu;
+  int priority;
+  uint64_t last_read; /* ns, 0 before the first read */
+  uint64_t max_read_gap;
+  uint64_t max_latency;
+  unsigned long long wakeups;
+  /* Bucket n counts wake-up latencies below 2^(n+1) us */
+  unsigned long long latency_hist[USB_REALTIME_BUCKETS];
+  struct rusage start_usage;
+};
+
+/* Parse "CPU[,PRIORITY]", NULL for CPU 0 and the default priority */
+int
+usb_realtime_parse(struct USBRealtime *rt, const char *arg);
+
+/* Give the file a buffer of its own so it is locked with the rest */
+int
+usb_realtime_buffer(FILE *file, size_t size);
+
+/* Apply the settings, call after everything is allocated */
+int
+usb_realtime_start(struct USBRealtime *rt);
+
+/* Call before each read from the source */
+void
+usb_realtime_read(struct USBRealtime *rt);
+
+/* Replaces usb_source_wait() */
+void
+usb_realtime_wait(struct USBRealtime *rt);
+
+void
+usb_realtime_report(struct USBRealtime *rt, FILE *out);
+
+#endif
@@ -4,6 +4,7 @@
 #include <errno.h>
 #include <sys/mman.h>
 #include <string.h>
+#include <usb_profile.h>
 
 #define MEM "/dev/mem"
 #define PRU_BASE 0x4a300000
@@ -70,6 +71,68 @@ usb_ringbuffer_read(struct USBRingBuffer *buf, uint8_t *data, size_t len)
   }
 }
 
+size_t
+usb_ringbuffer_read_batch(struct USBRingBuffer *buf,
+			  struct USBSamples *samples, size_t max)
+{
+  uint8_t *start = ((uint8_t*)buf) + sizeof(struct USBRingBuffer);
+  uint32_t buf_start = buf->start;
+  uint32_t read = buf->read;
+  uint32_t write = buf->write;
+  size_t n = 0;
+  while(read != write && n < max) {
+    uint8_t *r = start + (read - buf_start);
+    uint8_t l = *r++;
+    if (l == 0) {
+      r = start;
+      l = *r++;
+    }
+    if (l == sizeof(struct USBSamples)) {
+      memcpy(&samples[n++], r, l);
+    }
+    r += l;
+    read = buf_start + (r - start);
+  }
+  buf->read = read;
+  return n;
+}
+
+unsigned int
+usb_ringbuffer_backlog(const struct USBRingBuffer *buf)
+{
+  uint32_t size = buf->end - buf->start;
+  uint32_t read = buf->read;
+  uint32_t write = buf->write;
+  uint32_t used = write >= read ? write - read : size - (read - write);
+  return size > 0 ? (uint64_t)used * 100 / size : 0;
+}
+
+void
+usb_sequence_init(struct USBSequence *seq)
+{
+  seq->next = -1;
+  seq->avg_count = 32 << 8;
+}
+
+unsigned int
+usb_sequence_check(struct USBSequence *seq, const struct USBSamples *samples,
+		   timestamp_t *lost_ns)
+{
+  unsigned int lost = 0;
+  int32_t diff;
+  if (seq->next != -1 && samples->sequence != seq->next) {
+    lost = (samples->sequence - seq->next) & 0xffff;
+    USB_PROBE2(sequence_gap, lost, samples->sequence);
+  }
+  seq->next = (samples->sequence + 1) & 0xffff;
+  /* Blocks are at least 32 bits but idle periods give much longer ones,
+     so use a running average of the recent block lengths. */
+  *lost_ns = ((timestamp_t)lost * seq->avg_count * NS_PER_BIT) >> 8;
+  diff = ((int32_t)samples->count << 8) - (int32_t)seq->avg_count;
+  seq->avg_count += diff / 16;
+  return lost;
+}
+
 struct USBRingBuffer *
 usb_ringbuffer_init()
 {
@@ -17,6 +17,12 @@ struct USBSamples
   uint32_t dm_bits;
 };
 
+struct USBSequence
+{
+  int32_t next; /* Expected sequence number, -1 if unknown */
+  uint32_t avg_count; /* Average bits per block, 8 fractional bits */
+};
+
 struct USBRingBuffer *
 usb_ringbuffer_init();
 
@@ -27,4 +33,24 @@ usb_ringbuffer_clear(struct USBRingBuffer *buf);
 size_t
 usb_ringbuffer_read(struct USBRingBuffer *buf, uint8_t *data, size_t len);
 
+/* Read up to max sample blocks. The read pointer is only updated once
+   for the whole batch. Returns the number of blocks read. */
+size_t
+usb_ringbuffer_read_batch(struct USBRingBuffer *buf,
+			  struct USBSamples *samples, size_t max);
+
+/* Part of the buffer waiting to be read, in percent */
+unsigned int
+usb_ringbuffer_backlog(const struct USBRingBuffer *buf);
+
+void
+usb_sequence_init(struct USBSequence *seq);
+
+/* Check the sequence number of a block. Returns the number of blocks
+   lost before this one and stores an estimate of the bus time they
+   covered in *lost_ns. */
+unsigned int
+usb_sequence_check(struct USBSequence *seq, const struct USBSamples *samples,
+		   timestamp_t *lost_ns);
+
 #endif
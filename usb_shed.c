@@ -0,0 +1,86 @@
+#include "usb_shed.h"
+#include <stdio.h>
+#include <string.h>
+
+static const char *tier_names[USB_SHED_TIERS] = {
+  "vcd", "text", "decoded", "dump"
+};
+
+static const unsigned int default_thresholds[USB_SHED_TIERS] = {
+  50, 70, 85, 95
+};
+
+void
+usb_shed_init(USBShed *shed)
+{
+  unsigned int t;
+  memset(shed, 0, sizeof(*shed));
+  for (t = 0; t < USB_SHED_TIERS; t++) {
+    shed->tiers[t].threshold = default_thresholds[t];
+    shed->tiers[t].current.tier = t;
+  }
+  shed->backlog = -1;
+}
+
+int
+usb_shed_parse(USBShed *shed, const char *arg)
+{
+  unsigned int v[USB_SHED_TIERS];
+  unsigned int t;
+  int n;
+  if (sscanf(arg, "%u,%u,%u,%u%n", &v[0], &v[1], &v[2], &v[3], &n) != 4
+      || arg[n] != '\0') {
+    fprintf(stderr, "Invalid shedding thresholds: %s\n", arg);
+    return -1;
+  }
+  for (t = 0; t < USB_SHED_TIERS; t++) {
+    if (v[t] <= USB_SHED_HYSTERESIS || v[t] > 100
+	|| (t > 0 && v[t] < v[t - 1])) {
+      fprintf(stderr, "Shedding thresholds must go up, from %d to 100: %s\n",
+	      USB_SHED_HYSTERESIS + 1, arg);
+      return -1;
+    }
+    shed->tiers[t].threshold = v[t];
+  }
+  return 0;
+}
+
+const char *
+usb_shed_tier_name(unsigned int tier)
+{
+  return tier < USB_SHED_TIERS ? tier_names[tier] : "?";
+}
+
+unsigned int
+usb_shed_update(USBShed *shed, int backlog, timestamp_t time)
+{
+  unsigned int resumed = 0;
+  unsigned int t;
+  shed->backlog = backlog;
+  if (backlog < 0) backlog = 0;
+  for (t = 0; t < USB_SHED_TIERS; t++) {
+    struct USBShedTierState *tier = &shed->tiers[t];
+    if (!tier->active && backlog >= tier->threshold) {
+      tier->active = 1;
+      tier->current.start = time;
+      tier->current.end = time;
+      tier->current.items = 0;
+    } else if (tier->active
+	       && backlog + USB_SHED_HYSTERESIS < tier->threshold) {
+      tier->active = 0;
+      tier->current.end = time;
+      tier->items += tier->current.items;
+      tier->ranges++;
+      shed->history[shed->n_history++ % USB_SHED_HISTORY] = tier->current;
+      resumed |= 1 << t;
+    }
+  }
+  return resumed;
+}
+
+unsigned long long
+usb_shed_total(const USBShed *shed, enum USBShedTier tier)
+{
+  const struct USBShedTierState *state = &shed->tiers[tier];
+  return state->items + (state->active ? state->current.items : 0);
+}
@@ -0,0 +1,90 @@
+#ifndef USB_SHED_H
+#define USB_SHED_H
+
+#include <timestamp.h>
+
+/* What to give up when the capture falls behind. Work is shed in
+   tiers, cheapest to lose first: VCD, then formatting text, then
+   decoding for the other outputs, and writing the raw dump last.
+   Reading the source is never shed, so the ring buffer keeps being
+   drained and the PRU does not drop samples.
+
+   A tier is shed when the backlog of the source reaches its threshold
+   and taken up again when it is USB_SHED_HYSTERESIS percent below.
+   The thresholds go up with the tiers, so the tiers are shed in order.
+   Everything shed is counted, together with the bus time ranges it
+   was shed for. */
+
+enum USBShedTier {
+  USB_SHED_VCD, /* Counted in blocks */
+  USB_SHED_TEXT, /* Counted in packets */
+  USB_SHED_DECODED, /* Blocks not decoded */
+  USB_SHED_DUMP, /* Blocks */
+  USB_SHED_TIERS
+};
+
+#define USB_SHED_HYSTERESIS 10
+/* Ended ranges kept for reports, the oldest are overwritten */
+#define USB_SHED_HISTORY 64
+
+struct USBShedRange
+{
+  unsigned int tier;
+  timestamp_t start;
+  timestamp_t end;
+  unsigned long long items;
+};
+
+struct USBShedTierState
+{
+  unsigned int threshold; /* Backlog in percent */
+  int active;
+  struct USBShedRange current; /* While active, else the last one */
+  unsigned long long items; /* Total, without the current range */
+  unsigned long ranges;
+};
+
+struct USBShed
+{
+  struct USBShedTierState tiers[USB_SHED_TIERS];
+  int backlog; /* Last one seen */
+  struct USBShedRange history[USB_SHED_HISTORY];
+  unsigned long n_history; /* Ranges ended, only the last are kept */
+};
+
+typedef struct USBShed USBShed;
+
+/* Thresholds 50,70,85,95 */
+void
+usb_shed_init(USBShed *shed);
+
+/* Parse "VCD,TEXT,DECODED,DUMP" thresholds in percent */
+int
+usb_shed_parse(USBShed *shed, const char *arg);
+
+const char *
+usb_shed_tier_name(unsigned int tier);
+
+/* Call before handling blocks starting at bus time, with the backlog
+   of the source in percent. Returns a mask of the tiers that were
+   taken up again, their range is in current. */
+unsigned int
+usb_shed_update(USBShed *shed, int backlog, timestamp_t time);
+
+static inline int
+usb_shed_active(const USBShed *shed, enum USBShedTier tier)
+{
+  return shed->tiers[tier].active;
+}
+
+static inline void
+usb_shed_count(USBShed *shed, enum USBShedTier tier, unsigned int n)
+{
+  shed->tiers[tier].current.items += n;
+}
+
+/* Items shed so far, including the current range */
+unsigned long long
+usb_shed_total(const USBShed *shed, enum USBShedTier tier);
+
+#endif
@@ -0,0 +1,430 @@
+#define _GNU_SOURCE
+#include "usb_shmring.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define USB_SHMRING_MAGIC 0x52425355 /* "USBR" */
+#define USB_SHMRING_VERSION 1
+
+#define CACHE_LINE 64
+
+struct USBShmRingSlot
+{
+  uint32_t active;
+  uint32_t pid;
+  uint64_t cursor; /* Written by the consumer */
+  uint64_t lost; /* Written by the consumer */
+  uint8_t pad[CACHE_LINE - 24];
+};
+
+struct USBShmRingHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint64_t capacity; /* Number of records, power of two */
+  uint8_t pad0[CACHE_LINE - 16];
+  uint64_t write; /* Total number of records published */
+  uint8_t pad1[CACHE_LINE - 8];
+  struct USBShmRingSlot slots[USB_SHMRING_MAX_CONSUMERS];
+};
+
+struct USBShmRing
+{
+  int fd;
+  size_t map_len;
+  struct USBShmRingHeader *hdr;
+  struct USBSamples *records;
+  int slot_fd[USB_SHMRING_MAX_CONSUMERS];
+};
+
+struct USBShmRingConsumer
+{
+  int sock;
+  size_t map_len;
+  struct USBShmRingHeader *hdr;
+  struct USBSamples *records;
+  struct USBShmRingSlot *slot;
+};
+
+struct USBShmRing *
+usb_shmring_create(size_t records)
+{
+  struct USBShmRing *ring;
+  size_t capacity = USB_SHMRING_BATCH_MAX * 2;
+  int i;
+  while(capacity < records) capacity <<= 1;
+  ring = malloc(sizeof(struct USBShmRing));
+  if (!ring) return NULL;
+  ring->map_len = (sizeof(struct USBShmRingHeader)
+		   + capacity * sizeof(struct USBSamples));
+  ring->fd = memfd_create("usbbroker", MFD_CLOEXEC);
+  if (ring->fd < 0) {
+    fprintf(stderr, "Failed to create shared memory: %s\n", strerror(errno));
+    free(ring);
+    return NULL;
+  }
+  if (ftruncate(ring->fd, ring->map_len) < 0) {
+    fprintf(stderr, "Failed to resize shared memory: %s\n", strerror(errno));
+    close(ring->fd);
+    free(ring);
+    return NULL;
+  }
+  ring->hdr = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   ring->fd, 0);
+  if (ring->hdr == MAP_FAILED) {
+    fprintf(stderr, "Failed to map shared memory: %s\n", strerror(errno));
+    close(ring->fd);
+    free(ring);
+    return NULL;
+  }
+  /* Fault in the whole ring now rather than in the drain loop */
+  memset(ring->hdr, 0, ring->map_len);
+  ring->hdr->magic = USB_SHMRING_MAGIC;
+  ring->hdr->version = USB_SHMRING_VERSION;
+  ring->hdr->capacity = capacity;
+  ring->records = (struct USBSamples*)(ring->hdr + 1);
+  for (i = 0; i < USB_SHMRING_MAX_CONSUMERS; i++) {
+    ring->slot_fd[i] = -1;
+  }
+  return ring;
+}
+
+void
+usb_shmring_destroy(struct USBShmRing *ring)
+{
+  int i;
+  for (i = 0; i < USB_SHMRING_MAX_CONSUMERS; i++) {
+    if (ring->slot_fd[i] >= 0) close(ring->slot_fd[i]);
+  }
+  munmap(ring->hdr, ring->map_len);
+  close(ring->fd);
+  free(ring);
+}
+
+size_t
+usb_shmring_capacity(struct USBShmRing *ring)
+{
+  return ring->hdr->capacity;
+}
+
+void
+usb_shmring_publish(struct USBShmRing *ring,
+		    const struct USBSamples *samples, size_t n)
+{
+  struct USBShmRingHeader *hdr = ring->hdr;
+  uint64_t mask = hdr->capacity - 1;
+  uint64_t w = hdr->write;
+  while(n > 0) {
+    size_t batch = n < USB_SHMRING_BATCH_MAX ? n : USB_SHMRING_BATCH_MAX;
+    size_t i;
+    for (i = 0; i < batch; i++) {
+      ring->records[(w + i) & mask] = samples[i];
+    }
+    w += batch;
+    __atomic_store_n(&hdr->write, w, __ATOMIC_RELEASE);
+    samples += batch;
+    n -= batch;
+  }
+}
+
+int
+usb_shmring_listen(const char *path)
+{
+  struct sockaddr_un addr;
+  int fd;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    return -1;
+  }
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0
+      || listen(fd, USB_SHMRING_MAX_CONSUMERS) < 0) {
+    fprintf(stderr, "Failed to listen on %s: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int
+usb_shmring_accept(struct USBShmRing *ring, int listen_fd, int *slot_ret)
+{
+  struct USBShmRingHeader *hdr = ring->hdr;
+  struct msghdr msg;
+  struct iovec iov;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct cmsghdr *cmsg;
+  struct ucred cred;
+  socklen_t cred_len = sizeof(cred);
+  int32_t slot = -1;
+  int i;
+  int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  if (fd < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      fprintf(stderr, "Failed to accept consumer: %s\n", strerror(errno));
+    }
+    return -1;
+  }
+  for (i = 0; i < USB_SHMRING_MAX_CONSUMERS; i++) {
+    if (ring->slot_fd[i] < 0) {
+      slot = i;
+      break;
+    }
+  }
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = &slot;
+  iov.iov_len = sizeof(slot);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (slot < 0) {
+    fprintf(stderr, "Too many consumers\n");
+    sendmsg(fd, &msg, MSG_NOSIGNAL);
+    close(fd);
+    return -1;
+  }
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0) {
+    cred.pid = 0;
+  }
+  hdr->slots[slot].pid = cred.pid;
+  hdr->slots[slot].lost = 0;
+  hdr->slots[slot].cursor = hdr->write;
+  __atomic_store_n(&hdr->slots[slot].active, 1, __ATOMIC_RELEASE);
+
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &ring->fd, sizeof(int));
+  if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) {
+    fprintf(stderr, "Failed to send ring to consumer: %s\n", strerror(errno));
+    hdr->slots[slot].active = 0;
+    close(fd);
+    return -1;
+  }
+  ring->slot_fd[slot] = fd;
+  *slot_ret = slot;
+  return fd;
+}
+
+void
+usb_shmring_disconnect(struct USBShmRing *ring, int fd)
+{
+  int i;
+  for (i = 0; i < USB_SHMRING_MAX_CONSUMERS; i++) {
+    if (ring->slot_fd[i] == fd) {
+      __atomic_store_n(&ring->hdr->slots[i].active, 0, __ATOMIC_RELEASE);
+      ring->slot_fd[i] = -1;
+    }
+  }
+  close(fd);
+}
+
+int
+usb_shmring_status(struct USBShmRing *ring, int slot,
+		   struct USBShmRingStatus *status)
+{
+  struct USBShmRingSlot *s;
+  if (slot < 0 || slot >= USB_SHMRING_MAX_CONSUMERS) return -1;
+  s = &ring->hdr->slots[slot];
+  status->active = ring->slot_fd[slot] >= 0;
+  status->pid = s->pid;
+  status->lag = ring->hdr->write - __atomic_load_n(&s->cursor,
+						   __ATOMIC_ACQUIRE);
+  status->lost = __atomic_load_n(&s->lost, __ATOMIC_RELAXED);
+  return 0;
+}
+
+struct USBShmRingConsumer *
+usb_shmring_attach(const char *path)
+{
+  struct USBShmRingConsumer *consumer;
+  struct sockaddr_un addr;
+  struct msghdr msg;
+  struct iovec iov;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct cmsghdr *cmsg;
+  struct stat st;
+  int32_t slot = -1;
+  int mem_fd = -1;
+  int sock;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    return NULL;
+  }
+  sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0) {
+    fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
+    return NULL;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    fprintf(stderr, "Failed to connect to broker at %s: %s\n",
+	    path, strerror(errno));
+    close(sock);
+    return NULL;
+  }
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = &slot;
+  iov.iov_len = sizeof(slot);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(slot)) {
+    fprintf(stderr, "No reply from broker\n");
+    close(sock);
+    return NULL;
+  }
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET
+      && cmsg->cmsg_type == SCM_RIGHTS) {
+    memcpy(&mem_fd, CMSG_DATA(cmsg), sizeof(int));
+  }
+  if (slot < 0 || slot >= USB_SHMRING_MAX_CONSUMERS || mem_fd < 0) {
+    fprintf(stderr, "Broker refused connection\n");
+    if (mem_fd >= 0) close(mem_fd);
+    close(sock);
+    return NULL;
+  }
+  consumer = malloc(sizeof(struct USBShmRingConsumer));
+  if (!consumer) {
+    close(mem_fd);
+    close(sock);
+    return NULL;
+  }
+  consumer->sock = sock;
+  if (fstat(mem_fd, &st) < 0) {
+    fprintf(stderr, "Failed to get size of ring: %s\n", strerror(errno));
+    goto fail;
+  }
+  consumer->map_len = st.st_size;
+  consumer->hdr = mmap(NULL, consumer->map_len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED, mem_fd, 0);
+  if (consumer->hdr == MAP_FAILED) {
+    fprintf(stderr, "Failed to map ring: %s\n", strerror(errno));
+    goto fail;
+  }
+  close(mem_fd);
+  if (consumer->hdr->magic != USB_SHMRING_MAGIC
+      || consumer->hdr->version != USB_SHMRING_VERSION
+      || (sizeof(struct USBShmRingHeader)
+	  + consumer->hdr->capacity * sizeof(struct USBSamples)
+	  > consumer->map_len)) {
+    fprintf(stderr, "Incompatible broker\n");
+    munmap(consumer->hdr, consumer->map_len);
+    close(sock);
+    free(consumer);
+    return NULL;
+  }
+  consumer->records = (struct USBSamples*)(consumer->hdr + 1);
+  consumer->slot = &consumer->hdr->slots[slot];
+  return consumer;
+ fail:
+  close(mem_fd);
+  close(sock);
+  free(consumer);
+  return NULL;
+}
+
+void
+usb_shmring_detach(struct USBShmRingConsumer *consumer)
+{
+  munmap(consumer->hdr, consumer->map_len);
+  close(consumer->sock);
+  free(consumer);
+}
+
+size_t
+usb_shmring_read(struct USBShmRingConsumer *consumer,
+		 struct USBSamples *samples, size_t max, uint64_t *lost)
+{
+  struct USBShmRingHeader *hdr = consumer->hdr;
+  uint64_t capacity = hdr->capacity;
+  uint64_t mask = capacity - 1;
+  /* Records that the writer may already be overwriting are at least this
+     far behind the published write index. */
+  uint64_t window = capacity - USB_SHMRING_BATCH_MAX;
+  uint64_t cursor = consumer->slot->cursor;
+  uint64_t skipped = 0;
+  uint64_t w;
+  uint64_t n;
+  uint64_t i;
+  while(1) {
+    w = __atomic_load_n(&hdr->write, __ATOMIC_ACQUIRE);
+    if (w - cursor > window) {
+      skipped += w - cursor - window;
+      cursor = w - window;
+    }
+    n = w - cursor;
+    if (n > max) n = max;
+    if (n == 0) break;
+    for (i = 0; i < n; i++) {
+      samples[i] = consumer->records[(cursor + i) & mask];
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    w = __atomic_load_n(&hdr->write, __ATOMIC_ACQUIRE);
+    if (w - cursor > window) {
+      /* The writer lapped us while copying */
+      uint64_t bad = w - cursor - window;
+      if (bad >= n) {
+	skipped += n;
+	cursor += n;
+	continue;
+      }
+      memmove(samples, samples + bad, (n - bad) * sizeof(struct USBSamples));
+      skipped += bad;
+      cursor += bad;
+      n -= bad;
+    }
+    break;
+  }
+  if (skipped > 0) {
+    __atomic_store_n(&consumer->slot->lost, consumer->slot->lost + skipped,
+		     __ATOMIC_RELAXED);
+    if (lost) *lost += skipped;
+  }
+  __atomic_store_n(&consumer->slot->cursor, cursor + n, __ATOMIC_RELEASE);
+  return n;
+}
+
+unsigned int
+usb_shmring_backlog(const struct USBShmRingConsumer *consumer)
+{
+  uint64_t window = consumer->hdr->capacity - USB_SHMRING_BATCH_MAX;
+  uint64_t w = __atomic_load_n(&consumer->hdr->write, __ATOMIC_ACQUIRE);
+  uint64_t n = w - consumer->slot->cursor;
+  return n >= window ? 100 : n * 100 / window;
+}
+
+void
+usb_shmring_skip(struct USBShmRingConsumer *consumer)
+{
+  __atomic_store_n(&consumer->slot->cursor,
+		   __atomic_load_n(&consumer->hdr->write, __ATOMIC_ACQUIRE),
+		   __ATOMIC_RELEASE);
+}
@@ -0,0 +1,85 @@
+#ifndef USB_SHMRING_H
+#define USB_SHMRING_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <usb_ringbuffer.h>
+
+/* Shared memory ring used by usbbroker to republish the blocks read from
+   the PRU ring buffer. There is a single writer that never waits for the
+   readers. Each consumer has its own read cursor and detects on its own
+   when the writer has lapped it. */
+
+#define USB_SHMRING_DEFAULT_SOCKET "/tmp/usbbroker.sock"
+#define USB_SHMRING_MAX_CONSUMERS 16
+
+/* Maximum number of records the writer publishes at once */
+#define USB_SHMRING_BATCH_MAX 256
+
+struct USBShmRing;
+struct USBShmRingConsumer;
+
+struct USBShmRingStatus
+{
+  int active;
+  uint32_t pid;
+  uint64_t lag; /* Records published but not yet read */
+  uint64_t lost; /* Records lost due to overrun */
+};
+
+/* Writer side */
+
+struct USBShmRing *
+usb_shmring_create(size_t records);
+
+void
+usb_shmring_destroy(struct USBShmRing *ring);
+
+size_t
+usb_shmring_capacity(struct USBShmRing *ring);
+
+void
+usb_shmring_publish(struct USBShmRing *ring,
+		    const struct USBSamples *samples, size_t n);
+
+int
+usb_shmring_listen(const char *path);
+
+/* Accept a new consumer on the listening socket and hand it the ring.
+   Returns the connected socket, which must be passed to
+   usb_shmring_disconnect when it is closed, or -1 on failure. The
+   consumer slot is stored in *slot. */
+int
+usb_shmring_accept(struct USBShmRing *ring, int listen_fd, int *slot);
+
+void
+usb_shmring_disconnect(struct USBShmRing *ring, int fd);
+
+int
+usb_shmring_status(struct USBShmRing *ring, int slot,
+		   struct USBShmRingStatus *status);
+
+/* Consumer side */
+
+struct USBShmRingConsumer *
+usb_shmring_attach(const char *path);
+
+void
+usb_shmring_detach(struct USBShmRingConsumer *consumer);
+
+/* Read up to max records. Records overwritten before they could be read
+   are added to *lost. Returns the number of records read. */
+size_t
+usb_shmring_read(struct USBShmRingConsumer *consumer,
+		 struct USBSamples *samples, size_t max, uint64_t *lost);
+
+/* Records published but not read yet, in percent of what can be kept
+   before they are overwritten */
+unsigned int
+usb_shmring_backlog(const struct USBShmRingConsumer *consumer);
+
+/* Skip everything published so far */
+void
+usb_shmring_skip(struct USBShmRingConsumer *consumer);
+
+#endif
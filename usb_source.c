@@ -0,0 +1,339 @@
+#include "usb_source.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <usb_shmring.h>
+
+/* Longest time to wait for an inotify event before looking at a
+   followed file anyway */
+#define FOLLOW_POLL_MS 200
+
+static void
+sleep_wait(USBSource *source)
+{
+  usleep(10000);
+}
+
+struct PRUSource
+{
+  USBSource source;
+  struct USBRingBuffer *buffer;
+};
+
+static int
+pru_read(USBSource *source, struct USBSamples *samples, size_t max)
+{
+  struct PRUSource *pru = (struct PRUSource*)source;
+  return usb_ringbuffer_read_batch(pru->buffer, samples, max);
+}
+
+static void
+pru_clear(USBSource *source)
+{
+  struct PRUSource *pru = (struct PRUSource*)source;
+  usb_ringbuffer_clear(pru->buffer);
+}
+
+static unsigned int
+pru_backlog(USBSource *source)
+{
+  struct PRUSource *pru = (struct PRUSource*)source;
+  return usb_ringbuffer_backlog(pru->buffer);
+}
+
+static void
+pru_close(USBSource *source)
+{
+  free(source);
+}
+
+USBSource *
+usb_source_open_pru(void)
+{
+  struct PRUSource *pru;
+  struct USBRingBuffer *buffer = usb_ringbuffer_init();
+  if (!buffer) return NULL;
+  pru = malloc(sizeof(struct PRUSource));
+  if (!pru) return NULL;
+  pru->source.read = pru_read;
+  pru->source.wait = sleep_wait;
+  pru->source.clear = pru_clear;
+  pru->source.close = pru_close;
+  pru->source.backlog = pru_backlog;
+  pru->buffer = buffer;
+  return &pru->source;
+}
+
+struct FileSource
+{
+  USBSource source;
+  FILE *file;
+};
+
+static int
+file_read(USBSource *source, struct USBSamples *samples, size_t max)
+{
+  struct FileSource *file = (struct FileSource*)source;
+  size_t n = fread(samples, sizeof(struct USBSamples), max, file->file);
+  if (n == 0) {
+    if (ferror(file->file)) {
+      fprintf(stderr, "Failed to read input file: %s\n", strerror(errno));
+    }
+    return -1;
+  }
+  return n;
+}
+
+static void
+file_clear(USBSource *source)
+{
+}
+
+static void
+file_close(USBSource *source)
+{
+  struct FileSource *file = (struct FileSource*)source;
+  if (file->file != stdin) fclose(file->file);
+  free(file);
+}
+
+USBSource *
+usb_source_open_file(const char *filename)
+{
+  struct FileSource *file;
+  FILE *f;
+  if (filename[0] == '-' && filename[1] == '\0') {
+    f = stdin;
+  } else {
+    f = fopen(filename,"rb");
+    if (!f) {
+      fprintf(stderr, "Failed to open file %s for reading: %s\n",
+	      filename, strerror(errno));
+      return NULL;
+    }
+  }
+  file = malloc(sizeof(struct FileSource));
+  if (!file) {
+    if (f != stdin) fclose(f);
+    return NULL;
+  }
+  file->source.read = file_read;
+  file->source.wait = sleep_wait;
+  file->source.clear = file_clear;
+  file->source.close = file_close;
+  file->source.backlog = NULL;
+  file->file = f;
+  return &file->source;
+}
+
+struct FollowSource
+{
+  USBSource source;
+  int fd;
+  int inotify_fd; /* -1 if inotify is not available */
+  off_t offset;
+  uint8_t partial[sizeof(struct USBSamples)]; /* Incomplete last record */
+  size_t partial_len;
+};
+
+static int
+follow_read(USBSource *source, struct USBSamples *samples, size_t max)
+{
+  struct FollowSource *follow = (struct FollowSource*)source;
+  uint8_t *data = (uint8_t*)samples;
+  size_t len = follow->partial_len;
+  size_t n;
+  ssize_t r;
+  struct stat st;
+  if (max == 0) return 0;
+  memcpy(data, follow->partial, follow->partial_len);
+  r = read(follow->fd, data + len, max * sizeof(struct USBSamples) - len);
+  if (r < 0) {
+    if (errno == EINTR) return 0;
+    fprintf(stderr, "Failed to read input file: %s\n", strerror(errno));
+    return -1;
+  }
+  if (r == 0) {
+    if (fstat(follow->fd, &st) == 0 && st.st_size < follow->offset) {
+      fprintf(stderr, "Input file truncated, reading from start\n");
+      lseek(follow->fd, 0, SEEK_SET);
+      follow->offset = 0;
+      follow->partial_len = 0;
+    }
+    return 0;
+  }
+  follow->offset += r;
+  len += r;
+  /* Keep a partially written record until the rest of it arrives */
+  n = len / sizeof(struct USBSamples);
+  follow->partial_len = len - n * sizeof(struct USBSamples);
+  memcpy(follow->partial, data + n * sizeof(struct USBSamples),
+	 follow->partial_len);
+  return n;
+}
+
+static void
+follow_wait(USBSource *source)
+{
+  struct FollowSource *follow = (struct FollowSource*)source;
+  if (follow->inotify_fd >= 0) {
+    struct pollfd pfd;
+    char events[4096];
+    pfd.fd = follow->inotify_fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, FOLLOW_POLL_MS) > 0) {
+      while(read(follow->inotify_fd, events, sizeof(events)) > 0);
+    }
+  } else {
+    usleep(FOLLOW_POLL_MS * 1000 / 4);
+  }
+}
+
+static void
+follow_clear(USBSource *source)
+{
+}
+
+static void
+follow_close(USBSource *source)
+{
+  struct FollowSource *follow = (struct FollowSource*)source;
+  if (follow->inotify_fd >= 0) close(follow->inotify_fd);
+  close(follow->fd);
+  free(follow);
+}
+
+USBSource *
+usb_source_open_file_follow(const char *filename)
+{
+  struct FollowSource *follow;
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open file %s for reading: %s\n",
+	    filename, strerror(errno));
+    return NULL;
+  }
+  follow = malloc(sizeof(struct FollowSource));
+  if (!follow) {
+    close(fd);
+    return NULL;
+  }
+  follow->source.read = follow_read;
+  follow->source.wait = follow_wait;
+  follow->source.clear = follow_clear;
+  follow->source.close = follow_close;
+  follow->source.backlog = NULL;
+  follow->fd = fd;
+  follow->offset = 0;
+  follow->partial_len = 0;
+  follow->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (follow->inotify_fd >= 0) {
+    if (inotify_add_watch(follow->inotify_fd, filename, IN_MODIFY) < 0) {
+      close(follow->inotify_fd);
+      follow->inotify_fd = -1;
+    }
+  }
+  if (follow->inotify_fd < 0) {
+    fprintf(stderr, "inotify not available, polling %s\n", filename);
+  }
+  return &follow->source;
+}
+
+struct BrokerSource
+{
+  USBSource source;
+  struct USBShmRingConsumer *consumer;
+  uint64_t lost;
+};
+
+static int
+broker_read(USBSource *source, struct USBSamples *samples, size_t max)
+{
+  struct BrokerSource *broker = (struct BrokerSource*)source;
+  uint64_t lost = 0;
+  size_t n = usb_shmring_read(broker->consumer, samples, max, &lost);
+  if (lost > 0) {
+    broker->lost += lost;
+    fprintf(stderr, "Consumer too slow, %llu blocks lost (%llu total)\n",
+	    (unsigned long long)lost, (unsigned long long)broker->lost);
+  }
+  return n;
+}
+
+static void
+broker_clear(USBSource *source)
+{
+  struct BrokerSource *broker = (struct BrokerSource*)source;
+  usb_shmring_skip(broker->consumer);
+}
+
+static unsigned int
+broker_backlog(USBSource *source)
+{
+  struct BrokerSource *broker = (struct BrokerSource*)source;
+  return usb_shmring_backlog(broker->consumer);
+}
+
+static void
+broker_close(USBSource *source)
+{
+  struct BrokerSource *broker = (struct BrokerSource*)source;
+  usb_shmring_detach(broker->consumer);
+  free(broker);
+}
+
+USBSource *
+usb_source_open_broker(const char *socket_path)
+{
+  struct BrokerSource *broker;
+  struct USBShmRingConsumer *consumer = usb_shmring_attach(socket_path);
+  if (!consumer) return NULL;
+  broker = malloc(sizeof(struct BrokerSource));
+  if (!broker) {
+    usb_shmring_detach(consumer);
+    return NULL;
+  }
+  broker->source.read = broker_read;
+  broker->source.wait = sleep_wait;
+  broker->source.clear = broker_clear;
+  broker->source.close = broker_close;
+  broker->source.backlog = broker_backlog;
+  broker->consumer = consumer;
+  broker->lost = 0;
+  return &broker->source;
+}
+
+int
+usb_source_read(USBSource *source, struct USBSamples *samples, size_t max)
+{
+  return source->read(source, samples, max);
+}
+
+void
+usb_source_wait(USBSource *source)
+{
+  source->wait(source);
+}
+
+void
+usb_source_clear(USBSource *source)
+{
+  source->clear(source);
+}
+
+void
+usb_source_close(USBSource *source)
+{
+  source->close(source);
+}
+
+int
+usb_source_backlog(USBSource *source)
+{
+  return source->backlog ? source->backlog(source) : -1;
+}
@@ -0,0 +1,56 @@
+#ifndef USB_SOURCE_H
+#define USB_SOURCE_H
+
+#include <usb_ringbuffer.h>
+
+/* Common interface for reading sample blocks, either directly from the
+   PRU ring buffer, from a dump file or from usbbroker. */
+
+typedef struct USBSource USBSource;
+
+struct USBSource
+{
+  /* Returns number of blocks read, 0 if no blocks are available right
+     now or -1 at end of input. */
+  int (*read)(USBSource *source, struct USBSamples *samples, size_t max);
+  /* Wait a while for more blocks */
+  void (*wait)(USBSource *source);
+  void (*clear)(USBSource *source);
+  void (*close)(USBSource *source);
+  /* Blocks waiting to be read in percent of what the source can hold,
+     NULL if the source does not know */
+  unsigned int (*backlog)(USBSource *source);
+};
+
+USBSource *
+usb_source_open_pru(void);
+
+USBSource *
+usb_source_open_file(const char *filename);
+
+/* Read a dump file that is still being written. Never reaches the end,
+   instead it waits for more data to be appended. */
+USBSource *
+usb_source_open_file_follow(const char *filename);
+
+USBSource *
+usb_source_open_broker(const char *socket_path);
+
+int
+usb_source_read(USBSource *source, struct USBSamples *samples, size_t max);
+
+void
+usb_source_wait(USBSource *source);
+
+/* Throw away any buffered blocks */
+void
+usb_source_clear(USBSource *source);
+
+void
+usb_source_close(USBSource *source);
+
+/* Returns -1 if unknown */
+int
+usb_source_backlog(USBSource *source);
+
+#endif
@@ -0,0 +1,290 @@
+#include "usb_timeline.h"
+#include <stdlib.h>
+#include <string.h>
+#include <usb_packet.h>
+#include <usb_ringbuffer.h>
+
+#define SYNC_BITS 8
+#define EOP_BITS 3
+/* Longer gaps are not turnaround but a timeout */
+#define MAX_TURNAROUND_BITS 64
+
+#define RECORD_FRAME 0x01
+#define RECORD_REPEAT 0x02
+
+struct FrameEndpoint
+{
+  uint8_t addr;
+  uint8_t endp; /* 0x80 set for IN */
+  uint32_t bytes;
+};
+
+/* Everything compared when looking for repeated frames */
+struct FrameContent
+{
+  uint8_t flags;
+  uint32_t busy_bits;
+  uint32_t turnaround_bits;
+  uint32_t pid_count[16];
+  unsigned int n_endpoints;
+  struct FrameEndpoint endpoints[TIMELINE_ENDPOINTS];
+  uint32_t other_bytes;
+};
+
+struct USBTimeline
+{
+  FILE *bin;
+  FILE *csv;
+  struct USBPacketTracker tracker;
+  timestamp_t last_end; /* End of last packet, 0 if unknown */
+  int active; /* Current frame has any packets */
+  timestamp_t start;
+  int frame;
+  struct FrameContent content;
+  /* Last written frame record */
+  int written;
+  timestamp_t written_start;
+  struct FrameContent written_content;
+  unsigned long repeat;
+  timestamp_t repeat_start;
+  int repeat_frame;
+};
+
+USBTimeline *
+usb_timeline_init(FILE *bin, FILE *csv)
+{
+  USBTimeline *timeline = malloc(sizeof(USBTimeline));
+  if (!timeline) return NULL;
+  memset(timeline, 0, sizeof(USBTimeline));
+  timeline->bin = bin;
+  timeline->csv = csv;
+  timeline->frame = -1;
+  timeline->content.flags = TIMELINE_FLAG_NO_SOF;
+  usb_packet_tracker_init(&timeline->tracker);
+  if (bin) {
+    uint32_t ns_per_bit = NS_PER_BIT;
+    fwrite("USBTL1\0\0", 8, 1, bin);
+    fwrite(&ns_per_bit, sizeof(ns_per_bit), 1, bin);
+  }
+  if (csv) {
+    fputs("time_ns,frame,frames,flags,busy_bits,turnaround_bits,"
+	  "OUT,IN,SOF,SETUP,DATA0,DATA1,ACK,NAK,STALL,other_pid,"
+	  "endpoint_bytes,other_bytes\n", csv);
+  }
+  return timeline;
+}
+
+static void
+put_varint(FILE *out, unsigned long long v)
+{
+  uint8_t buf[10];
+  unsigned int len = 0;
+  while(v >= 0x80) {
+    buf[len++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  buf[len++] = v;
+  fwrite(buf, len, 1, out);
+}
+
+static void
+put_u16(FILE *out, uint16_t v)
+{
+  uint8_t buf[2];
+  buf[0] = v;
+  buf[1] = v >> 8;
+  fwrite(buf, 2, 1, out);
+}
+
+/* One line for each record, frames is the number of identical frames it
+   covers */
+static void
+write_csv(USBTimeline *timeline, timestamp_t start, int frame,
+	  unsigned long frames, const struct FrameContent *c)
+{
+  static const uint8_t pids[9] = {
+    USB_PID_OUT, USB_PID_IN, USB_PID_SOF, USB_PID_SETUP,
+    USB_PID_DATA0, USB_PID_DATA1, USB_PID_ACK, USB_PID_NAK, USB_PID_STALL
+  };
+  FILE *csv = timeline->csv;
+  uint32_t other = 0;
+  unsigned int i;
+  fprintf(csv, "%lld,%d,%lu,%d,%u,%u", start, frame, frames, c->flags,
+	  c->busy_bits, c->turnaround_bits);
+  for (i = 0; i < 16; i++) other += c->pid_count[i];
+  for (i = 0; i < 9; i++) {
+    fprintf(csv, ",%u", c->pid_count[pids[i] & 0x0f]);
+    other -= c->pid_count[pids[i] & 0x0f];
+  }
+  fprintf(csv, ",%u,", other);
+  for (i = 0; i < c->n_endpoints; i++) {
+    fprintf(csv, "%s%d.%d.%s:%u", i > 0 ? " " : "",
+	    c->endpoints[i].addr, c->endpoints[i].endp & 0x0f,
+	    (c->endpoints[i].endp & 0x80) ? "in" : "out",
+	    c->endpoints[i].bytes);
+  }
+  fprintf(csv, ",%u\n", c->other_bytes);
+}
+
+static void
+write_repeat(USBTimeline *timeline)
+{
+  if (timeline->repeat == 0) return;
+  if (timeline->bin) {
+    fputc(RECORD_REPEAT, timeline->bin);
+    put_varint(timeline->bin, timeline->repeat);
+  }
+  if (timeline->csv) {
+    write_csv(timeline, timeline->repeat_start, timeline->repeat_frame,
+	      timeline->repeat, &timeline->written_content);
+  }
+  timeline->repeat = 0;
+}
+
+static void
+write_frame(USBTimeline *timeline)
+{
+  struct FrameContent *c = &timeline->content;
+  FILE *bin = timeline->bin;
+  uint16_t mask = 0;
+  unsigned int i;
+  if (timeline->written
+      && memcmp(c, &timeline->written_content, sizeof(*c)) == 0) {
+    if (timeline->repeat++ == 0) {
+      timeline->repeat_start = timeline->start;
+      timeline->repeat_frame = timeline->frame;
+    }
+    return;
+  }
+  write_repeat(timeline);
+  if (bin) {
+    fputc(RECORD_FRAME, bin);
+    put_varint(bin, timeline->start - timeline->written_start);
+    put_u16(bin, timeline->frame < 0 ? 0xffff : timeline->frame);
+    fputc(c->flags, bin);
+    put_varint(bin, c->busy_bits);
+    put_varint(bin, c->turnaround_bits);
+    for (i = 0; i < 16; i++) {
+      if (c->pid_count[i]) mask |= 1 << i;
+    }
+    put_u16(bin, mask);
+    for (i = 0; i < 16; i++) {
+      if (c->pid_count[i]) put_varint(bin, c->pid_count[i]);
+    }
+    fputc(c->n_endpoints, bin);
+    for (i = 0; i < c->n_endpoints; i++) {
+      fputc(c->endpoints[i].addr, bin);
+      fputc(c->endpoints[i].endp, bin);
+      put_varint(bin, c->endpoints[i].bytes);
+    }
+    put_varint(bin, c->other_bytes);
+  }
+  if (timeline->csv) {
+    write_csv(timeline, timeline->start, timeline->frame, 1, c);
+  }
+  timeline->written = 1;
+  timeline->written_start = timeline->start;
+  /* Copy padding too, it is compared with memcmp */
+  memcpy(&timeline->written_content, c, sizeof(*c));
+}
+
+static void
+add_bytes(struct FrameContent *c, uint8_t addr, uint8_t endp,
+	  unsigned int bytes)
+{
+  unsigned int i;
+  for (i = 0; i < c->n_endpoints; i++) {
+    if (c->endpoints[i].addr == addr && c->endpoints[i].endp == endp) {
+      c->endpoints[i].bytes += bytes;
+      return;
+    }
+  }
+  if (c->n_endpoints < TIMELINE_ENDPOINTS) {
+    c->endpoints[i].addr = addr;
+    c->endpoints[i].endp = endp;
+    c->endpoints[i].bytes = bytes;
+    c->n_endpoints++;
+  } else {
+    c->other_bytes += bytes;
+  }
+}
+
+static void
+new_frame(USBTimeline *timeline, timestamp_t start, int frame,
+	  uint8_t flags)
+{
+  if (timeline->active) write_frame(timeline);
+  memset(&timeline->content, 0, sizeof(timeline->content));
+  timeline->content.flags = flags;
+  timeline->start = start;
+  timeline->frame = frame;
+  timeline->active = 0;
+}
+
+static void
+add_packet(USBTimeline *timeline, uint32_t *bits, uint32_t n_bits,
+	   const struct USBPacketInfo *info)
+{
+  struct FrameContent *c = &timeline->content;
+  timestamp_t start = info->ts - SYNC_BITS * NS_PER_BIT;
+  uint32_t bus_bits = (SYNC_BITS + usb_packet_bus_bits(bits, n_bits)
+		       + EOP_BITS);
+  if (info->pid == USB_PID_SOF && !(info->flags & (USB_PACKET_CRC_ERROR
+						 | USB_PACKET_INVALID))) {
+    new_frame(timeline, start, info->frame, 0);
+  } else if (!timeline->active && timeline->frame < 0) {
+    timeline->start = start;
+  }
+  timeline->active = 1;
+  c->busy_bits += bus_bits;
+  c->pid_count[info->pid & 0x0f]++;
+  if ((info->flags & (USB_PACKET_DATA | USB_PACKET_HANDSHAKE))
+      && info->has_token && timeline->last_end != 0
+      && start > timeline->last_end) {
+    timestamp_t gap = (start - timeline->last_end) / NS_PER_BIT;
+    if (gap < MAX_TURNAROUND_BITS) c->turnaround_bits += gap;
+  }
+  if (info->data_len > 0 && info->has_token) {
+    add_bytes(c, info->addr,
+	      info->endp | (info->dir == USB_DIR_IN ? 0x80 : 0),
+	      info->data_len);
+  }
+  timeline->last_end = start + bus_bits * NS_PER_BIT;
+}
+
+void
+usb_timeline_packet(uint32_t *bits, uint32_t n_bits, timestamp_t ts,
+		    void *user_data)
+{
+  USBTimeline *timeline = user_data;
+  struct USBPacketInfo info;
+  usb_packet_parse(&timeline->tracker, bits, n_bits, ts, &info);
+  add_packet(timeline, bits, n_bits, &info);
+}
+
+void
+usb_timeline_batch(struct USBPacketBatch *batch, void *user_data)
+{
+  USBTimeline *timeline = user_data;
+  unsigned int p;
+  for (p = 0; p < batch->n_packets; p++) {
+    add_packet(timeline, usb_packet_batch_bits(batch, p),
+	       batch->packets[p].n_bits, &batch->info[p]);
+  }
+}
+
+void
+usb_timeline_gap(USBTimeline *timeline)
+{
+  timeline->content.flags |= TIMELINE_FLAG_GAP;
+  timeline->last_end = 0;
+  usb_packet_tracker_init(&timeline->tracker);
+}
+
+void
+usb_timeline_close(USBTimeline *timeline)
+{
+  if (timeline->active) write_frame(timeline);
+  write_repeat(timeline);
+  free(timeline);
+}
@@ -0,0 +1,55 @@
+#ifndef USB_TIMELINE_H
+#define USB_TIMELINE_H
+
+#include <stdio.h>
+#include <packet_handler.h>
+
+/* Bus utilisation per SOF delimited frame.
+
+   For every frame the bit times occupied by packets (sync to EOP) and by
+   turnaround within transactions are summed, packets are counted by PID
+   and payload bytes are counted for the first TIMELINE_ENDPOINTS
+   endpoints seen in the frame, the rest go into one "other" counter.
+
+   Binary format, all numbers little endian, V is an unsigned LEB128
+   varint:
+   Header: "USBTL1\0\0", uint32 ns per bit
+   Frame record: 0x01, V ns since start of previous frame record,
+     uint16 frame number (0xffff if no SOF), uint8 flags, V busy bits,
+     V turnaround bits, uint16 mask of PID nibbles present, V count for
+     each PID in the mask from lowest nibble, uint8 number of endpoints,
+     for each endpoint uint8 address, uint8 endpoint | 0x80 for IN,
+     V bytes, then V other bytes.
+   Repeat record: 0x02, V number of following frames identical to the
+   last frame record except for time and frame number.
+
+   Idle periods and periodic polling thus take only a few bytes. */
+
+#define TIMELINE_ENDPOINTS 8
+
+#define TIMELINE_FLAG_GAP 0x01 /* Blocks were lost during the frame */
+#define TIMELINE_FLAG_NO_SOF 0x02 /* Frame did not start with an SOF */
+
+typedef struct USBTimeline USBTimeline;
+
+/* Either file may be NULL */
+USBTimeline *
+usb_timeline_init(FILE *bin, FILE *csv);
+
+/* Packet handler, user_data is the USBTimeline */
+void
+usb_timeline_packet(uint32_t *bits, uint32_t n_bits, timestamp_t ts,
+		    void *user_data);
+
+/* The same for batches, from the parsed packets */
+void
+usb_timeline_batch(struct USBPacketBatch *batch, void *user_data);
+
+void
+usb_timeline_gap(USBTimeline *timeline);
+
+/* Writes the last frame. Does not close the files. */
+void
+usb_timeline_close(USBTimeline *timeline);
+
+#endif
@@ -0,0 +1,81 @@
+#include "usb_vcd.h"
+#include <string.h>
+#include <time.h>
+
+int
+usb_vcd_header(FILE *out)
+{
+  time_t now;
+  char now_str[26];
+  now = time(NULL);
+  ctime_r(&now, now_str);
+  fprintf(out,"$date %s $end\n", now_str);
+  fputs("$version usbsniff $end\n", out);
+  fputs("$timescale 1 ns $end\n"
+	"$scope module top $end\n"
+	"$var wire 1 + DP $end\n"
+	"$var wire 1 - DM $end\n"
+	"$upscope $end\n"
+	"$enddefinitions $end\n",
+	out);
+  return 0;
+}
+
+/* Same as printf("#%lld\n") */
+static inline char *
+format_time(char *p, timestamp_t time)
+{
+  char digits[20];
+  int n = 0;
+  *p++ = '#';
+  do {
+    digits[n++] = '0' + time % 10;
+    time /= 10;
+  } while(time > 0);
+  while(n > 0) *p++ = digits[--n];
+  *p++ = '\n';
+  return p;
+}
+
+size_t
+usb_vcd_format_block(char *buf, const struct USBSamples *samples,
+		     timestamp_t time)
+{
+  char *p = buf;
+  uint32_t b;
+  uint32_t dp = samples->dp_bits;
+  uint32_t dp_chg = dp ^ (dp << 1);
+  uint32_t dm = samples->dm_bits;
+  uint32_t dm_chg = dm ^ (dm << 1);
+  p = format_time(p, time);
+  memcpy(p, "0+\n0-\n", 6);
+  p[0] += dp & 1;
+  p[3] += dm & 1;
+  p += 6;
+  for (b = 1; b != 0; b <<= 1) {
+    if ((dp_chg | dm_chg) & b) {
+      p = format_time(p, time);
+    }
+    if (dp_chg & b) {
+      *p++ = (dp & b) ? '1' : '0';
+      *p++ = '+';
+      *p++ = '\n';
+    }
+    if (dm_chg & b) {
+      *p++ = (dm & b) ? '1' : '0';
+      *p++ = '-';
+      *p++ = '\n';
+    }
+    time += NS_PER_BIT;
+  }
+  return p - buf;
+}
+
+int
+usb_vcd_write_block(FILE *out, const struct USBSamples *samples,
+		    timestamp_t time)
+{
+  char buf[USB_VCD_BLOCK_MAX];
+  size_t len = usb_vcd_format_block(buf, samples, time);
+  return fwrite(buf, 1, len, out) == len ? 0 : -1;
+}
@@ -0,0 +1,29 @@
+#ifndef USB_VCD_H
+#define USB_VCD_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <usb_ringbuffer.h>
+
+/* VCD output of the raw bus levels. A block only depends on its own
+   bits and start time, so blocks can be formatted in any order and
+   concatenated. */
+
+/* Largest text of one block: the start time, both levels, and a time
+   and both levels for each of the 32 bits */
+#define USB_VCD_BLOCK_MAX (33 * (1 + 20 + 1 + 6))
+
+int
+usb_vcd_header(FILE *out);
+
+/* Writes the block to buf, at least USB_VCD_BLOCK_MAX bytes, and
+   returns the length. Not null terminated. */
+size_t
+usb_vcd_format_block(char *buf, const struct USBSamples *samples,
+		     timestamp_t time);
+
+int
+usb_vcd_write_block(FILE *out, const struct USBSamples *samples,
+		    timestamp_t time);
+
+#endif
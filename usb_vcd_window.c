@@ -0,0 +1,360 @@
+#include "usb_vcd_window.h"
+#include <stdlib.h>
+#include <string.h>
+#include <usb_vcd.h>
+
+/* Bits of the SYNC before the packet timestamp */
+#define SYNC_BITS 8
+/* Longest packet on the bus: SYNC, the largest buffer the decoder
+   keeps with one stuffed bit for every six, and EOP */
+#define MAX_PACKET_BITS (SYNC_BITS + USB_BUF_LEN * 32 * 7 / 6 + 3)
+
+int
+usb_vcd_window_parse_times(USBVCDWindow *w, const char *arg)
+{
+  double pre;
+  double post;
+  if (sscanf(arg, "%lf,%lf", &pre, &post) != 2 || pre < 0 || post < 0) {
+    fprintf(stderr, "Invalid window times: %s\n", arg);
+    return -1;
+  }
+  w->pre = pre * 1000;
+  w->post = post * 1000;
+  return 0;
+}
+
+int
+usb_vcd_window_parse_on(USBVCDWindow *w, const char *arg)
+{
+  const char *p = arg;
+  w->on = 0;
+  while(*p) {
+    size_t len = strcspn(p, ",");
+    unsigned int addr;
+    unsigned int endp;
+    int n;
+    if (len == 7 && strncmp(p, "packets", len) == 0) {
+      w->on |= USB_VCD_WINDOW_PACKETS;
+    } else if (len == 4 && strncmp(p, "data", len) == 0) {
+      w->on |= USB_VCD_WINDOW_DATA;
+    } else if (len == 6 && strncmp(p, "errors", len) == 0) {
+      w->on |= USB_VCD_WINDOW_ERRORS;
+    } else if (sscanf(p, "%u.%u%n", &addr, &endp, &n) == 2 && n == len
+	       && addr < 128 && endp < 16) {
+      w->on |= USB_VCD_WINDOW_ADDR;
+      w->addr = addr;
+      w->endp = endp;
+    } else if (sscanf(p, "%u%n", &addr, &n) == 1 && n == len && addr < 128) {
+      w->on |= USB_VCD_WINDOW_ADDR;
+      w->addr = addr;
+      w->endp = -1;
+    } else {
+      fprintf(stderr, "Invalid window selection: %.*s\n", (int)len, p);
+      return -1;
+    }
+    p += len;
+    if (*p == ',') p++;
+  }
+  return 0;
+}
+
+void
+usb_vcd_window_defaults(USBVCDWindow *w)
+{
+  w->pre = USB_VCD_WINDOW_DEFAULT_NS;
+  w->post = USB_VCD_WINDOW_DEFAULT_NS;
+  w->on = USB_VCD_WINDOW_PACKETS | USB_VCD_WINDOW_ERRORS;
+  w->addr = 0;
+  w->endp = -1;
+}
+
+int
+usb_vcd_window_init(USBVCDWindow *w, FILE *out, const USBDecoder *decoder)
+{
+  unsigned int blocks;
+  w->out = out;
+  w->decoder = decoder;
+  usb_packet_tracker_init(&w->tracker);
+  w->errors = decoder->errors;
+  w->keep = w->pre + (timestamp_t)MAX_PACKET_BITS * NS_PER_BIT;
+  /* Blocks are at least 32 bits, the ring grows for shorter ones */
+  blocks = w->keep / (32 * NS_PER_BIT) + 2;
+  w->ring_size = 1;
+  while(w->ring_size < blocks) w->ring_size <<= 1;
+  w->ring = malloc(w->ring_size * sizeof(struct USBVCDWindowBlock));
+  if (!w->ring) {
+    fprintf(stderr, "Failed to allocate window buffer\n");
+    return -1;
+  }
+  w->ring_first = 0;
+  w->ring_len = 0;
+  w->n_pending = 0;
+  w->done = 0;
+  w->win_end = 0;
+  w->open = 0;
+  w->n_events = 0;
+  w->windows = 0;
+  return usb_vcd_header(out);
+}
+
+static void
+add_event(USBVCDWindow *w, timestamp_t start, timestamp_t end)
+{
+  unsigned int i;
+  if (w->n_events == USB_VCD_WINDOW_MAX_EVENTS) {
+    /* Cannot happen with real blocks, merge into the last one */
+    i = w->n_events - 1;
+    if (start < w->event_start[i]) w->event_start[i] = start;
+    if (end > w->event_end[i]) w->event_end[i] = end;
+    return;
+  }
+  /* Keep them sorted by start, errors are added after the packets */
+  i = w->n_events++;
+  while(i > 0 && w->event_start[i - 1] > start) {
+    w->event_start[i] = w->event_start[i - 1];
+    w->event_end[i] = w->event_end[i - 1];
+    i--;
+  }
+  w->event_start[i] = start;
+  w->event_end[i] = end;
+}
+
+static void
+select_packet(USBVCDWindow *w, const struct USBPacketInfo *info,
+	      timestamp_t eop_ts)
+{
+  int hit = 0;
+  if (w->on & USB_VCD_WINDOW_PACKETS) {
+    hit = 1;
+  } else if ((w->on & USB_VCD_WINDOW_DATA) && info->pid != USB_PID_SOF) {
+    hit = 1;
+  } else if ((w->on & USB_VCD_WINDOW_ERRORS)
+	     && (info->flags & (USB_PACKET_CRC_ERROR | USB_PACKET_INVALID))) {
+    hit = 1;
+  } else if ((w->on & USB_VCD_WINDOW_ADDR) && info->pid != USB_PID_SOF
+	     && info->has_token && info->addr == w->addr
+	     && (w->endp < 0 || info->endp == w->endp)) {
+    hit = 1;
+  }
+  if (hit) {
+    timestamp_t start = info->ts > SYNC_BITS * NS_PER_BIT
+      ? info->ts - SYNC_BITS * NS_PER_BIT : 0;
+    add_event(w, start, eop_ts);
+  }
+}
+
+void
+usb_vcd_window_packet(uint32_t *bits, uint32_t n_bits, timestamp_t ts,
+		      void *user_data)
+{
+  USBVCDWindow *w = user_data;
+  struct USBPacketInfo info;
+  usb_packet_parse(&w->tracker, bits, n_bits, ts, &info);
+  select_packet(w, &info, w->decoder->eop_ts);
+}
+
+static void
+write_bit(USBVCDWindow *w, timestamp_t t, unsigned int dp, unsigned int dm)
+{
+  if (!w->open) {
+    fprintf(w->out, "#%llu\n%u+\n%u-\n", t, dp, dm);
+    w->open = 1;
+    w->windows++;
+  } else if (dp != w->dp || dm != w->dm) {
+    fprintf(w->out, "#%llu\n", t);
+    if (dp != w->dp) fprintf(w->out, "%u+\n", dp);
+    if (dm != w->dm) fprintf(w->out, "%u-\n", dm);
+  }
+  w->dp = dp;
+  w->dm = dm;
+}
+
+/* Writes the bits from done up to end that are in the ring */
+static void
+write_to(USBVCDWindow *w, timestamp_t end)
+{
+  unsigned int k;
+  if (end <= w->done) return;
+  for (k = 0; k < w->ring_len; k++) {
+    const struct USBVCDWindowBlock *block
+      = &w->ring[(w->ring_first + k) & (w->ring_size - 1)];
+    timestamp_t time = block->time;
+    unsigned int count = block->samples.count;
+    unsigned int first = 0;
+    unsigned int last = count;
+    unsigned int i;
+    if (time + count * NS_PER_BIT <= w->done) continue;
+    if (time >= end) break;
+    if (w->done > time) {
+      first = (w->done - time + NS_PER_BIT - 1) / NS_PER_BIT;
+    }
+    if (end < time + count * NS_PER_BIT) {
+      last = (end - time + NS_PER_BIT - 1) / NS_PER_BIT;
+    }
+    for (i = first; i < last; i++) {
+      /* Bits after the first 32 repeat the last one */
+      unsigned int b = i < 32 ? i : 31;
+      if (i >= 32 && w->open) break;
+      write_bit(w, time + i * NS_PER_BIT, (block->samples.dp_bits >> b) & 1,
+		(block->samples.dm_bits >> b) & 1);
+    }
+  }
+  w->done = end;
+}
+
+/* Leave out the bits up to start, the next bit written starts a window */
+static void
+skip_to(USBVCDWindow *w, timestamp_t start)
+{
+  if (start <= w->done) return;
+  w->done = start;
+  w->open = 0;
+}
+
+static int
+push_block(USBVCDWindow *w, const struct USBSamples *samples,
+	   timestamp_t time)
+{
+  struct USBVCDWindowBlock *block;
+  if (w->ring_len == w->ring_size) {
+    unsigned int size = w->ring_size * 2;
+    struct USBVCDWindowBlock *ring;
+    unsigned int k;
+    ring = malloc(size * sizeof(struct USBVCDWindowBlock));
+    if (!ring) return -1;
+    for (k = 0; k < w->ring_len; k++) {
+      ring[k] = w->ring[(w->ring_first + k) & (w->ring_size - 1)];
+    }
+    free(w->ring);
+    w->ring = ring;
+    w->ring_size = size;
+    w->ring_first = 0;
+  }
+  block = &w->ring[(w->ring_first + w->ring_len) & (w->ring_size - 1)];
+  block->samples = *samples;
+  block->time = time;
+  w->ring_len++;
+  return 0;
+}
+
+/* Writes the block with the events of the packets that ended in it */
+static void
+write_block(USBVCDWindow *w, const struct USBVCDWindowBlock *block)
+{
+  timestamp_t time = block->time;
+  timestamp_t end = time + block->samples.count * NS_PER_BIT;
+  unsigned int e;
+  if (block->error && (w->on & USB_VCD_WINDOW_ERRORS)) {
+    add_event(w, time, end);
+  }
+  for (e = 0; e < w->n_events; e++) {
+    timestamp_t start = w->event_start[e];
+    start = start > w->pre ? start - w->pre : 0;
+    if (start > w->win_end) {
+      /* Finish the current window and leave out the time up to the
+	 next one */
+      write_to(w, w->win_end);
+      skip_to(w, start);
+    }
+    if (w->event_end[e] + w->post > w->win_end) {
+      w->win_end = w->event_end[e] + w->post;
+    }
+  }
+  w->n_events = 0;
+  write_to(w, w->win_end < end ? w->win_end : end);
+
+  /* Keep what later packets could reach back to */
+  while(w->ring_len > 1) {
+    const struct USBVCDWindowBlock *first = &w->ring[w->ring_first];
+    if (first->time + first->samples.count * NS_PER_BIT + w->keep > end) break;
+    w->ring_first = (w->ring_first + 1) & (w->ring_size - 1);
+    w->ring_len--;
+  }
+}
+
+static inline struct USBVCDWindowBlock *
+first_pending(USBVCDWindow *w)
+{
+  return &w->ring[(w->ring_first + w->ring_len - w->n_pending)
+		  & (w->ring_size - 1)];
+}
+
+static void
+write_pending(USBVCDWindow *w)
+{
+  const struct USBVCDWindowBlock *block = first_pending(w);
+  w->n_pending--;
+  write_block(w, block);
+}
+
+void
+usb_vcd_window_batch(struct USBPacketBatch *batch, void *user_data)
+{
+  USBVCDWindow *w = user_data;
+  unsigned int p;
+  for (p = 0; p < batch->n_packets; p++) {
+    timestamp_t eop_ts = batch->packets[p].eop_ts;
+    /* Blocks before the one the packet ended in are complete */
+    while(w->n_pending > 0) {
+      const struct USBVCDWindowBlock *block = first_pending(w);
+      if (eop_ts < block->time + block->samples.count * NS_PER_BIT) break;
+      write_pending(w);
+    }
+    select_packet(w, &batch->info[p], eop_ts);
+  }
+  /* The decoder is past all blocks passed on so far */
+  while(w->n_pending > 0) write_pending(w);
+}
+
+void
+usb_vcd_window_block(USBVCDWindow *w, const struct USBSamples *samples,
+		     timestamp_t time)
+{
+  struct USBVCDWindowBlock *block;
+  if (push_block(w, samples, time) < 0) {
+    /* Drop the history rather than stopping the capture */
+    w->ring_len = 0;
+    w->n_pending = 0;
+    push_block(w, samples, time);
+  }
+  block = &w->ring[(w->ring_first + w->ring_len - 1) & (w->ring_size - 1)];
+  block->error = w->decoder->errors != w->errors;
+  w->errors = w->decoder->errors;
+  if (w->decoder->batch) {
+    w->n_pending++;
+  } else {
+    write_block(w, block);
+  }
+}
+
+static void
+finish(USBVCDWindow *w)
+{
+  while(w->n_pending > 0) write_pending(w);
+  if (w->ring_len > 0) {
+    const struct USBVCDWindowBlock *block
+      = &w->ring[(w->ring_first + w->ring_len - 1) & (w->ring_size - 1)];
+    timestamp_t end = block->time + block->samples.count * NS_PER_BIT;
+    write_to(w, w->win_end < end ? w->win_end : end);
+  }
+}
+
+void
+usb_vcd_window_gap(USBVCDWindow *w)
+{
+  finish(w);
+  w->ring_len = 0;
+  w->n_events = 0;
+  w->win_end = 0;
+  w->open = 0;
+  usb_packet_tracker_init(&w->tracker);
+}
+
+void
+usb_vcd_window_close(USBVCDWindow *w)
+{
+  finish(w);
+  fflush(w->out);
+  free(w->ring);
+  w->ring = NULL;
+}
@@ -0,0 +1,111 @@
+#ifndef USB_VCD_WINDOW_H
+#define USB_VCD_WINDOW_H
+
+#include <stdio.h>
+#include <usb_packet.h>
+#include <usb_packet_decoder.h>
+
+/* VCD of the bus levels around selected packets and decoder errors
+   only, from PRE before the SYNC to POST after the EOP. Whatever is
+   between the windows is left out, the levels then change in one step
+   at the start of the next window.
+
+   Windows are found by the decoder, so the VCD is written behind it.
+   Blocks are kept for the pre window plus the longest packet, since
+   the start of a packet is only known at its end. When the decoder
+   collects packets in batches, the blocks are also kept until the
+   batch with their packets arrives. */
+
+#define USB_VCD_WINDOW_PACKETS 0x01 /* Every packet */
+#define USB_VCD_WINDOW_DATA 0x02 /* Every packet except SOF */
+#define USB_VCD_WINDOW_ERRORS 0x04 /* Decoder errors, CRC errors and
+				      invalid packets */
+#define USB_VCD_WINDOW_ADDR 0x08 /* Transactions of one address */
+
+#define USB_VCD_WINDOW_DEFAULT_NS 2000
+
+/* Events found while decoding one block */
+#define USB_VCD_WINDOW_MAX_EVENTS 8
+
+struct USBVCDWindowBlock
+{
+  struct USBSamples samples;
+  timestamp_t time;
+  int error; /* The decoder found an error in it */
+};
+
+struct USBVCDWindow
+{
+  FILE *out;
+  const USBDecoder *decoder;
+  timestamp_t pre;
+  timestamp_t post;
+  unsigned int on;
+  unsigned int addr;
+  int endp; /* -1 for all endpoints of addr */
+  struct USBPacketTracker tracker;
+  unsigned long errors; /* Decoder errors seen */
+  timestamp_t keep; /* Bus time kept in ring */
+  struct USBVCDWindowBlock *ring;
+  unsigned int ring_size; /* Power of 2 */
+  unsigned int ring_first;
+  unsigned int ring_len;
+  unsigned int n_pending; /* Blocks at the end of ring waiting for their
+			     packets */
+  timestamp_t done; /* Bits before this are written or left out */
+  timestamp_t win_end; /* End of the current window */
+  int open; /* Levels written, only changes follow */
+  unsigned int dp;
+  unsigned int dm;
+  timestamp_t event_start[USB_VCD_WINDOW_MAX_EVENTS];
+  timestamp_t event_end[USB_VCD_WINDOW_MAX_EVENTS];
+  unsigned int n_events;
+  unsigned long long windows;
+};
+
+typedef struct USBVCDWindow USBVCDWindow;
+
+/* Parse "PRE,POST" in microseconds */
+int
+usb_vcd_window_parse_times(USBVCDWindow *w, const char *arg);
+
+/* Parse a comma separated list of packets, errors, data and
+   ADDR[.ENDP] */
+int
+usb_vcd_window_parse_on(USBVCDWindow *w, const char *arg);
+
+/* Sets the defaults for the settings above, 2 us windows around every
+   packet and error */
+void
+usb_vcd_window_defaults(USBVCDWindow *w);
+
+/* Writes the header. The decoder must have usb_vcd_window_packet among
+   its packet handlers. */
+int
+usb_vcd_window_init(USBVCDWindow *w, FILE *out, const USBDecoder *decoder);
+
+/* Packet handler, user data is the USBVCDWindow */
+void
+usb_vcd_window_packet(uint32_t *bits, uint32_t n_bits, timestamp_t ts,
+		      void *user_data);
+
+/* The same for batches. The blocks passed on since the last batch are
+   written once their packets are in. */
+void
+usb_vcd_window_batch(struct USBPacketBatch *batch, void *user_data);
+
+/* Call after decode_block() for the same block. If the decoder batches,
+   the block is written when the batch with its packets arrives. */
+void
+usb_vcd_window_block(USBVCDWindow *w, const struct USBSamples *samples,
+		     timestamp_t time);
+
+/* Call for lost blocks, ends the current window */
+void
+usb_vcd_window_gap(USBVCDWindow *w);
+
+/* Finishes the last window and flushes the output */
+void
+usb_vcd_window_close(USBVCDWindow *w);
+
+#endif
@@ -0,0 +1,669 @@
+#define _GNU_SOURCE
+#include "usb_writer.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+/* O_DIRECT needs buffers, offsets and lengths aligned to this */
+#define DIRECT_ALIGN 4096
+
+#define FILE_THREADS 2
+
+#define MAX_BUFFERS 256
+
+/* How often to check if the pipe reader has caught up */
+#define PIPE_POLL_NS 1000000
+/* How long to wait for it when closing */
+#define PIPE_DRAIN_POLLS 1000
+
+enum {
+  BACKEND_URING,
+  BACKEND_THREADS, /* pwrite from FILE_THREADS threads */
+  BACKEND_STREAM, /* write from one thread, for terminals and sockets */
+  BACKEND_PIPE /* vmsplice from one thread */
+};
+
+static const char *backend_names[] = {
+  "io_uring", "pwrite threads", "write thread", "vmsplice"
+};
+
+struct Buffer
+{
+  uint8_t *data;
+  size_t len; /* Bytes filled */
+  size_t done; /* Bytes written */
+  uint64_t offset; /* In the file */
+  uint64_t submitted; /* ns */
+  uint64_t spliced_end; /* Bytes spliced to the pipe including this */
+  struct iovec iov;
+  struct Buffer *next;
+};
+
+struct USBWriter
+{
+  int fd;
+  int close_fd;
+  int backend;
+  unsigned int flags;
+  unsigned int n_buffers;
+  struct Buffer buffers[MAX_BUFFERS];
+  struct Buffer *current; /* Being filled, NULL if none */
+  uint64_t offset; /* File offset of the next buffer */
+  pthread_mutex_t lock; /* Protects everything below */
+  pthread_cond_t cond;
+  struct Buffer *free;
+  unsigned int n_free;
+  struct Buffer *queue; /* Waiting for a thread */
+  struct Buffer *queue_tail;
+  int stopping;
+  pthread_t threads[FILE_THREADS];
+  unsigned int n_threads;
+  pthread_cond_t free_cond; /* For usb_writer_wait() */
+  int failed;
+  unsigned int in_flight;
+  /* Statistics */
+  unsigned long long bytes;
+  unsigned long long dropped;
+  unsigned long long writes;
+  unsigned int max_in_flight;
+  uint64_t max_latency;
+  uint64_t first_submit;
+  uint64_t last_complete;
+  /* Pipe */
+  size_t pipe_size;
+  uint64_t spliced; /* Bytes written to the pipe */
+  struct Buffer *spliced_head; /* Maybe still referenced by the pipe */
+  struct Buffer *spliced_tail;
+#ifdef HAVE_LINUX_IO_URING_H
+  int ring_fd;
+  void *sq_map;
+  size_t sq_map_len;
+  void *cq_map;
+  size_t cq_map_len;
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  struct io_uring_cqe *cqes;
+#endif
+};
+
+static uint64_t
+now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Called with the lock held */
+static void
+buffer_done(USBWriter *w, struct Buffer *buf)
+{
+  uint64_t now = now_ns();
+  if (now - buf->submitted > w->max_latency) {
+    w->max_latency = now - buf->submitted;
+  }
+  w->last_complete = now;
+  w->bytes += buf->done;
+  w->in_flight--;
+  buf->next = w->free;
+  w->free = buf;
+  w->n_free++;
+  pthread_cond_signal(&w->free_cond);
+}
+
+static struct Buffer *
+take_free(USBWriter *w)
+{
+  struct Buffer *buf;
+  pthread_mutex_lock(&w->lock);
+  buf = w->free;
+  if (buf) {
+    w->free = buf->next;
+    w->n_free--;
+  }
+  pthread_mutex_unlock(&w->lock);
+  if (buf) {
+    buf->len = 0;
+    buf->next = NULL;
+  }
+  return buf;
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+static int
+uring_setup(USBWriter *w)
+{
+  struct io_uring_params p;
+  uint8_t *sq;
+  uint8_t *cq;
+  memset(&p, 0, sizeof(p));
+  w->ring_fd = syscall(__NR_io_uring_setup, w->n_buffers, &p);
+  if (w->ring_fd < 0) return -1;
+  w->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  w->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (w->cq_map_len > w->sq_map_len) w->sq_map_len = w->cq_map_len;
+    w->cq_map_len = 0;
+  }
+  w->sq_map = mmap(NULL, w->sq_map_len, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, w->ring_fd, IORING_OFF_SQ_RING);
+  if (w->sq_map == MAP_FAILED) goto fail;
+  if (w->cq_map_len > 0) {
+    w->cq_map = mmap(NULL, w->cq_map_len, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_POPULATE, w->ring_fd,
+		     IORING_OFF_CQ_RING);
+    if (w->cq_map == MAP_FAILED) goto fail;
+  } else {
+    w->cq_map = w->sq_map;
+  }
+  w->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  w->sqes = mmap(NULL, w->sqes_len, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_POPULATE, w->ring_fd, IORING_OFF_SQES);
+  if (w->sqes == MAP_FAILED) goto fail;
+  sq = w->sq_map;
+  cq = w->cq_map;
+  w->sq_head = (unsigned int*)(sq + p.sq_off.head);
+  w->sq_tail = (unsigned int*)(sq + p.sq_off.tail);
+  w->sq_mask = (unsigned int*)(sq + p.sq_off.ring_mask);
+  w->sq_array = (unsigned int*)(sq + p.sq_off.array);
+  w->cq_head = (unsigned int*)(cq + p.cq_off.head);
+  w->cq_tail = (unsigned int*)(cq + p.cq_off.tail);
+  w->cq_mask = (unsigned int*)(cq + p.cq_off.ring_mask);
+  w->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+  return 0;
+ fail:
+  if (w->sq_map != MAP_FAILED && w->sq_map) {
+    munmap(w->sq_map, w->sq_map_len);
+  }
+  if (w->cq_map_len > 0 && w->cq_map != MAP_FAILED && w->cq_map) {
+    munmap(w->cq_map, w->cq_map_len);
+  }
+  close(w->ring_fd);
+  return -1;
+}
+
+static void
+uring_close(USBWriter *w)
+{
+  munmap(w->sqes, w->sqes_len);
+  if (w->cq_map_len > 0) munmap(w->cq_map, w->cq_map_len);
+  munmap(w->sq_map, w->sq_map_len);
+  close(w->ring_fd);
+}
+
+static void
+uring_submit(USBWriter *w, struct Buffer *buf)
+{
+  unsigned int tail = *w->sq_tail;
+  unsigned int index = tail & *w->sq_mask;
+  struct io_uring_sqe *sqe = &w->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  buf->iov.iov_base = buf->data + buf->done;
+  buf->iov.iov_len = buf->len - buf->done;
+  sqe->opcode = IORING_OP_WRITEV;
+  sqe->fd = w->fd;
+  sqe->off = buf->offset + buf->done;
+  sqe->addr = (uintptr_t)&buf->iov;
+  sqe->len = 1;
+  sqe->user_data = buf - w->buffers;
+  w->sq_array[index] = index;
+  __atomic_store_n(w->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  while(syscall(__NR_io_uring_enter, w->ring_fd, 1, 0, 0, NULL, 0) < 0) {
+    if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+    fprintf(stderr, "Failed to submit write: %s\n", strerror(errno));
+    w->failed = 1;
+    break;
+  }
+}
+
+/* Handle finished writes, wait for at least one if wait is set */
+static void
+uring_reap(USBWriter *w, int wait)
+{
+  unsigned int head = *w->cq_head;
+  if (wait && head == __atomic_load_n(w->cq_tail, __ATOMIC_ACQUIRE)) {
+    syscall(__NR_io_uring_enter, w->ring_fd, 0, 1, IORING_ENTER_GETEVENTS,
+	    NULL, 0);
+  }
+  while(head != __atomic_load_n(w->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &w->cqes[head & *w->cq_mask];
+    struct Buffer *buf = &w->buffers[cqe->user_data];
+    int res = cqe->res;
+    head++;
+    __atomic_store_n(w->cq_head, head, __ATOMIC_RELEASE);
+    if (res < 0) {
+      fprintf(stderr, "Failed to write dump: %s\n", strerror(-res));
+      w->failed = 1;
+    } else {
+      buf->done += res;
+      if (buf->done < buf->len && res > 0) {
+	uring_submit(w, buf);
+	continue;
+      }
+    }
+    pthread_mutex_lock(&w->lock);
+    buffer_done(w, buf);
+    pthread_mutex_unlock(&w->lock);
+  }
+}
+
+#endif
+
+static int
+write_all(USBWriter *w, struct Buffer *buf)
+{
+  while(buf->done < buf->len) {
+    ssize_t r;
+    if (w->backend == BACKEND_THREADS) {
+      r = pwrite(w->fd, buf->data + buf->done, buf->len - buf->done,
+		 buf->offset + buf->done);
+    } else {
+      r = write(w->fd, buf->data + buf->done, buf->len - buf->done);
+    }
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "Failed to write dump: %s\n", strerror(errno));
+      return -1;
+    }
+    buf->done += r;
+  }
+  return 0;
+}
+
+static int
+splice_all(USBWriter *w, struct Buffer *buf)
+{
+  while(buf->done < buf->len) {
+    struct iovec iov;
+    ssize_t r;
+    iov.iov_base = buf->data + buf->done;
+    iov.iov_len = buf->len - buf->done;
+    r = vmsplice(w->fd, &iov, 1, 0);
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "Failed to write to pipe: %s\n", strerror(errno));
+      return -1;
+    }
+    buf->done += r;
+  }
+  return 0;
+}
+
+/* Bytes not yet read from the pipe */
+static uint64_t
+pipe_unread(USBWriter *w)
+{
+  int unread;
+  if (ioctl(w->fd, FIONREAD, &unread) < 0) return w->pipe_size;
+  return unread;
+}
+
+/* The pipe references the pages of a spliced buffer until the reader has
+   consumed them. Called with the lock held. */
+static void
+release_spliced(USBWriter *w)
+{
+  uint64_t unread;
+  if (!w->spliced_head) return;
+  unread = pipe_unread(w);
+  while(w->spliced_head && w->spliced_head->spliced_end + unread
+	<= w->spliced) {
+    struct Buffer *buf = w->spliced_head;
+    w->spliced_head = buf->next;
+    if (!w->spliced_head) w->spliced_tail = NULL;
+    buffer_done(w, buf);
+  }
+}
+
+static void *
+writer_thread(void *arg)
+{
+  USBWriter *w = arg;
+  while(1) {
+    struct Buffer *buf;
+    int spliced;
+    int ret;
+    pthread_mutex_lock(&w->lock);
+    while(!w->queue && !w->stopping) {
+      if (w->spliced_head) {
+	/* Poll for the reader to consume the spliced buffers */
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += PIPE_POLL_NS;
+	if (ts.tv_nsec >= 1000000000) {
+	  ts.tv_sec++;
+	  ts.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(&w->cond, &w->lock, &ts);
+	release_spliced(w);
+      } else {
+	pthread_cond_wait(&w->cond, &w->lock);
+      }
+    }
+    buf = w->queue;
+    if (!buf) {
+      pthread_mutex_unlock(&w->lock);
+      break;
+    }
+    w->queue = buf->next;
+    if (!w->queue) w->queue_tail = NULL;
+    pthread_mutex_unlock(&w->lock);
+
+    /* Partly filled buffers flushed while idle are cheaper to copy */
+    spliced = (w->backend == BACKEND_PIPE
+	       && buf->len == USB_WRITER_BUFFER_SIZE);
+    if (spliced) {
+      ret = splice_all(w, buf);
+    } else {
+      ret = write_all(w, buf);
+    }
+
+    pthread_mutex_lock(&w->lock);
+    if (ret < 0) w->failed = 1;
+    w->spliced += buf->done;
+    if (spliced && ret == 0) {
+      buf->spliced_end = w->spliced;
+      buf->next = NULL;
+      if (w->spliced_tail) {
+	w->spliced_tail->next = buf;
+      } else {
+	w->spliced_head = buf;
+      }
+      w->spliced_tail = buf;
+    } else {
+      buffer_done(w, buf);
+    }
+    if (w->backend == BACKEND_PIPE) release_spliced(w);
+    pthread_mutex_unlock(&w->lock);
+  }
+  return NULL;
+}
+
+static void
+submit(USBWriter *w, struct Buffer *buf)
+{
+  buf->offset = w->offset;
+  buf->done = 0;
+  buf->submitted = now_ns();
+  buf->next = NULL;
+  w->offset += buf->len;
+  pthread_mutex_lock(&w->lock);
+  if (w->first_submit == 0) w->first_submit = buf->submitted;
+  w->writes++;
+  w->in_flight++;
+  if (w->in_flight > w->max_in_flight) w->max_in_flight = w->in_flight;
+  if (w->backend != BACKEND_URING) {
+    if (w->queue_tail) {
+      w->queue_tail->next = buf;
+    } else {
+      w->queue = buf;
+    }
+    w->queue_tail = buf;
+    pthread_cond_signal(&w->cond);
+  }
+  pthread_mutex_unlock(&w->lock);
+#ifdef HAVE_LINUX_IO_URING_H
+  if (w->backend == BACKEND_URING) uring_submit(w, buf);
+#endif
+}
+
+USBWriter *
+usb_writer_open(const char *filename, unsigned int flags, size_t memory)
+{
+  USBWriter *w;
+  struct stat st;
+  unsigned int i;
+  w = malloc(sizeof(USBWriter));
+  if (!w) return NULL;
+  memset(w, 0, sizeof(USBWriter));
+  w->flags = flags;
+  if (filename[0] == '-' && filename[1] == '\0') {
+    w->fd = 1;
+    w->close_fd = 0;
+    if (flags & USB_WRITER_DIRECT) {
+      int fl = fcntl(w->fd, F_GETFL);
+      if (fl < 0 || fcntl(w->fd, F_SETFL, fl | O_DIRECT) < 0) {
+	w->flags &= ~USB_WRITER_DIRECT;
+      }
+    }
+  } else {
+    w->fd = open(filename, (O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC
+			    | ((flags & USB_WRITER_DIRECT) ? O_DIRECT : 0)),
+		 0666);
+    if (w->fd < 0) {
+      fprintf(stderr, "Failed to open file %s for writing: %s\n",
+	      filename, strerror(errno));
+      free(w);
+      return NULL;
+    }
+    w->close_fd = 1;
+  }
+  if (fstat(w->fd, &st) < 0) st.st_mode = 0;
+  if (S_ISFIFO(st.st_mode)) {
+    int size;
+    w->backend = BACKEND_PIPE;
+    fcntl(w->fd, F_SETPIPE_SZ, USB_WRITER_BUFFER_SIZE);
+    size = fcntl(w->fd, F_GETPIPE_SZ);
+    w->pipe_size = size > 0 ? size : USB_WRITER_BUFFER_SIZE;
+    w->flags &= ~USB_WRITER_DIRECT;
+  } else if (!S_ISREG(st.st_mode) && !S_ISBLK(st.st_mode)) {
+    w->backend = BACKEND_STREAM;
+  } else {
+    off_t pos = lseek(w->fd, 0, SEEK_CUR);
+    w->offset = pos > 0 ? pos : 0;
+    w->backend = BACKEND_THREADS;
+  }
+
+  w->n_buffers = memory / USB_WRITER_BUFFER_SIZE;
+  if (w->n_buffers < 2) w->n_buffers = 2;
+  if (w->n_buffers > MAX_BUFFERS) w->n_buffers = MAX_BUFFERS;
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->cond, NULL);
+  pthread_cond_init(&w->free_cond, NULL);
+  for (i = 0; i < w->n_buffers; i++) {
+    struct Buffer *buf = &w->buffers[i];
+    if (posix_memalign((void**)&buf->data, DIRECT_ALIGN,
+		       USB_WRITER_BUFFER_SIZE) != 0) {
+      fprintf(stderr, "Failed to allocate write buffers\n");
+      w->n_buffers = i;
+      usb_writer_close(w, NULL);
+      return NULL;
+    }
+    /* Fault the pages in now rather than in the drain loop */
+    memset(buf->data, 0, USB_WRITER_BUFFER_SIZE);
+    buf->next = w->free;
+    w->free = buf;
+    w->n_free++;
+  }
+
+#ifdef HAVE_LINUX_IO_URING_H
+  if (w->backend == BACKEND_THREADS && !(flags & USB_WRITER_NO_URING)
+      && uring_setup(w) == 0) {
+    w->backend = BACKEND_URING;
+  }
+#endif
+  if (w->backend != BACKEND_URING) {
+    unsigned int n = w->backend == BACKEND_THREADS ? FILE_THREADS : 1;
+    for (i = 0; i < n; i++) {
+      if (pthread_create(&w->threads[i], NULL, writer_thread, w) != 0) {
+	fprintf(stderr, "Failed to start writer thread\n");
+	break;
+      }
+      w->n_threads++;
+    }
+    if (w->n_threads == 0) {
+      usb_writer_close(w, NULL);
+      return NULL;
+    }
+  }
+  return w;
+}
+
+int
+usb_writer_write(USBWriter *w, const void *data, size_t len)
+{
+  const uint8_t *p = data;
+  size_t space;
+  size_t left = len;
+  if (w->failed) return -1;
+#ifdef HAVE_LINUX_IO_URING_H
+  if (w->backend == BACKEND_URING) uring_reap(w, 0);
+#endif
+  /* Threads only ever add free buffers, so this is a lower bound */
+  space = ((size_t)__atomic_load_n(&w->n_free, __ATOMIC_RELAXED)
+	   * USB_WRITER_BUFFER_SIZE);
+  if (w->current) space += USB_WRITER_BUFFER_SIZE - w->current->len;
+  if (space < len) {
+    w->dropped += len;
+    return 0;
+  }
+  while(left > 0) {
+    size_t n;
+    struct Buffer *buf = w->current;
+    if (!buf) buf = w->current = take_free(w);
+    n = USB_WRITER_BUFFER_SIZE - buf->len;
+    if (n > left) n = left;
+    memcpy(buf->data + buf->len, p, n);
+    buf->len += n;
+    p += n;
+    left -= n;
+    if (buf->len == USB_WRITER_BUFFER_SIZE) {
+      w->current = NULL;
+      submit(w, buf);
+    }
+  }
+  return len;
+}
+
+void
+usb_writer_flush(USBWriter *w)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+  if (w->backend == BACKEND_URING) uring_reap(w, 0);
+#endif
+  if (!w->current || w->current->len == 0
+      || (w->flags & USB_WRITER_DIRECT)) {
+    return;
+  }
+  submit(w, w->current);
+  w->current = NULL;
+}
+
+void
+usb_writer_wait(USBWriter *w)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+  if (w->backend == BACKEND_URING) {
+    while(w->n_free == 0 && !w->failed) uring_reap(w, 1);
+    return;
+  }
+#endif
+  pthread_mutex_lock(&w->lock);
+  while(w->n_free == 0 && !w->failed) {
+    pthread_cond_wait(&w->free_cond, &w->lock);
+  }
+  pthread_mutex_unlock(&w->lock);
+}
+
+static void
+report(USBWriter *w, FILE *out)
+{
+  double secs = (w->last_complete - w->first_submit) / 1e9;
+  fprintf(out, "Writer (%s%s): %llu bytes in %.3f s",
+	  backend_names[w->backend],
+	  (w->flags & USB_WRITER_DIRECT) ? ", O_DIRECT" : "",
+	  w->bytes, secs);
+  if (secs > 0) fprintf(out, ", %.1f MB/s", w->bytes / secs / 1e6);
+  fprintf(out, "\n  %llu writes, %u in flight at most, longest write %llu us,"
+	  " %llu bytes dropped\n", w->writes, w->max_in_flight,
+	  (unsigned long long)w->max_latency / 1000, w->dropped);
+}
+
+int
+usb_writer_close(USBWriter *w, FILE *out)
+{
+  unsigned int i;
+  int ret;
+  uint8_t *tail = NULL;
+  size_t tail_len = 0;
+  uint64_t tail_offset = 0;
+  if (w->current && w->current->len > 0) {
+    struct Buffer *buf = w->current;
+    w->current = NULL;
+    if (w->flags & USB_WRITER_DIRECT) {
+      /* The unaligned end is written without O_DIRECT below */
+      size_t aligned = buf->len & ~(size_t)(DIRECT_ALIGN - 1);
+      tail = buf->data + aligned;
+      tail_len = buf->len - aligned;
+      tail_offset = w->offset + aligned;
+      buf->len = aligned;
+    }
+    if (buf->len > 0) {
+      submit(w, buf);
+    } else {
+      w->offset = tail_offset;
+    }
+  }
+#ifdef HAVE_LINUX_IO_URING_H
+  if (w->backend == BACKEND_URING) {
+    while(w->in_flight > 0) uring_reap(w, 1);
+    uring_close(w);
+  }
+#endif
+  pthread_mutex_lock(&w->lock);
+  w->stopping = 1;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+  for (i = 0; i < w->n_threads; i++) pthread_join(w->threads[i], NULL);
+  for (i = 0; w->spliced_head && i < PIPE_DRAIN_POLLS; i++) {
+    usleep(PIPE_POLL_NS / 1000);
+    release_spliced(w);
+  }
+
+  if (tail_len > 0 && !w->failed) {
+    int fl = fcntl(w->fd, F_GETFL);
+    if (fl < 0 || fcntl(w->fd, F_SETFL, fl & ~O_DIRECT) < 0
+	|| pwrite(w->fd, tail, tail_len, tail_offset) != tail_len) {
+      fprintf(stderr, "Failed to write dump: %s\n", strerror(errno));
+      w->failed = 1;
+    } else {
+      w->bytes += tail_len;
+    }
+  }
+  if (out) report(w, out);
+  if (w->close_fd && close(w->fd) < 0) {
+    fprintf(stderr, "Failed to close dump: %s\n", strerror(errno));
+    w->failed = 1;
+  }
+  ret = w->failed ? -1 : 0;
+  /* Pages still in the pipe must not be reused, leave them to exit */
+  if (!w->spliced_head) {
+    for (i = 0; i < w->n_buffers; i++) free(w->buffers[i].data);
+  }
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->cond);
+  pthread_cond_destroy(&w->free_cond);
+  free(w);
+  return ret;
+}
@@ -0,0 +1,48 @@
+#ifndef USB_WRITER_H
+#define USB_WRITER_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* Asynchronous output for dump files. Data is copied into large aligned
+   buffers and full buffers are written in the background, several at a
+   time: with io_uring for files where the kernel supports it, otherwise
+   with pwrite from a few threads. Pipes are fed with vmsplice from a
+   thread, without copying.
+
+   usb_writer_write() never waits for the disk. When all buffers are in
+   flight the data is dropped and counted instead, the sequence numbers
+   in the dump show the gap later. */
+
+#define USB_WRITER_DIRECT 0x1 /* Open the file with O_DIRECT */
+#define USB_WRITER_NO_URING 0x2 /* Use threads even if io_uring works */
+
+/* Size of each buffer, a multiple of the O_DIRECT alignment */
+#define USB_WRITER_BUFFER_SIZE (1024 * 1024)
+
+typedef struct USBWriter USBWriter;
+
+/* filename "-" is stdout. memory is the total size of the buffers. */
+USBWriter *
+usb_writer_open(const char *filename, unsigned int flags, size_t memory);
+
+/* Returns len, 0 if the data was dropped or -1 after a write error */
+int
+usb_writer_write(USBWriter *writer, const void *data, size_t len);
+
+/* Start writing a partly filled buffer. Does nothing with O_DIRECT,
+   there only whole buffers are written until the file is closed. */
+void
+usb_writer_flush(USBWriter *writer);
+
+/* Wait until a whole buffer is free, a write of up to
+   USB_WRITER_BUFFER_SIZE bytes then succeeds. For benchmarks that want
+   backpressure. */
+void
+usb_writer_wait(USBWriter *writer);
+
+/* Writes the rest and waits for all writes. Returns -1 if any failed. */
+int
+usb_writer_close(USBWriter *writer, FILE *report);
+
+#endif
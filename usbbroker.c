@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+
+#include <usb_ringbuffer.h>
+#include <usb_shmring.h>
+
+/* Number of busy batches before checking the control sockets */
+#define POLL_INTERVAL 64
+
+static volatile sig_atomic_t stop = 0;
+
+static void
+stop_handler(int sig)
+{
+  stop = 1;
+}
+
+static void
+usage(void) {
+  fprintf(stderr,
+	  "usage: usbbroker [options]\n"
+	  "\t-S SOCKET   Socket for consumers (default "
+	  USB_SHMRING_DEFAULT_SOCKET ")\n"
+	  "\t-s MB       Size of shared ring in megabytes (default 64)\n"
+	  );
+}
+
+struct ConsumerState
+{
+  int fd;
+  uint64_t reported_lost;
+  int lagging;
+};
+
+static void
+check_consumers(struct USBShmRing *ring, struct ConsumerState *consumers)
+{
+  uint64_t capacity = usb_shmring_capacity(ring);
+  int i;
+  for (i = 0; i < USB_SHMRING_MAX_CONSUMERS; i++) {
+    struct USBShmRingStatus status;
+    if (consumers[i].fd < 0) continue;
+    if (usb_shmring_status(ring, i, &status) < 0 || !status.active) continue;
+    if (status.lost != consumers[i].reported_lost) {
+      fprintf(stderr, "Consumer %d (pid %u) too slow, %llu blocks lost\n",
+	      i, status.pid,
+	      (unsigned long long)(status.lost - consumers[i].reported_lost));
+      consumers[i].reported_lost = status.lost;
+    }
+    if (!consumers[i].lagging && status.lag > capacity / 4 * 3) {
+      fprintf(stderr, "Consumer %d (pid %u) falling behind\n",
+	      i, status.pid);
+      consumers[i].lagging = 1;
+    } else if (consumers[i].lagging && status.lag < capacity / 4) {
+      consumers[i].lagging = 0;
+    }
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  const char *socket_path = USB_SHMRING_DEFAULT_SOCKET;
+  size_t ring_mb = 64;
+  struct USBRingBuffer *buffer = NULL;
+  struct USBShmRing *ring = NULL;
+  struct USBSamples samples[USB_SHMRING_BATCH_MAX];
+  struct ConsumerState consumers[USB_SHMRING_MAX_CONSUMERS];
+  struct pollfd fds[USB_SHMRING_MAX_CONSUMERS + 1];
+  int slot_of_fd[USB_SHMRING_MAX_CONSUMERS + 1];
+  int listen_fd;
+  int busy = 0;
+  struct USBSequence sequence;
+  time_t last_check = 0;
+  int opt;
+  int i;
+
+  while ((opt = getopt(argc, argv, "S:s:")) != -1) {
+    switch (opt) {
+    case 'S':
+      socket_path = optarg;
+      break;
+    case 's':
+      ring_mb = strtoul(optarg, NULL, 0);
+      if (ring_mb == 0) {
+	usage();
+	exit(EXIT_FAILURE);
+      }
+      break;
+    default: /* '?' */
+      usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  buffer = usb_ringbuffer_init();
+  if (!buffer) exit(EXIT_FAILURE);
+
+  ring = usb_shmring_create(ring_mb * 1024 * 1024
+			    / sizeof(struct USBSamples));
+  if (!ring) exit(EXIT_FAILURE);
+
+  listen_fd = usb_shmring_listen(socket_path);
+  if (listen_fd < 0) exit(EXIT_FAILURE);
+
+  for (i = 0; i < USB_SHMRING_MAX_CONSUMERS; i++) {
+    consumers[i].fd = -1;
+  }
+
+  signal(SIGINT, stop_handler);
+  signal(SIGTERM, stop_handler);
+  signal(SIGPIPE, SIG_IGN);
+
+  usb_sequence_init(&sequence);
+  usb_ringbuffer_clear(buffer);
+  while(!stop) {
+    int n = usb_ringbuffer_read_batch(buffer, samples, USB_SHMRING_BATCH_MAX);
+    int nfds;
+    int timeout;
+    struct timespec now;
+    if (n > 0) {
+      for (i = 0; i < n; i++) {
+	timestamp_t lost_ns;
+	unsigned int lost = usb_sequence_check(&sequence, &samples[i],
+					       &lost_ns);
+	if (lost > 0) {
+	  fprintf(stderr, "Packet sequence error, %u blocks lost\n", lost);
+	}
+      }
+      usb_shmring_publish(ring, samples, n);
+      /* Keep draining while there is data, only looking at the
+	 sockets now and then */
+      if (++busy < POLL_INTERVAL) continue;
+      timeout = 0;
+    } else {
+      timeout = 10;
+    }
+    busy = 0;
+
+    fds[0].fd = listen_fd;
+    fds[0].events = POLLIN;
+    nfds = 1;
+    for (i = 0; i < USB_SHMRING_MAX_CONSUMERS; i++) {
+      if (consumers[i].fd >= 0) {
+	fds[nfds].fd = consumers[i].fd;
+	fds[nfds].events = POLLIN;
+	slot_of_fd[nfds] = i;
+	nfds++;
+      }
+    }
+    if (poll(fds, nfds, timeout) > 0) {
+      for (i = 1; i < nfds; i++) {
+	if (fds[i].revents) {
+	  char c;
+	  /* Consumers never send anything, so this is a hangup */
+	  if (read(fds[i].fd, &c, 1) <= 0) {
+	    usb_shmring_disconnect(ring, fds[i].fd);
+	    consumers[slot_of_fd[i]].fd = -1;
+	  }
+	}
+      }
+      if (fds[0].revents & POLLIN) {
+	int fd;
+	int slot;
+	while((fd = usb_shmring_accept(ring, listen_fd, &slot)) >= 0) {
+	  consumers[slot].fd = fd;
+	  consumers[slot].reported_lost = 0;
+	  consumers[slot].lagging = 0;
+	}
+      }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec != last_check) {
+      check_consumers(ring, consumers);
+      last_check = now.tv_sec;
+    }
+  }
+  close(listen_fd);
+  unlink(socket_path);
+  usb_shmring_destroy(ring);
+  return EXIT_SUCCESS;
+}
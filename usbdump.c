@@ -4,68 +4,224 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <getopt.h>
+#include <signal.h>
 #include <assert.h>
+#include <time.h>
 #include <crc5.h>
 #include <crc16.h>
 #include <usb_ringbuffer.h>
+#include <usb_source.h>
+#include <usb_realtime.h>
+#include <usb_writer.h>
+
+#define SAMPLE_BATCH 256
+/* Default memory for write buffers, in MB */
+#define WRITE_MEMORY 8
+/* While waiting for the bus, a partly filled buffer is written at most
+   this often. Flushing on every wait would make most writes small and
+   keep pipes from being vmspliced. */
+#define FLUSH_INTERVAL_NS 1000000000ULL
+
+static volatile sig_atomic_t stop = 0;
+
+static void
+stop_handler(int sig)
+{
+  stop = 1;
+}
+
+static void
+usage(void) {
+  fprintf(stderr,
+	  "usage: usbdump [options] <dumpfile>\n"
+	  "\t-b SOCKET   Read from usbbroker instead of hardware\n"
+	  "\t-d          Write with O_DIRECT, bypassing the page cache\n"
+	  "\t-m MB       Memory for write buffers (default %d)\n"
+	  "\t-s          Print write statistics at exit\n"
+	  "\t--no-uring  Write from threads instead of io_uring\n"
+	  "\t--write-test=SECONDS  Write synthetic blocks as fast as the\n"
+	  "\t            output takes them and report the bandwidth\n"
+	  "\t--realtime[=CPU[,PRIORITY]]  Pin to CPU, use SCHED_FIFO and\n"
+	  "\t            lock memory, report latencies at exit\n",
+	  WRITE_MEMORY);
+}
+
+static const struct option long_options[] = {
+  {"realtime", optional_argument, NULL, 'R'},
+  {"no-uring", no_argument, NULL, 'U'},
+  {"write-test", required_argument, NULL, 'W'},
+  {NULL, 0, NULL, 0}
+};
+
+static uint64_t
+monotonic_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* Idle bus with consecutive sequence numbers, waiting for the writer
+   instead of dropping so that the result is the sustained bandwidth */
+static int
+write_test(USBWriter *writer, unsigned int seconds)
+{
+  struct USBSamples samples[SAMPLE_BATCH];
+  struct timespec now;
+  time_t end;
+  long start_ns;
+  uint16_t seq = 0;
+  int i;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  end = now.tv_sec + seconds;
+  start_ns = now.tv_nsec;
+  do {
+    for (i = 0; i < SAMPLE_BATCH; i++) {
+      samples[i].count = 32;
+      samples[i].sequence = seq++;
+      samples[i].dp_bits = 0xffffffff;
+      samples[i].dm_bits = 0;
+    }
+    usb_writer_wait(writer);
+    if (usb_writer_write(writer, samples, sizeof(samples)) < 0) return -1;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  } while(!stop && (now.tv_sec < end
+		    || (now.tv_sec == end && now.tv_nsec < start_ns)));
+  return 0;
+}
 
 int
 main(int argc, char *argv[])
 {
-  FILE *dump_out = NULL;
-  struct USBRingBuffer *buffer = NULL;
+  USBWriter *writer = NULL;
+  unsigned int write_flags = 0;
+  unsigned int write_memory = WRITE_MEMORY;
+  unsigned int test_seconds = 0;
+  int stats = 0;
+  int dropped = 0;
+  char *broker_socket = NULL;
+  USBSource *source = NULL;
   timestamp_t time = 0;
-  uint8_t data[16];
-  size_t len;
-  int32_t next_sequence = -1;
+  struct USBSamples samples[SAMPLE_BATCH];
+  int n;
+  int i;
+  int opt;
+  struct USBSequence sequence;
+  int realtime = 0;
+  struct USBRealtime rt;
+  uint64_t last_flush;
   
-  if (argc < 2) {
-    fprintf(stderr,"usage: usbdump <dumpfile>\n");
+  while ((opt = getopt_long(argc, argv, "b:dm:s", long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'b':
+      broker_socket = optarg;
+      break;
+    case 'd':
+      write_flags |= USB_WRITER_DIRECT;
+      break;
+    case 'm':
+      write_memory = atoi(optarg);
+      break;
+    case 's':
+      stats = 1;
+      break;
+    case 'U':
+      write_flags |= USB_WRITER_NO_URING;
+      break;
+    case 'W':
+      test_seconds = atoi(optarg);
+      stats = 1;
+      break;
+    case 'R':
+      realtime = 1;
+      if (usb_realtime_parse(&rt, optarg) < 0) exit(EXIT_FAILURE);
+      break;
+    default: /* '?' */
+      usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (optind >= argc) {
+    usage();
     exit(EXIT_FAILURE);
   }
   
-  buffer = usb_ringbuffer_init();
-  if (!buffer) exit(EXIT_FAILURE);
+  writer = usb_writer_open(argv[optind], write_flags,
+			   (size_t)write_memory * 1024 * 1024);
+  if (!writer) exit(EXIT_FAILURE);
 
-  if (argv[1]) {
-    if (argv[1][0] == '-') {
-      dump_out = stdout;
-    } else {
-      dump_out = fopen(argv[1],"w");
-      if (!dump_out) {
-	fprintf(stderr, "Failed to open file %s for writing: %s\n",
-		argv[1], strerror(errno));
-	exit(EXIT_FAILURE);
-      }
+  if (test_seconds > 0) {
+    signal(SIGINT, stop_handler);
+    signal(SIGTERM, stop_handler);
+    if (write_test(writer, test_seconds) < 0) {
+      usb_writer_close(writer, stderr);
+      exit(EXIT_FAILURE);
     }
+    return usb_writer_close(writer, stderr) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  if (broker_socket) {
+    source = usb_source_open_broker(broker_socket);
+  } else {
+    source = usb_source_open_pru();
+  }
+  if (!source) exit(EXIT_FAILURE);
+
+  if (realtime) {
+    if (usb_realtime_start(&rt) < 0) exit(EXIT_FAILURE);
   }
+  /* Buffers still in memory are written on the way out */
+  signal(SIGINT, stop_handler);
+  signal(SIGTERM, stop_handler);
 
-   usb_ringbuffer_clear(buffer);
-   while(1) {
-    while((len = usb_ringbuffer_read(buffer, data, sizeof(data)))
-	    == 0) {
+   usb_sequence_init(&sequence);
+   usb_source_clear(source);
+   last_flush = monotonic_ns();
+   while(!stop) {
+    while(1) {
+      if (realtime) usb_realtime_read(&rt);
+      n = usb_source_read(source, samples, SAMPLE_BATCH);
+      if (n != 0 || stop) break;
       /* fprintf(stderr,"Wait\n"); */
-      usleep(10000);
-    }
-    if (len == sizeof(struct USBSamples)) {
-      struct USBSamples *samples = (struct USBSamples *)data;
-      if (samples->sequence != next_sequence && next_sequence != -1) {
-	fprintf(stderr, "Packet sequence error expected %d, got %d\n",
-		next_sequence, samples->sequence);
-	usb_ringbuffer_clear(buffer);
-	next_sequence = -1;
+      if (monotonic_ns() - last_flush >= FLUSH_INTERVAL_NS) {
+	usb_writer_flush(writer);
+	last_flush = monotonic_ns();
+      }
+      if (realtime) {
+	usb_realtime_wait(&rt);
       } else {
-	next_sequence = (samples->sequence + 1) & 0xffff;
+	usb_source_wait(source);
+      }
+    }
+    if (n <= 0) break;
+    for (i = 0; i < n; i++) {
+      timestamp_t lost_ns;
+      unsigned int lost = usb_sequence_check(&sequence, &samples[i], &lost_ns);
+      /* The sequence numbers are kept in the dump so the gap is seen
+	 again when it is decoded */
+      if (lost > 0) {
+	fprintf(stderr, "Packet sequence error, %u blocks lost\n", lost);
+	time += lost_ns;
       }
 
-      time += samples->count * NS_PER_BIT;
+      time += samples[i].count * NS_PER_BIT;
+    }
 
-      fwrite(samples, sizeof(struct USBSamples), 1, dump_out);
-      if (ferror(dump_out)) {
-	fprintf(stderr, "Failed to write to file: %s", strerror(errno));
-	exit(EXIT_FAILURE);
-      }
+    switch(usb_writer_write(writer, samples, n * sizeof(struct USBSamples))) {
+    case 0:
+      /* The disk is behind, the sequence gap marks the lost blocks */
+      if (!dropped) fprintf(stderr, "Write buffers full, dropping blocks\n");
+      dropped = 1;
+      break;
+    case -1:
+      exit(EXIT_FAILURE);
+    default:
+      dropped = 0;
     }
   }
+  usb_source_close(source);
+  if (usb_writer_close(writer, stats ? stderr : NULL) < 0) exit(EXIT_FAILURE);
+  if (realtime) usb_realtime_report(&rt, stderr);
 return EXIT_SUCCESS;
 }
@@ -0,0 +1,379 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <usb_source.h>
+#include <usb_packet_decoder.h>
+#include <usb_logger.h>
+
+#define SAMPLE_BATCH 256
+
+/* Formatted packets queued per input ahead of the merge */
+#define READ_AHEAD 1024
+/* Packets moved to and from the queue at a time */
+#define QUEUE_BATCH 64
+
+/* The text of a packet, a gap or decoder errors, formatted by the
+   decoder thread of the input. The items of a batch share one
+   allocation, the last one frees it. */
+struct Item
+{
+  const char *text;
+  size_t text_len;
+  char *chunk; /* Freed after writing this item, NULL if not the last */
+  timestamp_t ts;
+};
+
+struct Input
+{
+  unsigned int index;
+  const char *filename;
+  char *label;
+  timestamp_t start;
+  USBSource *source;
+  USBDecoder decoder;
+  USBLogger errors; /* Decoder text waiting to be queued */
+  USBLogger text; /* Text of the pending items */
+  timestamp_t last_ts; /* Of the last item queued */
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct Item items[READ_AHEAD];
+  unsigned int head; /* Next to merge */
+  unsigned int count;
+  int done; /* No more items will be added */
+  /* Only used by the decoder thread */
+  struct Item pending[QUEUE_BATCH];
+  unsigned int n_pending;
+  /* Only used by the merge */
+  struct Item taken[QUEUE_BATCH];
+  unsigned int n_taken;
+  unsigned int next_taken;
+};
+
+static void
+usage(void) {
+  fprintf(stderr,
+	  "usage: usbmerge [options] [LABEL:]DUMPFILE[@START_NS] ...\n"
+	  "\t-o FILE     Write the merged packets to FILE (default stdout)\n"
+	  "Each capture is decoded and formatted in its own thread and the\n"
+	  "packets are written in time order, with the label on each time\n"
+	  "line.\n"
+	  "START_NS is the time of the first block of the capture. A prefix\n"
+	  "with a / in it is part of the file name, not a label.\n"
+	  );
+}
+
+/* Move the pending items and their text to the queue */
+static void
+publish(struct Input *in)
+{
+  const char *text;
+  char *chunk;
+  size_t len;
+  size_t offset = 0;
+  unsigned int i;
+  text = log_take(&in->text, &len);
+  chunk = malloc(len);
+  if (!chunk && len > 0) {
+    fprintf(stderr, "Out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(chunk, text, len);
+  for (i = 0; i < in->n_pending; i++) {
+    in->pending[i].text = chunk + offset;
+    offset += in->pending[i].text_len;
+  }
+  in->pending[in->n_pending - 1].chunk = chunk;
+  pthread_mutex_lock(&in->lock);
+  while(READ_AHEAD - in->count < in->n_pending) {
+    pthread_cond_wait(&in->cond, &in->lock);
+  }
+  for (i = 0; i < in->n_pending; i++) {
+    in->items[(in->head + in->count++) % READ_AHEAD] = in->pending[i];
+  }
+  in->n_pending = 0;
+  pthread_cond_signal(&in->cond);
+  pthread_mutex_unlock(&in->lock);
+}
+
+/* Add an item at ts with the text formatted since start */
+static void
+push(struct Input *in, timestamp_t ts, size_t start)
+{
+  struct Item *item = &in->pending[in->n_pending++];
+  item->text = NULL;
+  item->text_len = in->text.used - start;
+  item->chunk = NULL;
+  item->ts = ts;
+  in->last_ts = ts;
+  if (in->n_pending == QUEUE_BATCH) publish(in);
+}
+
+/* Returns 0 when the input is finished */
+static int
+pop(struct Input *in, struct Item *item)
+{
+  if (in->next_taken == in->n_taken) {
+    pthread_mutex_lock(&in->lock);
+    while(in->count == 0 && !in->done) {
+      pthread_cond_wait(&in->cond, &in->lock);
+    }
+    in->n_taken = 0;
+    while(in->count > 0 && in->n_taken < QUEUE_BATCH) {
+      in->taken[in->n_taken++] = in->items[in->head];
+      in->head = (in->head + 1) % READ_AHEAD;
+      in->count--;
+    }
+    in->next_taken = 0;
+    pthread_cond_signal(&in->cond);
+    pthread_mutex_unlock(&in->lock);
+    if (in->n_taken == 0) return 0;
+  }
+  *item = in->taken[in->next_taken++];
+  return 1;
+}
+
+/* Queue what the decoder logged since the last item, at ts */
+static void
+queue_errors(struct Input *in, timestamp_t ts)
+{
+  size_t start = in->text.used;
+  const char *text;
+  size_t len;
+  if (in->errors.used == 0) return;
+  text = log_take(&in->errors, &len);
+  /* Error lines without a time line of their own get this one */
+  if (text[0] != '#') log_time(&in->text, ts);
+  log_text(&in->text, text, len);
+  push(in, ts, start);
+}
+
+static void
+queue_packet(uint32_t *bits, uint32_t n_bits, timestamp_t ts,
+	     void *user_data)
+{
+  struct Input *in = user_data;
+  size_t start;
+  /* Logged while decoding this packet or before it */
+  queue_errors(in, ts);
+  start = in->text.used;
+  decode_packet(bits, n_bits, ts, &in->text);
+  push(in, ts, start);
+}
+
+static void *
+decode_thread(void *arg)
+{
+  struct Input *in = arg;
+  struct USBSamples samples[SAMPLE_BATCH];
+  struct USBSequence sequence;
+  timestamp_t time = in->start;
+  int n;
+  int i;
+  usb_sequence_init(&sequence);
+  while((n = usb_source_read(in->source, samples, SAMPLE_BATCH)) >= 0) {
+    for (i = 0; i < n; i++) {
+      timestamp_t lost_ns;
+      unsigned int lost = usb_sequence_check(&sequence, &samples[i], &lost_ns);
+      if (lost > 0) {
+	size_t start;
+	size_t len;
+	queue_errors(in, in->last_ts);
+	start = in->text.used;
+	log_gap(&in->text, time, lost, lost_ns);
+	push(in, time, start);
+	decode_gap(&in->decoder, lost, lost_ns, time);
+	/* The gap item has the line decode_gap logged */
+	log_take(&in->errors, &len);
+	time += lost_ns;
+      }
+      decode_block(&in->decoder, &samples[i], time);
+      /* After the last packet queued, which may have started earlier */
+      queue_errors(in, in->last_ts);
+      time += samples[i].count * NS_PER_BIT;
+    }
+    if (in->n_pending > 0) publish(in);
+  }
+  if (in->n_pending > 0) publish(in);
+  pthread_mutex_lock(&in->lock);
+  in->done = 1;
+  pthread_cond_signal(&in->cond);
+  pthread_mutex_unlock(&in->lock);
+  return NULL;
+}
+
+/* [LABEL:]FILE[@START_NS] */
+static int
+parse_input(struct Input *in, const char *arg, unsigned int index)
+{
+  const char *colon = strchr(arg, ':');
+  const char *at = strrchr(arg, '@');
+  char *file;
+  in->index = index;
+  if (colon && memchr(arg, '/', colon - arg)) colon = NULL;
+  if (colon) {
+    in->label = strndup(arg, colon - arg);
+    arg = colon + 1;
+  } else {
+    in->label = malloc(16);
+    if (in->label) snprintf(in->label, 16, "%u", index);
+  }
+  if (at && at > arg) {
+    char *end;
+    in->start = strtoull(at + 1, &end, 0);
+    if (*end != '\0') {
+      fprintf(stderr, "Invalid start time in %s\n", arg);
+      return -1;
+    }
+    file = strndup(arg, at - arg);
+  } else {
+    file = strdup(arg);
+  }
+  if (!in->label || !file) return -1;
+  in->filename = file;
+  return 0;
+}
+
+static int
+open_input(struct Input *in)
+{
+  in->source = usb_source_open_file(in->filename);
+  if (!in->source) return -1;
+  pthread_mutex_init(&in->lock, NULL);
+  pthread_cond_init(&in->cond, NULL);
+  log_init_capture(&in->errors);
+  log_label(&in->errors, in->label);
+  log_init_capture(&in->text);
+  log_label(&in->text, in->label);
+  if (!in->errors.buf || !in->text.buf) return -1;
+  in->last_ts = in->start;
+  decode_init(&in->decoder, NULL);
+  in->decoder.logger = &in->errors;
+  in->decoder.packet_handler = queue_packet;
+  in->decoder.packet_handler_user_data = in;
+  if (pthread_create(&in->thread, NULL, decode_thread, in) != 0) {
+    fprintf(stderr, "Failed to start decoder thread\n");
+    return -1;
+  }
+  return 0;
+}
+
+/* Binary min-heap of inputs ordered by the time of their next item, ties
+   go to the input given first */
+
+struct HeapEntry
+{
+  struct Item item;
+  struct Input *input;
+};
+
+static inline int
+entry_before(const struct HeapEntry *a, const struct HeapEntry *b)
+{
+  if (a->item.ts != b->item.ts) return a->item.ts < b->item.ts;
+  return a->input->index < b->input->index;
+}
+
+static void
+sift_down(struct HeapEntry *heap, unsigned int n, unsigned int i)
+{
+  while(1) {
+    unsigned int l = 2 * i + 1;
+    unsigned int m = i;
+    struct HeapEntry t;
+    if (l < n && entry_before(&heap[l], &heap[m])) m = l;
+    if (l + 1 < n && entry_before(&heap[l + 1], &heap[m])) m = l + 1;
+    if (m == i) break;
+    t = heap[i];
+    heap[i] = heap[m];
+    heap[m] = t;
+    i = m;
+  }
+}
+
+static void
+output_item(USBLogger *logger, const struct Item *item)
+{
+  log_text(logger, item->text, item->text_len);
+  free(item->chunk);
+}
+
+int
+main(int argc, char *argv[])
+{
+  const char *out_filename = NULL;
+  FILE *out = stdout;
+  struct Input *inputs;
+  struct HeapEntry *heap;
+  unsigned int n_inputs;
+  unsigned int n_heap = 0;
+  unsigned int i;
+  USBLogger logger;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "o:")) != -1) {
+    switch (opt) {
+    case 'o':
+      out_filename = optarg;
+      break;
+    default: /* '?' */
+      usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (optind >= argc) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+  n_inputs = argc - optind;
+  inputs = calloc(n_inputs, sizeof(struct Input));
+  heap = calloc(n_inputs, sizeof(struct HeapEntry));
+  if (!inputs || !heap) exit(EXIT_FAILURE);
+  for (i = 0; i < n_inputs; i++) {
+    if (parse_input(&inputs[i], argv[optind + i], i) < 0) exit(EXIT_FAILURE);
+  }
+  if (out_filename) {
+    out = fopen(out_filename, "w");
+    if (!out) {
+      fprintf(stderr, "Failed to open file %s for writing: %s\n",
+	      out_filename, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
+  log_init(&logger, out);
+
+  for (i = 0; i < n_inputs; i++) {
+    if (open_input(&inputs[i]) < 0) exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < n_inputs; i++) {
+    heap[n_heap].input = &inputs[i];
+    if (pop(&inputs[i], &heap[n_heap].item)) n_heap++;
+  }
+  for (i = n_heap / 2; i-- > 0;) sift_down(heap, n_heap, i);
+
+  while(n_heap > 0) {
+    struct Input *in = heap[0].input;
+    output_item(&logger, &heap[0].item);
+    if (!pop(in, &heap[0].item)) heap[0] = heap[--n_heap];
+    sift_down(heap, n_heap, 0);
+  }
+
+  for (i = 0; i < n_inputs; i++) {
+    pthread_join(inputs[i].thread, NULL);
+    decode_close(&inputs[i].decoder);
+    usb_source_close(inputs[i].source);
+    log_close(&inputs[i].errors);
+    log_close(&inputs[i].text);
+  }
+  log_close(&logger);
+  if (out_filename) {
+    fclose(out);
+  } else {
+    fflush(out);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,619 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <usb_packet.h>
+#include <usb_colstore.h>
+#include <usb_class.h>
+
+#define LATENCY_BUCKETS 40
+/* Packets looked back at for the token and SETUP of a data packet */
+#define MAX_LOOK_BACK 64
+#define DESCRIPTION_MAX 256
+#define DESCRIPTIONS_MAGIC "USBDSC01"
+
+struct Query
+{
+  int pid; /* -1 for any */
+  int addr;
+  int endp;
+  int errors; /* Only packets with CRC errors or invalid ones */
+  uint64_t from; /* Wall clock times in ns, 0 for no limit */
+  uint64_t to;
+  int count_only;
+  int payload;
+  int latency;
+  const struct USBClassMap *classes; /* NULL unless describing */
+  uint64_t classes_hash;
+};
+
+/* The descriptions file of a segment: this header, the index of each
+   described packet, n + 1 offsets into the text and the text. Packets
+   not in the index have no description. */
+struct DescriptionsHeader
+{
+  char magic[8];
+  uint64_t map_hash; /* usb_class_map_hash() of the map used */
+  uint64_t n_packets; /* In the segment */
+  uint64_t n;
+};
+
+struct Descriptions
+{
+  uint64_t n;
+  const uint32_t *index;
+  const uint32_t *text_off;
+  const char *text;
+  void *map;
+  size_t map_len;
+};
+
+struct Latency
+{
+  unsigned long long count;
+  unsigned long long total;
+  unsigned long long min;
+  unsigned long long max;
+  unsigned long long hist[LATENCY_BUCKETS]; /* Bucket n is < 2^(n+1) ns */
+};
+
+static const struct {
+  const char *name;
+  uint8_t pid;
+} pid_names[] = {
+  {"OUT", USB_PID_OUT}, {"IN", USB_PID_IN}, {"SOF", USB_PID_SOF},
+  {"SETUP", USB_PID_SETUP}, {"DATA0", USB_PID_DATA0},
+  {"DATA1", USB_PID_DATA1}, {"ACK", USB_PID_ACK}, {"NAK", USB_PID_NAK},
+  {"STALL", USB_PID_STALL}
+};
+
+#define N_PID_NAMES (sizeof(pid_names) / sizeof(pid_names[0]))
+
+static void
+usage(void) {
+  fprintf(stderr,
+	  "usage: usbquery [options] <store>\n"
+	  "\t-p PID      Only packets with this PID (name or hex byte)\n"
+	  "\t-a ADDR     Only packets for this device address\n"
+	  "\t-e ENDP     Only packets for this endpoint\n"
+	  "\t-f TIME     Only packets at or after this time\n"
+	  "\t-t TIME     Only packets before this time\n"
+	  "\t-E          Only packets with CRC errors or invalid packets\n"
+	  "\t-c          Only count matching packets\n"
+	  "\t-x          Print payloads\n"
+	  "\t-l          Latency from matching packets to the next packet\n"
+	  "\t            of the same transaction\n"
+	  "\t-d          Describe control requests and HID, CDC and mass\n"
+	  "\t            storage payloads\n"
+	  "\t-k ADDR[.ENDP]=hid|cdc|msc  Class of endpoints whose\n"
+	  "\t            enumeration is not in the store\n"
+	  "TIME is in ns since 1970 or, starting with -, seconds before now.\n"
+	  "Packets are printed with their segment and wall clock time in ns.\n"
+	  );
+}
+
+static uint64_t
+parse_time(const char *str)
+{
+  struct timespec now;
+  double seconds;
+  if (str[0] != '-') return strtoull(str, NULL, 0);
+  seconds = atof(str + 1);
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec - (uint64_t)(seconds * 1e9);
+}
+
+static int
+parse_pid(const char *str)
+{
+  unsigned int i;
+  char *end;
+  long v;
+  for (i = 0; i < N_PID_NAMES; i++) {
+    if (strcasecmp(str, pid_names[i].name) == 0) return pid_names[i].pid;
+  }
+  v = strtol(str, &end, 16);
+  if (*end != '\0' || v < 0 || v > 0xff) return -1;
+  return v;
+}
+
+static const char *
+pid_name(uint8_t pid)
+{
+  static char hex[8];
+  unsigned int i;
+  for (i = 0; i < N_PID_NAMES; i++) {
+    if (pid_names[i].pid == pid) return pid_names[i].name;
+  }
+  snprintf(hex, sizeof(hex), "PID %02x", pid);
+  return hex;
+}
+
+/* First packet at or after t */
+static uint64_t
+find_time(const struct USBColSegment *seg, uint64_t t)
+{
+  uint64_t lo = 0;
+  uint64_t hi = seg->n_packets;
+  while(lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (seg->ts[mid] < t) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+static int
+is_token(uint8_t pid)
+{
+  return pid == USB_PID_IN || pid == USB_PID_OUT || pid == USB_PID_SETUP;
+}
+
+/* Token of the transaction of data packet i, 0 if it is not in the
+   segment */
+static uint8_t
+find_token(const struct USBColSegment *seg, uint64_t i)
+{
+  uint64_t j = i;
+  while(j > 0 && i - j < 2) {
+    j--;
+    if (is_token(seg->pid[j])) {
+      return (seg->addr[j] == seg->addr[i] && seg->endp[j] == seg->endp[i])
+	? seg->pid[j] : 0;
+    }
+  }
+  return 0;
+}
+
+/* The SETUP packet of the control transfer of data packet i */
+static const uint8_t *
+find_setup(const struct USBColSegment *seg, uint64_t i)
+{
+  uint64_t j = i;
+  while(j > 1 && i - j < MAX_LOOK_BACK) {
+    j--;
+    if (seg->pid[j - 1] == USB_PID_SETUP && seg->addr[j] == seg->addr[i]
+	&& seg->endp[j] == seg->endp[i]) {
+      unsigned int len;
+      const uint8_t *setup = usb_colstore_payload(seg, j, &len);
+      return len == 8 ? setup : NULL;
+    }
+  }
+  return NULL;
+}
+
+/* Class decoding is only done here, for the packets printed */
+static size_t
+describe(const struct Query *q, const struct USBColSegment *seg, uint64_t i,
+	 const uint8_t *data, unsigned int len, char *buf, size_t size)
+{
+  uint8_t token;
+  const uint8_t *setup;
+  if (!(seg->flags[i] & USB_PACKET_DATA)
+      || (seg->flags[i] & (USB_PACKET_CRC_ERROR | USB_PACKET_INVALID))
+      || seg->addr[i] == USB_COLSTORE_NONE) {
+    return 0;
+  }
+  token = find_token(seg, i);
+  if (token == USB_PID_SETUP) {
+    if (len != 8) return 0;
+    return usb_class_describe_setup(q->classes, seg->addr[i], data,
+				    buf, size);
+  }
+  if (!token) return snprintf(buf, size, "context not found");
+  if (seg->endp[i] == 0) {
+    setup = find_setup(seg, i);
+    if (!setup) return snprintf(buf, size, "context not found");
+    return usb_class_describe_control(q->classes, seg->addr[i], setup,
+				      data, len, buf, size);
+  }
+  return usb_class_describe(usb_class_lookup(q->classes, seg->addr[i],
+					     seg->endp[i],
+					     token == USB_PID_IN),
+			    data, len, buf, size);
+}
+
+/* Description of packet i from the file, NULL if it has none */
+static const char *
+lookup_description(const struct Descriptions *d, uint64_t i, size_t *len)
+{
+  uint64_t lo = 0;
+  uint64_t hi = d->n;
+  while(lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (d->index[mid] < i) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == d->n || d->index[lo] != i) return NULL;
+  *len = d->text_off[lo + 1] - d->text_off[lo];
+  return d->text + d->text_off[lo];
+}
+
+static void
+print_packet(const struct Query *q, const struct USBColSegment *seg,
+	     const struct Descriptions *d, uint64_t i)
+{
+  unsigned int len;
+  const uint8_t *data = usb_colstore_payload(seg, i, &len);
+  printf("%u %llu %s", seg->number,
+	 (unsigned long long)(seg->start_ns + seg->ts[i]), pid_name(seg->pid[i]));
+  if (seg->addr[i] != USB_COLSTORE_NONE) {
+    printf(" %d.%d", seg->addr[i], seg->endp[i]);
+  }
+  if (seg->flags[i] & USB_PACKET_CRC_ERROR) fputs(" CRC-error", stdout);
+  if (seg->flags[i] & USB_PACKET_INVALID) fputs(" invalid", stdout);
+  if (seg->flags[i] & USB_COLSTORE_AFTER_GAP) fputs(" after-gap", stdout);
+  if (len > 0) {
+    printf(" %u bytes", len);
+    if (q->payload) {
+      unsigned int b;
+      putchar(':');
+      for (b = 0; b < len; b++) printf(" %02x", data[b]);
+    }
+  }
+  if (d->map) {
+    size_t text_len;
+    const char *text = lookup_description(d, i, &text_len);
+    if (text) printf(" | %.*s", (int)text_len, text);
+  } else if (q->classes) {
+    char description[DESCRIPTION_MAX];
+    if (describe(q, seg, i, data, len, description, sizeof(description)) > 0) {
+      printf(" | %s", description);
+    }
+  }
+  putchar('\n');
+}
+
+static void
+add_latency(struct Latency *lat, const struct USBColSegment *seg, uint64_t i)
+{
+  unsigned long long d;
+  unsigned int bucket;
+  if (i + 1 >= seg->n_packets
+      || seg->addr[i + 1] != seg->addr[i] || seg->endp[i + 1] != seg->endp[i]
+      || (seg->flags[i + 1] & USB_COLSTORE_AFTER_GAP)) {
+    return;
+  }
+  d = seg->ts[i + 1] - seg->ts[i];
+  bucket = 63 - __builtin_clzll(d | 1);
+  if (bucket >= LATENCY_BUCKETS) bucket = LATENCY_BUCKETS - 1;
+  if (lat->count == 0 || d < lat->min) lat->min = d;
+  if (d > lat->max) lat->max = d;
+  lat->count++;
+  lat->total += d;
+  lat->hist[bucket]++;
+}
+
+static void
+print_latency(const struct Latency *lat)
+{
+  unsigned int b;
+  if (lat->count == 0) {
+    printf("No transactions\n");
+    return;
+  }
+  printf("%llu transactions, min %llu ns, mean %llu ns, max %llu ns\n",
+	 lat->count, lat->min, lat->total / lat->count, lat->max);
+  for (b = 0; b < LATENCY_BUCKETS; b++) {
+    if (lat->hist[b] == 0) continue;
+    printf("< %llu ns: %llu\n", 2ULL << b, lat->hist[b]);
+  }
+}
+
+static unsigned long long
+scan_segment(const struct Query *q, const struct USBColSegment *seg,
+	     const struct Descriptions *d, struct Latency *lat)
+{
+  unsigned long long matches = 0;
+  /* The range in the ts of this segment */
+  uint64_t from = q->from > seg->start_ns ? q->from - seg->start_ns : 0;
+  uint64_t to = q->to > seg->start_ns ? q->to - seg->start_ns : 0;
+  uint64_t i = from > 0 ? find_time(seg, from) : 0;
+  uint64_t end = q->to > 0 ? find_time(seg, to) : seg->n_packets;
+  for (; i < end; i++) {
+    if (q->pid >= 0 && seg->pid[i] != q->pid) continue;
+    if (q->addr >= 0 && seg->addr[i] != q->addr) continue;
+    if (q->endp >= 0 && seg->endp[i] != q->endp) continue;
+    if (q->errors
+	&& !(seg->flags[i] & (USB_PACKET_CRC_ERROR | USB_PACKET_INVALID))) {
+      continue;
+    }
+    matches++;
+    if (q->latency) {
+      add_latency(lat, seg, i);
+    } else if (!q->count_only) {
+      print_packet(q, seg, d, i);
+    }
+  }
+  return matches;
+}
+
+static void
+unmap_descriptions(struct Descriptions *d)
+{
+  if (d->map) munmap(d->map, d->map_len);
+  memset(d, 0, sizeof(*d));
+}
+
+/* Returns -1 if there is no file or it is not for this segment and
+   map */
+static int
+map_descriptions(const char *dir, const struct Query *q,
+		 const struct USBColSegment *seg, struct Descriptions *d)
+{
+  const struct DescriptionsHeader *header;
+  char *path = usb_colstore_path(dir, seg->number, "descriptions");
+  struct stat st;
+  size_t need;
+  int fd;
+  memset(d, 0, sizeof(*d));
+  if (!path) return -1;
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  free(path);
+  if (fd < 0) return -1;
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(*header)) {
+    close(fd);
+    return -1;
+  }
+  d->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (d->map == MAP_FAILED) {
+    d->map = NULL;
+    return -1;
+  }
+  d->map_len = st.st_size;
+  header = d->map;
+  need = sizeof(*header) + header->n * 2 * sizeof(uint32_t) + sizeof(uint32_t);
+  if (memcmp(header->magic, DESCRIPTIONS_MAGIC, sizeof(header->magic)) != 0
+      || header->map_hash != q->classes_hash
+      || header->n_packets != seg->n_packets
+      || header->n > seg->n_packets || d->map_len < need) {
+    unmap_descriptions(d);
+    return -1;
+  }
+  d->n = header->n;
+  d->index = (const uint32_t *)(header + 1);
+  d->text_off = d->index + d->n;
+  d->text = (const char *)(d->text_off + d->n + 1);
+  if (d->text_off[d->n] > d->map_len - need) {
+    unmap_descriptions(d);
+    return -1;
+  }
+  return 0;
+}
+
+/* Describes every packet of a complete segment and writes the
+   descriptions file, so that later queries only look them up */
+static int
+write_descriptions(const char *dir, const struct Query *q,
+		   const struct USBColSegment *seg)
+{
+  struct DescriptionsHeader header;
+  char *path = usb_colstore_path(dir, seg->number, "descriptions");
+  char *tmp;
+  uint32_t *index;
+  uint32_t *text_off;
+  char *text = NULL;
+  size_t text_size = 0;
+  size_t text_used = 0;
+  uint64_t n = 0;
+  uint64_t i;
+  FILE *out;
+  int ok = 0;
+  index = malloc(seg->n_packets * sizeof(uint32_t) + 1);
+  text_off = malloc((seg->n_packets + 1) * sizeof(uint32_t));
+  tmp = path ? malloc(strlen(path) + 8) : NULL;
+  if (!index || !text_off || !tmp) goto done;
+  for (i = 0; i < seg->n_packets; i++) {
+    char description[DESCRIPTION_MAX];
+    unsigned int len;
+    const uint8_t *data = usb_colstore_payload(seg, i, &len);
+    size_t d_len = describe(q, seg, i, data, len,
+			    description, sizeof(description));
+    if (d_len == 0) continue;
+    if (d_len >= sizeof(description)) d_len = sizeof(description) - 1;
+    if (text_used + d_len > UINT32_MAX) goto done;
+    if (text_used + d_len > text_size) {
+      char *more;
+      text_size = text_size ? 2 * text_size : 64 * 1024;
+      more = realloc(text, text_size);
+      if (!more) goto done;
+      text = more;
+    }
+    index[n] = i;
+    text_off[n++] = text_used;
+    memcpy(text + text_used, description, d_len);
+    text_used += d_len;
+  }
+  text_off[n] = text_used;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, DESCRIPTIONS_MAGIC, sizeof(header.magic));
+  header.map_hash = q->classes_hash;
+  header.n_packets = seg->n_packets;
+  header.n = n;
+  sprintf(tmp, "%s.new", path);
+  out = fopen(tmp, "w");
+  ok = out && fwrite(&header, sizeof(header), 1, out) == 1
+    && fwrite(index, sizeof(uint32_t), n, out) == n
+    && fwrite(text_off, sizeof(uint32_t), n + 1, out) == n + 1
+    && fwrite(text, 1, text_used, out) == text_used;
+  if (out && fclose(out) != 0) ok = 0;
+  /* The store may be read only, packets are then described as they
+     are printed */
+  if (ok) ok = rename(tmp, path) == 0;
+  if (!ok) remove(tmp);
+ done:
+  free(index);
+  free(text_off);
+  free(text);
+  free(tmp);
+  free(path);
+  return ok ? 0 : -1;
+}
+
+/* Learns the classes from the segments after those the saved map
+   covers. The last segment may still grow, so it is learned again next
+   time. */
+static struct USBClassMap *
+learn_classes(const char *dir, unsigned int n_segments)
+{
+  struct USBClassMap *map = malloc(sizeof(struct USBClassMap));
+  struct USBClassLearner *learner = malloc(sizeof(struct USBClassLearner));
+  unsigned int s;
+  if (!map || !learner) {
+    fprintf(stderr, "Out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  usb_class_map_init(map);
+  s = usb_class_map_load(map, dir);
+  if (s > n_segments) {
+    usb_class_map_init(map);
+    s = 0;
+  }
+  usb_class_learn_init(learner, map);
+  for (; s < n_segments; s++) {
+    struct USBColSegment seg;
+    uint64_t i;
+    if (usb_colstore_map(dir, s, &seg) < 0) exit(EXIT_FAILURE);
+    for (i = 0; i < seg.n_packets; i++) {
+      unsigned int len;
+      const uint8_t *data = usb_colstore_payload(&seg, i, &len);
+      usb_class_learn(learner, seg.pid[i], seg.addr[i], seg.endp[i],
+		      seg.flags[i], data, len);
+    }
+    usb_colstore_unmap(&seg);
+    if (s + 2 == n_segments) usb_class_map_save(map, dir, s + 1);
+  }
+  free(learner);
+  return map;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct Query query;
+  struct Latency latency;
+  unsigned long long matches = 0;
+  unsigned int n_segments;
+  unsigned int s;
+  int opt;
+  int describe_payloads = 0;
+  struct USBClassMap *classes = NULL;
+  char *class_settings[16];
+  unsigned int n_class_settings = 0;
+
+  memset(&query, 0, sizeof(query));
+  memset(&latency, 0, sizeof(latency));
+  query.pid = -1;
+  query.addr = -1;
+  query.endp = -1;
+  while ((opt = getopt(argc, argv, "p:a:e:f:t:Ecxldk:")) != -1) {
+    switch (opt) {
+    case 'p':
+      query.pid = parse_pid(optarg);
+      if (query.pid < 0) {
+	fprintf(stderr, "Unknown PID %s\n", optarg);
+	exit(EXIT_FAILURE);
+      }
+      break;
+    case 'a':
+      query.addr = atoi(optarg);
+      break;
+    case 'e':
+      query.endp = atoi(optarg);
+      break;
+    case 'f':
+      query.from = parse_time(optarg);
+      break;
+    case 't':
+      query.to = parse_time(optarg);
+      break;
+    case 'E':
+      query.errors = 1;
+      break;
+    case 'c':
+      query.count_only = 1;
+      break;
+    case 'x':
+      query.payload = 1;
+      break;
+    case 'l':
+      query.latency = 1;
+      break;
+    case 'd':
+      describe_payloads = 1;
+      break;
+    case 'k':
+      if (n_class_settings == 16) {
+	fprintf(stderr, "Too many class settings\n");
+	exit(EXIT_FAILURE);
+      }
+      class_settings[n_class_settings++] = optarg;
+      describe_payloads = 1;
+      break;
+    default: /* '?' */
+      usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (optind >= argc) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+
+  n_segments = usb_colstore_segments(argv[optind]);
+  if (describe_payloads && !query.latency && !query.count_only) {
+    classes = learn_classes(argv[optind], n_segments);
+    for (s = 0; s < n_class_settings; s++) {
+      if (usb_class_map_set(classes, class_settings[s]) < 0) {
+	exit(EXIT_FAILURE);
+      }
+    }
+    query.classes = classes;
+    query.classes_hash = usb_class_map_hash(classes);
+  }
+  for (s = 0; s < n_segments; s++) {
+    struct USBColSegment seg;
+    struct Descriptions descriptions;
+    memset(&descriptions, 0, sizeof(descriptions));
+    if (usb_colstore_map(argv[optind], s, &seg) < 0) exit(EXIT_FAILURE);
+    /* Each segment is in time order, skip those outside the range.
+       Segments of different runs overlap in ts, not in wall clock
+       time. */
+    if (seg.n_packets > 0
+	&& !(query.to > 0 && seg.start_ns + seg.ts[0] >= query.to)
+	&& !(seg.start_ns + seg.ts[seg.n_packets - 1] < query.from)) {
+      /* Descriptions are kept once a segment is complete, the last one
+	 may still grow */
+      if (query.classes && s + 1 < n_segments
+	  && map_descriptions(argv[optind], &query, &seg, &descriptions) < 0
+	  && write_descriptions(argv[optind], &query, &seg) == 0) {
+	map_descriptions(argv[optind], &query, &seg, &descriptions);
+      }
+      matches += scan_segment(&query, &seg, &descriptions, &latency);
+      unmap_descriptions(&descriptions);
+    }
+    usb_colstore_unmap(&seg);
+  }
+  free(classes);
+  if (query.latency) {
+    print_latency(&latency);
+  } else if (query.count_only) {
+    printf("%llu\n", matches);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,853 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <usb_dumpfile.h>
+#include <usb_packet_decoder.h>
+#include <usb_packet.h>
+#include <usb_logger.h>
+
+/* Payloads are searched per stream, an endpoint in one direction, in the
+   same order as usbsniff -E writes them: acknowledged data packets
+   without retransmissions. Matches may span any number of packets.
+
+   The dump is split into chunks that are searched in parallel. Each
+   chunk starts decoding a while before its first block to get in sync
+   with the packets and data toggles, and runs past its last block to
+   finish the transaction in progress. Only matches that start and end
+   within a chunk are found by its thread. Matches across a chunk
+   boundary are found afterwards from the last bytes of each stream
+   before the boundary and the first ones after it. */
+
+#define N_DIRS 3
+#define N_STREAMS (128 * 16 * N_DIRS)
+#define STREAM_NUMBER(addr, endp, dir) ((((addr) << 4) | (endp)) * N_DIRS \
+					+ (dir))
+
+#define MAX_PATTERN 4096
+
+/* Bus time decoded before a chunk, about 20 ms */
+#define WARMUP_BITS (256 * 1024)
+
+#define CHUNKS_PER_THREAD 4
+#define MIN_CHUNK_BLOCKS (64 * 1024)
+
+static const char *dir_names[N_DIRS] = {"out", "in", "setup"};
+
+struct Pattern
+{
+  uint8_t *bytes;
+  unsigned int len;
+  char *text; /* As given */
+  int next_same; /* Next pattern ending in the same state, -1 if none */
+};
+
+/* Aho-Corasick automaton. Bytes that appear in no pattern share one
+   class, which keeps the transition table small. */
+struct Automaton
+{
+  uint8_t classes[256];
+  unsigned int n_classes;
+  unsigned int n_states;
+  unsigned int max_len;
+  uint32_t *next; /* n_states * n_classes, complete */
+  int32_t *out; /* First pattern ending in the state */
+  int32_t *dict; /* Nearest state on the fail chain with output */
+  int32_t *report; /* The state itself if it has output, else dict */
+};
+
+/* First byte of a packet in a stream */
+struct Start
+{
+  uint64_t pos;
+  timestamp_t ts;
+};
+
+struct Stream
+{
+  uint32_t state;
+  uint64_t n_bytes;
+  uint8_t *ring; /* Last ring_mask + 1 bytes */
+  struct Start *starts; /* Last ring_mask + 1 packets */
+  uint64_t n_starts;
+  uint8_t *head; /* First max_len - 1 bytes */
+  struct Start *head_starts;
+  unsigned int n_head_starts;
+};
+
+struct Hit
+{
+  timestamp_t ts; /* Packet with the first byte of the match */
+  uint64_t offset; /* In the stream */
+  uint32_t pattern;
+  uint16_t stream;
+  uint16_t packet_offset;
+};
+
+struct Chunk
+{
+  struct USBDumpPos warmup;
+  struct USBDumpPos start;
+  size_t end_block;
+  timestamp_t end_time;
+  struct Stream *streams[N_STREAMS];
+  struct Hit *hits;
+  size_t n_hits;
+  size_t hits_size;
+};
+
+struct Search
+{
+  USBDumpFile *dump;
+  struct Pattern *patterns;
+  unsigned int n_patterns;
+  struct Automaton ac;
+  uint64_t ring_mask;
+  struct Chunk *chunks;
+  unsigned int n_chunks;
+  pthread_mutex_t lock;
+  unsigned int next_chunk;
+};
+
+struct Worker
+{
+  struct Search *search;
+  struct Chunk *chunk;
+  pthread_t thread;
+  USBDecoder decoder;
+  USBLogger quiet;
+  struct USBPacketTracker tracker;
+  uint8_t seen[N_STREAMS];
+  uint8_t toggles[N_STREAMS];
+  /* Data packet waiting for its handshake */
+  int pending;
+  int pending_owned; /* Sent within the chunk */
+  uint8_t pending_pid;
+  unsigned int pending_stream;
+  timestamp_t pending_ts;
+  unsigned int pending_len;
+  uint8_t pending_data[USB_MAX_PAYLOAD];
+};
+
+/* Bytes before a chunk boundary */
+struct Carry
+{
+  uint64_t total; /* Bytes of the stream so far */
+  unsigned int len;
+  uint8_t *bytes;
+  struct Start *meta; /* Packet of each byte, with the stream offset */
+};
+
+static void
+usage(void) {
+  fprintf(stderr,
+	  "usage: usbsearch [options] DUMPFILE\n"
+	  "\t-x HEX      Search for bytes given in hex\n"
+	  "\t-s TEXT     Search for a string\n"
+	  "\t-f FILE     Search for each line of FILE, in hex\n"
+	  "\t-j THREADS  Number of threads (default number of CPUs)\n"
+	  "Each hit is written as a line with the time of the packet where\n"
+	  "the match starts, address.endpoint, direction, offset in the\n"
+	  "stream as written by usbsniff -E, offset in the packet and\n"
+	  "the pattern.\n"
+	  );
+}
+
+static void
+alloc_failed(void)
+{
+  fprintf(stderr, "Failed to allocate memory\n");
+  exit(EXIT_FAILURE);
+}
+
+static void *
+alloc(size_t size)
+{
+  void *p = malloc(size > 0 ? size : 1);
+  if (!p) alloc_failed();
+  return p;
+}
+
+static int
+hex_value(int c)
+{
+  if (c >= '0' && c <= '9') return c - '0';
+  c = tolower(c);
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+/* Hex digits, optionally separated by spaces or colons */
+static int
+add_hex_pattern(struct Search *search, const char *text)
+{
+  struct Pattern *pattern;
+  const char *s = text;
+  unsigned int len = 0;
+  uint8_t *bytes = alloc(strlen(text) / 2 + 1);
+  while(*s) {
+    int h, l;
+    if (*s == ' ' || *s == ':' || *s == '\t') {
+      s++;
+      continue;
+    }
+    h = hex_value(s[0]);
+    l = h >= 0 ? hex_value(s[1]) : -1;
+    if (l < 0) {
+      fprintf(stderr, "Invalid hex pattern %s\n", text);
+      free(bytes);
+      return -1;
+    }
+    bytes[len++] = h << 4 | l;
+    s += 2;
+  }
+  if (len == 0 || len > MAX_PATTERN) {
+    fprintf(stderr, "Pattern must be 1 to %d bytes\n", MAX_PATTERN);
+    free(bytes);
+    return -1;
+  }
+  search->patterns = realloc(search->patterns, (search->n_patterns + 1)
+			     * sizeof(struct Pattern));
+  if (!search->patterns) alloc_failed();
+  pattern = &search->patterns[search->n_patterns++];
+  pattern->bytes = bytes;
+  pattern->len = len;
+  pattern->text = strdup(text);
+  if (!pattern->text) alloc_failed();
+  return 0;
+}
+
+static int
+add_text_pattern(struct Search *search, const char *text)
+{
+  struct Pattern *pattern;
+  unsigned int len = strlen(text);
+  if (len == 0 || len > MAX_PATTERN) {
+    fprintf(stderr, "Pattern must be 1 to %d bytes\n", MAX_PATTERN);
+    return -1;
+  }
+  search->patterns = realloc(search->patterns, (search->n_patterns + 1)
+			     * sizeof(struct Pattern));
+  if (!search->patterns) alloc_failed();
+  pattern = &search->patterns[search->n_patterns++];
+  pattern->bytes = alloc(len);
+  memcpy(pattern->bytes, text, len);
+  pattern->len = len;
+  pattern->text = alloc(len + 3);
+  snprintf(pattern->text, len + 3, "\"%s\"", text);
+  return 0;
+}
+
+static int
+read_pattern_file(struct Search *search, const char *filename)
+{
+  char line[2 * MAX_PATTERN + 256];
+  FILE *file = fopen(filename, "r");
+  if (!file) {
+    fprintf(stderr, "Failed to open file %s for reading: %s\n",
+	    filename, strerror(errno));
+    return -1;
+  }
+  while(fgets(line, sizeof(line), file)) {
+    size_t len = strlen(line);
+    while(len > 0 && isspace((unsigned char)line[len - 1])) line[--len] = '\0';
+    if (len == 0 || line[0] == '#') continue;
+    if (add_hex_pattern(search, line) < 0) {
+      fclose(file);
+      return -1;
+    }
+  }
+  fclose(file);
+  return 0;
+}
+
+static void
+build_automaton(struct Automaton *ac, struct Pattern *patterns,
+		unsigned int n_patterns)
+{
+  unsigned int max_states = 1;
+  unsigned int nc;
+  unsigned int head = 0;
+  unsigned int tail = 0;
+  uint32_t *fail;
+  uint32_t *queue;
+  unsigned int i, j, c;
+
+  memset(ac->classes, 0, sizeof(ac->classes));
+  ac->max_len = 0;
+  for (i = 0; i < n_patterns; i++) {
+    for (j = 0; j < patterns[i].len; j++) ac->classes[patterns[i].bytes[j]] = 1;
+    max_states += patterns[i].len;
+    if (patterns[i].len > ac->max_len) ac->max_len = patterns[i].len;
+  }
+  nc = 1;
+  for (c = 0; c < 256; c++) {
+    if (ac->classes[c]) ac->classes[c] = nc++;
+  }
+  ac->n_classes = nc;
+  ac->next = alloc((size_t)max_states * nc * sizeof(uint32_t));
+  ac->out = alloc(max_states * sizeof(int32_t));
+  ac->dict = alloc(max_states * sizeof(int32_t));
+  ac->report = alloc(max_states * sizeof(int32_t));
+  fail = alloc(max_states * sizeof(uint32_t));
+  queue = alloc(max_states * sizeof(uint32_t));
+
+  /* Trie, 0 is the root and means no transition while building */
+  memset(ac->next, 0, (size_t)max_states * nc * sizeof(uint32_t));
+  ac->out[0] = -1;
+  ac->n_states = 1;
+  for (i = 0; i < n_patterns; i++) {
+    uint32_t s = 0;
+    for (j = 0; j < patterns[i].len; j++) {
+      uint32_t *t = &ac->next[(size_t)s * nc
+			      + ac->classes[patterns[i].bytes[j]]];
+      if (*t == 0) {
+	ac->out[ac->n_states] = -1;
+	*t = ac->n_states++;
+      }
+      s = *t;
+    }
+    patterns[i].next_same = ac->out[s];
+    ac->out[s] = i;
+  }
+
+  /* Breadth first, so the fail state's row is complete before it is
+     used */
+  fail[0] = 0;
+  ac->dict[0] = -1;
+  for (c = 0; c < nc; c++) {
+    uint32_t t = ac->next[c];
+    if (t != 0) {
+      fail[t] = 0;
+      queue[tail++] = t;
+    }
+  }
+  while(head < tail) {
+    uint32_t s = queue[head++];
+    uint32_t f = fail[s];
+    ac->dict[s] = ac->out[f] >= 0 ? (int32_t)f : ac->dict[f];
+    for (c = 0; c < nc; c++) {
+      uint32_t *t = &ac->next[(size_t)s * nc + c];
+      if (*t != 0) {
+	fail[*t] = ac->next[(size_t)f * nc + c];
+	queue[tail++] = *t;
+      } else {
+	*t = ac->next[(size_t)f * nc + c];
+      }
+    }
+  }
+  for (i = 0; i < ac->n_states; i++) {
+    ac->report[i] = ac->out[i] >= 0 ? (int32_t)i : ac->dict[i];
+  }
+  free(fail);
+  free(queue);
+}
+
+/* The packet containing pos, among the last n of a ring or the first n
+   of an array if mask is all ones */
+static const struct Start *
+find_start(const struct Start *starts, uint64_t n, uint64_t mask, uint64_t pos)
+{
+  uint64_t i = n;
+  while(i > 0 && n - i <= mask) {
+    const struct Start *start = &starts[(i - 1) & mask];
+    if (start->pos <= pos) return start;
+    i--;
+  }
+  return NULL;
+}
+
+static struct Stream *
+get_stream(struct Search *search, struct Chunk *chunk, unsigned int number)
+{
+  struct Stream *stream = chunk->streams[number];
+  size_t ring_size = search->ring_mask + 1;
+  size_t head_size = search->ac.max_len - 1;
+  if (stream) return stream;
+  stream = alloc(sizeof(struct Stream));
+  memset(stream, 0, sizeof(struct Stream));
+  stream->ring = alloc(ring_size);
+  stream->starts = alloc(ring_size * sizeof(struct Start));
+  stream->head = alloc(head_size);
+  stream->head_starts = alloc(head_size * sizeof(struct Start));
+  chunk->streams[number] = stream;
+  return stream;
+}
+
+static void
+add_hit(struct Chunk *chunk, const struct Hit *hit)
+{
+  if (chunk->n_hits == chunk->hits_size) {
+    chunk->hits_size = chunk->hits_size ? 2 * chunk->hits_size : 256;
+    chunk->hits = realloc(chunk->hits, chunk->hits_size * sizeof(struct Hit));
+    if (!chunk->hits) alloc_failed();
+  }
+  chunk->hits[chunk->n_hits++] = *hit;
+}
+
+static void
+report_hits(struct Search *search, struct Chunk *chunk, struct Stream *stream,
+	    unsigned int number, int32_t state, uint64_t pos)
+{
+  const struct Automaton *ac = &search->ac;
+  int32_t t;
+  for (t = ac->report[state]; t >= 0; t = ac->dict[t]) {
+    int32_t p;
+    for (p = ac->out[t]; p >= 0; p = search->patterns[p].next_same) {
+      struct Hit hit;
+      uint64_t first = pos + 1 - search->patterns[p].len;
+      const struct Start *start = find_start(stream->starts, stream->n_starts,
+					     search->ring_mask, first);
+      hit.ts = start->ts;
+      hit.offset = first;
+      hit.pattern = p;
+      hit.stream = number;
+      hit.packet_offset = first - start->pos;
+      add_hit(chunk, &hit);
+    }
+  }
+}
+
+static void
+add_bytes(struct Worker *w, unsigned int number, const uint8_t *data,
+	  unsigned int len, timestamp_t ts)
+{
+  struct Search *search = w->search;
+  const struct Automaton *ac = &search->ac;
+  struct Stream *stream = get_stream(search, w->chunk, number);
+  const uint64_t mask = search->ring_mask;
+  const unsigned int head_len = ac->max_len - 1;
+  const unsigned int nc = ac->n_classes;
+  uint64_t pos = stream->n_bytes;
+  uint32_t s = stream->state;
+  struct Start start;
+  unsigned int i;
+  start.pos = pos;
+  start.ts = ts;
+  stream->starts[stream->n_starts++ & mask] = start;
+  if (pos < head_len) {
+    stream->head_starts[stream->n_head_starts++] = start;
+    for (i = 0; i < len && pos + i < head_len; i++) {
+      stream->head[pos + i] = data[i];
+    }
+  }
+  for (i = 0; i < len; i++) {
+    uint8_t b = data[i];
+    stream->ring[(pos + i) & mask] = b;
+    s = ac->next[(size_t)s * nc + ac->classes[b]];
+    if (ac->report[s] >= 0) {
+      report_hits(search, w->chunk, stream, number, s, pos + i);
+    }
+  }
+  stream->n_bytes = pos + len;
+  stream->state = s;
+}
+
+static void
+commit_pending(struct Worker *w)
+{
+  unsigned int number = w->pending_stream;
+  w->seen[number] = 1;
+  w->toggles[number] = w->pending_pid;
+  if (w->pending_owned && w->pending_len > 0) {
+    add_bytes(w, number, w->pending_data, w->pending_len, w->pending_ts);
+  }
+  w->pending = 0;
+}
+
+/* Same rules as the extractor */
+static void
+search_packet(uint32_t *bits, uint32_t n_bits, timestamp_t ts,
+	      void *user_data)
+{
+  struct Worker *w = user_data;
+  struct USBPacketInfo info;
+  usb_packet_parse(&w->tracker, bits, n_bits, ts, &info);
+  if (info.flags & USB_PACKET_HANDSHAKE) {
+    if (w->pending && info.pid == USB_PID_ACK) {
+      unsigned int number = w->pending_stream;
+      if (number % N_DIRS == USB_DIR_SETUP) {
+	unsigned int control = STREAM_NUMBER(number / N_DIRS >> 4, 0, 0);
+	commit_pending(w);
+	/* Both directions of the control endpoint start with DATA1 */
+	if (w->seen[control + USB_DIR_IN]) {
+	  w->toggles[control + USB_DIR_IN] = USB_PID_DATA0;
+	}
+	if (w->seen[control + USB_DIR_OUT]) {
+	  w->toggles[control + USB_DIR_OUT] = USB_PID_DATA0;
+	}
+      } else if (!(w->seen[number] && w->toggles[number] == w->pending_pid)) {
+	commit_pending(w);
+      }
+    }
+    w->pending = 0;
+    return;
+  }
+  /* A data packet without handshake is isochronous */
+  if (w->pending) commit_pending(w);
+  if ((info.flags & USB_PACKET_DATA) && info.data && info.has_token) {
+    unsigned int len = info.data_len;
+    if (len > USB_MAX_PAYLOAD) len = USB_MAX_PAYLOAD;
+    w->pending = 1;
+    w->pending_owned = (ts >= w->chunk->start.time
+			&& ts < w->chunk->end_time);
+    w->pending_pid = info.pid;
+    w->pending_stream = STREAM_NUMBER(info.addr, info.endp, info.dir);
+    w->pending_ts = info.ts;
+    w->pending_len = len;
+    memcpy(w->pending_data, info.data, len);
+  }
+}
+
+static void
+search_gap(struct Worker *w)
+{
+  w->pending = 0;
+  usb_packet_tracker_init(&w->tracker);
+  memset(w->toggles, 0, sizeof(w->toggles));
+}
+
+static void
+search_chunk(struct Worker *w, struct Chunk *chunk)
+{
+  const USBDumpFile *dump = w->search->dump;
+  struct USBSequence sequence = chunk->warmup.sequence;
+  timestamp_t time = chunk->warmup.time;
+  size_t b;
+  w->chunk = chunk;
+  memset(&w->decoder, 0, sizeof(w->decoder));
+  decode_init(&w->decoder, NULL);
+  w->decoder.logger = &w->quiet;
+  w->decoder.packet_handler = search_packet;
+  w->decoder.packet_handler_user_data = w;
+  usb_packet_tracker_init(&w->tracker);
+  memset(w->seen, 0, sizeof(w->seen));
+  memset(w->toggles, 0, sizeof(w->toggles));
+  w->pending = 0;
+  for (b = chunk->warmup.block; b < dump->n_blocks; b++) {
+    const struct USBSamples *samples = &dump->blocks[b];
+    timestamp_t lost_ns;
+    unsigned int lost;
+    if (b >= chunk->end_block) {
+      /* Finish the last packet and transaction of the chunk */
+      int in_packet = (w->decoder.bit_count >= 0
+		       && w->decoder.sync_ts < chunk->end_time);
+      if (!in_packet && !(w->pending && w->pending_owned)) break;
+    }
+    lost = usb_sequence_check(&sequence, samples, &lost_ns);
+    if (lost > 0) {
+      decode_gap(&w->decoder, lost, lost_ns, time);
+      search_gap(w);
+      time += lost_ns;
+    }
+    decode_block(&w->decoder, samples, time);
+    time += samples->count * NS_PER_BIT;
+  }
+  decode_close(&w->decoder);
+}
+
+static void *
+search_thread(void *arg)
+{
+  struct Worker *w = arg;
+  struct Search *search = w->search;
+  while(1) {
+    unsigned int c;
+    pthread_mutex_lock(&search->lock);
+    c = search->next_chunk++;
+    pthread_mutex_unlock(&search->lock);
+    if (c >= search->n_chunks) break;
+    search_chunk(w, &search->chunks[c]);
+  }
+  return NULL;
+}
+
+static void
+split_chunks(struct Search *search, unsigned int n_threads)
+{
+  const USBDumpFile *dump = search->dump;
+  struct USBDumpPos *pos;
+  unsigned int n = n_threads * CHUNKS_PER_THREAD;
+  unsigned int i;
+  if (n > dump->n_blocks / MIN_CHUNK_BLOCKS) n = dump->n_blocks
+					      / MIN_CHUNK_BLOCKS;
+  if (n == 0) n = 1;
+  search->n_chunks = n;
+  search->chunks = alloc(n * sizeof(struct Chunk));
+  memset(search->chunks, 0, n * sizeof(struct Chunk));
+  pos = alloc(2 * n * sizeof(struct USBDumpPos));
+  for (i = 0; i < n; i++) {
+    size_t block = dump->n_blocks * (uint64_t)i / n;
+    pos[2 * i].block = usb_dumpfile_back(dump, block, WARMUP_BITS);
+    pos[2 * i + 1].block = block;
+  }
+  usb_dumpfile_locate(dump, pos, 2 * n);
+  for (i = 0; i < n; i++) {
+    search->chunks[i].warmup = pos[2 * i];
+    search->chunks[i].start = pos[2 * i + 1];
+  }
+  for (i = 0; i + 1 < n; i++) {
+    search->chunks[i].end_block = search->chunks[i + 1].start.block;
+    search->chunks[i].end_time = search->chunks[i + 1].start.time;
+  }
+  search->chunks[n - 1].end_block = dump->n_blocks;
+  search->chunks[n - 1].end_time = ~(timestamp_t)0;
+  free(pos);
+}
+
+/* Matches that start in carry and end in the first bytes of stream */
+static void
+find_boundary_hits(struct Search *search, struct Chunk *chunk,
+		   unsigned int number, const struct Carry *carry,
+		   const struct Stream *stream)
+{
+  const struct Automaton *ac = &search->ac;
+  unsigned int head_len = ac->max_len - 1;
+  uint32_t s = 0;
+  unsigned int i;
+  if (stream->n_bytes < head_len) head_len = stream->n_bytes;
+  for (i = 0; i < carry->len; i++) {
+    s = ac->next[(size_t)s * ac->n_classes + ac->classes[carry->bytes[i]]];
+  }
+  for (i = 0; i < head_len; i++) {
+    int32_t t;
+    s = ac->next[(size_t)s * ac->n_classes + ac->classes[stream->head[i]]];
+    for (t = ac->report[s]; t >= 0; t = ac->dict[t]) {
+      int32_t p;
+      for (p = ac->out[t]; p >= 0; p = search->patterns[p].next_same) {
+	unsigned int len = search->patterns[p].len;
+	const struct Start *meta;
+	struct Hit hit;
+	unsigned int first;
+	if (len <= i + 1) continue; /* Found by the chunk */
+	first = carry->len + i + 1 - len;
+	meta = &carry->meta[first];
+	hit.offset = carry->total - carry->len + first;
+	hit.ts = meta->ts;
+	hit.pattern = p;
+	hit.stream = number;
+	hit.packet_offset = hit.offset - meta->pos;
+	add_hit(chunk, &hit);
+      }
+    }
+  }
+}
+
+/* Keep the last bytes of the stream up to the end of the chunk */
+static void
+update_carry(struct Search *search, struct Carry *carry,
+	     const struct Stream *stream)
+{
+  unsigned int keep = search->ac.max_len - 1;
+  uint64_t n = stream->n_bytes;
+  uint64_t from;
+  uint64_t pos;
+  unsigned int i;
+  if (n < keep) {
+    /* Older bytes move down to make room */
+    unsigned int old = keep - n;
+    if (old > carry->len) old = carry->len;
+    memmove(carry->bytes, carry->bytes + carry->len - old, old);
+    memmove(carry->meta, carry->meta + carry->len - old,
+	    old * sizeof(struct Start));
+    carry->len = old;
+    from = 0;
+  } else {
+    carry->len = 0;
+    from = n - keep;
+  }
+  for (pos = from; pos < n; pos++) {
+    const struct Start *start;
+    i = carry->len++;
+    if (pos < search->ac.max_len - 1) {
+      carry->bytes[i] = stream->head[pos];
+      start = find_start(stream->head_starts, stream->n_head_starts,
+			 ~(uint64_t)0, pos);
+    } else {
+      carry->bytes[i] = stream->ring[pos & search->ring_mask];
+      start = find_start(stream->starts, stream->n_starts,
+			 search->ring_mask, pos);
+    }
+    carry->meta[i].pos = carry->total + start->pos;
+    carry->meta[i].ts = start->ts;
+  }
+  carry->total += n;
+}
+
+static int
+hit_cmp(const void *a, const void *b)
+{
+  const struct Hit *ha = a;
+  const struct Hit *hb = b;
+  if (ha->ts != hb->ts) return ha->ts < hb->ts ? -1 : 1;
+  if (ha->stream != hb->stream) return ha->stream < hb->stream ? -1 : 1;
+  if (ha->offset != hb->offset) return ha->offset < hb->offset ? -1 : 1;
+  if (ha->pattern != hb->pattern) return ha->pattern < hb->pattern ? -1 : 1;
+  return 0;
+}
+
+/* Turns chunk offsets into stream offsets, adds matches across chunk
+   boundaries and writes all hits in time order */
+static void
+output_hits(struct Search *search, FILE *out)
+{
+  struct Carry **carries;
+  struct Hit *hits;
+  size_t n_hits = 0;
+  unsigned int c;
+  size_t i;
+  carries = alloc(N_STREAMS * sizeof(struct Carry*));
+  memset(carries, 0, N_STREAMS * sizeof(struct Carry*));
+  for (c = 0; c < search->n_chunks; c++) {
+    struct Chunk *chunk = &search->chunks[c];
+    unsigned int number;
+    for (i = 0; i < chunk->n_hits; i++) {
+      struct Carry *carry = carries[chunk->hits[i].stream];
+      if (carry) chunk->hits[i].offset += carry->total;
+    }
+    for (number = 0; number < N_STREAMS; number++) {
+      struct Stream *stream = chunk->streams[number];
+      struct Carry *carry = carries[number];
+      if (!stream) continue;
+      if (!carry) {
+	carry = alloc(sizeof(struct Carry));
+	carry->total = 0;
+	carry->len = 0;
+	carry->bytes = alloc(search->ac.max_len - 1);
+	carry->meta = alloc((search->ac.max_len - 1) * sizeof(struct Start));
+	carries[number] = carry;
+      }
+      if (carry->len > 0) find_boundary_hits(search, chunk, number, carry,
+					     stream);
+      update_carry(search, carry, stream);
+    }
+    n_hits += chunk->n_hits;
+  }
+
+  hits = alloc(n_hits * sizeof(struct Hit));
+  n_hits = 0;
+  for (c = 0; c < search->n_chunks; c++) {
+    struct Chunk *chunk = &search->chunks[c];
+    if (chunk->n_hits == 0) continue;
+    memcpy(hits + n_hits, chunk->hits, chunk->n_hits * sizeof(struct Hit));
+    n_hits += chunk->n_hits;
+  }
+  qsort(hits, n_hits, sizeof(struct Hit), hit_cmp);
+  for (i = 0; i < n_hits; i++) {
+    const struct Hit *hit = &hits[i];
+    fprintf(out, "%llu %03d.%d %s %llu %u %s\n", hit->ts,
+	    hit->stream / N_DIRS >> 4, hit->stream / N_DIRS & 0xf,
+	    dir_names[hit->stream % N_DIRS],
+	    (unsigned long long)hit->offset, hit->packet_offset,
+	    search->patterns[hit->pattern].text);
+  }
+  free(hits);
+  for (i = 0; i < N_STREAMS; i++) {
+    if (!carries[i]) continue;
+    free(carries[i]->bytes);
+    free(carries[i]->meta);
+    free(carries[i]);
+  }
+  free(carries);
+}
+
+static void
+free_chunks(struct Search *search)
+{
+  unsigned int c, i;
+  for (c = 0; c < search->n_chunks; c++) {
+    struct Chunk *chunk = &search->chunks[c];
+    for (i = 0; i < N_STREAMS; i++) {
+      struct Stream *stream = chunk->streams[i];
+      if (!stream) continue;
+      free(stream->ring);
+      free(stream->starts);
+      free(stream->head);
+      free(stream->head_starts);
+      free(stream);
+    }
+    free(chunk->hits);
+  }
+  free(search->chunks);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct Search search;
+  struct Worker *workers;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned int n_threads = cpus > 0 ? cpus : 1;
+  unsigned int i;
+  int opt;
+
+  memset(&search, 0, sizeof(search));
+  while ((opt = getopt(argc, argv, "x:s:f:j:")) != -1) {
+    switch (opt) {
+    case 'x':
+      if (add_hex_pattern(&search, optarg) < 0) exit(EXIT_FAILURE);
+      break;
+    case 's':
+      if (add_text_pattern(&search, optarg) < 0) exit(EXIT_FAILURE);
+      break;
+    case 'f':
+      if (read_pattern_file(&search, optarg) < 0) exit(EXIT_FAILURE);
+      break;
+    case 'j':
+      n_threads = atoi(optarg) > 0 ? atoi(optarg) : 1;
+      break;
+    default: /* '?' */
+      usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (optind + 1 != argc || search.n_patterns == 0) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+
+  build_automaton(&search.ac, search.patterns, search.n_patterns);
+  search.ring_mask = 1;
+  while(search.ring_mask < search.ac.max_len) search.ring_mask <<= 1;
+  search.ring_mask--;
+
+  search.dump = usb_dumpfile_open(argv[optind]);
+  if (!search.dump) exit(EXIT_FAILURE);
+  split_chunks(&search, n_threads);
+  if (n_threads > search.n_chunks) n_threads = search.n_chunks;
+
+  pthread_mutex_init(&search.lock, NULL);
+  workers = alloc(n_threads * sizeof(struct Worker));
+  for (i = 0; i < n_threads; i++) {
+    workers[i].search = &search;
+    log_init(&workers[i].quiet, NULL);
+    if (pthread_create(&workers[i].thread, NULL, search_thread,
+		       &workers[i]) != 0) {
+      fprintf(stderr, "Failed to start search thread\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < n_threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  free(workers);
+
+  output_hits(&search, stdout);
+  fflush(stdout);
+  free_chunks(&search);
+  usb_dumpfile_close(search.dump);
+  free(search.ac.next);
+  free(search.ac.out);
+  free(search.ac.dict);
+  free(search.ac.report);
+  for (i = 0; i < search.n_patterns; i++) {
+    free(search.patterns[i].bytes);
+    free(search.patterns[i].text);
+  }
+  free(search.patterns);
+  return EXIT_SUCCESS;
+}
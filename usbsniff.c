@@ -6,58 +6,37 @@
 #include <errno.h>
 #include <assert.h>
 #include <time.h>
+#include <getopt.h>
+#include <signal.h>
 
 
 #include <usb_ringbuffer.h>
+#include <usb_source.h>
+#include <usb_import.h>
 #include <usb_packet_decoder.h>
+#include <usb_extract.h>
+#include <usb_timeline.h>
+#include <usb_latency.h>
+#include <usb_colstore.h>
+#include <usb_pyramid.h>
+#include <usb_profile.h>
+#include <usb_realtime.h>
+#include <usb_decode_cache.h>
+#include <usb_vcd.h>
+#include <usb_vcd_window.h>
 
+#define SAMPLE_BATCH 256
+/* Packets that may be held by handlers at the same time */
+#define PACKET_POOL_SIZE 64
+/* stdio buffer of outputs in real-time mode */
+#define OUTPUT_BUFFER (1024 * 1024)
 
+static volatile sig_atomic_t stop = 0;
 
-static int
-write_vcd_header(FILE *out)
+static void
+stop_handler(int sig)
 {
-  time_t now;
-  char now_str[26];
-  now = time(NULL);
-  ctime_r(&now, now_str);
-  fprintf(out,"$date %s $end\n", now_str);
-  fputs("$version usbsniff $end\n", out);
-  fputs("$timescale 1 ns $end\n"
-	"$scope module top $end\n"
-	"$var wire 1 + DP $end\n"
-	"$var wire 1 - DM $end\n"
-	"$upscope $end\n"
-	"$enddefinitions $end\n",
-	out);
-  return 0;
-}
-
-
-
-static int
-write_vcd_sample(FILE *out, const struct USBSamples *samples,
-		 timestamp_t time) {
-  uint32_t b = 1;
-  uint32_t dp = samples->dp_bits;
-  uint32_t dp_chg = dp ^ (dp << 1);
-  uint32_t dm = samples->dm_bits;
-  uint32_t dm_chg = dm ^ (dm << 1);
-  fprintf(out, "#%lld\n", time);
-
-  fprintf(out, "%d+\n%d-\n", dp & 1, dm & 1); 
-  for (b = 1; b != 0; b <<= 1) {
-    if ((dp_chg | dm_chg) & b) {
-      fprintf(out, "#%lld\n", time);
-    }
-    if (dp_chg & b) {
-      fprintf(out, "%c+\n", (dp & b) ? '1' : '0');
-    }
-     if (dm_chg & b) {
-      fprintf(out, "%c-\n", (dm & b) ? '1' : '0');
-    }
-    time += NS_PER_BIT;
-  }
-  return 0;
+  stop = 1;
 }
 
 
@@ -67,41 +46,236 @@ usage(void) {
   fprintf(stderr, 
 	  "usage: usbsniff [options]\n"
 	  "\t-V FILE     VCD file\n"
+	  "\t-W FILE     VCD file with only the bus around packets\n"
+	  "\t--window PRE,POST  Microseconds before SYNC and after EOP\n"
+	  "\t            written with -W, default 2,2\n"
+	  "\t--window-on LIST  What -W writes windows around, any of\n"
+	  "\t            packets, data (not SOF), errors and ADDR[.ENDP],\n"
+	  "\t            default packets,errors\n"
 	  "\t-D	FILE     Decoded USB packets\n"
-	  "\t-i FILE     Use this dum file as input instead of hardware\n"
+	  "\t-i FILE     Use this dum file as input instead of hardware,\n"
+	  "\t            files ending in .vcd are read as VCD\n"
+	  "\t--signals DP,DM  Names of the signals in a VCD input file\n"
+	  "\t--logic RATE,DP,DM[,UNITSIZE]  Input file is raw logic samples\n"
+	  "\t            at RATE Hz with DP and DM on these channels\n"
+	  "\t-b SOCKET   Read from usbbroker instead of hardware\n"
+	  "\t-f, --follow  Keep reading the input file as it grows\n"
+	  "\t--cache     Keep the decoded packets of the input dump in\n"
+	  "\t            DUMP.dcache and use them on later runs\n"
+	  "\t-E PREFIX   Extract payloads to PREFIX-ADDR.EP-DIR.bin\n"
+	  "\t-T FILE     Bus utilisation per frame, binary\n"
+	  "\t-C FILE     Bus utilisation per frame, CSV\n"
+	  "\t-Q DIR      Store packets for usbquery in DIR\n"
+	  "\t--latency FILE  Transaction latency histograms per endpoint\n"
+	  "\t--latency-interval SECONDS  Time covered by each latency\n"
+	  "\t            snapshot, default 60\n"
+	  "\t--pyramid DIR  Bus activity at several resolutions for\n"
+	  "\t            usbsummary\n"
+	  "\t--pyramid-base SECONDS  Buckets of the finest level, default\n"
+	  "\t            0.001\n"
+	  "\t--batch[=PACKETS[,BLOCKS]]  Hand decoded packets to the outputs\n"
+	  "\t            in batches of up to PACKETS packets or BLOCKS\n"
+	  "\t            blocks, default 256,256\n"
+	  "\t--profile   Print time spent in each stage at exit\n"
+	  "\t--realtime[=CPU[,PRIORITY]]  Pin to CPU, use SCHED_FIFO and\n"
+	  "\t            lock memory, report latencies at exit\n"
 	  );
   
 }
 
+static FILE *
+open_output(const char *filename)
+{
+  FILE *out;
+  if (filename[0] == '-') return stdout;
+  out = fopen(filename,"w");
+  if (!out) {
+    fprintf(stderr, "Failed to open file %s for writing: %s\n",
+	    filename, strerror(errno));
+  }
+  return out;
+}
+
+static int
+has_suffix(const char *str, const char *suffix)
+{
+  size_t len = strlen(str);
+  size_t suffix_len = strlen(suffix);
+  return len >= suffix_len && strcmp(str + len - suffix_len, suffix) == 0;
+}
+
+/* CLOCK_REALTIME in ns */
+static uint64_t
+wall_clock_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static const struct option long_options[] = {
+  {"follow", no_argument, NULL, 'f'},
+  {"profile", no_argument, NULL, 'P'},
+  {"signals", required_argument, NULL, 'N'},
+  {"logic", required_argument, NULL, 'L'},
+  {"realtime", optional_argument, NULL, 'R'},
+  {"cache", no_argument, NULL, 'K'},
+  {"window", required_argument, NULL, 'w'},
+  {"window-on", required_argument, NULL, 'o'},
+  {"batch", optional_argument, NULL, 'B'},
+  {"latency", required_argument, NULL, 'A'},
+  {"latency-interval", required_argument, NULL, 'I'},
+  {"pyramid", required_argument, NULL, 'Y'},
+  {"pyramid-base", required_argument, NULL, 'y'},
+  {NULL, 0, NULL, 0}
+};
+
 int
 main(int argc, char *argv[])
 {
   FILE *vcd_out = NULL;
   FILE *decoded_out = NULL;
-  FILE *input = NULL;
   char *vcd_filename = NULL;
   char *decoded_filename = NULL;
   char *input_filename = NULL;
-  struct USBRingBuffer *buffer = NULL;
+  char *broker_socket = NULL;
+  USBSource *source = NULL;
   USBLogger logger;
-  struct USBDecoder decoder = {0};
+  struct USBDecoder decoder;
+  USBPacketPool *pool = NULL;
   int opt;
   timestamp_t time = 0;
-  uint8_t data[16];
-  size_t len;
-  int32_t next_sequence = -1;
-  
-  while ((opt = getopt(argc, argv, "V:D:i:")) != -1) {
+  struct USBSamples samples[SAMPLE_BATCH];
+  int n;
+  int i;
+  struct USBSequence sequence;
+  int follow = 0;
+  char *extract_prefix = NULL;
+  USBExtractor *extractor = NULL;
+  char *timeline_filename = NULL;
+  char *timeline_csv_filename = NULL;
+  USBTimeline *timeline = NULL;
+  char *latency_filename = NULL;
+  timestamp_t latency_interval = LATENCY_DEFAULT_INTERVAL_NS;
+  USBLatency *latency = NULL;
+  double latency_seconds;
+  char *store_dir = NULL;
+  USBColStore *store = NULL;
+  char *pyramid_dir = NULL;
+  uint64_t pyramid_base = USB_PYRAMID_DEFAULT_BASE_NS;
+  double pyramid_seconds;
+  USBPyramid *pyramid = NULL;
+  struct USBPacketHandlerChain handlers;
+  int decoding;
+  int profile = 0;
+  char *signals = NULL;
+  char *dm_signal = NULL;
+  char *logic_format = NULL;
+  int realtime = 0;
+  struct USBRealtime rt;
+  int use_cache = 0;
+  USBDecodeCache *cache = NULL;
+  char *window_filename = NULL;
+  USBVCDWindow window;
+  FILE *window_out = NULL;
+  unsigned int batch_packets = 0;
+  unsigned int batch_blocks = USB_PACKET_BATCH_DEFAULT_BLOCKS;
+  struct USBPacketBatch *batch = NULL;
+
+  usb_vcd_window_defaults(&window);
+  while ((opt = getopt_long(argc, argv, "V:W:D:i:b:fE:T:C:Q:", long_options,
+			    NULL))
+	 != -1) {
     switch (opt) {
     case 'V':
       vcd_filename = optarg;
       break;
+    case 'W':
+      window_filename = optarg;
+      break;
+    case 'w':
+      if (usb_vcd_window_parse_times(&window, optarg) < 0) exit(EXIT_FAILURE);
+      break;
+    case 'o':
+      if (usb_vcd_window_parse_on(&window, optarg) < 0) exit(EXIT_FAILURE);
+      break;
     case 'D':
       decoded_filename = optarg;
       break;
     case 'i':
       input_filename = optarg;
       break;
+    case 'b':
+      broker_socket = optarg;
+      break;
+    case 'f':
+      follow = 1;
+      break;
+    case 'E':
+      extract_prefix = optarg;
+      break;
+    case 'T':
+      timeline_filename = optarg;
+      break;
+    case 'C':
+      timeline_csv_filename = optarg;
+      break;
+    case 'A':
+      latency_filename = optarg;
+      break;
+    case 'I':
+      if (sscanf(optarg, "%lf", &latency_seconds) != 1
+	  || latency_seconds < 1e-6) {
+	usage();
+	exit(EXIT_FAILURE);
+      }
+      latency_interval = latency_seconds * 1e9;
+      break;
+    case 'Y':
+      pyramid_dir = optarg;
+      break;
+    case 'y':
+      if (sscanf(optarg, "%lf", &pyramid_seconds) != 1
+	  || pyramid_seconds < 1e-6) {
+	usage();
+	exit(EXIT_FAILURE);
+      }
+      pyramid_base = pyramid_seconds * 1e9;
+      break;
+    case 'P':
+      profile = 1;
+      break;
+    case 'Q':
+      store_dir = optarg;
+      break;
+    case 'N':
+      signals = optarg;
+      dm_signal = strchr(signals, ',');
+      if (!dm_signal) {
+	usage();
+	exit(EXIT_FAILURE);
+      }
+      *dm_signal++ = '\0';
+      break;
+    case 'L':
+      logic_format = optarg;
+      break;
+    case 'R':
+      realtime = 1;
+      if (usb_realtime_parse(&rt, optarg) < 0) exit(EXIT_FAILURE);
+      break;
+    case 'K':
+      use_cache = 1;
+      break;
+    case 'B':
+      batch_packets = USB_PACKET_BATCH_DEFAULT_PACKETS;
+      if (optarg
+	  && (sscanf(optarg, "%u,%u", &batch_packets, &batch_blocks) < 1
+	      || batch_packets == 0 || batch_blocks == 0)) {
+	usage();
+	exit(EXIT_FAILURE);
+      }
+      break;
       
     default: /* '?' */
       usage();
@@ -110,95 +284,282 @@ main(int argc, char *argv[])
   }
   
 
-  if (input_filename) {
-    input = fopen(input_filename,"rb");
-    if (!input) {
-      fprintf(stderr, "Failed to open file %s for reading: %s\n",
-	      input_filename, strerror(errno));
+  if (follow && !input_filename) {
+    fprintf(stderr, "--follow needs an input file\n");
+    exit(EXIT_FAILURE);
+  }
+  if (use_cache
+      && (!input_filename || follow || logic_format || vcd_filename
+	  || window_filename || has_suffix(input_filename, ".vcd"))) {
+    fprintf(stderr, "--cache needs a dump file input and no -V or -W\n");
+    exit(EXIT_FAILURE);
+  }
+  if (use_cache) {
+    cache = usb_decode_cache_open(input_filename);
+    if (!cache) exit(EXIT_FAILURE);
+  } else if (input_filename) {
+    if (follow) {
+      if (logic_format || has_suffix(input_filename, ".vcd")) {
+	fprintf(stderr, "--follow only works with dump files\n");
+	exit(EXIT_FAILURE);
+      }
+      source = usb_source_open_file_follow(input_filename);
+    } else if (logic_format) {
+      unsigned long rate;
+      unsigned int dp;
+      unsigned int dm;
+      unsigned int unit_size = 1;
+      if (sscanf(logic_format, "%lu,%u,%u,%u", &rate, &dp, &dm, &unit_size)
+	  < 3) {
+	usage();
+	exit(EXIT_FAILURE);
+      }
+      source = usb_source_open_logic(input_filename, rate, dp, dm, unit_size);
+    } else if (has_suffix(input_filename, ".vcd")) {
+      source = usb_source_open_vcd(input_filename, signals, dm_signal);
+    } else if (has_suffix(input_filename, ".sr")) {
+      fprintf(stderr, "Convert sigrok sessions with "
+	      "sigrok-cli -i FILE -O binary and use --logic\n");
       exit(EXIT_FAILURE);
+    } else {
+      source = usb_source_open_file(input_filename);
     }
+  } else if (broker_socket) {
+    source = usb_source_open_broker(broker_socket);
   } else { 
-    buffer = usb_ringbuffer_init();
-    if (!buffer) exit(EXIT_FAILURE);
+    source = usb_source_open_pru();
   }
+  if (!source && !cache) exit(EXIT_FAILURE);
   
-  decoder.n_buf_bits = 0;
-  decoder.bit_count = -8;
-  decoder.one_count = 0;
+  usb_sequence_init(&sequence);
+  pool = usb_packet_pool_create(PACKET_POOL_SIZE);
+  if (!pool) {
+    fprintf(stderr, "Failed to allocate packet buffers\n");
+    exit(EXIT_FAILURE);
+  }
+  decode_init(&decoder, pool);
 
-  decoder.packet_handler = decode_packet;
-  decoder.packet_handler_user_data = &logger;
   decoder.logger = &logger;
 
   if (decoded_filename) {
-    if (decoded_filename[0] == '-') {
-      decoded_out = stdout;
-    } else {
-      decoded_out = fopen(decoded_filename,"w");
-      if (!decoded_out) {
-	fprintf(stderr, "Failed to open file %s for writing: %s\n",
-		decoded_filename, strerror(errno));
-      }
-    }
+    decoded_out = open_output(decoded_filename);
   }
 
   log_init(&logger, decoded_out);
 
-  if (vcd_filename) {
-    if (vcd_filename[0] == '-') {
-      vcd_out = stdout;
-    } else {
-      vcd_out = fopen(vcd_filename,"w");
-      if (!vcd_out) {
-	fprintf(stderr, "Failed to open file %s for writing: %s\n",
-		vcd_filename, strerror(errno));
-      }
+  if (extract_prefix) {
+    extractor = usb_extract_init(extract_prefix, pool);
+    if (!extractor) exit(EXIT_FAILURE);
+  }
+
+  if (timeline_filename || timeline_csv_filename) {
+    FILE *bin = NULL;
+    FILE *csv = NULL;
+    if (timeline_filename) {
+      bin = open_output(timeline_filename);
+      if (!bin) exit(EXIT_FAILURE);
+    }
+    if (timeline_csv_filename) {
+      csv = open_output(timeline_csv_filename);
+      if (!csv) exit(EXIT_FAILURE);
+    }
+    timeline = usb_timeline_init(bin, csv);
+    if (!timeline) exit(EXIT_FAILURE);
+  }
+
+  if (latency_filename) {
+    FILE *out = open_output(latency_filename);
+    if (!out) exit(EXIT_FAILURE);
+    latency = usb_latency_init(out, latency_interval);
+    if (!latency) exit(EXIT_FAILURE);
+  }
+
+  if (store_dir) {
+    /* Bus time 0 is about now, replays are stamped with the time they
+       were replayed */
+    store = usb_colstore_open(store_dir, wall_clock_ns());
+    if (!store) exit(EXIT_FAILURE);
+  }
+
+  if (pyramid_dir) {
+    pyramid = usb_pyramid_open(pyramid_dir, pyramid_base, wall_clock_ns());
+    if (!pyramid) exit(EXIT_FAILURE);
+  }
+
+  packet_handler_chain_init(&handlers);
+  if (decoded_out) {
+    packet_handler_chain_add_batch(&handlers, decode_packet,
+				   decode_packet_batch, &logger);
+  }
+  if (extractor) {
+    packet_handler_chain_add_batch(&handlers, usb_extract_packet,
+				   usb_extract_batch, extractor);
+  }
+  if (timeline) {
+    packet_handler_chain_add_batch(&handlers, usb_timeline_packet,
+				   usb_timeline_batch, timeline);
+  }
+  if (latency) {
+    packet_handler_chain_add_batch(&handlers, usb_latency_packet,
+				   usb_latency_batch, latency);
+  }
+  if (store) {
+    packet_handler_chain_add_batch(&handlers, usb_colstore_packet,
+				   usb_colstore_batch, store);
+  }
+  if (pyramid) {
+    packet_handler_chain_add_batch(&handlers, usb_pyramid_packet,
+				   usb_pyramid_batch, pyramid);
+  }
+  if (window_filename) {
+    window_out = open_output(window_filename);
+    if (!window_out) exit(EXIT_FAILURE);
+    if (usb_vcd_window_init(&window, window_out, &decoder) < 0) {
+      exit(EXIT_FAILURE);
+    }
+    packet_handler_chain_add_batch(&handlers, usb_vcd_window_packet,
+				   usb_vcd_window_batch, &window);
+  }
+  if (handlers.n_handlers == 1) {
+    decoder.packet_handler = handlers.handlers[0];
+    decoder.packet_handler_user_data = handlers.user_data[0];
+  } else {
+    decoder.packet_handler = packet_handler_chain;
+    decoder.packet_handler_user_data = &handlers;
+  }
+  decoding = handlers.n_handlers > 0;
+  if (decoding && batch_packets > 0 && !cache) {
+    batch = usb_packet_batch_create(batch_packets);
+    if (!batch) {
+      fprintf(stderr, "Failed to allocate packet batch\n");
+      exit(EXIT_FAILURE);
     }
+    decode_set_batch(&decoder, batch, batch_blocks,
+		     packet_handler_chain_batch, &handlers);
+  }
+
+  if (vcd_filename) {
+    vcd_out = open_output(vcd_filename);
   }
 
   
   if (vcd_out) {
-    write_vcd_header(vcd_out);
-  }
-  while(1) {
-    if (buffer) {
-      while((len = usb_ringbuffer_read(buffer, data, sizeof(data)))
-	    == 0) {
-	/* fprintf(stderr,"Wait\n"); */
-	usleep(10000);
-      }
-    } else {
-      len = sizeof(struct USBSamples);
-      fread(data, len, 1, input);
-      if (ferror(input)) {
-	fprintf(stderr, "Failed to read input file: %s\n", strerror(errno));
-	exit(EXIT_FAILURE);
+    usb_vcd_header(vcd_out);
+  }
+  if (realtime) {
+    if (decoded_out) usb_realtime_buffer(decoded_out, OUTPUT_BUFFER);
+    if (vcd_out) usb_realtime_buffer(vcd_out, OUTPUT_BUFFER);
+    if (window_out) usb_realtime_buffer(window_out, OUTPUT_BUFFER);
+    if (usb_realtime_start(&rt) < 0) exit(EXIT_FAILURE);
+  }
+  signal(SIGINT, stop_handler);
+  signal(SIGTERM, stop_handler);
+  if (cache) {
+    /* Same calls as the decoding loop below makes */
+    struct USBDecodeRecord rec;
+    while(!stop && usb_decode_cache_next(cache, &rec)) {
+      switch(rec.type) {
+      case USB_DECODE_CACHE_PACKET:
+	if (decoding) {
+	  decoder.packet_handler((uint32_t*)rec.bits, rec.n_bits, rec.ts,
+				 decoder.packet_handler_user_data);
+	}
+	break;
+      case USB_DECODE_CACHE_TEXT:
+	log_text(&logger, rec.text, rec.len);
+	break;
+      case USB_DECODE_CACHE_GAP:
+	fprintf(stderr, "Packet sequence error, %u blocks lost\n",
+		rec.lost_blocks);
+	if (decoding) {
+	  log_gap(&logger, rec.ts, rec.lost_blocks, rec.lost_ns);
+	}
+	if (extractor) usb_extract_gap(extractor);
+	if (timeline) usb_timeline_gap(timeline);
+	if (latency) usb_latency_gap(latency);
+	if (store) usb_colstore_gap(store);
+	if (pyramid) usb_pyramid_gap(pyramid, rec.lost_blocks, rec.ts);
+	break;
       }
-      if (feof(input)) break;
     }
-    if (len == sizeof(struct USBSamples)) {
-      struct USBSamples *samples = (struct USBSamples *)data;
-      if (samples->sequence != next_sequence && next_sequence != -1) {
-	fprintf(stderr, "Packet sequence error expected %d, got %d\n",
-		next_sequence, samples->sequence);
-	usb_ringbuffer_clear(buffer);
-	next_sequence = -1;
+    usb_decode_cache_close(cache);
+  }
+  while(source && !stop) {
+    while(1) {
+      USB_PROFILE_START(t0);
+      if (realtime) usb_realtime_read(&rt);
+      n = usb_source_read(source, samples, SAMPLE_BATCH);
+      USB_PROFILE_END(USB_PROFILE_READ, t0);
+      if (n != 0 || stop) break;
+      /* fprintf(stderr,"Wait\n"); */
+      /* Nothing more right now, so let the readers see what we have */
+      if (batch) decode_flush(&decoder);
+      log_flush(&logger);
+      if (vcd_out) fflush(vcd_out);
+      if (window_out) fflush(window_out);
+      if (extractor) usb_extract_flush(extractor);
+      if (store) usb_colstore_flush(store);
+      if (pyramid) usb_pyramid_flush(pyramid);
+      if (realtime) {
+	usb_realtime_wait(&rt);
       } else {
-	next_sequence = (samples->sequence + 1) & 0xffff;
+	usb_source_wait(source);
+      }
+    }
+    if (n < 0) break;
+    for (i = 0; i < n; i++) {
+      timestamp_t lost_ns;
+      unsigned int lost = usb_sequence_check(&sequence, &samples[i], &lost_ns);
+      if (lost > 0) {
+	/* Keep what we have and restart decoding after the gap */
+	fprintf(stderr, "Packet sequence error, %u blocks lost\n", lost);
+	if (decoding) {
+	  decode_gap(&decoder, lost, lost_ns, time);
+	}
+	if (extractor) usb_extract_gap(extractor);
+	if (timeline) usb_timeline_gap(timeline);
+	if (latency) usb_latency_gap(latency);
+	if (store) usb_colstore_gap(store);
+	if (pyramid) usb_pyramid_gap(pyramid, lost, time);
+	if (window_out) usb_vcd_window_gap(&window);
+	time += lost_ns;
       }
 
       /* fprintf(stderr, "Time: %ld %ld\n", time, samples->count);  */
-      if (decoded_out) {
-	
-	decode_block(&decoder,samples, time);
+      if (decoding) {
+	USB_PROFILE_START(t0);
+	decode_block(&decoder, &samples[i], time);
+	USB_PROFILE_END(USB_PROFILE_DECODE, t0);
       }
       if (vcd_out) {
-	write_vcd_sample(vcd_out, samples, time);
+	USB_PROFILE_START(t0);
+	usb_vcd_write_block(vcd_out, &samples[i], time);
+	USB_PROFILE_END(USB_PROFILE_VCD, t0);
+      }
+      if (window_out) {
+	USB_PROFILE_START(t0);
+	usb_vcd_window_block(&window, &samples[i], time);
+	USB_PROFILE_END(USB_PROFILE_VCD, t0);
       }
-      time += samples->count * NS_PER_BIT;
+      time += samples[i].count * NS_PER_BIT;
     }
   }
+  if (batch) decode_flush(&decoder);
   log_close(&logger);
+  if (extractor) usb_extract_close(extractor);
+  if (timeline) usb_timeline_close(timeline);
+  if (latency) usb_latency_close(latency);
+  if (store) usb_colstore_close(store);
+  if (pyramid) usb_pyramid_close(pyramid);
+  if (window_out) usb_vcd_window_close(&window);
+  decode_close(&decoder);
+  if (batch) usb_packet_batch_destroy(batch);
+  usb_packet_pool_destroy(pool);
+  if (decoded_out) fflush(decoded_out);
+  if (vcd_out) fflush(vcd_out);
+  if (source) usb_source_close(source);
+  if (profile) usb_profile_report(stderr);
+  if (realtime) usb_realtime_report(&rt, stderr);
 
 return EXIT_SUCCESS;
 }
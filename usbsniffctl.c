@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <usbsniffd.h>
+
+/* Sends one command to usbsniffd and prints the reply */
+
+#define LINE_MAX 512
+
+static void
+usage(void) {
+  fprintf(stderr,
+	  "usage: usbsniffctl [-S SOCKET] COMMAND [ARG]...\n"
+	  "\t-S SOCKET   Control socket (default "
+	  USBSNIFFD_DEFAULT_SOCKET ")\n"
+	  "Commands: attach log|vcd|pcap|dump FILE, detach ID,\n"
+	  "filter ID all|nosof|ADDR[.ENDP][,nosof], rotate ID, list, stats, quit\n"
+	  );
+}
+
+int
+main(int argc, char *argv[])
+{
+  const char *socket_path = USBSNIFFD_DEFAULT_SOCKET;
+  struct sockaddr_un addr;
+  char line[LINE_MAX];
+  size_t len = 0;
+  FILE *in;
+  int fd;
+  int opt;
+  int i;
+
+  while ((opt = getopt(argc, argv, "+S:")) != -1) {
+    switch (opt) {
+    case 'S':
+      socket_path = optarg;
+      break;
+    default: /* '?' */
+      usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (optind == argc) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+  for (i = optind; i < argc; i++) {
+    int n = snprintf(line + len, sizeof(line) - len, "%s%s",
+		     argv[i], i + 1 < argc ? " " : "\n");
+    if (n < 0 || n >= sizeof(line) - len) {
+      fprintf(stderr, "Command too long\n");
+      exit(EXIT_FAILURE);
+    }
+    len += n;
+  }
+
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", socket_path);
+    exit(EXIT_FAILURE);
+  }
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socket_path);
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    fprintf(stderr, "Failed to connect to %s: %s\n", socket_path,
+	    strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  if (write(fd, line, len) != len) {
+    fprintf(stderr, "Failed to send command: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  in = fdopen(fd, "r");
+  if (!in) {
+    fprintf(stderr, "Failed to read reply: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  while(fgets(line, sizeof(line), in)) {
+    if (strncmp(line, "ok", 2) == 0 && (line[2] == '\n' || line[2] == ' ')) {
+      if (line[2] == ' ') fputs(line + 3, stdout);
+      fclose(in);
+      return EXIT_SUCCESS;
+    }
+    if (strncmp(line, "error", 5) == 0 && (line[5] == '\n' || line[5] == ' ')) {
+      fprintf(stderr, "usbsniffd: %s", line[5] == ' ' ? line + 6 : "error\n");
+      fclose(in);
+      return EXIT_FAILURE;
+    }
+    fputs(line, stdout);
+  }
+  fprintf(stderr, "No reply from usbsniffd\n");
+  fclose(in);
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,963 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+
+#include <usb_ringbuffer.h>
+#include <usb_source.h>
+#include <usb_packet_decoder.h>
+#include <usb_packet.h>
+#include <usb_vcd.h>
+#include <usb_pcap.h>
+#include <usb_writer.h>
+#include <usb_shed.h>
+#include <usbsniffd.h>
+
+/* Capture daemon. The source, the decoder and its state live as long
+   as the process; outputs are attached, filtered, rotated and detached
+   through commands on a Unix socket while the drain loop keeps going.
+   The sockets are only looked at between batches, like in usbbroker.
+
+   Decoder errors are collected in a capture logger and copied into the
+   text outputs before the next packet, so every text output gets them
+   in the same place as usbsniff -D would.
+
+   With --shed the work of the outputs is given up in tiers when the
+   source gets a backlog, see usb_shed.h. The ring buffer is drained
+   all the same. Where the decoder was shed it is told about a gap, so
+   text outputs get a "! Gap" line; dump files have a gap in the block
+   sequence numbers, VCD and text outputs get a comment saying what
+   was skipped. */
+
+#define SAMPLE_BATCH 256
+/* Number of busy batches before checking the control sockets */
+#define POLL_INTERVAL 64
+#define MAX_OUTPUTS 16
+#define MAX_CLIENTS 8
+#define LINE_MAX 512
+/* Memory for write buffers of each dump output */
+#define DUMP_MEMORY (8 * 1024 * 1024)
+/* Lag of a paced replay that counts as a full buffer */
+#define PACE_BACKLOG_NS 1000000000ULL
+
+static volatile sig_atomic_t stop = 0;
+
+static void
+stop_handler(int sig)
+{
+  stop = 1;
+}
+
+enum OutputType {
+  OUTPUT_LOG,
+  OUTPUT_VCD,
+  OUTPUT_PCAP,
+  OUTPUT_DUMP,
+  N_OUTPUT_TYPES
+};
+
+static const char *type_names[N_OUTPUT_TYPES] = {
+  "log", "vcd", "pcap", "dump"
+};
+
+struct Filter
+{
+  int addr; /* -1 for all */
+  int endp; /* -1 for all endpoints of addr */
+  int no_sof;
+};
+
+struct Output
+{
+  int used;
+  unsigned int id;
+  enum OutputType type;
+  char *filename;
+  FILE *file;
+  USBLogger logger;
+  USBPcap *pcap;
+  USBWriter *writer;
+  struct Filter filter;
+  unsigned long long count; /* Packets or blocks written */
+  unsigned long long dropped; /* Blocks a dump output could not take */
+};
+
+struct Client
+{
+  int fd;
+  char line[LINE_MAX];
+  size_t len;
+};
+
+struct Daemon
+{
+  USBSource *source;
+  int pace;
+  USBDecoder decoder;
+  USBLogger errors; /* Decoder text waiting for the text outputs */
+  struct USBPacketTracker tracker;
+  struct USBSequence sequence;
+  timestamp_t time;
+  struct Output outputs[MAX_OUTPUTS];
+  unsigned int next_id;
+  struct Client clients[MAX_CLIENTS];
+  int listen_fd;
+  time_t started;
+  unsigned long long blocks;
+  unsigned long long lost_blocks;
+  unsigned long long gaps;
+  unsigned long long packets;
+  unsigned long long bad_packets; /* CRC errors or invalid */
+  int shedding; /* --shed given */
+  USBShed shed;
+  unsigned long long pace_start;
+};
+
+static void
+usage(void) {
+  fprintf(stderr,
+	  "usage: usbsniffd [options]\n"
+	  "\t-S SOCKET   Control socket (default "
+	  USBSNIFFD_DEFAULT_SOCKET ")\n"
+	  "\t-i FILE     Replay this dump file instead of capturing\n"
+	  "\t--pace      Replay at the speed of the bus\n"
+	  "\t-b SOCKET   Read from usbbroker instead of hardware\n"
+	  "\t--shed[=VCD,TEXT,DECODED,DUMP]\n"
+	  "\t            Shed outputs at these backlogs in percent\n"
+	  "\t            (default 50,70,85,95)\n"
+	  "Commands are sent with usbsniffctl, see usbsniffd.h.\n"
+	  );
+}
+
+static const struct option long_options[] = {
+  {"pace", no_argument, NULL, 'p'},
+  {"shed", optional_argument, NULL, 's'},
+  {NULL, 0, NULL, 0}
+};
+
+/* Outputs */
+
+static int
+filter_match(const struct Filter *filter, const struct USBPacketInfo *info)
+{
+  if (filter->no_sof && info->pid == USB_PID_SOF) return 0;
+  if (filter->addr < 0) return 1;
+  if (info->pid == USB_PID_SOF || !info->has_token) return 0;
+  if (info->addr != filter->addr) return 0;
+  return filter->endp < 0 || info->endp == filter->endp;
+}
+
+static int
+parse_filter(struct Filter *filter, const char *arg)
+{
+  struct Filter f = {-1, -1, 0};
+  const char *p = arg;
+  while(*p) {
+    size_t len = strcspn(p, ",");
+    unsigned int addr;
+    unsigned int endp;
+    int n;
+    if (len == 3 && strncmp(p, "all", len) == 0) {
+      f.addr = -1;
+      f.endp = -1;
+      f.no_sof = 0;
+    } else if (len == 5 && strncmp(p, "nosof", len) == 0) {
+      f.no_sof = 1;
+    } else if (sscanf(p, "%u.%u%n", &addr, &endp, &n) == 2 && n == len
+	       && addr < 128 && endp < 16) {
+      f.addr = addr;
+      f.endp = endp;
+    } else if (sscanf(p, "%u%n", &addr, &n) == 1 && n == len && addr < 128) {
+      f.addr = addr;
+      f.endp = -1;
+    } else {
+      return -1;
+    }
+    p += len;
+    if (*p == ',') p++;
+  }
+  *filter = f;
+  return 0;
+}
+
+static void
+format_filter(const struct Filter *filter, char *buf, size_t size)
+{
+  if (filter->addr < 0) {
+    snprintf(buf, size, "%s", filter->no_sof ? "nosof" : "all");
+  } else if (filter->endp < 0) {
+    snprintf(buf, size, "%d%s", filter->addr,
+	     filter->no_sof ? ",nosof" : "");
+  } else {
+    snprintf(buf, size, "%d.%d%s", filter->addr, filter->endp,
+	     filter->no_sof ? ",nosof" : "");
+  }
+}
+
+/* CLOCK_REALTIME in ns at bus time 0 */
+static uint64_t
+wall_base(const struct Daemon *d)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec - d->time;
+}
+
+/* Opens the file of out, returns an error message or NULL */
+static const char *
+output_open(struct Daemon *d, struct Output *out)
+{
+  if (out->type == OUTPUT_DUMP) {
+    out->writer = usb_writer_open(out->filename, 0, DUMP_MEMORY);
+    return out->writer ? NULL : "Failed to open file";
+  }
+  out->file = fopen(out->filename, "w");
+  if (!out->file) return strerror(errno);
+  switch(out->type) {
+  case OUTPUT_LOG:
+    log_init(&out->logger, out->file);
+    break;
+  case OUTPUT_VCD:
+    usb_vcd_header(out->file);
+    break;
+  case OUTPUT_PCAP:
+    out->pcap = usb_pcap_init(out->file, wall_base(d));
+    if (!out->pcap) {
+      fclose(out->file);
+      out->file = NULL;
+      return "Out of memory";
+    }
+    break;
+  default:
+    break;
+  }
+  return NULL;
+}
+
+static void
+output_close(struct Output *out)
+{
+  if (out->type == OUTPUT_DUMP) {
+    if (out->writer) usb_writer_close(out->writer, NULL);
+    out->writer = NULL;
+    return;
+  }
+  if (out->type == OUTPUT_LOG) log_close(&out->logger);
+  if (out->pcap) usb_pcap_close(out->pcap);
+  out->pcap = NULL;
+  if (out->file) fclose(out->file);
+  out->file = NULL;
+}
+
+static void
+output_flush(struct Output *out)
+{
+  switch(out->type) {
+  case OUTPUT_LOG:
+    log_flush(&out->logger);
+    break;
+  case OUTPUT_DUMP:
+    usb_writer_flush(out->writer);
+    break;
+  default:
+    fflush(out->file);
+    break;
+  }
+}
+
+static void
+flush_outputs(struct Daemon *d)
+{
+  unsigned int i;
+  for (i = 0; i < MAX_OUTPUTS; i++) {
+    if (d->outputs[i].used) output_flush(&d->outputs[i]);
+  }
+}
+
+static struct Output *
+find_output(struct Daemon *d, const char *id)
+{
+  unsigned int i;
+  char *end;
+  unsigned long n = strtoul(id, &end, 10);
+  if (*end != '\0') return NULL;
+  for (i = 0; i < MAX_OUTPUTS; i++) {
+    if (d->outputs[i].used && d->outputs[i].id == n) return &d->outputs[i];
+  }
+  return NULL;
+}
+
+static int
+has_outputs(const struct Daemon *d, enum OutputType type)
+{
+  unsigned int i;
+  for (i = 0; i < MAX_OUTPUTS; i++) {
+    if (d->outputs[i].used && d->outputs[i].type == type) return 1;
+  }
+  return 0;
+}
+
+/* Decoding */
+
+static unsigned long long
+now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/* Copy what the decoder logged since last time into the text outputs */
+static void
+pass_errors(struct Daemon *d)
+{
+  size_t len;
+  const char *text;
+  unsigned int i;
+  if (d->errors.used == 0) return;
+  text = log_take(&d->errors, &len);
+  if (usb_shed_active(&d->shed, USB_SHED_TEXT)) return;
+  for (i = 0; i < MAX_OUTPUTS; i++) {
+    struct Output *out = &d->outputs[i];
+    if (out->used && out->type == OUTPUT_LOG) log_text(&out->logger, text, len);
+  }
+}
+
+static void
+daemon_packet(uint32_t *bits, uint32_t n_bits, timestamp_t ts,
+	      void *user_data)
+{
+  struct Daemon *d = user_data;
+  struct USBPacketInfo info;
+  int no_text = usb_shed_active(&d->shed, USB_SHED_TEXT);
+  unsigned int i;
+  pass_errors(d);
+  usb_packet_parse(&d->tracker, bits, n_bits, ts, &info);
+  d->packets++;
+  if (info.flags & (USB_PACKET_CRC_ERROR | USB_PACKET_INVALID)) {
+    d->bad_packets++;
+  }
+  if (no_text && has_outputs(d, OUTPUT_LOG)) {
+    usb_shed_count(&d->shed, USB_SHED_TEXT, 1);
+  }
+  for (i = 0; i < MAX_OUTPUTS; i++) {
+    struct Output *out = &d->outputs[i];
+    if (!out->used || !filter_match(&out->filter, &info)) continue;
+    if (out->type == OUTPUT_LOG) {
+      if (no_text) continue;
+      decode_packet_info(bits, n_bits, &info, &out->logger);
+      out->count++;
+    } else if (out->type == OUTPUT_PCAP) {
+      usb_pcap_packet(bits, n_bits, ts, out->pcap);
+      out->count++;
+    }
+  }
+}
+
+/* Backlog of the source in percent, -1 if unknown. A paced replay
+   has none, so there it is how far the replay lags behind. */
+static int
+source_backlog(struct Daemon *d)
+{
+  unsigned long long lag;
+  unsigned long long wall;
+  if (!d->pace) return usb_source_backlog(d->source);
+  wall = now_ns() - d->pace_start;
+  lag = wall > d->time ? wall - d->time : 0;
+  if (lag >= PACE_BACKLOG_NS) return 100;
+  return lag * 100 / PACE_BACKLOG_NS;
+}
+
+/* Tell the outputs about the range of a tier that was just taken up
+   again */
+static void
+shed_resumed(struct Daemon *d, enum USBShedTier tier)
+{
+  const struct USBShedRange *r = &d->shed.tiers[tier].current;
+  unsigned int i;
+  fprintf(stderr, "Shed %s from %llu to %llu ns: %llu %s\n",
+	  usb_shed_tier_name(tier), r->start, r->end, r->items,
+	  tier == USB_SHED_TEXT ? "packets" : "blocks");
+  switch(tier) {
+  case USB_SHED_VCD:
+    for (i = 0; i < MAX_OUTPUTS; i++) {
+      struct Output *out = &d->outputs[i];
+      if (!out->used || out->type != OUTPUT_VCD) continue;
+      fprintf(out->file,
+	      "$comment Shed from %llu to %llu ns, %llu blocks $end\n",
+	      r->start, r->end, r->items);
+    }
+    break;
+  case USB_SHED_TEXT:
+    for (i = 0; i < MAX_OUTPUTS; i++) {
+      struct Output *out = &d->outputs[i];
+      if (!out->used || out->type != OUTPUT_LOG) continue;
+      log_error(&out->logger,
+		"Shed: text skipped from %llu to %llu ns, %llu packets",
+		r->start, r->end, r->items);
+    }
+    break;
+  case USB_SHED_DECODED:
+    /* The decoder and tracker start over like after lost blocks */
+    decode_gap(&d->decoder, r->items, r->end - r->start, r->start);
+    usb_packet_tracker_init(&d->tracker);
+    pass_errors(d);
+    break;
+  default:
+    /* Dump readers see the gap in the sequence numbers */
+    break;
+  }
+}
+
+static void
+process_blocks(struct Daemon *d, const struct USBSamples *samples, int n)
+{
+  int no_vcd;
+  int no_decode;
+  unsigned int o;
+  int i;
+  if (d->shedding) {
+    unsigned int resumed = usb_shed_update(&d->shed, source_backlog(d),
+					   d->time);
+    unsigned int t;
+    for (t = 0; t < USB_SHED_TIERS; t++) {
+      if (resumed & (1 << t)) shed_resumed(d, t);
+    }
+  }
+  no_vcd = usb_shed_active(&d->shed, USB_SHED_VCD)
+    && has_outputs(d, OUTPUT_VCD);
+  no_decode = usb_shed_active(&d->shed, USB_SHED_DECODED);
+  if (usb_shed_active(&d->shed, USB_SHED_DUMP)
+      && has_outputs(d, OUTPUT_DUMP)) {
+    usb_shed_count(&d->shed, USB_SHED_DUMP, n);
+  }
+  for (o = 0; o < MAX_OUTPUTS; o++) {
+    struct Output *out = &d->outputs[o];
+    if (!out->used || out->type != OUTPUT_DUMP) continue;
+    if (usb_shed_active(&d->shed, USB_SHED_DUMP)) continue;
+    if (usb_writer_write(out->writer, samples, n * sizeof(struct USBSamples))
+	> 0) {
+      out->count += n;
+    } else {
+      out->dropped += n;
+    }
+  }
+  for (i = 0; i < n; i++) {
+    timestamp_t lost_ns;
+    unsigned int lost = usb_sequence_check(&d->sequence, &samples[i],
+					   &lost_ns);
+    if (lost > 0) {
+      d->lost_blocks += lost;
+      d->gaps++;
+      if (!no_decode) {
+	decode_gap(&d->decoder, lost, lost_ns, d->time);
+	usb_packet_tracker_init(&d->tracker);
+      }
+      d->time += lost_ns;
+    }
+    if (no_decode) {
+      usb_shed_count(&d->shed, USB_SHED_DECODED, 1);
+    } else {
+      decode_block(&d->decoder, &samples[i], d->time);
+      pass_errors(d);
+    }
+    if (no_vcd) usb_shed_count(&d->shed, USB_SHED_VCD, 1);
+    for (o = 0; !no_vcd && o < MAX_OUTPUTS; o++) {
+      struct Output *out = &d->outputs[o];
+      if (!out->used || out->type != OUTPUT_VCD) continue;
+      usb_vcd_write_block(out->file, &samples[i], d->time);
+      out->count++;
+    }
+    d->time += samples[i].count * NS_PER_BIT;
+  }
+  d->blocks += n;
+}
+
+/* Commands */
+
+static void
+reply(struct Client *c, const char *format, ...)
+  __attribute__((format(printf, 2, 3)));
+
+static void
+reply(struct Client *c, const char *format, ...)
+{
+  char buf[LINE_MAX];
+  va_list ap;
+  int len;
+  va_start(ap, format);
+  len = vsnprintf(buf, sizeof(buf) - 1, format, ap);
+  va_end(ap);
+  if (len < 0) return;
+  if (len > (int)sizeof(buf) - 2) len = sizeof(buf) - 2;
+  buf[len++] = '\n';
+  /* Replies are short, a client that does not read them loses them */
+  if (write(c->fd, buf, len) < 0) return;
+}
+
+static void
+cmd_attach(struct Daemon *d, struct Client *c, char **argv, int argc)
+{
+  struct Output *out = NULL;
+  const char *err;
+  unsigned int i;
+  int type;
+  if (argc != 3) {
+    reply(c, "error usage: attach log|vcd|pcap|dump FILE");
+    return;
+  }
+  for (type = 0; type < N_OUTPUT_TYPES; type++) {
+    if (strcmp(argv[1], type_names[type]) == 0) break;
+  }
+  if (type == N_OUTPUT_TYPES) {
+    reply(c, "error unknown output type %s", argv[1]);
+    return;
+  }
+  for (i = 0; i < MAX_OUTPUTS; i++) {
+    if (!d->outputs[i].used) {
+      out = &d->outputs[i];
+      break;
+    }
+  }
+  if (!out) {
+    reply(c, "error too many outputs");
+    return;
+  }
+  memset(out, 0, sizeof(*out));
+  out->type = type;
+  out->filter.addr = -1;
+  out->filter.endp = -1;
+  out->filename = strdup(argv[2]);
+  if (!out->filename) {
+    reply(c, "error out of memory");
+    return;
+  }
+  err = output_open(d, out);
+  if (err) {
+    reply(c, "error %s: %s", argv[2], err);
+    free(out->filename);
+    return;
+  }
+  out->used = 1;
+  out->id = d->next_id++;
+  reply(c, "ok %u", out->id);
+}
+
+static void
+cmd_detach(struct Daemon *d, struct Client *c, char **argv, int argc)
+{
+  struct Output *out;
+  if (argc != 2 || !(out = find_output(d, argv[1]))) {
+    reply(c, "error usage: detach ID");
+    return;
+  }
+  output_close(out);
+  free(out->filename);
+  out->used = 0;
+  reply(c, "ok");
+}
+
+static void
+cmd_filter(struct Daemon *d, struct Client *c, char **argv, int argc)
+{
+  struct Output *out;
+  if (argc != 3 || !(out = find_output(d, argv[1]))
+      || parse_filter(&out->filter, argv[2]) < 0) {
+    reply(c, "error usage: filter ID all|nosof|ADDR[.ENDP][,nosof]");
+    return;
+  }
+  reply(c, "ok");
+}
+
+/* The current file gets a time suffix and a new one is started */
+static void
+cmd_rotate(struct Daemon *d, struct Client *c, char **argv, int argc)
+{
+  struct Output *out;
+  char rotated[LINE_MAX];
+  struct stat st;
+  struct tm tm;
+  time_t now;
+  const char *err;
+  size_t len;
+  if (argc != 2 || !(out = find_output(d, argv[1]))) {
+    reply(c, "error usage: rotate ID");
+    return;
+  }
+  now = time(NULL);
+  localtime_r(&now, &tm);
+  len = snprintf(rotated, sizeof(rotated), "%s.", out->filename);
+  if (len >= sizeof(rotated)
+      || strftime(rotated + len, sizeof(rotated) - len, "%Y%m%d-%H%M%S", &tm)
+      == 0) {
+    reply(c, "error file name too long");
+    return;
+  }
+  if (stat(rotated, &st) == 0) {
+    reply(c, "error %s exists", rotated);
+    return;
+  }
+  /* Renamed while still open, what is buffered goes into the rotated
+     file when it is closed. If that fails the output goes on as before. */
+  if (rename(out->filename, rotated) < 0) {
+    reply(c, "error failed to rename %s: %s", out->filename, strerror(errno));
+    return;
+  }
+  output_close(out);
+  err = output_open(d, out);
+  if (err) {
+    reply(c, "error %s: %s, output detached", out->filename, err);
+    free(out->filename);
+    out->used = 0;
+    return;
+  }
+  reply(c, "ok %s", rotated);
+}
+
+static void
+cmd_list(struct Daemon *d, struct Client *c, char **argv, int argc)
+{
+  unsigned int i;
+  for (i = 0; i < MAX_OUTPUTS; i++) {
+    const struct Output *out = &d->outputs[i];
+    char filter[32];
+    if (!out->used) continue;
+    format_filter(&out->filter, filter, sizeof(filter));
+    reply(c, "%u %s %s %s %llu", out->id, type_names[out->type], filter,
+	  out->filename, out->count);
+  }
+  reply(c, "ok");
+}
+
+static void
+cmd_stats(struct Daemon *d, struct Client *c, char **argv, int argc)
+{
+  unsigned long long dropped = 0;
+  unsigned int i;
+  for (i = 0; i < MAX_OUTPUTS; i++) {
+    if (d->outputs[i].used) dropped += d->outputs[i].dropped;
+  }
+  reply(c, "uptime_s %lld", (long long)(time(NULL) - d->started));
+  reply(c, "bus_time_ns %llu", d->time);
+  reply(c, "blocks %llu", d->blocks);
+  reply(c, "lost_blocks %llu", d->lost_blocks);
+  reply(c, "gaps %llu", d->gaps);
+  reply(c, "packets %llu", d->packets);
+  reply(c, "bad_packets %llu", d->bad_packets);
+  reply(c, "decoder_errors %lu", d->decoder.errors);
+  reply(c, "dump_blocks_dropped %llu", dropped);
+  reply(c, "capturing %d", d->source != NULL);
+  if (d->shedding) {
+    char shedding[64] = "none";
+    size_t len = 0;
+    unsigned int t;
+    reply(c, "backlog_percent %d", d->shed.backlog);
+    for (t = 0; t < USB_SHED_TIERS; t++) {
+      reply(c, "shed_%s %llu", usb_shed_tier_name(t),
+	    usb_shed_total(&d->shed, t));
+      if (usb_shed_active(&d->shed, t)) {
+	len += snprintf(shedding + len, sizeof(shedding) - len, "%s%s",
+			len ? "," : "", usb_shed_tier_name(t));
+      }
+    }
+    reply(c, "shedding %s", shedding);
+  }
+  reply(c, "ok");
+}
+
+/* The last ranges of bus time each tier was shed for, the ones still
+   going on end with "-" */
+static void
+cmd_shed(struct Daemon *d, struct Client *c, char **argv, int argc)
+{
+  const USBShed *shed = &d->shed;
+  unsigned long i = 0;
+  unsigned int t;
+  if (shed->n_history > USB_SHED_HISTORY) {
+    i = shed->n_history - USB_SHED_HISTORY;
+  }
+  for (; i < shed->n_history; i++) {
+    const struct USBShedRange *r = &shed->history[i % USB_SHED_HISTORY];
+    reply(c, "%s %llu %llu %llu", usb_shed_tier_name(r->tier), r->start,
+	  r->end, r->items);
+  }
+  for (t = 0; t < USB_SHED_TIERS; t++) {
+    const struct USBShedTierState *tier = &shed->tiers[t];
+    if (!tier->active) continue;
+    reply(c, "%s %llu - %llu", usb_shed_tier_name(t), tier->current.start,
+	  tier->current.items);
+  }
+  reply(c, "ok");
+}
+
+static void
+cmd_quit(struct Daemon *d, struct Client *c, char **argv, int argc)
+{
+  stop = 1;
+  reply(c, "ok");
+}
+
+struct Command
+{
+  const char *name;
+  void (*func)(struct Daemon *d, struct Client *c, char **argv, int argc);
+};
+
+static const struct Command commands[] = {
+  {"attach", cmd_attach},
+  {"detach", cmd_detach},
+  {"filter", cmd_filter},
+  {"rotate", cmd_rotate},
+  {"list", cmd_list},
+  {"stats", cmd_stats},
+  {"shed", cmd_shed},
+  {"quit", cmd_quit},
+  {NULL, NULL}
+};
+
+#define MAX_ARGS 8
+
+static void
+run_command(struct Daemon *d, struct Client *c, char *line)
+{
+  char *argv[MAX_ARGS];
+  int argc = 0;
+  char *save;
+  char *arg;
+  const struct Command *cmd;
+  for (arg = strtok_r(line, " \t\r", &save); arg && argc < MAX_ARGS;
+       arg = strtok_r(NULL, " \t\r", &save)) {
+    argv[argc++] = arg;
+  }
+  if (argc == 0) return;
+  for (cmd = commands; cmd->name; cmd++) {
+    if (strcmp(argv[0], cmd->name) == 0) {
+      cmd->func(d, c, argv, argc);
+      return;
+    }
+  }
+  reply(c, "error unknown command %s", argv[0]);
+}
+
+/* Returns -1 when the client has gone */
+static int
+read_client(struct Daemon *d, struct Client *c)
+{
+  char *nl;
+  ssize_t n = read(c->fd, c->line + c->len, sizeof(c->line) - 1 - c->len);
+  if (n < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+  if (n <= 0) return -1;
+  c->len += n;
+  c->line[c->len] = '\0';
+  while((nl = strchr(c->line, '\n'))) {
+    size_t used = nl + 1 - c->line;
+    *nl = '\0';
+    run_command(d, c, c->line);
+    memmove(c->line, nl + 1, c->len - used + 1);
+    c->len -= used;
+  }
+  if (c->len == sizeof(c->line) - 1) {
+    reply(c, "error line too long");
+    c->len = 0;
+  }
+  return 0;
+}
+
+static int
+control_listen(const char *path)
+{
+  struct sockaddr_un addr;
+  int fd;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    return -1;
+  }
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0
+      || listen(fd, MAX_CLIENTS) < 0) {
+    fprintf(stderr, "Failed to listen on %s: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void
+poll_control(struct Daemon *d, int timeout)
+{
+  struct pollfd fds[MAX_CLIENTS + 1];
+  int slot_of_fd[MAX_CLIENTS + 1];
+  int nfds = 1;
+  int i;
+  fds[0].fd = d->listen_fd;
+  fds[0].events = POLLIN;
+  for (i = 0; i < MAX_CLIENTS; i++) {
+    if (d->clients[i].fd >= 0) {
+      fds[nfds].fd = d->clients[i].fd;
+      fds[nfds].events = POLLIN;
+      slot_of_fd[nfds] = i;
+      nfds++;
+    }
+  }
+  if (poll(fds, nfds, timeout) <= 0) return;
+  for (i = 1; i < nfds; i++) {
+    struct Client *c = &d->clients[slot_of_fd[i]];
+    if (fds[i].revents && read_client(d, c) < 0) {
+      close(c->fd);
+      c->fd = -1;
+    }
+  }
+  if (fds[0].revents & POLLIN) {
+    int fd;
+    while((fd = accept4(d->listen_fd, NULL, NULL,
+			SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0) {
+      for (i = 0; i < MAX_CLIENTS; i++) {
+	if (d->clients[i].fd < 0) break;
+      }
+      if (i == MAX_CLIENTS) {
+	close(fd);
+	continue;
+      }
+      d->clients[i].fd = fd;
+      d->clients[i].len = 0;
+    }
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  static struct Daemon daemon;
+  struct Daemon *d = &daemon;
+  const char *socket_path = USBSNIFFD_DEFAULT_SOCKET;
+  char *input_filename = NULL;
+  char *broker_socket = NULL;
+  struct USBSamples samples[SAMPLE_BATCH];
+  int busy = 0;
+  int opt;
+  int i;
+
+  usb_shed_init(&d->shed);
+  while ((opt = getopt_long(argc, argv, "S:i:b:", long_options, NULL))
+	 != -1) {
+    switch (opt) {
+    case 'S':
+      socket_path = optarg;
+      break;
+    case 'i':
+      input_filename = optarg;
+      break;
+    case 'b':
+      broker_socket = optarg;
+      break;
+    case 'p':
+      d->pace = 1;
+      break;
+    case 's':
+      d->shedding = 1;
+      if (optarg && usb_shed_parse(&d->shed, optarg) < 0) exit(EXIT_FAILURE);
+      break;
+    default: /* '?' */
+      usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (optind != argc) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+
+  if (input_filename) {
+    d->source = usb_source_open_file(input_filename);
+  } else if (broker_socket) {
+    d->source = usb_source_open_broker(broker_socket);
+  } else {
+    d->source = usb_source_open_pru();
+  }
+  if (!d->source) exit(EXIT_FAILURE);
+
+  d->listen_fd = control_listen(socket_path);
+  if (d->listen_fd < 0) exit(EXIT_FAILURE);
+  for (i = 0; i < MAX_CLIENTS; i++) d->clients[i].fd = -1;
+
+  decode_init(&d->decoder, NULL);
+  log_init_capture(&d->errors);
+  d->decoder.logger = &d->errors;
+  d->decoder.packet_handler = daemon_packet;
+  d->decoder.packet_handler_user_data = d;
+  usb_packet_tracker_init(&d->tracker);
+  usb_sequence_init(&d->sequence);
+  d->next_id = 1;
+  d->started = time(NULL);
+
+  signal(SIGINT, stop_handler);
+  signal(SIGTERM, stop_handler);
+  signal(SIGPIPE, SIG_IGN);
+
+  if (d->pace) d->pace_start = now_ns();
+  while(!stop) {
+    int n = 0;
+    int timeout;
+    if (d->source) {
+      if (d->pace && d->time > now_ns() - d->pace_start) {
+	n = 0;
+      } else {
+	n = usb_source_read(d->source, samples, SAMPLE_BATCH);
+      }
+      if (n < 0) {
+	/* End of a replayed dump, keep serving commands */
+	fprintf(stderr, "End of input\n");
+	usb_source_close(d->source);
+	d->source = NULL;
+	n = 0;
+      }
+    }
+    if (n > 0) {
+      process_blocks(d, samples, n);
+      if (++busy < POLL_INTERVAL) continue;
+      timeout = 0;
+    } else {
+      /* Nothing more right now, so let the readers see what we have */
+      flush_outputs(d);
+      timeout = d->source ? 10 : 1000;
+    }
+    busy = 0;
+    poll_control(d, timeout);
+  }
+
+  for (i = 0; i < MAX_OUTPUTS; i++) {
+    if (d->outputs[i].used) {
+      output_close(&d->outputs[i]);
+      free(d->outputs[i].filename);
+    }
+  }
+  for (i = 0; i < MAX_CLIENTS; i++) {
+    if (d->clients[i].fd >= 0) close(d->clients[i].fd);
+  }
+  close(d->listen_fd);
+  unlink(socket_path);
+  decode_close(&d->decoder);
+  log_close(&d->errors);
+  if (d->source) usb_source_close(d->source);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,21 @@
+#ifndef USBSNIFFD_H
+#define USBSNIFFD_H
+
+/* Control protocol of usbsniffd, shared with usbsniffctl.
+
+   Commands are single lines of words separated by spaces. The reply
+   is zero or more lines of data followed by a line that starts with
+   "ok" or "error", the rest of that line is the result or the reason.
+
+   attach log|vcd|pcap|dump FILE  ok ID
+   detach ID
+   filter ID all|nosof|ADDR[.ENDP][,nosof]  packets for log and pcap
+   rotate ID                      ok FILE the old file was renamed to
+   list                           ID TYPE FILTER FILE COUNT per output
+   stats                          NAME VALUE per counter
+   shed                           TIER START END ITEMS per range shed
+   quit */
+
+#define USBSNIFFD_DEFAULT_SOCKET "/tmp/usbsniffd.sock"
+
+#endif
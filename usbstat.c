@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <usb_ringbuffer.h>
+#include <usb_source.h>
+
+#define SAMPLE_BATCH 256
+
+struct Stats
+{
+  unsigned long long blocks;
+  unsigned long long bits;
+  unsigned long long gaps;
+  unsigned long long lost;
+};
+
+static void
+usage(void) {
+  fprintf(stderr,
+	  "usage: usbstat [options]\n"
+	  "\t-i FILE     Use this dump file as input instead of hardware\n"
+	  "\t-b SOCKET   Read from usbbroker instead of hardware\n"
+	  );
+}
+
+static void
+print_stats(const struct Stats *stats, const char *label)
+{
+  printf("%s: %llu blocks, %llu ns bus time, %llu gaps, %llu blocks lost\n",
+	 label, stats->blocks, stats->bits * NS_PER_BIT, stats->gaps,
+	 stats->lost);
+  fflush(stdout);
+}
+
+int
+main(int argc, char *argv[])
+{
+  char *input_filename = NULL;
+  char *broker_socket = NULL;
+  USBSource *source = NULL;
+  struct USBSamples samples[SAMPLE_BATCH];
+  struct Stats total = {0};
+  struct Stats second = {0};
+  struct USBSequence sequence;
+  time_t last = time(NULL);
+  int opt;
+  int n;
+  int i;
+
+  while ((opt = getopt(argc, argv, "i:b:")) != -1) {
+    switch (opt) {
+    case 'i':
+      input_filename = optarg;
+      break;
+    case 'b':
+      broker_socket = optarg;
+      break;
+    default: /* '?' */
+      usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (input_filename) {
+    source = usb_source_open_file(input_filename);
+  } else if (broker_socket) {
+    source = usb_source_open_broker(broker_socket);
+  } else {
+    source = usb_source_open_pru();
+  }
+  if (!source) exit(EXIT_FAILURE);
+
+  usb_sequence_init(&sequence);
+  while(1) {
+    time_t now;
+    n = usb_source_read(source, samples, SAMPLE_BATCH);
+    if (n < 0) break;
+    if (n == 0) usb_source_wait(source);
+    for (i = 0; i < n; i++) {
+      timestamp_t lost_ns;
+      unsigned int lost = usb_sequence_check(&sequence, &samples[i], &lost_ns);
+      if (lost > 0) {
+	second.gaps++;
+	second.lost += lost;
+      }
+      second.blocks++;
+      second.bits += samples[i].count;
+    }
+    if (input_filename) continue;
+    now = time(NULL);
+    if (now != last) {
+      print_stats(&second, "1 s");
+      total.blocks += second.blocks;
+      total.bits += second.bits;
+      total.gaps += second.gaps;
+      total.lost += second.lost;
+      memset(&second, 0, sizeof(second));
+      last = now;
+    }
+  }
+  total.blocks += second.blocks;
+  total.bits += second.bits;
+  total.gaps += second.gaps;
+  total.lost += second.lost;
+  print_stats(&total, "Total");
+  usb_source_close(source);
+  return EXIT_SUCCESS;
+}
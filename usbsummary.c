@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <usb_ringbuffer.h>
+#include <usb_pyramid.h>
+
+/* Buckets printed at most when no level is given */
+#define DEFAULT_MAX_BUCKETS 1000
+
+/* By the low 4 bits of the PID */
+static const char *pid_names[16] = {
+  "PID0", "OUT", "ACK", "DATA0", "PING", "SOF", "NYET", "DATA2",
+  "SPLIT", "IN", "NAK", "DATA1", "PRE", "SETUP", "STALL", "MDATA"
+};
+
+static void
+usage(void) {
+  fprintf(stderr,
+	  "usage: usbsummary [options] <pyramid>\n"
+	  "\t-l LEVEL    Print the buckets of this level\n"
+	  "\t-r NS       Print the level with the longest buckets up to NS\n"
+	  "\t-n N        Otherwise the finest level with at most N buckets\n"
+	  "\t            in the range (default 1000)\n"
+	  "\t-f TIME     Only buckets ending after this time\n"
+	  "\t-t TIME     Only buckets starting before this time\n"
+	  "\t-L NS       Only the last NS of the capture\n"
+	  "\t-s          Add up the buckets in the range\n"
+	  "\t-e          Payload bytes per endpoint\n"
+	  "\t-i          List the levels\n"
+	  "TIME is in ns since 1970 or, starting with -, seconds before now.\n"
+	  "Each line has the wall clock time of the start of the bucket in\n"
+	  "ns, how busy the bus was,\n"
+	  "the packets, CRC errors and invalid packets, blocks lost and then\n"
+	  "the packets by PID.\n"
+	  );
+}
+
+/* Sums over ranges may need more than the 32 bits of a bucket */
+struct Sum
+{
+  uint64_t busy_bits;
+  uint64_t packets[16];
+  uint64_t errors;
+  uint64_t lost_blocks;
+  uint64_t other_bytes;
+  uint64_t bytes[USB_PYRAMID_ENDPOINTS];
+};
+
+static void
+sum_bucket(struct Sum *sum, const struct USBPyramidBucket *b)
+{
+  unsigned int i;
+  sum->busy_bits += b->busy_bits;
+  for (i = 0; i < 16; i++) sum->packets[i] += b->packets[i];
+  sum->errors += b->crc_errors + b->invalid;
+  sum->lost_blocks += b->lost_blocks;
+  sum->other_bytes += b->other_bytes;
+  for (i = 0; i < USB_PYRAMID_ENDPOINTS; i++) sum->bytes[i] += b->bytes[i];
+}
+
+static void
+print_sum(const struct USBPyramidHeader *header, const struct Sum *sum,
+	  uint64_t start, uint64_t length, int endpoints)
+{
+  uint64_t packets = 0;
+  unsigned int i;
+  for (i = 0; i < 16; i++) packets += sum->packets[i];
+  printf("%llu %.1f%% %llu %llu %llu", (unsigned long long)start,
+	 length ? 100.0 * sum->busy_bits * NS_PER_BIT / length : 0.0,
+	 (unsigned long long)packets, (unsigned long long)sum->errors,
+	 (unsigned long long)sum->lost_blocks);
+  for (i = 0; i < 16; i++) {
+    if (sum->packets[i] == 0) continue;
+    printf(" %s:%llu", pid_names[i], (unsigned long long)sum->packets[i]);
+  }
+  if (endpoints) {
+    for (i = 0; i < header->n_endpoints; i++) {
+      const struct USBPyramidEndpoint *ep = &header->endpoints[i];
+      if (sum->bytes[i] == 0) continue;
+      printf(" %u.%u%s:%llu", ep->addr, ep->endp & 0x0f,
+	     (ep->endp & 0x80) ? "in" : "out",
+	     (unsigned long long)sum->bytes[i]);
+    }
+    if (sum->other_bytes) {
+      printf(" other:%llu", (unsigned long long)sum->other_bytes);
+    }
+  }
+  printf("\n");
+}
+
+static uint64_t
+parse_time(const char *str)
+{
+  struct timespec now;
+  double seconds;
+  if (str[0] != '-') return strtoull(str, NULL, 0);
+  seconds = atof(str + 1);
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec - (uint64_t)(seconds * 1e9);
+}
+
+static void
+list_levels(const char *dir, unsigned int n_levels)
+{
+  unsigned int l;
+  for (l = 0; l < n_levels; l++) {
+    struct USBPyramidLevel map;
+    if (usb_pyramid_map(dir, l, &map) < 0) exit(EXIT_FAILURE);
+    printf("%u %llu ns %llu buckets\n", l,
+	   (unsigned long long)map.header->bucket_ns,
+	   (unsigned long long)map.n_buckets);
+    usb_pyramid_unmap(&map);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct USBPyramidLevel map;
+  const char *dir;
+  unsigned int n_levels;
+  int level = -1;
+  uint64_t resolution = 0;
+  uint64_t max_buckets = DEFAULT_MAX_BUCKETS;
+  uint64_t from = 0;
+  uint64_t to = 0;
+  uint64_t last = 0;
+  uint64_t base_ns;
+  uint64_t capture;
+  uint64_t start_ns;
+  uint64_t first;
+  uint64_t end;
+  uint64_t i;
+  int sum_up = 0;
+  int endpoints = 0;
+  int list = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "l:r:n:f:t:L:sei")) != -1) {
+    switch (opt) {
+    case 'l':
+      level = atoi(optarg);
+      break;
+    case 'r':
+      resolution = strtoull(optarg, NULL, 0);
+      break;
+    case 'n':
+      max_buckets = strtoull(optarg, NULL, 0);
+      if (max_buckets == 0) max_buckets = 1;
+      break;
+    case 'f':
+      from = parse_time(optarg);
+      break;
+    case 't':
+      to = parse_time(optarg);
+      break;
+    case 'L':
+      last = strtoull(optarg, NULL, 0);
+      break;
+    case 's':
+      sum_up = 1;
+      break;
+    case 'e':
+      endpoints = 1;
+      break;
+    case 'i':
+      list = 1;
+      break;
+    default: /* '?' */
+      usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (optind >= argc) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+  dir = argv[optind];
+
+  n_levels = usb_pyramid_levels(dir);
+  if (n_levels == 0) {
+    fprintf(stderr, "No pyramid in %s\n", dir);
+    exit(EXIT_FAILURE);
+  }
+  if (list) {
+    list_levels(dir, n_levels);
+    return EXIT_SUCCESS;
+  }
+  /* The finest level has the most of a capture still being written */
+  if (usb_pyramid_map(dir, 0, &map) < 0) exit(EXIT_FAILURE);
+  base_ns = map.header->bucket_ns;
+  capture = map.n_buckets * base_ns;
+  start_ns = map.header->start_ns;
+  usb_pyramid_unmap(&map);
+  if (to > 0 && to <= start_ns) return EXIT_SUCCESS; /* Before the capture */
+  /* Bus time from here on */
+  from = from > start_ns ? from - start_ns : 0;
+  if (to > 0) to -= start_ns;
+  if (last > 0) {
+    from = capture > last ? capture - last : 0;
+    to = 0;
+  }
+  if (level >= (int)n_levels) {
+    fprintf(stderr, "There are only %u levels\n", n_levels);
+    exit(EXIT_FAILURE);
+  }
+  if (level < 0) {
+    uint64_t span = to > 0 ? to : capture;
+    uint64_t bucket_ns = base_ns;
+    span = span > from ? span - from : 0;
+    for (level = 0; level + 1 < (int)n_levels; level++) {
+      if (resolution > 0) {
+	if (bucket_ns * USB_PYRAMID_FACTOR > resolution) break;
+      } else {
+	if ((span + bucket_ns - 1) / bucket_ns <= max_buckets) break;
+      }
+      bucket_ns *= USB_PYRAMID_FACTOR;
+    }
+  }
+
+  if (usb_pyramid_map(dir, level, &map) < 0) exit(EXIT_FAILURE);
+  first = from / map.header->bucket_ns;
+  end = map.n_buckets;
+  if (to > 0) {
+    uint64_t to_bucket = (to + map.header->bucket_ns - 1)
+      / map.header->bucket_ns;
+    if (to_bucket < end) end = to_bucket;
+  }
+  printf("# Level %d, %llu ns per bucket\n", level,
+	 (unsigned long long)map.header->bucket_ns);
+  if (sum_up) {
+    struct Sum sum;
+    memset(&sum, 0, sizeof(sum));
+    for (i = first; i < end; i++) sum_bucket(&sum, &map.buckets[i]);
+    print_sum(map.header, &sum, start_ns + first * map.header->bucket_ns,
+	      end > first ? (end - first) * map.header->bucket_ns : 0,
+	      endpoints);
+  } else {
+    for (i = first; i < end; i++) {
+      struct Sum sum;
+      memset(&sum, 0, sizeof(sum));
+      sum_bucket(&sum, &map.buckets[i]);
+      print_sum(map.header, &sum, start_ns + i * map.header->bucket_ns,
+		map.header->bucket_ns, endpoints);
+    }
+  }
+  usb_pyramid_unmap(&map);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <usb_dumpfile.h>
+#include <usb_vcd.h>
+
+/* Writes the same VCD as usbsniff -V for a dump file, formatting chunks
+   of blocks in parallel.
+
+   The start time of a block is the sum of the lengths of the blocks
+   before it, so the times are found with a two level prefix sum: the
+   threads first sum the lengths of the chunks, the chunk start times
+   are summed from those, and each chunk is then formatted from its own
+   start time. Lost blocks add an estimate based on the running average
+   of the block lengths, which can only be followed from the start, so
+   chunks up to the last gap in the dump are summed block by block with
+   usb_sequence_check(). That is still cheap compared to formatting.
+
+   Formatted chunks are written in order. Threads only work a limited
+   number of chunks ahead of the writer to bound the memory used. */
+
+#define CHUNK_BLOCKS 16384
+/* Formatted chunks waiting to be written, per thread */
+#define CHUNKS_AHEAD 2
+
+struct Chunk
+{
+  size_t start;
+  size_t end;
+  uint64_t bits; /* Sum of counts */
+  int gap; /* Some block in the chunk follows lost blocks */
+  timestamp_t time;
+  struct USBSequence sequence;
+  char *text;
+  size_t len;
+  int done;
+};
+
+struct Export
+{
+  const USBDumpFile *dump;
+  struct Chunk *chunks;
+  unsigned int n_chunks;
+  unsigned int next_chunk;
+  unsigned int written; /* Chunks written to the output */
+  unsigned int ahead;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+struct Worker
+{
+  struct Export *export;
+  pthread_t thread;
+  unsigned int first; /* Chunks to sum */
+  unsigned int last;
+};
+
+static void
+usage(void) {
+  fprintf(stderr,
+	  "usage: usbvcd [options] DUMPFILE VCDFILE\n"
+	  "\t-j THREADS  Number of threads (default number of CPUs)\n"
+	  "VCDFILE is - for standard output. The result is the same as\n"
+	  "from usbsniff -i DUMPFILE -V VCDFILE.\n"
+	  );
+}
+
+static void
+alloc_failed(void)
+{
+  fprintf(stderr, "Failed to allocate memory\n");
+  exit(EXIT_FAILURE);
+}
+
+static void *
+sum_thread(void *arg)
+{
+  struct Worker *w = arg;
+  const USBDumpFile *dump = w->export->dump;
+  unsigned int c;
+  for (c = w->first; c < w->last; c++) {
+    struct Chunk *chunk = &w->export->chunks[c];
+    size_t b;
+    for (b = chunk->start; b < chunk->end; b++) {
+      const struct USBSamples *samples = &dump->blocks[b];
+      chunk->bits += samples->count;
+      if (b > 0 && samples->sequence
+	  != ((dump->blocks[b - 1].sequence + 1) & 0xffff)) {
+	chunk->gap = 1;
+      }
+    }
+  }
+  return NULL;
+}
+
+/* Same as the time keeping of the usbsniff main loop */
+static void
+chunk_times(struct Export *export)
+{
+  const USBDumpFile *dump = export->dump;
+  struct USBSequence sequence;
+  timestamp_t time = 0;
+  unsigned int last_gap = 0;
+  unsigned int c;
+  size_t b;
+  for (c = 0; c < export->n_chunks; c++) {
+    if (export->chunks[c].gap) last_gap = c + 1;
+  }
+  usb_sequence_init(&sequence);
+  for (c = 0; c < export->n_chunks; c++) {
+    struct Chunk *chunk = &export->chunks[c];
+    chunk->time = time;
+    chunk->sequence = sequence;
+    if (c < last_gap) {
+      for (b = chunk->start; b < chunk->end; b++) {
+	timestamp_t lost_ns;
+	if (usb_sequence_check(&sequence, &dump->blocks[b], &lost_ns) > 0) {
+	  time += lost_ns;
+	}
+	time += dump->blocks[b].count * NS_PER_BIT;
+      }
+    } else {
+      /* No more gaps, the average is never used */
+      time += chunk->bits * NS_PER_BIT;
+      sequence.next = (dump->blocks[chunk->end - 1].sequence + 1) & 0xffff;
+    }
+  }
+}
+
+static void
+format_chunk(const USBDumpFile *dump, struct Chunk *chunk)
+{
+  struct USBSequence sequence = chunk->sequence;
+  timestamp_t time = chunk->time;
+  size_t size = (chunk->end - chunk->start) * 64 + USB_VCD_BLOCK_MAX;
+  size_t b;
+  chunk->text = malloc(size);
+  if (!chunk->text) alloc_failed();
+  chunk->len = 0;
+  for (b = chunk->start; b < chunk->end; b++) {
+    const struct USBSamples *samples = &dump->blocks[b];
+    timestamp_t lost_ns;
+    if (usb_sequence_check(&sequence, samples, &lost_ns) > 0) {
+      time += lost_ns;
+    }
+    if (size - chunk->len < USB_VCD_BLOCK_MAX) {
+      size *= 2;
+      chunk->text = realloc(chunk->text, size);
+      if (!chunk->text) alloc_failed();
+    }
+    chunk->len += usb_vcd_format_block(chunk->text + chunk->len, samples,
+				       time);
+    time += samples->count * NS_PER_BIT;
+  }
+}
+
+static void *
+format_thread(void *arg)
+{
+  struct Worker *w = arg;
+  struct Export *export = w->export;
+  while(1) {
+    unsigned int c;
+    pthread_mutex_lock(&export->lock);
+    while(export->next_chunk < export->n_chunks
+	  && export->next_chunk >= export->written + export->ahead) {
+      pthread_cond_wait(&export->cond, &export->lock);
+    }
+    c = export->next_chunk++;
+    pthread_mutex_unlock(&export->lock);
+    if (c >= export->n_chunks) break;
+    format_chunk(export->dump, &export->chunks[c]);
+    pthread_mutex_lock(&export->lock);
+    export->chunks[c].done = 1;
+    pthread_cond_broadcast(&export->cond);
+    pthread_mutex_unlock(&export->lock);
+  }
+  return NULL;
+}
+
+static int
+write_chunks(struct Export *export, FILE *out)
+{
+  unsigned int c;
+  int res = 0;
+  for (c = 0; c < export->n_chunks; c++) {
+    struct Chunk *chunk = &export->chunks[c];
+    pthread_mutex_lock(&export->lock);
+    while(!chunk->done) pthread_cond_wait(&export->cond, &export->lock);
+    pthread_mutex_unlock(&export->lock);
+    if (res == 0 && fwrite(chunk->text, 1, chunk->len, out) != chunk->len) {
+      res = -1;
+    }
+    free(chunk->text);
+    chunk->text = NULL;
+    pthread_mutex_lock(&export->lock);
+    export->written++;
+    pthread_cond_broadcast(&export->cond);
+    pthread_mutex_unlock(&export->lock);
+  }
+  return res;
+}
+
+static void
+run_workers(struct Worker *workers, unsigned int n_threads,
+	    void *(*func)(void *))
+{
+  unsigned int i;
+  for (i = 0; i < n_threads; i++) {
+    if (pthread_create(&workers[i].thread, NULL, func, &workers[i]) != 0) {
+      fprintf(stderr, "Failed to start thread\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+static void
+join_workers(struct Worker *workers, unsigned int n_threads)
+{
+  unsigned int i;
+  for (i = 0; i < n_threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct Export export;
+  struct Worker *workers;
+  USBDumpFile *dump;
+  FILE *out;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned int n_threads = cpus > 0 ? cpus : 1;
+  unsigned int i;
+  int opt;
+  int res;
+
+  while ((opt = getopt(argc, argv, "j:")) != -1) {
+    switch (opt) {
+    case 'j':
+      n_threads = atoi(optarg) > 0 ? atoi(optarg) : 1;
+      break;
+    default: /* '?' */
+      usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (optind + 2 != argc) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+
+  dump = usb_dumpfile_open(argv[optind]);
+  if (!dump) exit(EXIT_FAILURE);
+  if (strcmp(argv[optind + 1], "-") == 0) {
+    out = stdout;
+  } else {
+    out = fopen(argv[optind + 1], "w");
+    if (!out) {
+      fprintf(stderr, "Failed to open file %s for writing: %s\n",
+	      argv[optind + 1], strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  memset(&export, 0, sizeof(export));
+  export.dump = dump;
+  export.n_chunks = (dump->n_blocks + CHUNK_BLOCKS - 1) / CHUNK_BLOCKS;
+  export.ahead = n_threads * CHUNKS_AHEAD;
+  export.chunks = calloc(export.n_chunks + 1, sizeof(struct Chunk));
+  if (!export.chunks) alloc_failed();
+  for (i = 0; i < export.n_chunks; i++) {
+    export.chunks[i].start = (size_t)i * CHUNK_BLOCKS;
+    export.chunks[i].end = export.chunks[i].start + CHUNK_BLOCKS;
+  }
+  if (export.n_chunks > 0) export.chunks[export.n_chunks - 1].end
+			     = dump->n_blocks;
+  pthread_mutex_init(&export.lock, NULL);
+  pthread_cond_init(&export.cond, NULL);
+
+  workers = calloc(n_threads, sizeof(struct Worker));
+  if (!workers) alloc_failed();
+  for (i = 0; i < n_threads; i++) {
+    workers[i].export = &export;
+    workers[i].first = export.n_chunks * (uint64_t)i / n_threads;
+    workers[i].last = export.n_chunks * (uint64_t)(i + 1) / n_threads;
+  }
+  run_workers(workers, n_threads, sum_thread);
+  join_workers(workers, n_threads);
+  chunk_times(&export);
+
+  usb_vcd_header(out);
+  run_workers(workers, n_threads, format_thread);
+  res = write_chunks(&export, out);
+  join_workers(workers, n_threads);
+  if (fflush(out) != 0) res = -1;
+  if (res < 0) {
+    fprintf(stderr, "Failed to write VCD file: %s\n", strerror(errno));
+  }
+  if (out != stdout) fclose(out);
+
+  pthread_cond_destroy(&export.cond);
+  pthread_mutex_destroy(&export.lock);
+  free(workers);
+  free(export.chunks);
+  usb_dumpfile_close(dump);
+  return res < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}